@@ -1,17 +1,27 @@
+#include <assert.h>
+#include <ctype.h>
 #include <future>
 #include <stdio.h>
 #include <limits>
 #include <math.h>
 #include <memory>
 #include <string.h>
+#include <string>
+#include <vector>
 
+#include "Benchmark.hpp"
 #include "Bitmap.hpp"
 #include "BlockData.hpp"
 #include "CpuArch.hpp"
 #include "DataProvider.hpp"
 #include "Debug.hpp"
+#include "Differential.hpp"
 #include "Dither.hpp"
 #include "Error.hpp"
+#include "ErrorMetric.hpp"
+#include "Etcpak.hpp"
+#include "OutputCache.hpp"
+#include "RowHashes.hpp"
 #include "System.hpp"
 #include "TaskDispatch.hpp"
 #include "Timing.hpp"
@@ -28,28 +38,211 @@ void Usage()
 {
     fprintf( stderr, "Usage: etcpak input.png [options]\n" );
 #ifdef __SSE4_1__
-    if( can_use_intel_core_4th_gen_features() )
-    {
-        fprintf( stderr, "  Using AVX 2 instructions.\n" );
-    }
-    else
-    {
-        fprintf( stderr, "  Using SSE 4.1 instructions.\n" );
-    }
+    const unsigned int f = cpu_features();
+    fprintf( stderr, "  Using %s instructions (CPU has%s%s%s%s%s).\n", cpu_isa_name( cpu_isa() ),
+        ( f & CpuFeatureSSE41 ) ? " sse41" : "",
+        ( f & CpuFeatureAVX2 ) ? " avx2" : "",
+        ( f & CpuFeatureAVX512BW ) ? " avx512bw" : "",
+        ( f & CpuFeatureAVX512VL ) ? " avx512vl" : "",
+        ( f & CpuFeatureAVX512VNNI ) ? " avx512vnni" : "" );
 #else
     fprintf( stderr, "  SIMD not available.\n" );
 #endif
     fprintf( stderr, "  Options:\n" );
-    fprintf( stderr, "  -v          view mode (loads pvr/ktx file, decodes it and saves to png)\n" );
-    fprintf( stderr, "  -o 1        output selection (sum of: 1 - save pvr file; 2 - save png file)\n" );
-    fprintf( stderr, "                note: pvr files are written regardless of this option\n" );
+    fprintf( stderr, "  -v          view mode (loads pvr/ktx/ktx2 file, decodes it and saves to png)\n" );
+    fprintf( stderr, "  -o 1        output selection (sum of: 1 - save compressed file; 2 - save png file)\n" );
+    fprintf( stderr, "                note: compressed files are written regardless of this option\n" );
+    fprintf( stderr, "  -format f   compressed file format (pvr, ktx, ktx2)\n" );
+    fprintf( stderr, "  -zlib       deflate each mip level of ktx2 output (KTX2 zlib supercompression)\n" );
     fprintf( stderr, "  -a          disable alpha channel processing\n" );
     fprintf( stderr, "  -s          display image quality measurements\n" );
     fprintf( stderr, "  -b          benchmark mode\n" );
+    fprintf( stderr, "  -kbench f   per kernel benchmark, compared with (or saved to, if missing) baseline json file f\n" );
+    fprintf( stderr, "  -difftest n compare n random and adversarial blocks across all kernel variants (input file is ignored)\n" );
     fprintf( stderr, "  -m          generate mipmaps\n" );
+    fprintf( stderr, "  -mipfilter f mipmap filter (box - 2x2 average; kaiser - sharper windowed sinc)\n" );
     fprintf( stderr, "  -d          enable dithering\n" );
     fprintf( stderr, "  -debug      dissect ETC texture\n" );
-    fprintf( stderr, "  -etc2       enable ETC2 mode\n" );
+    fprintf( stderr, "  -etc2       enable ETC2 mode (alpha channel is stored as EAC in the same file)\n" );
+    fprintf( stderr, "  -batch dir  batch mode (input is a directory of png files or a list file, output is written to dir)\n" );
+    fprintf( stderr, "  -stream     stream large images through a window of block rows (no mipmaps, stats or png output)\n" );
+    fprintf( stderr, "  -incremental only compress block rows changed since the last run, patching the existing output\n" );
+    fprintf( stderr, "  -cache dir  copy the output from a cache directory if the same input was compressed with the same options\n" );
+    fprintf( stderr, "                (not looked up with -s or png output, which need the image)\n" );
+    fprintf( stderr, "  -cachesize n size limit of the cache directory in MB (default 1024), least recently used outputs are removed\n" );
+    fprintf( stderr, "  -effort 1   encoding effort (0 - fastest, 4x2 sub-blocks only; 1 - default; 2 - also try ETC2 T and H modes;\n" );
+    fprintf( stderr, "              3 - also search neighbouring base colors in all sub-block layouts, slow)\n" );
+    fprintf( stderr, "  -rdo l      rate-distortion lambda for ETC1, makes LZ compressed output smaller (0 - off; 10-50 typical)\n" );
+    fprintf( stderr, "  -metric m   color error metric (luma - default; uniform - plain RGB; linear - luma weights in linear light)\n" );
+    fprintf( stderr, "  -isa name   force a narrower instruction set (scalar, sse41, avx2, avx512), for comparisons\n" );
+}
+
+// Calls f( src, blocks, offset ) for each run of block rows of the part whose source changed since the
+// hashes were saved, or once for the whole part without hashes
+template<class F>
+static void ForChangedRows( const DataPart& part, RowHashes* rows, F f )
+{
+    const uint bw = part.width / 4;
+    if( !rows )
+    {
+        f( part.src, bw * part.lines, part.offset );
+        return;
+    }
+
+    uint first = 0;
+    bool run = false;
+    for( uint y=0; y<=part.lines; y++ )
+    {
+        const bool changed = y < part.lines && rows->Changed( part.src + y * 4 * part.width, part.width, part.offset + y * bw );
+        if( changed && !run )
+        {
+            first = y;
+            run = true;
+        }
+        else if( !changed && run )
+        {
+            f( part.src + first * 4 * part.width, bw * ( y - first ), part.offset + first * bw );
+            run = false;
+        }
+    }
+}
+
+// With a streaming data provider the window is the number of parts it keeps in memory. With rows, only the
+// block rows that changed are compressed.
+static void QueueParts( DataProvider& dp, const BlockDataPtr& bd, const BlockDataPtr& bda, bool rgba, bool dither, int effort, float rdo, ErrorMetric metric, RowHashes* rows = nullptr, uint window = 0 )
+{
+    const auto num = dp.NumberOfParts();
+    for( uint i=0; i<num; i++ )
+    {
+        auto part = dp.NextPart();
+
+        // The part is released when the last task using it is gone
+        std::shared_ptr<const DataPart> ref( new DataPart( part ), [&dp]( const DataPart* p ) { dp.Release( *p ); delete p; } );
+
+        if( bda && rows )
+        {
+            // Both files take the same rows, which are hashed once
+            TaskDispatch::Queue( [part, bd, bda, dither, effort, rdo, metric, rows, ref]()
+            {
+                ForChangedRows( part, rows, [&]( const uint32* src, uint blocks, uint offset )
+                {
+                    bd->Process( src, blocks, offset, part.width, Channels::RGB, dither, effort, rdo, metric );
+                    bda->Process( src, blocks, offset, part.width, Channels::Alpha, false, effort, rdo, metric );
+                } );
+            } );
+        }
+        else if( bda )
+        {
+            TaskDispatch::Queue( [part, bd, dither, effort, rdo, metric, ref]()
+            {
+                bd->Process( part.src, part.width / 4 * part.lines, part.offset, part.width, Channels::RGB, dither, effort, rdo, metric );
+            } );
+            TaskDispatch::Queue( [part, bda, effort, rdo, metric, ref]()
+            {
+                bda->Process( part.src, part.width / 4 * part.lines, part.offset, part.width, Channels::Alpha, false, effort, rdo, metric );
+            } );
+        }
+        else if( rgba )
+        {
+            TaskDispatch::Queue( [part, bd, dither, effort, rdo, metric, rows, ref]()
+            {
+                ForChangedRows( part, rows, [&]( const uint32* src, uint blocks, uint offset ) { bd->ProcessRGBA( src, blocks, offset, part.width, dither, effort, rdo, metric ); } );
+            } );
+        }
+        else
+        {
+            TaskDispatch::Queue( [part, bd, dither, effort, rdo, metric, rows, ref]()
+            {
+                ForChangedRows( part, rows, [&]( const uint32* src, uint blocks, uint offset ) { bd->Process( src, blocks, offset, part.width, Channels::RGB, dither, effort, rdo, metric ); } );
+            } );
+        }
+
+        // Keep at most half of the window queued, so that the loader always has room for the next part
+        if( window != 0 && ( i + 1 ) % std::max<uint>( 1, window / 2 ) == 0 )
+        {
+            TaskDispatch::Sync();
+        }
+    }
+}
+
+static void PrintStats( const DataProvider& dp, const BlockDataPtr& bd, const BlockDataPtr& bda, bool rgba )
+{
+    auto out = bd->Decode();
+    float mse = CalcMSE3( dp.ImageData(), *out );
+    printf( "RGB data\n" );
+    printf( "  RMSE: %f\n", sqrt( mse ) );
+    printf( "  PSNR: %f\n", 20 * log10( 255 ) - 10 * log10( mse ) );
+    if( bda )
+    {
+        auto out = bda->Decode();
+        float mse = CalcMSE1( dp.ImageData(), *out );
+        printf( "A data\n" );
+        printf( "  RMSE: %f\n", sqrt( mse ) );
+        printf( "  PSNR: %f\n", 20 * log10( 255 ) - 10 * log10( mse ) );
+    }
+    else if( rgba )
+    {
+        float mse = CalcMSEA( dp.ImageData(), *out );
+        printf( "A data\n" );
+        printf( "  RMSE: %f\n", sqrt( mse ) );
+        printf( "  PSNR: %f\n", 20 * log10( 255 ) - 10 * log10( mse ) );
+    }
+
+    auto cs = bd->GetCacheStats();
+    if( bda )
+    {
+        const auto csa = bda->GetCacheStats();
+        cs.blocks += csa.blocks;
+        cs.reused += csa.reused;
+    }
+    printf( "Repeated blocks\n" );
+    printf( "  %llu of %llu (%0.2f%%) copied from the block cache\n", (unsigned long long)cs.reused, (unsigned long long)cs.blocks, cs.blocks ? 100.f * cs.reused / cs.blocks : 0.f );
+}
+
+// Input files of the batch mode, either a directory of png files or a list file with one path per line
+static std::vector<std::string> BatchFiles( const char* input )
+{
+    std::vector<std::string> ret;
+    if( System::IsDirectory( input ) )
+    {
+        for( auto& fn : System::ListFiles( input ) )
+        {
+            if( fn.size() > 4 )
+            {
+                auto ext = fn.substr( fn.size() - 4 );
+                for( auto& c : ext ) c = tolower( c );
+                if( ext == ".png" )
+                {
+                    ret.emplace_back( fn );
+                }
+            }
+        }
+    }
+    else
+    {
+        FILE* f = fopen( input, "r" );
+        assert( f );
+        char buf[4096];
+        while( fgets( buf, sizeof( buf ), f ) )
+        {
+            size_t len = strlen( buf );
+            while( len > 0 && isspace( (unsigned char)buf[len-1] ) ) len--;
+            if( len == 0 ) continue;
+            ret.emplace_back( buf, len );
+        }
+        fclose( f );
+    }
+    return ret;
+}
+
+// Output name for the input file, with the path and extension replaced
+static std::string BatchOutput( const char* dir, const std::string& fn, const char* suffix )
+{
+    auto pos = fn.find_last_of( "/\\" );
+    auto name = pos == std::string::npos ? fn : fn.substr( pos + 1 );
+    pos = name.rfind( '.' );
+    if( pos != std::string::npos ) name.resize( pos );
+    return std::string( dir ) + "/" + name + suffix;
 }
 
 int main( int argc, char** argv )
@@ -62,9 +255,22 @@ int main( int argc, char** argv )
     bool stats = false;
     bool benchmark = false;
     bool mipmap = false;
+    MipFilter filter = MipFilter::Box;
     bool dither = false;
     bool debug = false;
     bool etc2 = false;
+    bool stream = false;
+    bool incremental = false;
+    BlockData::Format format = BlockData::Pvr;
+    bool zlib = false;
+    int effort = EffortDefault;
+    float rdo = 0;
+    ErrorMetric metric = ErrorMetric::Luma;
+    const char* batch = nullptr;
+    const char* cacheDir = nullptr;
+    uint64 cacheSize = 1024;
+    const char* kbench = nullptr;
+    uint32 difftest = 0;
 
     if( argc < 2 )
     {
@@ -97,10 +303,30 @@ int main( int argc, char** argv )
         {
             benchmark = true;
         }
+        else if( CSTR( "-kbench" ) )
+        {
+            i++;
+            kbench = argv[i];
+        }
+        else if( CSTR( "-difftest" ) )
+        {
+            i++;
+            difftest = atoi( argv[i] );
+            assert( difftest > 0 );
+        }
         else if( CSTR( "-m" ) )
         {
             mipmap = true;
         }
+        else if( CSTR( "-mipfilter" ) )
+        {
+            i++;
+            if( !ParseMipFilter( argv[i], filter ) )
+            {
+                Usage();
+                return 1;
+            }
+        }
         else if( CSTR( "-d" ) )
         {
             dither = true;
@@ -113,6 +339,73 @@ int main( int argc, char** argv )
         {
             etc2 = true;
         }
+        else if( CSTR( "-stream" ) )
+        {
+            stream = true;
+        }
+        else if( CSTR( "-incremental" ) )
+        {
+            incremental = true;
+        }
+        else if( CSTR( "-format" ) )
+        {
+            i++;
+            if( !BlockData::ParseFormat( argv[i], format ) )
+            {
+                Usage();
+                return 1;
+            }
+        }
+        else if( CSTR( "-zlib" ) )
+        {
+            zlib = true;
+        }
+        else if( CSTR( "-batch" ) )
+        {
+            i++;
+            batch = argv[i];
+        }
+        else if( CSTR( "-cache" ) )
+        {
+            i++;
+            cacheDir = argv[i];
+        }
+        else if( CSTR( "-cachesize" ) )
+        {
+            i++;
+            cacheSize = strtoull( argv[i], nullptr, 10 );
+        }
+        else if( CSTR( "-effort" ) )
+        {
+            i++;
+            effort = atoi( argv[i] );
+            assert( effort >= EffortFast && effort <= EffortMax );
+        }
+        else if( CSTR( "-rdo" ) )
+        {
+            i++;
+            rdo = float( atof( argv[i] ) );
+            assert( rdo >= 0 );
+        }
+        else if( CSTR( "-metric" ) )
+        {
+            i++;
+            if( !ParseErrorMetric( argv[i], metric ) )
+            {
+                Usage();
+                return 1;
+            }
+        }
+        else if( CSTR( "-isa" ) )
+        {
+            i++;
+            CpuIsa isa;
+            if( !cpu_parse_isa( argv[i], isa ) || !cpu_force_isa( isa ) )
+            {
+                fprintf( stderr, "Instruction set %s is not available.\n", argv[i] );
+                return 1;
+            }
+        }
         else
         {
             Usage();
@@ -121,6 +414,46 @@ int main( int argc, char** argv )
     }
 #undef CSTR
 
+    if( zlib && format != BlockData::Ktx2 )
+    {
+        fprintf( stderr, "Supercompression is only available with ktx2 output.\n" );
+        return 1;
+    }
+    if( rdo > 0 && etc2 )
+    {
+        fprintf( stderr, "Rate-distortion optimization is only available in ETC1 mode.\n" );
+        return 1;
+    }
+    // Streamed rows are gone once they are compressed, nothing that needs the whole image can be made
+    if( stream && ( mipmap || stats || ( save & 0x2 ) != 0 || batch ) )
+    {
+        fprintf( stderr, "Streaming can't be combined with -m, -s, png output or -batch.\n" );
+        return 1;
+    }
+    // Patched rows must come out as a full run would make them: in place, and not depending on other rows
+    if( incremental && ( stream || zlib || batch || rdo > 0 ) )
+    {
+        fprintf( stderr, "Incremental mode can't be combined with -stream, -zlib, -batch or -rdo.\n" );
+        return 1;
+    }
+    if( incremental && cacheDir )
+    {
+        fprintf( stderr, "Incremental mode can't be combined with -cache.\n" );
+        return 1;
+    }
+
+    if( difftest )
+    {
+        return DifferentialCheck( difftest ) == 0 ? 0 : 1;
+    }
+
+    if( kbench )
+    {
+        // Slower kernels are only reported, timings are too noisy to fail on
+        KernelBenchmark( argv[1], kbench );
+        return 0;
+    }
+
     if( dither )
     {
         InitDither();
@@ -128,6 +461,20 @@ int main( int argc, char** argv )
 
     TaskDispatch taskDispatch( System::CPUCores() );
 
+    std::unique_ptr<OutputCache> cache;
+    uint64 cacheSettings = 0;
+    // Stats and png output need the image, so these runs compress it and only add it to the cache
+    const bool cacheLookup = !stats && ( save & 0x2 ) == 0;
+    if( cacheDir && !benchmark && !viewMode && !debug )
+    {
+        cache.reset( new OutputCache( cacheDir, cacheSize * 1024 * 1024 ) );
+        uint32 rdoBits;
+        memcpy( &rdoBits, &rdo, sizeof( rdoBits ) );
+        // Everything besides the input file that the output depends on
+        const uint32 settings[] = { etc2, alpha, uint32( format ), zlib, mipmap, uint32( filter ), dither, uint32( effort ), rdoBits, uint32( metric ), uint32( cpu_isa() ) };
+        cacheSettings = RowHashes::Hash( settings, sizeof( settings ) );
+    }
+
     if( benchmark )
     {
         auto start = GetTime();
@@ -135,20 +482,23 @@ int main( int argc, char** argv )
         auto data = bmp->Data();
         auto end = GetTime();
         printf( "Image load time: %0.3f ms\n", ( end - start ) / 1000.f );
+        printf( "Instruction set: %s\n", cpu_isa_name( cpu_isa() ) );
 
         const int NumTasks = System::CPUCores() * 10;
         start = GetTime();
         for( int i=0; i<NumTasks; i++ )
         {
-            TaskDispatch::Queue( [&bmp, &dither, i, etc2]()
+            TaskDispatch::Queue( [&bmp, &dither, i, etc2, effort, rdo, metric]()
             {
-                auto bd = std::make_shared<BlockData>( bmp->Size(), false );
-                bd->Process( bmp->Data(), bmp->Size().x * bmp->Size().y / 16, 0, bmp->Size().x, Channels::RGB, dither, etc2 );
+                auto bd = std::make_shared<BlockData>( bmp->Size(), false, etc2 ? BlockData::Etc2_RGB : BlockData::Etc1 );
+                bd->Process( bmp->Data(), bmp->Stride() * bmp->PaddedHeight() / 16, 0, bmp->Stride(), Channels::RGB, dither, effort, rdo, metric );
             } );
         }
         TaskDispatch::Sync();
         end = GetTime();
         printf( "Mean compression time for %i runs: %0.3f ms\n", NumTasks, ( end - start ) / ( NumTasks * 1000.f ) );
+        const auto ts = TaskDispatch::GetStats();
+        printf( "Task dispatch: %llu steals, %0.3f ms idle\n", (unsigned long long)ts.steals, ts.idle / 1000.f );
     }
     else if( viewMode )
     {
@@ -161,66 +511,198 @@ int main( int argc, char** argv )
         auto bd = std::make_shared<BlockData>( argv[1] );
         bd->Dissect();
     }
-    else
+    else if( batch )
     {
-        DataProvider dp( argv[1], mipmap );
-        auto num = dp.NumberOfParts();
+        auto files = BatchFiles( argv[1] );
+        assert( !files.empty() );
 
-        auto bd = std::make_shared<BlockData>( "out.pvr", dp.Size(), mipmap );
-        BlockDataPtr bda;
-        if( alpha && dp.Alpha() )
+        uint64 pixels = 0;
+        uint failed = 0;
+        const auto start = GetTime();
+
+        // Batch outputs are never patched, row hashes of an earlier incremental run would be stale
+        for( auto& fn : files )
         {
-            bda = std::make_shared<BlockData>( "outa.pvr", dp.Size(), mipmap );
+            remove( ( BatchOutput( batch, fn, BlockData::Extension( format ) ) + ".rows" ).c_str() );
         }
 
-        if( bda )
+        // Files found in the cache are copied and left out of the compression pipeline
+        std::vector<std::string> keys;
+        if( cache )
         {
-            for( int i=0; i<num; i++ )
+            std::vector<std::string> misses;
+            for( auto& fn : files )
             {
-                auto part = dp.NextPart();
-
-                TaskDispatch::Queue( [part, i, &bd, &dither, etc2]()
-                {
-                    bd->Process( part.src, part.width / 4 * part.lines, part.offset, part.width, Channels::RGB, dither, etc2 );
-                } );
-                TaskDispatch::Queue( [part, i, &bda, etc2]()
-                {
-                    bda->Process( part.src, part.width / 4 * part.lines, part.offset, part.width, Channels::Alpha, false, etc2 );
-                } );
+                auto key = cache->Key( fn.c_str(), cacheSettings );
+                if( cacheLookup && !key.empty() && cache->Fetch( key, BatchOutput( batch, fn, BlockData::Extension( format ) ).c_str(), BatchOutput( batch, fn, ( std::string( "_alpha" ) + BlockData::Extension( format ) ).c_str() ).c_str() ) ) continue;
+                misses.emplace_back( fn );
+                keys.emplace_back( std::move( key ) );
             }
+            files = std::move( misses );
         }
-        else
+
+        // Image N+1 is decoded on the task dispatcher while image N is compressed
+        std::unique_ptr<DataProvider> dp;
+        if( !files.empty() ) dp.reset( new DataProvider( files[0].c_str(), mipmap, false, 0, filter ) );
+        for( size_t i=0; i<files.size(); i++ )
         {
-            for( int i=0; i<num; i++ )
+            const bool rgba = alpha && dp->Alpha() && etc2;
+            BlockData::Type type = BlockData::Etc1;
+            if( etc2 )
             {
-                auto part = dp.NextPart();
+                type = rgba ? BlockData::Etc2_RGBA : BlockData::Etc2_RGB;
+            }
 
-                TaskDispatch::Queue( [part, i, &bd, &dither, etc2]()
+            const auto fn = BatchOutput( batch, files[i], BlockData::Extension( format ) );
+            const auto fna = BatchOutput( batch, files[i], ( std::string( "_alpha" ) + BlockData::Extension( format ) ).c_str() );
+            auto bd = std::make_shared<BlockData>( fn.c_str(), dp->Size(), mipmap, type, false, format, zlib );
+            BlockDataPtr bda;
+            if( alpha && dp->Alpha() && !etc2 )
+            {
+                bda = std::make_shared<BlockData>( fna.c_str(), dp->Size(), mipmap, BlockData::Etc1, false, format, zlib );
+            }
+
+            QueueParts( *dp, bd, bda, rgba, dither, effort, rdo, metric );
+
+            std::unique_ptr<DataProvider> next;
+            if( i+1 < files.size() )
+            {
+                const char* fn = files[i+1].c_str();
+                TaskDispatch::Queue( [&next, fn, mipmap, filter]()
                 {
-                    bd->Process( part.src, part.width / 4 * part.lines, part.offset, part.width, Channels::RGB, dither, etc2 );
+                    next.reset( new DataProvider( fn, mipmap, false, 0, filter ) );
                 } );
             }
+            TaskDispatch::Sync();
+
+            // The rest of the batch is still compressed
+            if( dp->Failed() )
+            {
+                fprintf( stderr, "Can't decode %s.\n", files[i].c_str() );
+                const bool hasAlpha = bda != nullptr;
+                bd.reset();
+                bda.reset();
+                remove( fn.c_str() );
+                if( hasAlpha ) remove( fna.c_str() );
+                failed++;
+                dp = std::move( next );
+                continue;
+            }
+
+            pixels += uint64( dp->Size().x ) * dp->Size().y;
+            if( stats )
+            {
+                printf( "%s\n", files[i].c_str() );
+                PrintStats( *dp, bd, bda, rgba );
+            }
+
+            if( cache && !keys[i].empty() )
+            {
+                // The files are complete once their writers are gone
+                const bool hasAlpha = bda != nullptr;
+                bd.reset();
+                bda.reset();
+                cache->Store( keys[i], fn.c_str(), hasAlpha ? fna.c_str() : nullptr );
+            }
+
+            dp = std::move( next );
         }
 
-        TaskDispatch::Sync();
+        const auto time = GetTime() - start;
+        printf( "Compressed %i images, %0.2f MPix in %0.3f ms (%0.2f MPix/s)\n", int( files.size() - failed ), pixels / 1000000.f, time / 1000.f, pixels / float( time ) );
+        if( cache )
+        {
+            printf( "Copied %u images from the cache\n", cache->Hits() );
+            cache->Evict();
+        }
+        if( failed != 0 )
+        {
+            fprintf( stderr, "%u images could not be decoded.\n", failed );
+            return 1;
+        }
+    }
+    else
+    {
+        const std::string fn = std::string( "out" ) + BlockData::Extension( format );
+        const std::string fna = std::string( "outa" ) + BlockData::Extension( format );
+        const std::string sidecar = fn + ".rows";
 
-        if( stats )
+        // Row hashes of an earlier incremental run don't describe what any other run writes
+        if( !incremental ) remove( sidecar.c_str() );
+
+        std::string key;
+        if( cache )
         {
-            auto out = bd->Decode();
-            float mse = CalcMSE3( dp.ImageData(), *out );
-            printf( "RGB data\n" );
-            printf( "  RMSE: %f\n", sqrt( mse ) );
-            printf( "  PSNR: %f\n", 20 * log10( 255 ) - 10 * log10( mse ) );
-            if( bda )
+            key = cache->Key( argv[1], cacheSettings );
+            if( cacheLookup && !key.empty() && cache->Fetch( key, fn.c_str(), fna.c_str() ) )
             {
-                auto out = bda->Decode();
-                float mse = CalcMSE1( dp.ImageData(), *out );
-                printf( "A data\n" );
-                printf( "  RMSE: %f\n", sqrt( mse ) );
-                printf( "  PSNR: %f\n", 20 * log10( 255 ) - 10 * log10( mse ) );
+                printf( "Copied from the cache\n" );
+                cache->Evict();
+                return 0;
             }
         }
 
+        const uint window = stream ? std::max<uint>( 4, System::CPUCores() * 4 ) : 0;
+
+        DataProvider dp( argv[1], mipmap, true, window, filter );
+
+        const bool rgba = alpha && dp.Alpha() && etc2;
+        BlockData::Type type = BlockData::Etc1;
+        if( etc2 )
+        {
+            type = rgba ? BlockData::Etc2_RGBA : BlockData::Etc2_RGB;
+        }
+
+        // Ties the row hashes to the output files they were saved with
+        const bool hasAlpha = alpha && dp.Alpha() && !etc2;
+        auto outputHash = [&fn, &fna, hasAlpha]()
+        {
+            const uint64 h = RowHashes::FileHash( fn.c_str() );
+            return hasAlpha ? h * 0x9E3779B97F4A7C15ull ^ RowHashes::FileHash( fna.c_str() ) : h;
+        };
+        uint64 output = 0;
+        if( incremental ) output = outputHash();
+
+        auto bd = std::make_shared<BlockData>( fn.c_str(), dp.Size(), mipmap, type, stream, format, zlib, incremental );
+        BlockDataPtr bda;
+        if( hasAlpha )
+        {
+            bda = std::make_shared<BlockData>( fna.c_str(), dp.Size(), mipmap, BlockData::Etc1, stream, format, zlib, incremental );
+        }
+
+        std::unique_ptr<RowHashes> rows;
+        if( incremental )
+        {
+            // Everything besides the source that the blocks depend on
+            const uint32 settings[] = { uint32( type ), uint32( format ), mipmap, uint32( filter ), dither, uint32( effort ), uint32( metric ), bda != nullptr, uint32( cpu_isa() ) };
+            rows.reset( new RowHashes( dp.Size(), mipmap, RowHashes::Hash( settings, sizeof( settings ) ) ) );
+
+            // The hashes are only valid for the files they were saved with. They are gone until this run
+            // is done, so that an interrupted run is followed by a full one.
+            if( bd->Patched() && ( !bda || bda->Patched() ) ) rows->Load( sidecar.c_str(), output );
+            remove( sidecar.c_str() );
+        }
+
+        QueueParts( dp, bd, bda, rgba, dither, effort, rdo, metric, rows.get(), window );
+        TaskDispatch::Sync();
+
+        // Nothing of a broken source is kept. In incremental mode the sidecar is already gone, so the next
+        // run starts over.
+        if( dp.Failed() )
+        {
+            fprintf( stderr, "Can't decode %s.\n", argv[1] );
+            bd.reset();
+            bda.reset();
+            remove( fn.c_str() );
+            if( hasAlpha ) remove( fna.c_str() );
+            return 1;
+        }
+
+        if( stats )
+        {
+            PrintStats( dp, bd, bda, rgba );
+        }
+
         if( save & 0x2 )
         {
             auto out = bd->Decode();
@@ -234,6 +716,22 @@ int main( int argc, char** argv )
 
         bd.reset();
         bda.reset();
+
+        // The files are complete once their writers are gone
+        if( rows )
+        {
+            printf( "Compressed %u of %u block rows\n", rows->ChangedRows(), rows->Rows() );
+            if( !rows->Save( sidecar.c_str(), outputHash() ) )
+            {
+                fprintf( stderr, "Can't write %s.\n", sidecar.c_str() );
+            }
+        }
+
+        if( cache && !key.empty() )
+        {
+            cache->Store( key, fn.c_str(), hasAlpha ? fna.c_str() : nullptr );
+            cache->Evict();
+        }
     }
 
     return 0;
@@ -0,0 +1,402 @@
+#include <algorithm>
+#include <assert.h>
+#include <functional>
+#include <limits>
+#include <map>
+#include <memory>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+#include "Benchmark.hpp"
+#include "Bitmap.hpp"
+#include "BitmapDownsampled.hpp"
+#include "CpuArch.hpp"
+#include "Dither.hpp"
+#include "Etcpak.hpp"
+#include "MipChain.hpp"
+#include "ProcessAlpha.hpp"
+#include "ProcessAlpha_AVX2.hpp"
+#include "ProcessRGB.hpp"
+#include "ProcessRGB_AVX2.hpp"
+#include "Timing.hpp"
+
+// A kernel slower than its baseline by more than this, in each of 1 + Retries measurements, is a regression
+static const double Tolerance = 0.1;
+enum { Retries = 4 };
+// Each kernel runs at least MinRuns times and MinTime microseconds, the best run counts
+enum { MinRuns = 3 };
+enum { MinTime = 250000 };
+// Larger images are cropped, to keep the run time reasonable
+enum { MaxSize = 1024 };
+
+struct Corpus
+{
+    std::string name;
+    v2i size;
+    std::vector<uint32> pixels;     // BGRA, row by row
+    std::vector<uint32> blocks;     // 16 pixels per block, column by column, as the kernels expect
+    std::vector<uint8> alpha;       // 16 alpha values per block
+    std::vector<uint64> etc[3];     // Compressed blocks of each BlockData::Type, for the decoders
+};
+
+static volatile uint64 s_sink;
+
+static void Gather( Corpus& c )
+{
+    const int bw = c.size.x / 4;
+    const int bh = c.size.y / 4;
+    c.blocks.resize( bw * bh * 16 );
+    c.alpha.resize( bw * bh * 16 );
+
+    auto dst = c.blocks.data();
+    auto dsta = c.alpha.data();
+    for( int by=0; by<bh; by++ )
+    {
+        for( int bx=0; bx<bw; bx++ )
+        {
+            for( int x=0; x<4; x++ )
+            {
+                for( int y=0; y<4; y++ )
+                {
+                    const uint32 v = c.pixels[( by*4 + y ) * c.size.x + bx*4 + x];
+                    *dst++ = v;
+                    *dsta++ = v >> 24;
+                }
+            }
+        }
+    }
+
+    const uint32 num = bw * bh;
+    for( int i=0; i<3; i++ )
+    {
+        const auto type = BlockData::Type( i );
+        c.etc[i].resize( num * ( type == BlockData::Etc2_RGBA ? 2 : 1 ) );
+        CompressBlocks( c.pixels.data(), c.etc[i].data(), num, c.size.x, c.size.x, type, Channels::RGB, false, EffortDefault, 0, ErrorMetric::Luma, false );
+    }
+}
+
+// Gradients, a noisy quadrant and a flat one. The same on every run.
+static Corpus Synthetic()
+{
+    Corpus c;
+    c.name = "synthetic";
+    c.size = v2i( 512, 512 );
+    c.pixels.resize( 512*512 );
+
+    uint32 seed = 1;
+    for( int y=0; y<512; y++ )
+    {
+        for( int x=0; x<512; x++ )
+        {
+            seed = seed * 1664525 + 1013904223;
+            const uint32 noise = ( x >= 256 && y < 256 ) ? ( seed >> 24 ) & 0x3F : 0;
+            const uint32 r = std::min<uint32>( 255, x / 2 + noise );
+            const uint32 g = ( x >= 256 && y >= 256 ) ? 128 : y / 2;
+            const uint32 b = ( x + y ) / 4;
+            const uint32 a = ( x ^ y ) & 0xFF;
+            c.pixels[y*512+x] = b | ( g << 8 ) | ( r << 16 ) | ( a << 24 );
+        }
+    }
+
+    Gather( c );
+    return c;
+}
+
+static Corpus Load( const char* fn )
+{
+    Bitmap bmp( fn, std::numeric_limits<uint>::max(), false );
+
+    Corpus c;
+    const char* name = std::max( strrchr( fn, '/' ), strrchr( fn, '\\' ) );
+    c.name = name ? name + 1 : fn;
+    c.size = v2i( std::min<int>( MaxSize, bmp.Stride() ), std::min<int>( MaxSize, bmp.PaddedHeight() ) );
+    c.pixels.resize( c.size.x * c.size.y );
+    for( int y=0; y<c.size.y; y++ )
+    {
+        memcpy( c.pixels.data() + y * c.size.x, bmp.Data() + y * bmp.Stride(), c.size.x * sizeof( uint32 ) );
+    }
+
+    Gather( c );
+    return c;
+}
+
+// Returns the speed of the best run in MPix/s
+static double Measure( size_t pixels, const std::function<void()>& f )
+{
+    uint64 best = std::numeric_limits<uint64>::max();
+    uint64 total = 0;
+    int runs = 0;
+    while( runs < MinRuns || total < MinTime )
+    {
+        const auto start = GetTime();
+        f();
+        const auto time = GetTime() - start;
+        best = std::min( best, time );
+        total += time;
+        runs++;
+    }
+    return pixels / double( std::max<uint64>( 1, best ) );
+}
+
+static std::map<std::string, double> ReadBaseline( FILE* f )
+{
+    std::map<std::string, double> ret;
+
+    std::string data;
+    char buf[4096];
+    size_t len;
+    while( ( len = fread( buf, 1, sizeof( buf ), f ) ) > 0 )
+    {
+        data.append( buf, len );
+    }
+
+    // Flat object of "name": value pairs, as written below
+    size_t pos = 0;
+    for(;;)
+    {
+        const auto start = data.find( '"', pos );
+        if( start == std::string::npos ) break;
+        const auto end = data.find( '"', start + 1 );
+        const auto colon = data.find( ':', end );
+        if( end == std::string::npos || colon == std::string::npos ) break;
+        ret[data.substr( start + 1, end - start - 1 )] = strtod( data.c_str() + colon + 1, nullptr );
+        pos = colon + 1;
+    }
+    return ret;
+}
+
+struct Kernel
+{
+    std::string name;
+    std::function<void( const Corpus& )> run;
+};
+
+static std::vector<Kernel> Kernels()
+{
+    std::vector<Kernel> ret;
+
+    // The color kernels run with the default metric
+    auto rgb = [&ret]( const char* name, const std::function<uint64( const uint8*, ErrorMetric )>& f )
+    {
+        ret.push_back( { name, [f]( const Corpus& c )
+        {
+            uint64 sink = 0;
+            const size_t num = c.blocks.size() / 16;
+            for( size_t i=0; i<num; i++ )
+            {
+                sink ^= f( (const uint8*)( c.blocks.data() + i*16 ), ErrorMetric::Luma );
+            }
+            s_sink = sink;
+        } } );
+    };
+    auto batch = [&ret]( const char* name, uint32 n, const std::function<void( const uint8*, uint64*, ErrorMetric )>& f )
+    {
+        ret.push_back( { name, [n, f]( const Corpus& c )
+        {
+            uint64 out[4];
+            const size_t num = c.blocks.size() / 16;
+            for( size_t i=0; i+n<=num; i+=n )
+            {
+                f( (const uint8*)( c.blocks.data() + i*16 ), out, ErrorMetric::Luma );
+            }
+            s_sink = out[0];
+        } } );
+    };
+    auto alpha = [&ret]( const char* name, uint64 (*f)( const uint8* ) )
+    {
+        ret.push_back( { name, [f]( const Corpus& c )
+        {
+            uint64 sink = 0;
+            const size_t num = c.alpha.size() / 16;
+            for( size_t i=0; i<num; i++ )
+            {
+                sink ^= f( c.alpha.data() + i*16 );
+            }
+            s_sink = sink;
+        } } );
+    };
+    auto decode = [&ret]( const char* name, BlockData::Type type )
+    {
+        // The output buffer is reused, so that page faults are not timed
+        auto out = std::make_shared<std::vector<uint32>>();
+        ret.push_back( { name, [type, out]( const Corpus& c )
+        {
+            out->resize( c.pixels.size() );
+            EtcDecompress( c.etc[type].data(), c.size.x, c.size.y, type, out->data(), c.size.x );
+            s_sink = (*out)[0];
+        } } );
+    };
+
+    rgb( "ProcessRGB", ProcessRGB );
+    rgb( "ProcessRGB_4x2", ProcessRGB_4x2 );
+    rgb( "ProcessRGB_ETC2", []( const uint8* src, ErrorMetric metric ) { return ProcessRGB_ETC2( src, false, metric ); } );
+    rgb( "ProcessRGB_ETC2 effort 2", []( const uint8* src, ErrorMetric metric ) { return ProcessRGB_ETC2( src, true, metric ); } );
+#ifdef __SSE4_1__
+    if( can_use_intel_core_4th_gen_features() )
+    {
+        rgb( "ProcessRGB_AVX2", ProcessRGB_AVX2 );
+        rgb( "ProcessRGB_4x2_AVX2", ProcessRGB_4x2_AVX2 );
+        rgb( "ProcessRGB_ETC2_AVX2", []( const uint8* src, ErrorMetric metric ) { return ProcessRGB_ETC2_AVX2( src, false, metric ); } );
+        rgb( "ProcessRGB_ETC2_AVX2 effort 2", []( const uint8* src, ErrorMetric metric ) { return ProcessRGB_ETC2_AVX2( src, true, metric ); } );
+        batch( "ProcessRGB_AVX2_x2", 2, ProcessRGB_AVX2_x2 );
+        batch( "ProcessRGB_ETC2_AVX2_x2", 2, []( const uint8* src, uint64* dst, ErrorMetric metric ) { ProcessRGB_ETC2_AVX2_x2( src, dst, false, metric ); } );
+    }
+    if( can_use_avx512_features() )
+    {
+        batch( "ProcessRGB_AVX512_x4", 4, ProcessRGB_AVX512_x4 );
+        batch( "ProcessRGB_ETC2_AVX512_x4", 4, []( const uint8* src, uint64* dst, ErrorMetric metric ) { ProcessRGB_ETC2_AVX512_x4( src, dst, false, metric ); } );
+    }
+#endif
+    alpha( "ProcessAlpha", ProcessAlpha );
+    alpha( "ProcessAlpha_ETC2", ProcessAlpha_ETC2 );
+#ifdef __SSE4_1__
+    if( can_use_intel_core_4th_gen_features() )
+    {
+        alpha( "ProcessAlpha_ETC2_AVX2", ProcessAlpha_ETC2_AVX2 );
+    }
+#endif
+    ret.push_back( { "Dither", []( const Corpus& c )
+    {
+        uint8 buf[16*4];
+        const size_t num = c.blocks.size() / 16;
+        for( size_t i=0; i<num; i++ )
+        {
+            memcpy( buf, c.blocks.data() + i*16, sizeof( buf ) );
+            Dither( buf );
+        }
+        s_sink = buf[0];
+    } } );
+#ifdef __SSE4_1__
+    ret.push_back( { "Dither_Swizzle_SSE41", []( const Corpus& c )
+    {
+        alignas(16) uint8 buf[2][16*4];
+        for( int y=0; y<c.size.y; y+=4 )
+        {
+            for( int x=0; x+8<=c.size.x; x+=8 )
+            {
+                Dither_Swizzle_SSE41( (const uint8*)( c.pixels.data() + y * c.size.x + x ), c.size.x * 4, buf[0], buf[1] );
+            }
+        }
+        s_sink = buf[0][0];
+    } } );
+#endif
+    auto mip = [&ret]( const char* name, MipFilter filter )
+    {
+        ret.push_back( { name, [filter]( const Corpus& c )
+        {
+            Bitmap bmp( c.size );
+            memcpy( bmp.Data(), c.pixels.data(), c.pixels.size() * sizeof( uint32 ) );
+            BitmapDownsampled mip( bmp, std::numeric_limits<uint>::max(), filter );
+            s_sink = mip.Data()[0];
+        } } );
+    };
+    mip( "BitmapDownsampled", MipFilter::Box );
+    mip( "BitmapDownsampled kaiser", MipFilter::Kaiser );
+    ret.push_back( { "Mip chain per level", []( const Corpus& c )
+    {
+        std::unique_ptr<Bitmap> level( new Bitmap( c.size ) );
+        memcpy( level->Data(), c.pixels.data(), c.pixels.size() * sizeof( uint32 ) );
+        while( level->Size().x != 1 || level->Size().y != 1 )
+        {
+            level.reset( new BitmapDownsampled( *level, std::numeric_limits<uint>::max() ) );
+        }
+        s_sink = level->Data()[0];
+    } } );
+    ret.push_back( { "Mip chain bands", []( const Corpus& c )
+    {
+        MipChain chain( 32, MipFilter::Box );
+        for( int y=0; y<c.size.y; y+=4 )
+        {
+            chain.Push( c.pixels.data() + y * c.size.x, c.size, c.size.x );
+        }
+        chain.Queue();
+        DataPart part;
+        while( chain.TryNextPart( part ) )
+        {
+            s_sink = part.src[0];
+        }
+    } } );
+    decode( "Decode Etc1", BlockData::Etc1 );
+    decode( "Decode Etc2_RGB", BlockData::Etc2_RGB );
+    decode( "Decode Etc2_RGBA", BlockData::Etc2_RGBA );
+
+    return ret;
+}
+
+int KernelBenchmark( const char* fn, const char* baseline )
+{
+    InitDither();
+
+    std::vector<Corpus> corpus;
+    corpus.emplace_back( Synthetic() );
+    corpus.emplace_back( Load( fn ) );
+
+    std::map<std::string, double> base;
+    FILE* f = fopen( baseline, "rb" );
+    if( f )
+    {
+        base = ReadBaseline( f );
+        fclose( f );
+    }
+
+    const auto kernels = Kernels();
+    std::vector<std::pair<std::string, double>> results;
+    int regressions = 0;
+
+    printf( "%-32s %-16s %12s %10s %10s\n", "Kernel", "Corpus", "Mblocks/s", "MPix/s", "Change" );
+    for( auto& k : kernels )
+    {
+        for( auto& c : corpus )
+        {
+            const auto key = k.name + "/" + c.name;
+            const auto it = base.find( key );
+            const bool compare = it != base.end() && it->second > 0;
+
+            // Interference from the rest of the system only ever slows a run down, so a kernel that looks
+            // slower is measured again before it counts as a regression
+            double mpix = 0;
+            for( int i=0; i<=Retries; i++ )
+            {
+                mpix = std::max( mpix, Measure( c.pixels.size(), [&k, &c]{ k.run( c ); } ) );
+                if( !compare || mpix / it->second - 1 >= -Tolerance ) break;
+            }
+            results.emplace_back( key, mpix );
+
+            printf( "%-32s %-16s %12.3f %10.2f", k.name.c_str(), c.name.c_str(), mpix / 16, mpix );
+            if( compare )
+            {
+                const double change = mpix / it->second - 1;
+                printf( " %+9.1f%%", change * 100 );
+                if( change < -Tolerance )
+                {
+                    printf( "  REGRESSION" );
+                    regressions++;
+                }
+            }
+            printf( "\n" );
+        }
+    }
+
+    if( base.empty() )
+    {
+        f = fopen( baseline, "wb" );
+        assert( f );
+        fprintf( f, "{\n" );
+        for( size_t i=0; i<results.size(); i++ )
+        {
+            fprintf( f, "  \"%s\": %.3f%s\n", results[i].first.c_str(), results[i].second, i+1 < results.size() ? "," : "" );
+        }
+        fprintf( f, "}\n" );
+        fclose( f );
+        printf( "Baseline written to %s\n", baseline );
+    }
+    else
+    {
+        printf( "%i possible regressions against %s\n", regressions, baseline );
+    }
+
+    return regressions;
+}
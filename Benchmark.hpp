@@ -0,0 +1,10 @@
+#ifndef __BENCHMARK_HPP__
+#define __BENCHMARK_HPP__
+
+// Times each compression and decompression kernel on its own, on a synthetic image and on the given png file.
+// Results are compared with the JSON baseline file, which is written if it doesn't exist yet. Returns the
+// number of kernels that are slower than the baseline. Timings of identical code on a loaded machine differ
+// by more than the tolerance, so the count is a hint for a closer look rather than a pass or fail result.
+int KernelBenchmark( const char* fn, const char* baseline );
+
+#endif
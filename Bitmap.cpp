@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <ctype.h>
 #include <stdlib.h>
 #include <string.h>
@@ -8,17 +9,49 @@
 
 #include "Bitmap.hpp"
 #include "Debug.hpp"
+#include "PngLoader.hpp"
 
-Bitmap::Bitmap( const char* fn, uint lines )
+// libpng reports errors by jumping back to the last setjmp, so each call gets its own, in a frame that is
+// still alive when the error happens
+static bool ReadInfo( png_structp png_ptr, png_infop info_ptr )
+{
+    if( setjmp( png_jmpbuf( png_ptr ) ) ) return false;
+    png_read_info( png_ptr, info_ptr );
+    return true;
+}
+
+static bool ReadRow( png_structp png_ptr, uint32* row )
+{
+    if( setjmp( png_jmpbuf( png_ptr ) ) ) return false;
+    png_read_rows( png_ptr, (png_bytepp)&row, NULL, 1 );
+    return true;
+}
+
+static bool ReadEnd( png_structp png_ptr, png_infop info_ptr )
+{
+    if( setjmp( png_jmpbuf( png_ptr ) ) ) return false;
+    png_read_end( png_ptr, info_ptr );
+    return true;
+}
+
+Bitmap::Bitmap( const char* fn, uint lines, bool async, uint window, const BlockRowCallback& blockRow )
     : m_block( nullptr )
     , m_lines( lines )
     , m_alpha( true )
+    , m_failed( false )
     , m_sema( 0 )
+    , m_window( window )
+    , m_oldest( 0 )
+    , m_free( window )
 {
     FILE* f = fopen( fn, "rb" );
-    assert( f );
+    if( !f )
+    {
+        LoadBlank( blockRow );
+        return;
+    }
 
-    char buf[4];
+    char buf[4] = {};
     fread( buf, 1, 4, f );
     if( memcmp( buf, "raw4", 4 ) == 0 )
     {
@@ -32,26 +65,75 @@ Bitmap::Bitmap( const char* fn, uint lines )
         m_size.y = d;
         DBGPRINT( "Raw bitmap " << fn << "  " << m_size.x << "x" << m_size.y );
 
-        assert( m_size.x % 4 == 0 );
-        assert( m_size.y % 4 == 0 );
-
         int32 csize;
         fread( &csize, 1, 4, f );
         char* cbuf = new char[csize];
         fread( cbuf, 1, csize, f );
         fclose( f );
 
-        m_block = m_data = new uint32[m_size.x*m_size.y];
-        m_linesLeft = m_size.y / 4;
+        // Decompressed in one go, the whole image is kept
+        m_window = 0;
+        Allocate();
 
         LZ4_decompress_fast( cbuf, (char*)m_data, m_size.x*m_size.y*4 );
         delete[] cbuf;
 
-        for( int i=0; i<m_size.y/4; i++ )
+        // Rows are moved to the padded stride from the bottom up, so that none is overwritten
+        const int stride = Stride();
+        if( stride != m_size.x )
         {
+            for( int y=m_size.y-1; y>0; y-- )
+            {
+                memmove( m_data + size_t( y ) * stride, m_data + size_t( y ) * m_size.x, m_size.x * sizeof( uint32 ) );
+            }
+        }
+
+        for( int i=0; i<PaddedHeight()/4; i++ )
+        {
+            auto rows = m_data + size_t( i ) * 4 * stride;
+            Pad( rows, i );
+            if( blockRow ) blockRow( rows, m_size, stride );
             m_sema.unlock();
         }
     }
+    else if( PngLoadHeader( f, m_size, m_alpha ) )
+    {
+        DBGPRINT( "Bitmap " << fn << "  " << m_size.x << "x" << m_size.y );
+
+        Allocate();
+
+        auto load = [this, f, blockRow]()
+        {
+            uint lines = 0;
+            uint row = 0;
+            uint32* rows = nullptr;
+            m_failed = !PngLoad( f, m_size, m_alpha, Stride(), [this, &rows]( uint i ) { return rows = Reserve( i ); }, [this, &lines, &row, &rows, &blockRow]()
+            {
+                Pad( rows, row++ );
+                if( blockRow ) blockRow( rows, m_size, Stride() );
+                lines++;
+                if( lines >= m_lines )
+                {
+                    lines = 0;
+                    m_sema.unlock();
+                }
+            } );
+
+            if( lines != 0 )
+            {
+                m_sema.unlock();
+            }
+        };
+
+        if( async )
+        {
+            m_load = std::async( std::launch::async, load );
+        }
+        else
+        {
+            load();
+        }
+    }
     else
     {
         fseek( f, 0, SEEK_SET );
@@ -61,14 +143,19 @@ Bitmap::Bitmap( const char* fn, uint lines )
 
         png_structp png_ptr = png_create_read_struct( PNG_LIBPNG_VER_STRING, NULL, NULL, NULL );
         png_infop info_ptr = png_create_info_struct( png_ptr );
-        setjmp( png_jmpbuf( png_ptr ) );
 
         png_init_io( png_ptr, f );
         png_set_sig_bytes( png_ptr, sig_read );
 
         png_uint_32 w, h;
 
-        png_read_info( png_ptr, info_ptr );
+        if( !ReadInfo( png_ptr, info_ptr ) )
+        {
+            png_destroy_read_struct( &png_ptr, &info_ptr, NULL );
+            fclose( f );
+            LoadBlank( blockRow );
+            return;
+        }
         png_get_IHDR( png_ptr, info_ptr, &w, &h, &bit_depth, &color_type, &interlace_type, NULL, NULL );
 
         m_size = v2i( w, h );
@@ -114,23 +201,25 @@ Bitmap::Bitmap( const char* fn, uint lines )
 
         DBGPRINT( "Bitmap " << fn << "  " << w << "x" << h );
 
-        assert( w % 4 == 0 );
-        assert( h % 4 == 0 );
-
-        m_block = m_data = new uint32[w*h];
-        m_linesLeft = h / 4;
+        Allocate();
 
-        m_load = std::async( std::launch::async, [this, f, png_ptr, info_ptr]() mutable
+        auto load = [this, f, png_ptr, info_ptr, blockRow]() mutable
         {
-            auto ptr = m_data;
+            // Once libpng fails, the rest of the rows are cleared
+            bool ok = true;
             uint lines = 0;
-            for( int i=0; i<m_size.y / 4; i++ )
+            for( int i=0; i<PaddedHeight() / 4; i++ )
             {
-                for( int j=0; j<4; j++ )
+                auto ptr = Reserve( i );
+                const auto rows = ptr;
+                for( int j=0; j<std::min( 4, m_size.y - i*4 ); j++ )
                 {
-                    png_read_rows( png_ptr, (png_bytepp)&ptr, NULL, 1 );
-                    ptr += m_size.x;
+                    ok = ok && ReadRow( png_ptr, ptr );
+                    if( !ok ) memset( ptr, 0, Stride() * sizeof( uint32 ) );
+                    ptr += Stride();
                 }
+                Pad( rows, i );
+                if( blockRow ) blockRow( rows, m_size, Stride() );
                 lines++;
                 if( lines >= m_lines )
                 {
@@ -144,27 +233,45 @@ Bitmap::Bitmap( const char* fn, uint lines )
                 m_sema.unlock();
             }
 
-            png_read_end( png_ptr, info_ptr );
+            if( ok ) ReadEnd( png_ptr, info_ptr );
             png_destroy_read_struct( &png_ptr, &info_ptr, NULL );
             fclose( f );
-        } );
+            m_failed = !ok;
+        };
+
+        if( async )
+        {
+            m_load = std::async( std::launch::async, load );
+        }
+        else
+        {
+            load();
+        }
     }
 }
 
 Bitmap::Bitmap( const v2i& size )
-    : m_data( new uint32[size.x*size.y] )
+    : m_data( new uint32[( ( size.x + 3 ) & ~3 ) * ( ( size.y + 3 ) & ~3 )] )
     , m_block( nullptr )
     , m_lines( 1 )
-    , m_linesLeft( size.y / 4 )
+    , m_linesLeft( ( size.y + 3 ) / 4 )
     , m_size( size )
+    , m_failed( false )
     , m_sema( 0 )
+    , m_window( 0 )
+    , m_oldest( 0 )
+    , m_free( 0 )
 {
 }
 
 Bitmap::Bitmap( const Bitmap& src, uint lines )
     : m_lines( lines )
     , m_alpha( src.Alpha() )
+    , m_failed( false )
     , m_sema( 0 )
+    , m_window( 0 )
+    , m_oldest( 0 )
+    , m_free( 0 )
 {
 }
 
@@ -191,7 +298,7 @@ void Bitmap::Write( const char* fn )
     for( int i=0; i<m_size.y; i++ )
     {
         png_write_rows( png_ptr, (png_bytepp)(&ptr), 1 );
-        ptr += m_size.x;
+        ptr += Stride();
     }
 
     png_write_end( png_ptr, info_ptr );
@@ -206,8 +313,88 @@ const uint32* Bitmap::NextBlock( uint& lines, bool& done )
     lines = std::min( m_lines, m_linesLeft );
     auto ret = m_block;
     m_sema.lock();
-    m_block += m_size.x * 4 * lines;
+    m_block += Stride() * 4 * lines;
+    if( m_window != 0 && m_block == m_data + size_t( Stride() ) * 4 * m_lines * m_window )
+    {
+        m_block = m_data;
+    }
     m_linesLeft -= lines;
     done = m_linesLeft == 0;
     return ret;
 }
+
+void Bitmap::Release( const uint32* block )
+{
+    if( m_window == 0 ) return;
+
+    std::lock_guard<std::mutex> lock( m_releaseLock );
+    const size_t part = size_t( block - m_data ) / ( size_t( Stride() ) * 4 * m_lines );
+    m_released[part] = true;
+
+    // Parts may be released out of order, their storage is reused in load order
+    while( m_released[m_oldest] )
+    {
+        m_released[m_oldest] = false;
+        m_oldest = ( m_oldest + 1 ) % m_window;
+        m_free.unlock();
+    }
+}
+
+void Bitmap::Allocate()
+{
+    // A window covering the whole image is no window at all
+    if( m_window != 0 && uint64( m_window ) * m_lines >= uint64( PaddedHeight() / 4 ) )
+    {
+        m_window = 0;
+    }
+
+    const size_t rows = m_window == 0 ? PaddedHeight() : size_t( m_window ) * m_lines * 4;
+    m_block = m_data = new uint32[Stride()*rows];
+    m_linesLeft = PaddedHeight() / 4;
+    m_released.resize( m_window );
+}
+
+// Lets the readers of the block rows run their course, Failed() tells them the image is not usable
+void Bitmap::LoadBlank( const BlockRowCallback& blockRow )
+{
+    m_failed = true;
+    m_alpha = false;
+    m_size = v2i( 4, 4 );
+    m_window = 0;
+    Allocate();
+    memset( m_data, 0, Stride() * PaddedHeight() * sizeof( uint32 ) );
+    if( blockRow ) blockRow( m_data, m_size, Stride() );
+    m_sema.unlock();
+}
+
+uint32* Bitmap::Reserve( uint blockRow )
+{
+    if( m_window == 0 )
+    {
+        return m_data + size_t( blockRow ) * 4 * Stride();
+    }
+
+    if( blockRow % m_lines == 0 )
+    {
+        m_free.lock();
+    }
+    return m_data + size_t( blockRow % ( m_window * m_lines ) ) * 4 * Stride();
+}
+
+void Bitmap::Pad( uint32* rows, uint blockRow )
+{
+    const int stride = Stride();
+    const int num = std::min( 4, m_size.y - int( blockRow ) * 4 );
+    for( int y=0; y<num; y++ )
+    {
+        auto row = rows + y * stride;
+        for( int x=m_size.x; x<stride; x++ )
+        {
+            row[x] = row[m_size.x-1];
+        }
+    }
+    for( int y=num; y<4; y++ )
+    {
+        memcpy( rows + y * stride, rows + ( num - 1 ) * stride, stride * sizeof( uint32 ) );
+    }
+}
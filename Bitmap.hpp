@@ -1,9 +1,11 @@
 #ifndef __DARKRL__BITMAP_HPP__
 #define __DARKRL__BITMAP_HPP__
 
+#include <functional>
 #include <future>
 #include <memory>
 #include <mutex>
+#include <vector>
 
 #include "Semaphore.hpp"
 #include "Types.hpp"
@@ -18,7 +20,12 @@ enum class Channels
 class Bitmap
 {
 public:
-    Bitmap( const char* fn, uint lines );
+    // Called on the loading thread with each block row, before the part it belongs to is made available
+    typedef std::function<void( const uint32* rows, const v2i& size, size_t stride )> BlockRowCallback;
+
+    // With a non-zero window only that many parts of the given number of block rows are kept in memory.
+    // The loader waits for the oldest part to be released before it reuses its storage.
+    Bitmap( const char* fn, uint lines, bool async = true, uint window = 0, const BlockRowCallback& blockRow = nullptr );
     Bitmap( const v2i& size );
     virtual ~Bitmap();
 
@@ -27,22 +34,42 @@ public:
     uint32* Data() { if( m_load.valid() ) m_load.wait(); return m_data; }
     const uint32* Data() const { if( m_load.valid() ) m_load.wait(); return m_data; }
     const v2i& Size() const { return m_size; }
+    // Rows are stored with the width rounded up to whole blocks, and the last block row is completed. The
+    // padding repeats the edge pixels.
+    int Stride() const { return ( m_size.x + 3 ) & ~3; }
+    int PaddedHeight() const { return ( m_size.y + 3 ) & ~3; }
     bool Alpha() const { return m_alpha; }
+    // The image data was truncated or corrupt, the lines that could not be read are cleared. A file that
+    // can't be opened or isn't an image at all loads as a cleared 4x4 image.
+    bool Failed() const { if( m_load.valid() ) m_load.wait(); return m_failed; }
 
     const uint32* NextBlock( uint& lines, bool& done );
+    void Release( const uint32* block );
 
 protected:
     Bitmap( const Bitmap& src, uint lines );
 
+    void Allocate();
+    void LoadBlank( const BlockRowCallback& blockRow );
+    uint32* Reserve( uint blockRow );
+    void Pad( uint32* rows, uint blockRow );
+
     uint32* m_data;
     uint32* m_block;
     uint m_lines;
     uint m_linesLeft;
     v2i m_size;
     bool m_alpha;
+    bool m_failed;
     Semaphore m_sema;
     std::mutex m_lock;
     std::future<void> m_load;
+
+    uint m_window;
+    uint m_oldest;
+    Semaphore m_free;
+    std::vector<bool> m_released;
+    std::mutex m_releaseLock;
 };
 
 typedef std::shared_ptr<Bitmap> BitmapPtr;
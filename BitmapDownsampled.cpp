@@ -1,83 +1,71 @@
+#include <algorithm>
 #include <string.h>
 #include <utility>
 
 #include "BitmapDownsampled.hpp"
 #include "Debug.hpp"
+#include "TaskDispatch.hpp"
 
-BitmapDownsampled::BitmapDownsampled( const Bitmap& bmp, uint lines )
+// Output rows per job
+enum { BandRows = 64 };
+
+BitmapDownsampled::BitmapDownsampled( const Bitmap& bmp, uint lines, MipFilter filter )
     : Bitmap( bmp, lines )
 {
     m_size.x = std::max( 1, bmp.Size().x / 2 );
     m_size.y = std::max( 1, bmp.Size().y / 2 );
 
-    int w = std::max( m_size.x, 4 );
-    int h = std::max( m_size.y, 4 );
+    const int w = Stride();
+    const int h = PaddedHeight();
 
     DBGPRINT( "Subbitmap " << m_size.x << "x" << m_size.y );
 
     m_block = m_data = new uint32[w*h];
+    m_linesLeft = h / 4;
 
-    if( m_size.x < w || m_size.y < h )
+    const auto src = bmp.Data();
+    const auto srcSize = bmp.Size();
+    const size_t srcStride = bmp.Stride();
+    const auto size = m_size;
+    const auto dst = m_data;
+
+    const int bands = ( m_size.y + BandRows - 1 ) / BandRows;
+    if( TaskDispatch::Available() && bands > 1 )
     {
-        memset( m_data, 0, w*h*sizeof( uint32 ) );
-        m_linesLeft = h / 4;
-        uint lines = 0;
-        for( int i=0; i<h/4; i++ )
+        for( int i=0; i<bands; i++ )
         {
-            for( int j=0; j<4; j++ )
+            TaskDispatch::Queue( [src, srcSize, srcStride, dst, size, w, i, filter]()
             {
-                lines++;
-                if( lines > m_lines )
-                {
-                    lines = 0;
-                    m_sema.unlock();
-                }
-            }
-        }
-        if( lines != 0 )
-        {
-            m_sema.unlock();
+                Downsample( src, srcSize, srcStride, dst, size, w, i * BandRows, std::min<int>( size.y, ( i + 1 ) * BandRows ), filter );
+            } );
         }
+        TaskDispatch::Sync();
     }
     else
     {
-        m_linesLeft = h / 4;
-        m_load = std::async( std::launch::async, [this, &bmp, w, h]() mutable
+        Downsample( src, srcSize, srcStride, dst, size, w, 0, m_size.y, filter );
+    }
+
+    // Partial blocks repeat the edge pixels, so that the padding doesn't pull the encoded colors towards black
+    if( m_size.x < w || m_size.y < h )
+    {
+        for( int y=0; y<m_size.y; y++ )
         {
-            auto ptr = m_data;
-            auto src1 = bmp.Data();
-            auto src2 = src1 + bmp.Size().x;
-            uint lines = 0;
-            for( int i=0; i<h/4; i++ )
+            for( int x=m_size.x; x<w; x++ )
             {
-                for( int j=0; j<4; j++ )
-                {
-                    for( int k=0; k<m_size.x; k++ )
-                    {
-                        int r = ( ( *src1 & 0x000000FF ) + ( *(src1+1) & 0x000000FF ) + ( *src2 & 0x000000FF ) + ( *(src2+1) & 0x000000FF ) ) / 4;
-                        int g = ( ( ( *src1 & 0x0000FF00 ) + ( *(src1+1) & 0x0000FF00 ) + ( *src2 & 0x0000FF00 ) + ( *(src2+1) & 0x0000FF00 ) ) / 4 ) & 0x0000FF00;
-                        int b = ( ( ( *src1 & 0x00FF0000 ) + ( *(src1+1) & 0x00FF0000 ) + ( *src2 & 0x00FF0000 ) + ( *(src2+1) & 0x00FF0000 ) ) / 4 ) & 0x00FF0000;
-                        int a = ( ( ( ( ( *src1 & 0xFF000000 ) >> 8 ) + ( ( *(src1+1) & 0xFF000000 ) >> 8 ) + ( ( *src2 & 0xFF000000 ) >> 8 ) + ( ( *(src2+1) & 0xFF000000 ) >> 8 ) ) / 4 ) & 0x00FF0000 ) << 8;
-                        *ptr++ = r | g | b | a;
-                        src1 += 2;
-                        src2 += 2;
-                    }
-                    src1 += m_size.x * 2;
-                    src2 += m_size.x * 2;
-                }
-                lines++;
-                if( lines >= m_lines )
-                {
-                    lines = 0;
-                    m_sema.unlock();
-                }
+                m_data[y*w+x] = m_data[y*w+m_size.x-1];
             }
+        }
+        for( int y=m_size.y; y<h; y++ )
+        {
+            memcpy( m_data + y*w, m_data + ( m_size.y - 1 ) * w, w * sizeof( uint32 ) );
+        }
+    }
 
-            if( lines != 0 )
-            {
-                m_sema.unlock();
-            }
-        } );
+    const uint parts = ( h / 4 ) / m_lines + ( ( h / 4 ) % m_lines != 0 );
+    for( uint i=0; i<parts; i++ )
+    {
+        m_sema.unlock();
     }
 }
 
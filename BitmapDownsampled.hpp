@@ -2,12 +2,14 @@
 #define __DARKRL__BITMAPDOWNSAMPLED_HPP__
 
 #include "Bitmap.hpp"
+#include "Downsample.hpp"
 #include "Types.hpp"
 
 class BitmapDownsampled : public Bitmap
 {
 public:
-    BitmapDownsampled( const Bitmap& bmp, uint lines );
+    // Filtered in bands, on the task dispatcher when called from one of its threads (but not from a job)
+    BitmapDownsampled( const Bitmap& bmp, uint lines, MipFilter filter = MipFilter::Box );
     ~BitmapDownsampled();
 };
 
@@ -0,0 +1,77 @@
+#include <algorithm>
+#include <string.h>
+
+#include "BlockCache.hpp"
+
+// Largest table, in slots. Jobs span a few block rows, so this is rarely reached.
+enum { MaxSlots = 1 << 15 };
+
+BlockCache::BlockCache( uint32 blocks )
+    : m_hits( 0 )
+{
+    // Kept at most half full, so that probe sequences stay short
+    uint32 slots = 16;
+    while( slots < blocks * 2 && slots < MaxSlots ) slots *= 2;
+    m_hash.resize( slots, 0 );
+    m_slot.resize( slots );
+    m_entries.reserve( std::min<uint32>( blocks, slots / 2 ) );
+    m_mask = slots - 1;
+}
+
+uint64 BlockCache::Hash( const uint32* px, const uint8* alpha )
+{
+    uint64 h = 0;
+    for( int i=0; i<16; i+=2 )
+    {
+        uint64 v;
+        memcpy( &v, px + i, 8 );
+        h = ( h ^ v ) * 0x9E3779B97F4A7C15ull;
+        h ^= h >> 29;
+    }
+    if( alpha )
+    {
+        for( int i=0; i<16; i+=8 )
+        {
+            uint64 v;
+            memcpy( &v, alpha + i, 8 );
+            h = ( h ^ v ) * 0x9E3779B97F4A7C15ull;
+            h ^= h >> 29;
+        }
+    }
+    h ^= h >> 32;
+    return h | 1;
+}
+
+bool BlockCache::Find( uint64 hash, const uint32* px, const uint8* alpha, uint64 words[2] )
+{
+    for( uint32 i = uint32( hash ) & m_mask; m_hash[i] != 0; i = ( i + 1 ) & m_mask )
+    {
+        if( m_hash[i] != hash ) continue;
+        const Entry& e = m_entries[m_slot[i]];
+        if( memcmp( e.px, px, sizeof( e.px ) ) != 0 ) continue;
+        if( alpha && memcmp( e.alpha, alpha, sizeof( e.alpha ) ) != 0 ) continue;
+        words[0] = e.words[0];
+        words[1] = e.words[1];
+        m_hits++;
+        return true;
+    }
+    return false;
+}
+
+void BlockCache::Insert( uint64 hash, const uint32* px, const uint8* alpha, const uint64 words[2] )
+{
+    if( m_entries.size() >= ( m_mask + 1 ) / 2 ) return;
+
+    uint32 i = uint32( hash ) & m_mask;
+    while( m_hash[i] != 0 ) i = ( i + 1 ) & m_mask;
+
+    Entry e;
+    memcpy( e.px, px, sizeof( e.px ) );
+    if( alpha ) memcpy( e.alpha, alpha, sizeof( e.alpha ) );
+    e.words[0] = words[0];
+    e.words[1] = words[1];
+
+    m_hash[i] = hash;
+    m_slot[i] = uint32( m_entries.size() );
+    m_entries.push_back( e );
+}
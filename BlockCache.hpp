@@ -0,0 +1,40 @@
+#ifndef __BLOCKCACHE_HPP__
+#define __BLOCKCACHE_HPP__
+
+#include <vector>
+
+#include "Types.hpp"
+
+// Encoded blocks of one job, keyed by the 16 kernel pixels and, with EAC alpha, the 16 alpha values. Atlases
+// and sprite sheets repeat many blocks (empty borders, flat fills, tiled patterns), which then go through the
+// kernels once per job. Each job has its own cache, so nothing is shared between threads.
+class BlockCache
+{
+public:
+    // Sized for a job of the given number of blocks. Once full, new blocks are no longer added.
+    BlockCache( uint32 blocks );
+
+    static uint64 Hash( const uint32* px, const uint8* alpha );
+
+    // alpha is null when there is no alpha block. Words are the alpha and the color block.
+    bool Find( uint64 hash, const uint32* px, const uint8* alpha, uint64 words[2] );
+    void Insert( uint64 hash, const uint32* px, const uint8* alpha, const uint64 words[2] );
+
+    uint32 Hits() const { return m_hits; }
+
+private:
+    struct Entry
+    {
+        uint32 px[16];
+        uint8 alpha[16];
+        uint64 words[2];
+    };
+
+    std::vector<uint64> m_hash;     // 0 marks an empty slot
+    std::vector<uint32> m_slot;     // index of the entry of each slot
+    std::vector<Entry> m_entries;
+    uint32 m_mask;
+    uint32 m_hits;
+};
+
+#endif
@@ -1,21 +1,46 @@
+#include <algorithm>
 #include <assert.h>
 #include <string.h>
 
 #include "BlockData.hpp"
 #include "ColorSpace.hpp"
-#include "CpuArch.hpp"
 #include "Debug.hpp"
-#include "Dither.hpp"
+#include "DecodeRGB.hpp"
+#include "Etcpak.hpp"
 #include "MipMap.hpp"
 #include "mmap.hpp"
-#include "ProcessAlpha.hpp"
-#include "ProcessRGB.hpp"
-#include "ProcessRGB_AVX2.hpp"
 #include "Tables.hpp"
 #include "TaskDispatch.hpp"
+#include "zlib/zlib.h"
+
+enum
+{
+    GlRGB = 0x1907,
+    GlRGBA = 0x1908,
+    GlEtc1RGB = 0x8D64,
+    GlEtc2RGB = 0x9274,
+    GlEtc2RGBA = 0x9278,
+
+    VkEtc2RGB = 147,
+    VkEtc2RGBA = 151,
+
+    Ktx2Zlib = 3,       // supercompressionScheme
+
+    DfModelEtc1 = 160,
+    DfModelEtc2 = 161
+};
+
+static int BitsPerPixel( BlockData::Type type )
+{
+    return type == BlockData::Etc2_RGBA ? 8 : 4;
+}
 
 BlockData::BlockData( const char* fn )
     : m_file( fopen( fn, "rb" ) )
+    , m_zlib( false )
+    , m_patched( false )
+    , m_blocks( 0 )
+    , m_reused( 0 )
 {
     assert( m_file );
     fseek( m_file, 0, SEEK_END );
@@ -26,15 +51,82 @@ BlockData::BlockData( const char* fn )
     auto data32 = (uint32*)m_data;
     if( *data32 == 0x03525650 )
     {
+        switch( *(data32+2) )
+        {
+        case 22:
+            m_type = Etc2_RGB;
+            break;
+        case 23:
+            m_type = Etc2_RGBA;
+            break;
+        default:
+            m_type = Etc1;
+            break;
+        }
+
         m_size.y = *(data32+6);
         m_size.x = *(data32+7);
         m_dataOffset = 52 + *(data32+12);
     }
+    else if( *data32 == 0x58544BAB && *(data32+1) == 0xBB303220 )
+    {
+        // KTX2, the color model of the data format descriptor tells ETC1 from ETC2
+        switch( *(data32+3) )
+        {
+        case VkEtc2RGB:
+            m_type = m_data[*(data32+12) + 12] == DfModelEtc1 ? Etc1 : Etc2_RGB;
+            break;
+        case VkEtc2RGBA:
+            m_type = Etc2_RGBA;
+            break;
+        default:
+            assert( false );
+            break;
+        }
+
+        m_size.x = *(data32+5);
+        m_size.y = *(data32+6);
+        m_dataOffset = size_t( *(uint64*)( m_data + 80 ) );
+
+        if( *(data32+11) == Ktx2Zlib )
+        {
+            // The base level is inflated to memory, the file is not needed anymore
+            const auto index = (const uint64*)( m_data + 80 );
+            uLongf len = uLongf( index[2] );
+            auto buf = new uint8[len];
+            const int res = uncompress( buf, &len, m_data + m_dataOffset, uLong( index[1] ) );
+            assert( res == Z_OK && len == index[2] );
+            munmap( m_data, m_maplen );
+            fclose( m_file );
+            m_file = nullptr;
+            m_data = buf;
+            m_maplen = len;
+            m_dataOffset = 0;
+        }
+        else
+        {
+            assert( *(data32+11) == 0 );
+        }
+    }
     else if( *data32 == 0x58544BAB )
     {
+        switch( *(data32+7) )
+        {
+        case GlEtc2RGB:
+            m_type = Etc2_RGB;
+            break;
+        case GlEtc2RGBA:
+            m_type = Etc2_RGBA;
+            break;
+        default:
+            m_type = Etc1;
+            break;
+        }
+
         m_size.x = *(data32+9);
         m_size.y = *(data32+10);
-        m_dataOffset = 17 + *(data32+15);
+        // Header, key/value data and the image size of the base level
+        m_dataOffset = 64 + *(data32+15) + 4;
     }
     else
     {
@@ -42,21 +134,58 @@ BlockData::BlockData( const char* fn )
     }
 }
 
-static uint8* OpenForWriting( const char* fn, size_t len, const v2i& size, FILE** f, int levels )
+bool BlockData::ParseFormat( const char* name, Format& format )
 {
-    *f = fopen( fn, "wb+" );
-    assert( *f );
-    fseek( *f, len - 1, SEEK_SET );
-    const char zero = 0;
-    fwrite( &zero, 1, 1, *f );
-    fseek( *f, 0, SEEK_SET );
+    if( strcmp( name, "pvr" ) == 0 )
+    {
+        format = Pvr;
+        return true;
+    }
+    if( strcmp( name, "ktx" ) == 0 )
+    {
+        format = Ktx;
+        return true;
+    }
+    if( strcmp( name, "ktx2" ) == 0 )
+    {
+        format = Ktx2;
+        return true;
+    }
+    return false;
+}
 
-    auto ret = (uint8*)mmap( nullptr, len, PROT_WRITE, MAP_SHARED, fileno( *f ), 0 );
-    auto dst = (uint32*)ret;
+const char* BlockData::Extension( Format format )
+{
+    switch( format )
+    {
+    case Ktx:
+        return ".ktx";
+    case Ktx2:
+        return ".ktx2";
+    default:
+        return ".pvr";
+    }
+}
 
+static void WritePvrHeader( uint32* dst, const v2i& size, int levels, BlockData::Type type )
+{
     *dst++ = 0x03525650;  // version
     *dst++ = 0;           // flags
-    *dst++ = 6;           // pixelformat[0], value 22 is needed for etc2
+    switch( type )
+    {
+    case BlockData::Etc1:
+        *dst++ = 6;       // pixelformat[0]
+        break;
+    case BlockData::Etc2_RGB:
+        *dst++ = 22;
+        break;
+    case BlockData::Etc2_RGBA:
+        *dst++ = 23;
+        break;
+    default:
+        assert( false );
+        break;
+    }
     *dst++ = 0;           // pixelformat[1]
     *dst++ = 0;           // colourspace
     *dst++ = 0;           // channel type
@@ -67,67 +196,354 @@ static uint8* OpenForWriting( const char* fn, size_t len, const v2i& size, FILE*
     *dst++ = 1;           // num faces
     *dst++ = levels;      // mipmap count
     *dst++ = 0;           // metadata size
+}
 
-    return ret;
+static void WriteKtxHeader( uint32* dst, const v2i& size, int levels, BlockData::Type type )
+{
+    static const uint8 id[12] = { 0xAB, 'K', 'T', 'X', ' ', '1', '1', 0xBB, '\r', '\n', 0x1A, '\n' };
+    memcpy( dst, id, sizeof( id ) );
+    dst += 3;
+    *dst++ = 0x04030201;  // endianness
+    *dst++ = 0;           // glType
+    *dst++ = 1;           // glTypeSize
+    *dst++ = 0;           // glFormat
+    switch( type )
+    {
+    case BlockData::Etc1:
+        *dst++ = GlEtc1RGB;
+        *dst++ = GlRGB;   // glBaseInternalFormat
+        break;
+    case BlockData::Etc2_RGB:
+        *dst++ = GlEtc2RGB;
+        *dst++ = GlRGB;
+        break;
+    case BlockData::Etc2_RGBA:
+        *dst++ = GlEtc2RGBA;
+        *dst++ = GlRGBA;
+        break;
+    default:
+        assert( false );
+        break;
+    }
+    *dst++ = size.x;      // pixelWidth
+    *dst++ = size.y;      // pixelHeight
+    *dst++ = 0;           // pixelDepth
+    *dst++ = 0;           // numberOfArrayElements
+    *dst++ = 1;           // numberOfFaces
+    *dst++ = levels;      // numberOfMipmapLevels
+    *dst++ = 0;           // bytesOfKeyValueData
 }
 
-static int AdjustSizeForMipmaps( const v2i& size, int levels )
+static const char Ktx2Writer[] = "KTXwriter\0etcpak";
+
+static size_t Ktx2DfdSize( BlockData::Type type )
 {
-    int len = 0;
-    v2i current = size;
-    for( int i=1; i<levels; i++ )
+    // Total size, block header and one sample per compressed channel
+    return 4 + 24 + ( type == BlockData::Etc2_RGBA ? 2 : 1 ) * 16;
+}
+
+static size_t Ktx2KvdSize()
+{
+    return ( 4 + sizeof( Ktx2Writer ) + 3 ) & ~3;
+}
+
+// Header, level index, data format descriptor and key/value data
+static size_t Ktx2HeaderSize( int levels, BlockData::Type type )
+{
+    return 80 + levels * 24 + Ktx2DfdSize( type ) + Ktx2KvdSize();
+}
+
+static uint32* WriteDfdSample( uint32* dst, uint32 bitOffset, uint32 channel )
+{
+    *dst++ = bitOffset | ( 63 << 16 ) | ( channel << 24 );  // 64 bits
+    *dst++ = 0;           // sample position
+    *dst++ = 0;           // sampleLower
+    *dst++ = 0xFFFFFFFF;  // sampleUpper
+    return dst;
+}
+
+static void WriteKtx2Dfd( uint32* dst, BlockData::Type type )
+{
+    const uint32 len = uint32( Ktx2DfdSize( type ) );
+    *dst++ = len;                                   // dfdTotalSize
+    *dst++ = 0;                                     // vendor, descriptor type: basic
+    *dst++ = 2 | ( ( len - 4 ) << 16 );             // version, descriptorBlockSize
+    *dst++ = ( type == BlockData::Etc1 ? DfModelEtc1 : DfModelEtc2 ) | ( 1 << 8 ) | ( 1 << 16 );    // BT.709 primaries, linear transfer
+    *dst++ = 3 | ( 3 << 8 );                        // 4x4 texel blocks
+    *dst++ = type == BlockData::Etc2_RGBA ? 16 : 8; // bytesPlane0
+    *dst++ = 0;
+    switch( type )
     {
-        assert( current.x != 1 || current.y != 1 );
+    case BlockData::Etc1:
+        WriteDfdSample( dst, 0, 0 );                // ETC1 color
+        break;
+    case BlockData::Etc2_RGB:
+        WriteDfdSample( dst, 0, 2 );                // ETC2 color
+        break;
+    case BlockData::Etc2_RGBA:
+        dst = WriteDfdSample( dst, 0, 15 );         // EAC alpha
+        WriteDfdSample( dst, 64, 2 );
+        break;
+    default:
+        assert( false );
+        break;
+    }
+}
+
+size_t BlockData::Layout( int levels, Format format )
+{
+    const size_t blockBytes = BitsPerPixel( m_type ) * 2;
+
+    m_levels.resize( levels );
+    size_t block = 0;
+    v2i current = m_size;
+    for( int i=0; i<levels; i++ )
+    {
+        m_levels[i].block = block;
+        m_levels[i].blocks = size_t( ( current.x + 3 ) / 4 ) * ( ( current.y + 3 ) / 4 );
+        m_levels[i].done = 0;
+        block += m_levels[i].blocks;
         current.x = std::max( 1, current.x / 2 );
         current.y = std::max( 1, current.y / 2 );
-        len += std::max( 4, current.x ) * std::max( 4, current.y ) / 2;
     }
-    assert( current.x == 1 && current.y == 1 );
-    return len;
+
+    size_t pos;
+    switch( format )
+    {
+    case Pvr:
+        pos = 52;
+        for( auto& level : m_levels )
+        {
+            level.offset = pos;
+            pos += level.blocks * blockBytes;
+        }
+        break;
+    case Ktx:
+        // Each level is preceded by its image size. Blocks keep the data 4-byte aligned, no padding is needed.
+        pos = 64;
+        for( auto& level : m_levels )
+        {
+            level.offset = pos + 4;
+            pos += 4 + level.blocks * blockBytes;
+        }
+        break;
+    case Ktx2:
+        // Levels are stored from the smallest up, each aligned to the block size, so that they can be
+        // uploaded straight from the file
+        pos = Ktx2HeaderSize( levels, m_type );
+        for( int i=levels-1; i>=0; i-- )
+        {
+            pos = ( pos + blockBytes - 1 ) / blockBytes * blockBytes;
+            m_levels[i].offset = pos;
+            pos += m_levels[i].blocks * blockBytes;
+        }
+        break;
+    default:
+        assert( false );
+        pos = 0;
+        break;
+    }
+    return pos;
 }
 
-BlockData::BlockData( const char* fn, const v2i& size, bool mipmap )
-    : m_size( size )
-    , m_dataOffset( 52 )
-    , m_maplen( 52 + m_size.x*m_size.y/2 )
+// Writes everything but the block data. With a single level all of it comes before the data.
+void BlockData::WriteHeader( uint8* dst, Format format ) const
 {
-    assert( m_size.x%4 == 0 && m_size.y%4 == 0 );
+    const size_t blockBytes = BitsPerPixel( m_type ) * 2;
+    const int levels = int( m_levels.size() );
 
-    uint32 cnt = m_size.x * m_size.y / 16;
-    DBGPRINT( cnt << " blocks" );
+    switch( format )
+    {
+    case Pvr:
+        WritePvrHeader( (uint32*)dst, m_size, levels, m_type );
+        break;
+    case Ktx:
+        WriteKtxHeader( (uint32*)dst, m_size, levels, m_type );
+        for( auto& level : m_levels )
+        {
+            *(uint32*)( dst + level.offset - 4 ) = uint32( level.blocks * blockBytes );
+        }
+        break;
+    case Ktx2:
+    {
+        static const uint8 id[12] = { 0xAB, 'K', 'T', 'X', ' ', '2', '0', 0xBB, '\r', '\n', 0x1A, '\n' };
+        memcpy( dst, id, sizeof( id ) );
+        auto hdr = (uint32*)( dst + 12 );
+        *hdr++ = m_type == Etc2_RGBA ? VkEtc2RGBA : VkEtc2RGB;    // vkFormat, ETC1 is a subset of ETC2 RGB
+        *hdr++ = 1;           // typeSize
+        *hdr++ = m_size.x;    // pixelWidth
+        *hdr++ = m_size.y;    // pixelHeight
+        *hdr++ = 0;           // pixelDepth
+        *hdr++ = 0;           // layerCount
+        *hdr++ = 1;           // faceCount
+        *hdr++ = levels;      // levelCount
+        *hdr++ = m_zlib ? Ktx2Zlib : 0;   // supercompressionScheme
+
+        const uint32 dfd = 80 + levels * 24;
+        const uint32 kvd = dfd + uint32( Ktx2DfdSize( m_type ) );
+        *hdr++ = dfd;
+        *hdr++ = uint32( Ktx2DfdSize( m_type ) );
+        *hdr++ = kvd;
+        *hdr++ = uint32( Ktx2KvdSize() );
+
+        auto index = (uint64*)( dst + 64 );
+        *index++ = 0;         // sgdByteOffset
+        *index++ = 0;         // sgdByteLength
+        for( auto& level : m_levels )
+        {
+            *index++ = level.offset;
+            *index++ = m_zlib ? level.packed.size() : level.blocks * blockBytes;
+            *index++ = level.blocks * blockBytes;     // uncompressedByteLength
+        }
 
+        WriteKtx2Dfd( (uint32*)( dst + dfd ), m_type );
+        *(uint32*)( dst + kvd ) = sizeof( Ktx2Writer );
+        memcpy( dst + kvd + 4, Ktx2Writer, sizeof( Ktx2Writer ) );
+        break;
+    }
+    default:
+        assert( false );
+        break;
+    }
+}
+
+static uint8* OpenForWriting( const char* fn, size_t len, FILE** f )
+{
+    *f = fopen( fn, "wb+" );
+    assert( *f );
+    fseek( *f, len - 1, SEEK_SET );
+    const char zero = 0;
+    fwrite( &zero, 1, 1, *f );
+    fseek( *f, 0, SEEK_SET );
+
+    return (uint8*)mmap( nullptr, len, PROT_WRITE, MAP_SHARED, fileno( *f ), 0 );
+}
+
+BlockData::BlockData( const char* fn, const v2i& size, bool mipmap, Type type, bool stream, Format format, bool zlib, bool patch )
+    : m_size( size )
+    , m_type( type )
+    , m_zlib( zlib )
+    , m_patched( false )
+    , m_blocks( 0 )
+    , m_reused( 0 )
+{
     int levels = 1;
 
     if( mipmap )
     {
         levels = NumberOfMipLevels( size );
         DBGPRINT( "Number of mipmaps: " << levels );
-        m_maplen += AdjustSizeForMipmaps( size, levels );
     }
 
-    m_data = OpenForWriting( fn, m_maplen, m_size, &m_file, levels );
+    m_maplen = Layout( levels, format );
+    m_dataOffset = m_levels[0].offset;
+    DBGPRINT( m_levels[0].blocks << " blocks" );
+
+    if( zlib )
+    {
+        // Levels are compressed in memory, the file is written once all of them are deflated
+        assert( format == Ktx2 && !stream );
+        m_file = fopen( fn, "wb" );
+        assert( m_file );
+        m_data = new uint8[m_maplen];
+    }
+    else if( stream )
+    {
+        // Nothing is mapped, blocks are written to the file as they are compressed
+        assert( !mipmap );
+        m_file = fopen( fn, "wb" );
+        assert( m_file );
+        std::vector<uint8> hdr( m_dataOffset );
+        WriteHeader( hdr.data(), format );
+        fwrite( hdr.data(), 1, hdr.size(), m_file );
+        m_data = nullptr;
+    }
+    else if( !patch || !OpenForPatching( fn, format ) )
+    {
+        // The header and the blocks go straight to the mapped file
+        m_data = OpenForWriting( fn, m_maplen, &m_file );
+        WriteHeader( m_data, format );
+    }
+}
+
+// The file is kept only if it has the length and the header that a new one would have. The header is
+// written over the mapped file, and everything outside of the level data has to stay the same.
+bool BlockData::OpenForPatching( const char* fn, Format format )
+{
+    assert( !m_zlib );
+    FILE* f = fopen( fn, "rb+" );
+    if( !f ) return false;
+
+    fseek( f, 0, SEEK_END );
+    bool ok = size_t( ftell( f ) ) == m_maplen;
+    if( ok )
+    {
+        m_data = (uint8*)mmap( nullptr, m_maplen, PROT_WRITE, MAP_SHARED, fileno( f ), 0 );
+        ok = m_data != MAP_FAILED;
+    }
+    if( ok )
+    {
+        // Byte ranges between the levels, in file order
+        const size_t blockBytes = BitsPerPixel( m_type ) * 2;
+        std::vector<std::pair<size_t, size_t>> gaps;
+        std::vector<const Level*> levels;
+        for( auto& level : m_levels ) levels.push_back( &level );
+        std::sort( levels.begin(), levels.end(), []( const Level* a, const Level* b ) { return a->offset < b->offset; } );
+        size_t pos = 0;
+        for( auto level : levels )
+        {
+            gaps.emplace_back( pos, level->offset );
+            pos = level->offset + level->blocks * blockBytes;
+        }
+        gaps.emplace_back( pos, m_maplen );
+
+        std::vector<uint8> old;
+        for( auto& gap : gaps ) old.insert( old.end(), m_data + gap.first, m_data + gap.second );
+        WriteHeader( m_data, format );
+        auto it = old.begin();
+        for( auto& gap : gaps )
+        {
+            ok = ok && std::equal( m_data + gap.first, m_data + gap.second, it );
+            it += gap.second - gap.first;
+        }
+        if( !ok ) munmap( m_data, m_maplen );
+    }
+    if( !ok )
+    {
+        fclose( f );
+        return false;
+    }
+
+    m_file = f;
+    m_patched = true;
+    return true;
 }
 
-BlockData::BlockData( const v2i& size, bool mipmap )
+BlockData::BlockData( const v2i& size, bool mipmap, Type type )
     : m_size( size )
-    , m_dataOffset( 52 )
     , m_file( nullptr )
-    , m_maplen( 52 + m_size.x*m_size.y/2 )
+    , m_type( type )
+    , m_zlib( false )
+    , m_patched( false )
+    , m_blocks( 0 )
+    , m_reused( 0 )
 {
-    assert( m_size.x%4 == 0 && m_size.y%4 == 0 );
-    if( mipmap )
-    {
-        const int levels = NumberOfMipLevels( size );
-        m_maplen += AdjustSizeForMipmaps( size, levels );
-    }
+    m_maplen = Layout( mipmap ? NumberOfMipLevels( size ) : 1, Pvr );
+    m_dataOffset = m_levels[0].offset;
     m_data = new uint8[m_maplen];
 }
 
 BlockData::~BlockData()
 {
-    if( m_file )
+    if( m_zlib )
     {
-        munmap( m_data, m_maplen );
+        WriteSupercompressed();
+        fclose( m_file );
+        delete[] m_data;
+    }
+    else if( m_file )
+    {
+        if( m_data ) munmap( m_data, m_maplen );
         fclose( m_file );
     }
     else
@@ -136,203 +552,105 @@ BlockData::~BlockData()
     }
 }
 
-static uint64 _f_rgb( uint8* ptr )
+// Parts never straddle levels
+size_t BlockData::LevelIndex( size_t block ) const
 {
-    return ProcessRGB( ptr );
+    auto it = std::upper_bound( m_levels.begin(), m_levels.end(), block, []( size_t b, const Level& level ) { return b < level.block; } );
+    assert( it != m_levels.begin() );
+    return size_t( it - m_levels.begin() ) - 1;
 }
 
-#ifdef __SSE4_1__
-static uint64 _f_rgb_avx2( uint8* ptr )
+size_t BlockData::Position( size_t block ) const
 {
-    return ProcessRGB_AVX2( ptr );
+    const auto& level = m_levels[LevelIndex( block )];
+    return level.offset + ( block - level.block ) * BitsPerPixel( m_type ) * 2;
 }
-#endif
 
-static uint64 _f_rgb_dither( uint8* ptr )
+// The part completing a level deflates it, while the other levels are still being compressed
+void BlockData::LevelDone( size_t offset, uint32 blocks )
 {
-    Dither( ptr );
-    return ProcessRGB( ptr );
-}
+    auto& level = m_levels[LevelIndex( offset )];
+    {
+        std::lock_guard<std::mutex> lock( m_lock );
+        level.done += blocks;
+        if( level.done != level.blocks ) return;
+    }
 
-#ifdef __SSE4_1__
-static uint64 _f_rgb_dither_avx2( uint8* ptr )
-{
-    Dither( ptr );
-    return ProcessRGB_AVX2( ptr );
+    const uLong len = uLong( level.blocks * BitsPerPixel( m_type ) * 2 );
+    uLongf packed = compressBound( len );
+    level.packed.resize( packed );
+    const int res = compress2( level.packed.data(), &packed, m_data + level.offset, len, Z_DEFAULT_COMPRESSION );
+    assert( res == Z_OK );
+    level.packed.resize( packed );
 }
-#endif
 
-static uint64 _f_rgb_etc2( uint8* ptr )
+// Supercompressed levels follow the header smallest first, with no alignment
+void BlockData::WriteSupercompressed()
 {
-    return ProcessRGB_ETC2( ptr );
-}
+    const int levels = int( m_levels.size() );
+    size_t pos = Ktx2HeaderSize( levels, m_type );
+    for( int i=levels-1; i>=0; i-- )
+    {
+        assert( m_levels[i].done == m_levels[i].blocks );
+        m_levels[i].offset = pos;
+        pos += m_levels[i].packed.size();
+    }
 
-#ifdef __SSE4_1__
-static uint64 _f_rgb_etc2_avx2( uint8* ptr )
-{
-    return ProcessRGB_ETC2_AVX2( ptr );
+    std::vector<uint8> hdr( Ktx2HeaderSize( levels, m_type ) );
+    WriteHeader( hdr.data(), Ktx2 );
+    fwrite( hdr.data(), 1, hdr.size(), m_file );
+    for( int i=levels-1; i>=0; i-- )
+    {
+        fwrite( m_levels[i].packed.data(), 1, m_levels[i].packed.size(), m_file );
+    }
 }
-#endif
 
-static uint64 _f_rgb_etc2_dither( uint8* ptr )
+void BlockData::Process( const uint32* src, uint32 blocks, size_t offset, size_t width, Channels type, bool dither, int effort, float rdo, ErrorMetric metric )
 {
-    Dither( ptr );
-    return ProcessRGB_ETC2( ptr );
-}
+    assert( m_type != Etc2_RGBA );
+    m_blocks += blocks;
 
-#ifdef __SSE4_1__
-static uint64 _f_rgb_etc2_dither_avx2( uint8* ptr )
-{
-    Dither( ptr );
-    return ProcessRGB_ETC2_AVX2( ptr );
+    if( m_data )
+    {
+        auto dst = (uint64*)( m_data + Position( offset ) );
+        m_reused += CompressBlocks( src, dst, blocks, width, width, m_type, type, dither, effort, rdo, metric, false );
+        if( m_zlib ) LevelDone( offset, blocks );
+    }
+    else
+    {
+        std::vector<uint64> buf( blocks );
+        m_reused += CompressBlocks( src, buf.data(), blocks, width, width, m_type, type, dither, effort, rdo, metric, false );
+        WriteBlocks( buf, offset );
+    }
 }
-#endif
 
-void BlockData::Process( const uint32* src, uint32 blocks, size_t offset, size_t width, Channels type, bool dither, bool etc2 )
+void BlockData::ProcessRGBA( const uint32* src, uint32 blocks, size_t offset, size_t width, bool dither, int effort, float rdo, ErrorMetric metric )
 {
-    uint32 buf[4*4];
-    int w = 0;
-
-    auto dst = ((uint64*)( m_data + m_dataOffset )) + offset;
-
-    uint64 (*func)(uint8*);
+    assert( m_type == Etc2_RGBA );
+    m_blocks += blocks;
 
-    if( type == Channels::Alpha )
+    // Each block is a 64-bit EAC alpha word followed by a 64-bit ETC2 color word
+    if( m_data )
     {
-#ifdef __SSE4_1__
-        if( can_use_intel_core_4th_gen_features() )
-        {
-            if( etc2 )
-            {
-                func = _f_rgb_etc2_avx2;
-            }
-            else
-            {
-                func = _f_rgb_avx2;
-            }
-        }
-        else
-#endif
-        {
-            if( etc2 )
-            {
-                func = _f_rgb_etc2;
-            }
-            else
-            {
-                func = _f_rgb;
-            }
-        }
-
-        do
-        {
-            auto ptr = buf;
-            for( int x=0; x<4; x++ )
-            {
-                uint a = *src >> 24;
-                *ptr++ = a | ( a << 8 ) | ( a << 16 );
-                src += width;
-                a = *src >> 24;
-                *ptr++ = a | ( a << 8 ) | ( a << 16 );
-                src += width;
-                a = *src >> 24;
-                *ptr++ = a | ( a << 8 ) | ( a << 16 );
-                src += width;
-                a = *src >> 24;
-                *ptr++ = a | ( a << 8 ) | ( a << 16 );
-                src -= width * 3 - 1;
-            }
-            if( ++w == width/4 )
-            {
-                src += width * 3;
-                w = 0;
-            }
-
-            *dst++ = func( (uint8*)buf );
-        }
-        while( --blocks );
+        auto dst = (uint64*)( m_data + Position( offset ) );
+        m_reused += CompressBlocks( src, dst, blocks, width, width, m_type, Channels::RGB, dither, effort, rdo, metric, false );
+        if( m_zlib ) LevelDone( offset, blocks );
     }
     else
     {
-#ifdef __SSE4_1__
-        if( can_use_intel_core_4th_gen_features() )
-        {
-            if( etc2 )
-            {
-                if( dither )
-                {
-                    func = _f_rgb_etc2_dither_avx2;
-                }
-                else
-                {
-                    func = _f_rgb_etc2_avx2;
-                }
-            }
-            else
-            {
-                if( dither )
-                {
-                    func = _f_rgb_dither_avx2;
-                }
-                else
-                {
-                    func = _f_rgb_avx2;
-                }
-            }
-        }
-        else
-#endif
-        {
-            if( etc2 )
-            {
-                if( dither )
-                {
-                    func = _f_rgb_etc2_dither;
-                }
-                else
-                {
-                    func = _f_rgb_etc2;
-                }
-            }
-            else
-            {
-                if( dither )
-                {
-                    func = _f_rgb_dither;
-                }
-                else
-                {
-                    func = _f_rgb;
-                }
-            }
-        }
-
-        do
-        {
-            auto ptr = buf;
-            for( int x=0; x<4; x++ )
-            {
-                *ptr++ = *src;
-                src += width;
-                *ptr++ = *src;
-                src += width;
-                *ptr++ = *src;
-                src += width;
-                *ptr++ = *src;
-                src -= width * 3 - 1;
-            }
-            if( ++w == width/4 )
-            {
-                src += width * 3;
-                w = 0;
-            }
-
-            *dst++ = func( (uint8*)buf );
-        }
-        while( --blocks );
+        std::vector<uint64> buf( blocks * 2 );
+        m_reused += CompressBlocks( src, buf.data(), blocks, width, width, m_type, Channels::RGB, dither, effort, rdo, metric, false );
+        WriteBlocks( buf, offset );
     }
 }
 
+void BlockData::WriteBlocks( const std::vector<uint64>& buf, size_t offset )
+{
+    std::lock_guard<std::mutex> lock( m_lock );
+    fseek( m_file, Position( offset ), SEEK_SET );
+    fwrite( buf.data(), sizeof( uint64 ), buf.size(), m_file );
+}
+
 namespace
 {
 struct BlockColor
@@ -418,216 +736,64 @@ Etc2Mode DecodeBlockColor( uint64 d, BlockColor& c )
     return Etc2Mode::none;
 }
 
-inline int32 expand6(uint32 value)
-{
-    return (value << 2) | (value >> 4);
-}
-
-inline int32 expand7(uint32 value)
-{
-    return (value << 1) | (value >> 6);
-}
-
-void DecodePlanar(uint64 block, uint32* l[4])
-{
-    const auto bv = expand6((block >> ( 0 + 32)) & 0x3F);
-    const auto gv = expand7((block >> ( 6 + 32)) & 0x7F);
-    const auto rv = expand6((block >> (13 + 32)) & 0x3F);
-
-    const auto bh = expand6((block >> (19 + 32)) & 0x3F);
-    const auto gh = expand7((block >> (25 + 32)) & 0x7F);
-
-    const auto rh0 = (block >> (32 - 32)) & 0x01;
-    const auto rh1 = ((block >> (34 - 32)) & 0x1F) << 1;
-    const auto rh = expand6(rh0 | rh1);
-
-    const auto bo0 = (block >> (39 - 32)) & 0x07;
-    const auto bo1 = ((block >> (43 - 32)) & 0x3) << 3;
-    const auto bo2 = ((block >> (48 - 32)) & 0x1) << 5;
-    const auto bo = expand6(bo0 | bo1 | bo2);
-    const auto go0 = (block >> (49 - 32)) & 0x3F;
-    const auto go1 = ((block >> (56 - 32)) & 0x01) << 6;
-    const auto go = expand7(go0 | go1);
-    const auto ro = expand6((block >> (57 - 32)) & 0x3F);
-
-    for (auto j = 0; j < 4; j++)
-    {
-        for (auto i = 0; i < 4; i++)
-        {
-            uint32 r = clampu8((i * (rh - ro) + j * (rv - ro) + 4 * ro + 2) >> 2);
-            uint32 g = clampu8((i * (gh - go) + j * (gv - go) + 4 * go + 2) >> 2);
-            uint32 b = clampu8((i * (bh - bo) + j * (bv - bo) + 4 * bo + 2) >> 2);
-
-            *l[j]++ = r | ( g << 8 ) | ( b << 16 ) | 0xFF000000;
-        }
-    }
-}
-
 }
 
 BitmapPtr BlockData::Decode()
 {
+    assert( m_data );
     auto ret = std::make_shared<Bitmap>( m_size );
 
-    uint32* l[4];
-    l[0] = ret->Data();
-    l[1] = l[0] + m_size.x;
-    l[2] = l[1] + m_size.x;
-    l[3] = l[2] + m_size.x;
-
-    const uint64* src = (const uint64*)( m_data + m_dataOffset );
-
-    for( int y=0; y<m_size.y/4; y++ )
+    // Block rows are independent, decode them in parallel. Partial blocks are decoded whole, into the
+    // padding of the bitmap.
+    EtcDecompress( m_data + m_dataOffset, ret->Stride(), ret->PaddedHeight(), m_type, ret->Data(), ret->Stride(), []( uint32 count, const std::function<void( uint32 )>& job )
     {
-        for( int x=0; x<m_size.x/4; x++ )
+        for( uint32 i=0; i<count; i++ )
         {
-            uint64 d = *src++;
-
-            d = ( ( d & 0xFF000000FF000000 ) >> 24 ) |
-                ( ( d & 0x000000FF000000FF ) << 24 ) |
-                ( ( d & 0x00FF000000FF0000 ) >> 8 ) |
-                ( ( d & 0x0000FF000000FF00 ) << 8 );
-
-            BlockColor c;
-            const auto mode = DecodeBlockColor( d, c );
-
-            if (mode == Etc2Mode::planar)
-            {
-                DecodePlanar(d, l);
-                continue;
-            }
-
-            uint tcw[2];
-            tcw[0] = ( d & 0xE0 ) >> 5;
-            tcw[1] = ( d & 0x1C ) >> 2;
-
-            uint ra, ga, ba;
-            uint rb, gb, bb;
-            uint rc, gc, bc;
-            uint rd, gd, bd;
-
-            if( d & 0x1 )
-            {
-                int o = 0;
-                for( int i=0; i<4; i++ )
-                {
-                    ra = clampu8( c.r1 + g_table[tcw[0]][ ( ( d & ( 1ll << ( o + 32 ) ) ) >> ( o + 32 ) ) | ( ( d & ( 1ll << ( o + 48 ) ) ) >> ( o + 47 ) ) ] );
-                    ga = clampu8( c.g1 + g_table[tcw[0]][ ( ( d & ( 1ll << ( o + 32 ) ) ) >> ( o + 32 ) ) | ( ( d & ( 1ll << ( o + 48 ) ) ) >> ( o + 47 ) ) ] );
-                    ba = clampu8( c.b1 + g_table[tcw[0]][ ( ( d & ( 1ll << ( o + 32 ) ) ) >> ( o + 32 ) ) | ( ( d & ( 1ll << ( o + 48 ) ) ) >> ( o + 47 ) ) ] );
-
-                    rb = clampu8( c.r1 + g_table[tcw[0]][ ( ( d & ( 1ll << ( o + 33 ) ) ) >> ( o + 33 ) ) | ( ( d & ( 1ll << ( o + 49 ) ) ) >> ( o + 48 ) ) ] );
-                    gb = clampu8( c.g1 + g_table[tcw[0]][ ( ( d & ( 1ll << ( o + 33 ) ) ) >> ( o + 33 ) ) | ( ( d & ( 1ll << ( o + 49 ) ) ) >> ( o + 48 ) ) ] );
-                    bb = clampu8( c.b1 + g_table[tcw[0]][ ( ( d & ( 1ll << ( o + 33 ) ) ) >> ( o + 33 ) ) | ( ( d & ( 1ll << ( o + 49 ) ) ) >> ( o + 48 ) ) ] );
-
-                    rc = clampu8( c.r2 + g_table[tcw[1]][ ( ( d & ( 1ll << ( o + 34 ) ) ) >> ( o + 34 ) ) | ( ( d & ( 1ll << ( o + 50 ) ) ) >> ( o + 49 ) ) ] );
-                    gc = clampu8( c.g2 + g_table[tcw[1]][ ( ( d & ( 1ll << ( o + 34 ) ) ) >> ( o + 34 ) ) | ( ( d & ( 1ll << ( o + 50 ) ) ) >> ( o + 49 ) ) ] );
-                    bc = clampu8( c.b2 + g_table[tcw[1]][ ( ( d & ( 1ll << ( o + 34 ) ) ) >> ( o + 34 ) ) | ( ( d & ( 1ll << ( o + 50 ) ) ) >> ( o + 49 ) ) ] );
-
-                    rd = clampu8( c.r2 + g_table[tcw[1]][ ( ( d & ( 1ll << ( o + 35 ) ) ) >> ( o + 35 ) ) | ( ( d & ( 1ll << ( o + 51 ) ) ) >> ( o + 50 ) ) ] );
-                    gd = clampu8( c.g2 + g_table[tcw[1]][ ( ( d & ( 1ll << ( o + 35 ) ) ) >> ( o + 35 ) ) | ( ( d & ( 1ll << ( o + 51 ) ) ) >> ( o + 50 ) ) ] );
-                    bd = clampu8( c.b2 + g_table[tcw[1]][ ( ( d & ( 1ll << ( o + 35 ) ) ) >> ( o + 35 ) ) | ( ( d & ( 1ll << ( o + 51 ) ) ) >> ( o + 50 ) ) ] );
-
-                    *l[0]++ = ra | ( ga << 8 ) | ( ba << 16 ) | 0xFF000000;
-                    *l[1]++ = rb | ( gb << 8 ) | ( bb << 16 ) | 0xFF000000;
-                    *l[2]++ = rc | ( gc << 8 ) | ( bc << 16 ) | 0xFF000000;
-                    *l[3]++ = rd | ( gd << 8 ) | ( bd << 16 ) | 0xFF000000;
-
-                    o += 4;
-                }
-            }
-            else
-            {
-                int o = 0;
-                for( int i=0; i<2; i++ )
-                {
-                    ra = clampu8( c.r1 + g_table[tcw[0]][ ( ( d & ( 1ll << ( o + 32 ) ) ) >> ( o + 32 ) ) | ( ( d & ( 1ll << ( o + 48 ) ) ) >> ( o + 47 ) ) ] );
-                    ga = clampu8( c.g1 + g_table[tcw[0]][ ( ( d & ( 1ll << ( o + 32 ) ) ) >> ( o + 32 ) ) | ( ( d & ( 1ll << ( o + 48 ) ) ) >> ( o + 47 ) ) ] );
-                    ba = clampu8( c.b1 + g_table[tcw[0]][ ( ( d & ( 1ll << ( o + 32 ) ) ) >> ( o + 32 ) ) | ( ( d & ( 1ll << ( o + 48 ) ) ) >> ( o + 47 ) ) ] );
-
-                    rb = clampu8( c.r1 + g_table[tcw[0]][ ( ( d & ( 1ll << ( o + 33 ) ) ) >> ( o + 33 ) ) | ( ( d & ( 1ll << ( o + 49 ) ) ) >> ( o + 48 ) ) ] );
-                    gb = clampu8( c.g1 + g_table[tcw[0]][ ( ( d & ( 1ll << ( o + 33 ) ) ) >> ( o + 33 ) ) | ( ( d & ( 1ll << ( o + 49 ) ) ) >> ( o + 48 ) ) ] );
-                    bb = clampu8( c.b1 + g_table[tcw[0]][ ( ( d & ( 1ll << ( o + 33 ) ) ) >> ( o + 33 ) ) | ( ( d & ( 1ll << ( o + 49 ) ) ) >> ( o + 48 ) ) ] );
-
-                    rc = clampu8( c.r1 + g_table[tcw[0]][ ( ( d & ( 1ll << ( o + 34 ) ) ) >> ( o + 34 ) ) | ( ( d & ( 1ll << ( o + 50 ) ) ) >> ( o + 49 ) ) ] );
-                    gc = clampu8( c.g1 + g_table[tcw[0]][ ( ( d & ( 1ll << ( o + 34 ) ) ) >> ( o + 34 ) ) | ( ( d & ( 1ll << ( o + 50 ) ) ) >> ( o + 49 ) ) ] );
-                    bc = clampu8( c.b1 + g_table[tcw[0]][ ( ( d & ( 1ll << ( o + 34 ) ) ) >> ( o + 34 ) ) | ( ( d & ( 1ll << ( o + 50 ) ) ) >> ( o + 49 ) ) ] );
-
-                    rd = clampu8( c.r1 + g_table[tcw[0]][ ( ( d & ( 1ll << ( o + 35 ) ) ) >> ( o + 35 ) ) | ( ( d & ( 1ll << ( o + 51 ) ) ) >> ( o + 50 ) ) ] );
-                    gd = clampu8( c.g1 + g_table[tcw[0]][ ( ( d & ( 1ll << ( o + 35 ) ) ) >> ( o + 35 ) ) | ( ( d & ( 1ll << ( o + 51 ) ) ) >> ( o + 50 ) ) ] );
-                    bd = clampu8( c.b1 + g_table[tcw[0]][ ( ( d & ( 1ll << ( o + 35 ) ) ) >> ( o + 35 ) ) | ( ( d & ( 1ll << ( o + 51 ) ) ) >> ( o + 50 ) ) ] );
-
-                    *l[0]++ = ra | ( ga << 8 ) | ( ba << 16 ) | 0xFF000000;
-                    *l[1]++ = rb | ( gb << 8 ) | ( bb << 16 ) | 0xFF000000;
-                    *l[2]++ = rc | ( gc << 8 ) | ( bc << 16 ) | 0xFF000000;
-                    *l[3]++ = rd | ( gd << 8 ) | ( bd << 16 ) | 0xFF000000;
-
-                    o += 4;
-                }
-                for( int i=0; i<2; i++ )
-                {
-                    ra = clampu8( c.r2 + g_table[tcw[1]][ ( ( d & ( 1ll << ( o + 32 ) ) ) >> ( o + 32 ) ) | ( ( d & ( 1ll << ( o + 48 ) ) ) >> ( o + 47 ) ) ] );
-                    ga = clampu8( c.g2 + g_table[tcw[1]][ ( ( d & ( 1ll << ( o + 32 ) ) ) >> ( o + 32 ) ) | ( ( d & ( 1ll << ( o + 48 ) ) ) >> ( o + 47 ) ) ] );
-                    ba = clampu8( c.b2 + g_table[tcw[1]][ ( ( d & ( 1ll << ( o + 32 ) ) ) >> ( o + 32 ) ) | ( ( d & ( 1ll << ( o + 48 ) ) ) >> ( o + 47 ) ) ] );
-
-                    rb = clampu8( c.r2 + g_table[tcw[1]][ ( ( d & ( 1ll << ( o + 33 ) ) ) >> ( o + 33 ) ) | ( ( d & ( 1ll << ( o + 49 ) ) ) >> ( o + 48 ) ) ] );
-                    gb = clampu8( c.g2 + g_table[tcw[1]][ ( ( d & ( 1ll << ( o + 33 ) ) ) >> ( o + 33 ) ) | ( ( d & ( 1ll << ( o + 49 ) ) ) >> ( o + 48 ) ) ] );
-                    bb = clampu8( c.b2 + g_table[tcw[1]][ ( ( d & ( 1ll << ( o + 33 ) ) ) >> ( o + 33 ) ) | ( ( d & ( 1ll << ( o + 49 ) ) ) >> ( o + 48 ) ) ] );
-
-                    rc = clampu8( c.r2 + g_table[tcw[1]][ ( ( d & ( 1ll << ( o + 34 ) ) ) >> ( o + 34 ) ) | ( ( d & ( 1ll << ( o + 50 ) ) ) >> ( o + 49 ) ) ] );
-                    gc = clampu8( c.g2 + g_table[tcw[1]][ ( ( d & ( 1ll << ( o + 34 ) ) ) >> ( o + 34 ) ) | ( ( d & ( 1ll << ( o + 50 ) ) ) >> ( o + 49 ) ) ] );
-                    bc = clampu8( c.b2 + g_table[tcw[1]][ ( ( d & ( 1ll << ( o + 34 ) ) ) >> ( o + 34 ) ) | ( ( d & ( 1ll << ( o + 50 ) ) ) >> ( o + 49 ) ) ] );
-
-                    rd = clampu8( c.r2 + g_table[tcw[1]][ ( ( d & ( 1ll << ( o + 35 ) ) ) >> ( o + 35 ) ) | ( ( d & ( 1ll << ( o + 51 ) ) ) >> ( o + 50 ) ) ] );
-                    gd = clampu8( c.g2 + g_table[tcw[1]][ ( ( d & ( 1ll << ( o + 35 ) ) ) >> ( o + 35 ) ) | ( ( d & ( 1ll << ( o + 51 ) ) ) >> ( o + 50 ) ) ] );
-                    bd = clampu8( c.b2 + g_table[tcw[1]][ ( ( d & ( 1ll << ( o + 35 ) ) ) >> ( o + 35 ) ) | ( ( d & ( 1ll << ( o + 51 ) ) ) >> ( o + 50 ) ) ] );
-
-                    *l[0]++ = ra | ( ga << 8 ) | ( ba << 16 ) | 0xFF000000;
-                    *l[1]++ = rb | ( gb << 8 ) | ( bb << 16 ) | 0xFF000000;
-                    *l[2]++ = rc | ( gc << 8 ) | ( bc << 16 ) | 0xFF000000;
-                    *l[3]++ = rd | ( gd << 8 ) | ( bd << 16 ) | 0xFF000000;
-
-                    o += 4;
-                }
-            }
+            TaskDispatch::Queue( [&job, i]() { job( i ); } );
         }
-
-        l[0] += m_size.x * 3;
-        l[1] += m_size.x * 3;
-        l[2] += m_size.x * 3;
-        l[3] += m_size.x * 3;
-    }
+        TaskDispatch::Sync();
+    } );
 
     return ret;
 }
 
 // Block type:
-//  red - 2x4, green - 4x2, blue - planar
+//  red - 2x4, green - 4x2, blue - planar, yellow - T, magenta - H
 //  dark - 444, bright - 555 + 333
 void BlockData::Dissect()
 {
-    auto size = m_size / 4;
+    assert( m_data );
+    const v2i size( ( m_size.x + 3 ) / 4, ( m_size.y + 3 ) / 4 );
     const uint64* data = (const uint64*)( m_data + m_dataOffset );
 
     auto src = data;
 
     auto bmp = std::make_shared<Bitmap>( size );
-    auto dst = bmp->Data();
 
-    auto bmp2 = std::make_shared<Bitmap>( m_size );
+    // Partial blocks are shown whole
+    const int width = size.x * 4;
+    auto bmp2 = std::make_shared<Bitmap>( v2i( width, size.y * 4 ) );
     uint32* l[4];
     l[0] = bmp2->Data();
-    l[1] = l[0] + m_size.x;
-    l[2] = l[1] + m_size.x;
-    l[3] = l[2] + m_size.x;
+    l[1] = l[0] + width;
+    l[2] = l[1] + width;
+    l[3] = l[2] + width;
 
     auto bmp3 = std::make_shared<Bitmap>( size );
-    auto dst3 = bmp3->Data();
 
     for( int y=0; y<size.y; y++ )
     {
+        auto dst = bmp->Data() + y * bmp->Stride();
+        auto dst3 = bmp3->Data() + y * bmp3->Stride();
         for( int x=0; x<size.x; x++ )
         {
-            uint64 d = *src++;
+            if( m_type == Etc2_RGBA )
+            {
+                // skip alpha word
+                src++;
+            }
+            const uint64 raw = *src++;
+            uint64 d = raw;
 
             d = ( ( d & 0xFF000000FF000000 ) >> 24 ) |
                 ( ( d & 0x000000FF000000FF ) << 24 ) |
@@ -662,6 +828,12 @@ void BlockData::Dissect()
             case Etc2Mode::planar:
                 *dst++ = 0xFFFF0000;
                 break;
+            case Etc2Mode::t:
+                *dst++ = 0xFF00FFFF;
+                break;
+            case Etc2Mode::h:
+                *dst++ = 0xFFFF00FF;
+                break;
             default:
                 assert( false );
                 break;
@@ -673,7 +845,16 @@ void BlockData::Dissect()
 
             *dst3++ = 0xFF000000 | ( tcw[0] << 8 ) | ( tcw[1] );
 
-            if( d & 0x1 )
+            if( mode != Etc2Mode::none )
+            {
+                // No base colors, show the decoded block instead
+                DecodeRGB( &raw, l[0], 1, width );
+                for( int i=0; i<4; i++ )
+                {
+                    l[i] += 4;
+                }
+            }
+            else if( d & 0x1 )
             {
                 for( int i=0; i<4; i++ )
                 {
@@ -701,10 +882,10 @@ void BlockData::Dissect()
                 }
             }
         }
-        l[0] += m_size.x * 3;
-        l[1] += m_size.x * 3;
-        l[2] += m_size.x * 3;
-        l[3] += m_size.x * 3;
+        l[0] += width * 3;
+        l[1] += width * 3;
+        l[2] += width * 3;
+        l[3] += width * 3;
     }
 
     bmp->Write( "out_block_type.png" );
@@ -1,6 +1,7 @@
 #ifndef __BLOCKDATA_HPP__
 #define __BLOCKDATA_HPP__
 
+#include <atomic>
 #include <condition_variable>
 #include <future>
 #include <memory>
@@ -9,28 +10,91 @@
 #include <vector>
 
 #include "Bitmap.hpp"
+#include "ErrorMetric.hpp"
 #include "Types.hpp"
 #include "Vector.hpp"
 
 class BlockData
 {
 public:
+    enum Type
+    {
+        Etc1,
+        Etc2_RGB,
+        Etc2_RGBA
+    };
+
+    // File container of the output
+    enum Format
+    {
+        Pvr,
+        Ktx,
+        Ktx2
+    };
+
+    static bool ParseFormat( const char* name, Format& format );
+    static const char* Extension( Format format );
+
     BlockData( const char* fn );
-    BlockData( const char* fn, const v2i& size, bool mipmap );
-    BlockData( const v2i& size, bool mipmap );
+    // A stream BlockData writes the blocks to the file as they come, instead of mapping the whole output.
+    // A zlib BlockData keeps the blocks in memory and deflates each level as soon as it is complete, the
+    // KTX2 file is written when it is destroyed. A patch BlockData keeps the blocks of an existing file with
+    // the same header and only overwrites the blocks processed, see Patched().
+    BlockData( const char* fn, const v2i& size, bool mipmap, Type type, bool stream = false, Format format = Pvr, bool zlib = false, bool patch = false );
+    BlockData( const v2i& size, bool mipmap, Type type );
     ~BlockData();
 
     BitmapPtr Decode();
     void Dissect();
 
-    void Process( const uint32* src, uint32 blocks, size_t offset, size_t width, Channels type, bool dither, bool etc2 );
+    void Process( const uint32* src, uint32 blocks, size_t offset, size_t width, Channels type, bool dither, int effort, float rdo, ErrorMetric metric );
+    void ProcessRGBA( const uint32* src, uint32 blocks, size_t offset, size_t width, bool dither, int effort, float rdo, ErrorMetric metric );
+
+    Type GetType() const { return m_type; }
+    // Whether the blocks of an earlier file were kept, otherwise the file was created anew
+    bool Patched() const { return m_patched; }
+
+    // Blocks compressed so far, and how many of them were copies of an earlier block of the same job
+    struct CacheStats
+    {
+        uint64 blocks;
+        uint64 reused;
+    };
+    CacheStats GetCacheStats() const { return CacheStats { m_blocks, m_reused }; }
 
 private:
+    // Blocks are numbered level by level from the base, as the data provider hands them out. The file
+    // may order the levels differently and put data between them.
+    struct Level
+    {
+        size_t block;       // first block of the level
+        size_t blocks;
+        size_t offset;      // position of the level data in the file
+        size_t done;        // blocks compressed so far, with zlib
+        std::vector<uint8> packed;
+    };
+
+    size_t Layout( int levels, Format format );
+    void WriteHeader( uint8* dst, Format format ) const;
+    size_t LevelIndex( size_t block ) const;
+    size_t Position( size_t block ) const;
+    void LevelDone( size_t offset, uint32 blocks );
+    void WriteSupercompressed();
+    void WriteBlocks( const std::vector<uint64>& buf, size_t offset );
+    bool OpenForPatching( const char* fn, Format format );
+
     uint8* m_data;
     v2i m_size;
     size_t m_dataOffset;
     FILE* m_file;
     size_t m_maplen;
+    Type m_type;
+    bool m_zlib;
+    bool m_patched;
+    std::vector<Level> m_levels;
+    std::mutex m_lock;
+    std::atomic<uint64> m_blocks;
+    std::atomic<uint64> m_reused;
 };
 
 typedef std::shared_ptr<BlockData> BlockDataPtr;
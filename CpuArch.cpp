@@ -1,3 +1,5 @@
+#include <string.h>
+
 #include "CpuArch.hpp"
 
 #if defined(__x86_64__) || defined(_M_X64) || defined(__i386) || defined(_M_IX86)
@@ -5,6 +7,14 @@
 #if defined(__INTEL_COMPILER) && (__INTEL_COMPILER >= 1300)
 
 #include <immintrin.h>
+int check_sse41_features()
+{
+    uint32_t abcd[4];
+
+    /* CPUID.(EAX=01H, ECX=0H):ECX.SSE4_1[bit 19]==1 */
+    run_cpuid( 1, 0, abcd );
+    return ( abcd[2] & (1 << 19) ) != 0;
+}
 
 int check_4th_gen_intel_core_features()
 {
@@ -13,6 +23,25 @@ int check_4th_gen_intel_core_features()
     return _may_i_use_cpu_feature( the_4th_gen_features );
 }
 
+int check_sse41_features()
+{
+    return _may_i_use_cpu_feature( _FEATURE_SSE4_1 );
+}
+
+int check_avx512_features()
+{
+    return _may_i_use_cpu_feature( _FEATURE_AVX512F | _FEATURE_AVX512BW | _FEATURE_AVX512VL );
+}
+
+int check_avx512vnni_features()
+{
+#ifdef _FEATURE_AVX512_VNNI
+    return _may_i_use_cpu_feature( _FEATURE_AVX512_VNNI );
+#else
+    return 0;
+#endif
+}
+
 #else /* non-Intel compiler */
 
 #include <stdint.h>
@@ -48,6 +77,25 @@ int check_xcr0_ymm()
     return ((xcr0 & 6) == 6); /* checking if xmm and ymm state are enabled in XCR0 */
 }
 
+int check_xcr0_zmm()
+{
+    uint32_t xcr0;
+#if defined(_MSC_VER)
+    xcr0 = (uint32_t)_xgetbv(0);
+#else
+    __asm__ ("xgetbv" : "=a" (xcr0) : "c" (0) : "%edx" );
+#endif
+    return ((xcr0 & 0xE6) == 0xE6); /* checking if opmask and zmm state are enabled as well */
+}
+
+int check_sse41_features()
+{
+    uint32_t abcd[4];
+
+    /* CPUID.(EAX=01H, ECX=0H):ECX.SSE4_1[bit 19]==1 */
+    run_cpuid( 1, 0, abcd );
+    return ( abcd[2] & (1 << 19) ) != 0;
+}
 
 int check_4th_gen_intel_core_features()
 {
@@ -80,24 +128,126 @@ int check_4th_gen_intel_core_features()
     return 1;
 }
 
+int check_avx512_features()
+{
+    uint32_t abcd[4];
+    uint32_t avx512_mask = (1 << 16) | (1 << 30) | (1u << 31);
+
+    if ( ! check_xcr0_zmm() )
+        return 0;
+
+    /*  CPUID.(EAX=07H, ECX=0H):EBX.AVX512F[bit 16]==1  &&
+    CPUID.(EAX=07H, ECX=0H):EBX.AVX512BW[bit 30]==1 &&
+    CPUID.(EAX=07H, ECX=0H):EBX.AVX512VL[bit 31]==1 */
+    run_cpuid( 7, 0, abcd );
+    if ( (abcd[1] & avx512_mask) != avx512_mask )
+        return 0;
+
+    return 1;
+}
+
+int check_avx512vnni_features()
+{
+    uint32_t abcd[4];
+
+    if ( ! check_xcr0_zmm() )
+        return 0;
+
+    /* CPUID.(EAX=07H, ECX=0H):ECX.AVX512_VNNI[bit 11]==1 */
+    run_cpuid( 7, 0, abcd );
+    return ( abcd[2] & (1 << 11) ) != 0;
+}
+
 #endif /* non-Intel compiler */
 
 
-bool can_use_intel_core_4th_gen_features()
+unsigned int cpu_features()
 {
-    static int the_4th_gen_features_available = -1;
+    static int the_features = -1;
     /* test is performed once */
-    if (the_4th_gen_features_available < 0 )
-        the_4th_gen_features_available = check_4th_gen_intel_core_features();
+    if (the_features < 0 )
+    {
+        int f = 0;
+        if ( check_sse41_features() ) f |= CpuFeatureSSE41;
+        if ( check_4th_gen_intel_core_features() ) f |= CpuFeatureAVX2;
+        if ( check_avx512_features() ) f |= CpuFeatureAVX512BW | CpuFeatureAVX512VL;
+        if ( check_avx512vnni_features() ) f |= CpuFeatureAVX512VNNI;
+        the_features = f;
+    }
+
+    return the_features;
+}
+
+#else
 
-    return the_4th_gen_features_available == 1;
+unsigned int cpu_features()
+{
+    return 0;
 }
 
+#endif
+
+// SIMD code is only compiled in if the build targets SSE 4.1, which then is also the minimum tier
+#ifdef __SSE4_1__
+static const CpuIsa LowestIsa = CpuIsa::SSE41;
 #else
+static const CpuIsa LowestIsa = CpuIsa::Scalar;
+#endif
 
-bool can_use_intel_core_4th_gen_features()
+static CpuIsa DetectIsa()
+{
+#ifdef __SSE4_1__
+    const unsigned int f = cpu_features();
+    if( f & CpuFeatureAVX2 )
+    {
+        const unsigned int avx512 = CpuFeatureAVX512BW | CpuFeatureAVX512VL;
+        return ( f & avx512 ) == avx512 ? CpuIsa::AVX512 : CpuIsa::AVX2;
+    }
+#endif
+    return LowestIsa;
+}
+
+static int s_isa = -1;
+
+CpuIsa cpu_isa()
+{
+    if( s_isa < 0 ) s_isa = int( DetectIsa() );
+    return CpuIsa( s_isa );
+}
+
+bool cpu_force_isa( CpuIsa isa )
+{
+    if( isa < LowestIsa || isa > DetectIsa() ) return false;
+    s_isa = int( isa );
+    return true;
+}
+
+static const char* IsaNames[] = { "scalar", "sse41", "avx2", "avx512" };
+
+const char* cpu_isa_name( CpuIsa isa )
 {
+    return IsaNames[int( isa )];
+}
+
+bool cpu_parse_isa( const char* name, CpuIsa& isa )
+{
+    for( int i=0; i<int( sizeof( IsaNames ) / sizeof( *IsaNames ) ); i++ )
+    {
+        if( strcmp( name, IsaNames[i] ) == 0 )
+        {
+            isa = CpuIsa( i );
+            return true;
+        }
+    }
     return false;
 }
 
-#endif
+bool can_use_intel_core_4th_gen_features()
+{
+    return cpu_isa() >= CpuIsa::AVX2;
+}
+
+bool can_use_avx512_features()
+{
+    return cpu_isa() >= CpuIsa::AVX512;
+}
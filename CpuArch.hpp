@@ -1,6 +1,38 @@
 #ifndef __CPUARCH_HPP__
 #define __CPUARCH_HPP__
 
+// Instruction set tiers, each one includes the previous ones
+enum class CpuIsa
+{
+    Scalar,
+    SSE41,
+    AVX2,       // with the other 4th gen Intel Core features: FMA, BMI, LZCNT and MOVBE
+    AVX512      // F, BW and VL
+};
+
+enum CpuFeature
+{
+    CpuFeatureSSE41         = 1 << 0,
+    CpuFeatureAVX2          = 1 << 1,
+    CpuFeatureAVX512BW      = 1 << 2,
+    CpuFeatureAVX512VL      = 1 << 3,
+    CpuFeatureAVX512VNNI    = 1 << 4
+};
+
+// CpuFeature flags of the running CPU
+unsigned int cpu_features();
+
+// Widest tier that both the CPU and the build support, unless a narrower one was forced
+CpuIsa cpu_isa();
+// Kernels are picked once, so this must be called before anything is compressed. Returns false if the
+// tier is not available.
+bool cpu_force_isa( CpuIsa isa );
+
+const char* cpu_isa_name( CpuIsa isa );
+bool cpu_parse_isa( const char* name, CpuIsa& isa );
+
+// Shorthands for cpu_isa() checks
 bool can_use_intel_core_4th_gen_features();
+bool can_use_avx512_features();
 
 #endif
@@ -1,18 +1,29 @@
 #include <assert.h>
 #include <utility>
 
-#include "BitmapDownsampled.hpp"
 #include "DataProvider.hpp"
+#include "MipChain.hpp"
 #include "MipMap.hpp"
 
-DataProvider::DataProvider( const char* fn, bool mipmap )
+DataProvider::DataProvider( const char* fn, bool mipmap, bool async, uint window, MipFilter filter )
     : m_offset( 0 )
+    , m_parts( 0 )
+    , m_lines( window == 0 ? 32 : 8 )
     , m_mipmap( mipmap )
+    , m_sourceDone( false )
     , m_done( false )
-    , m_lines( 32 )
 {
-    m_bmp.emplace_back( new Bitmap( fn, m_lines ) );
-    m_current = m_bmp[0].get();
+    assert( !mipmap || window == 0 );
+
+    // Mip levels are built by the loader, right after it has read each block row of the source
+    Bitmap::BlockRowCallback blockRow;
+    if( mipmap )
+    {
+        m_chain.reset( new MipChain( m_lines, filter ) );
+        auto chain = m_chain.get();
+        blockRow = [chain]( const uint32* rows, const v2i& size, size_t stride ) { chain->Push( rows, size, stride ); };
+    }
+    m_bmp.reset( new Bitmap( fn, m_lines, async, window, blockRow ) );
 }
 
 DataProvider::~DataProvider()
@@ -21,11 +32,11 @@ DataProvider::~DataProvider()
 
 uint DataProvider::NumberOfParts() const
 {
-    uint parts = ( ( m_bmp[0]->Size().y / 4 ) + m_lines - 1 ) / m_lines;
+    uint parts = ( ( m_bmp->PaddedHeight() / 4 ) + m_lines - 1 ) / m_lines;
 
     if( m_mipmap )
     {
-        v2i current = m_bmp[0]->Size();
+        v2i current = m_bmp->Size();
         int levels = NumberOfMipLevels( current );
         uint lines = m_lines;
         for( int i=1; i<levels; i++ )
@@ -34,7 +45,7 @@ uint DataProvider::NumberOfParts() const
             current.x = std::max( 1, current.x / 2 );
             current.y = std::max( 1, current.y / 2 );
             lines *= 2;
-            parts += ( ( std::max( 4, current.y ) / 4 ) + lines - 1 ) / lines;
+            parts += ( ( ( current.y + 3 ) / 4 ) + lines - 1 ) / lines;
         }
         assert( current.x == 1 && current.y == 1 );
     }
@@ -45,32 +56,34 @@ uint DataProvider::NumberOfParts() const
 DataPart DataProvider::NextPart()
 {
     assert( !m_done );
+    m_parts++;
 
-    uint lines = m_lines;
-    bool done;
-
-    DataPart ret = {
-        m_current->NextBlock( lines, done ),
-        std::max<uint>( 4, m_current->Size().x ),
-        lines,
-        m_offset
-    };
-
-    m_offset += m_current->Size().x / 4 * lines;
-
-    if( done )
+    // Parts of the mip levels are handed out as soon as they are finished, in between the source parts
+    DataPart ret;
+    if( m_sourceDone )
     {
-        if( m_mipmap && ( m_current->Size().x != 1 || m_current->Size().y != 1 ) )
-        {
-            m_lines *= 2;
-            m_bmp.emplace_back( new BitmapDownsampled( *m_current, m_lines ) );
-            m_current = m_bmp[m_bmp.size()-1].get();
-        }
-        else
-        {
-            m_done = true;
-        }
+        ret = m_chain->NextPart();
+    }
+    else if( !m_chain || !m_chain->TryNextPart( ret ) )
+    {
+        uint lines = m_lines;
+        bool done;
+        ret.src = m_bmp->NextBlock( lines, done );
+        ret.width = m_bmp->Stride();
+        ret.lines = lines;
+        ret.offset = m_offset;
+        m_offset += m_bmp->Stride() / 4 * lines;
+        m_sourceDone = done;
+
+        // The rows just loaded may let more bands of the mip levels start
+        if( m_chain ) m_chain->Queue();
     }
 
+    m_done = m_parts == NumberOfParts();
     return ret;
 }
+
+void DataProvider::Release( const DataPart& part )
+{
+    m_bmp->Release( part.src );
+}
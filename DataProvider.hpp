@@ -5,8 +5,11 @@
 #include <vector>
 
 #include "Bitmap.hpp"
+#include "Downsample.hpp"
 #include "Types.hpp"
 
+class MipChain;
+
 struct DataPart
 {
     const uint32* src;
@@ -18,23 +21,30 @@ struct DataPart
 class DataProvider
 {
 public:
-    DataProvider( const char* fn, bool mipmap );
+    // A non-zero window streams the image through that many parts, each part must be released once it
+    // has been processed. Mipmaps need the whole image and can't be streamed.
+    DataProvider( const char* fn, bool mipmap, bool async = true, uint window = 0, MipFilter filter = MipFilter::Box );
     ~DataProvider();
 
     uint NumberOfParts() const;
 
     DataPart NextPart();
+    void Release( const DataPart& part );
 
-    bool Alpha() const { return m_bmp[0]->Alpha(); }
-    const v2i& Size() const { return m_bmp[0]->Size(); }
-    const Bitmap& ImageData() const { return *m_bmp[0]; }
+    bool Alpha() const { return m_bmp->Alpha(); }
+    const v2i& Size() const { return m_bmp->Size(); }
+    const Bitmap& ImageData() const { return *m_bmp; }
+    // The image data was truncated or corrupt, waits for the loader
+    bool Failed() const { return m_bmp->Failed(); }
 
 private:
-    std::vector<std::unique_ptr<Bitmap>> m_bmp;
-    Bitmap* m_current;
+    std::unique_ptr<Bitmap> m_bmp;
+    std::unique_ptr<MipChain> m_chain;
     uint m_offset;
+    uint m_parts;
     uint m_lines;
     bool m_mipmap;
+    bool m_sourceDone;
     bool m_done;
 };
 
@@ -0,0 +1,138 @@
+#ifndef __DECODECOMMON_HPP__
+#define __DECODECOMMON_HPP__
+
+#include "Math.hpp"
+#include "Tables.hpp"
+#include "Types.hpp"
+
+static inline uint32 PackRGBA( int32 r, int32 g, int32 b )
+{
+    return clampu8( r ) | ( clampu8( g ) << 8 ) | ( clampu8( b ) << 16 ) | 0xFF000000;
+}
+
+// RGB444 color of T and H blocks, expanded and shifted by d
+static inline uint32 ExpandTH( uint32 c, int32 d )
+{
+    return PackRGBA( ( c >> 8 ) * 17 + d, ( ( c >> 4 ) & 0xF ) * 17 + d, ( c & 0xF ) * 17 + d );
+}
+
+// Base colors of the sub-blocks of individual and differential blocks, expanded to 8 bits. Returns false for
+// T, H and planar blocks, whose differential base colors overflow.
+static inline bool DecodeBases( uint32 w0, int32 base[2][3] )
+{
+    if( w0 & 0x2 )
+    {
+        const int32 c1[3] = { int32( w0 >> 27 ), int32( ( w0 >> 19 ) & 0x1F ), int32( ( w0 >> 11 ) & 0x1F ) };
+        const int32 c2[3] = { c1[0] + ( int32( w0 << 5 ) >> 29 ), c1[1] + ( int32( w0 << 13 ) >> 29 ), c1[2] + ( int32( w0 << 21 ) >> 29 ) };
+        for( int i=0; i<3; i++ )
+        {
+            if( c2[i] < 0 || c2[i] > 31 ) return false;
+            base[0][i] = ( c1[i] << 3 ) | ( c1[i] >> 2 );
+            base[1][i] = ( c2[i] << 3 ) | ( c2[i] >> 2 );
+        }
+    }
+    else
+    {
+        for( int i=0; i<3; i++ )
+        {
+            base[0][i] = ( ( w0 >> ( 28 - i*8 ) ) & 0xF ) * 17;
+            base[1][i] = ( ( w0 >> ( 24 - i*8 ) ) & 0xF ) * 17;
+        }
+    }
+    return true;
+}
+
+// w0 and w1 are the color block words in big endian order. Planar blocks return false, otherwise
+// pal holds the colors addressed by the selectors, with the second sub-block's colors in pal[4..7]
+// and the pixels of the second sub-block flagged in sub, in selector bit order.
+static inline bool DecodePalette( uint32 w0, uint32 w1, uint32 pal[8], uint32& sub )
+{
+    int32 base[2][3];
+    if( !DecodeBases( w0, base ) )
+    {
+        const int32 r = w0 >> 27;
+        const int32 g = ( w0 >> 19 ) & 0x1F;
+        const int32 dr = int32( w0 << 5 ) >> 29;
+        const int32 dg = int32( w0 << 13 ) >> 29;
+
+        if( r + dr < 0 || r + dr > 31 )
+        {
+            const uint32 c1 = ( ( ( w0 >> 27 ) & 0x3 ) << 10 ) | ( ( ( w0 >> 24 ) & 0x3 ) << 8 ) | ( ( w0 >> 16 ) & 0xFF );
+            const uint32 c2 = ( w0 >> 4 ) & 0xFFF;
+            const int32 d = g_distanceTH[( ( w0 >> 1 ) & 0x6 ) | ( w0 & 0x1 )];
+
+            pal[0] = ExpandTH( c1, 0 );
+            pal[1] = ExpandTH( c2, d );
+            pal[2] = ExpandTH( c2, 0 );
+            pal[3] = ExpandTH( c2, -d );
+            sub = 0;
+            return true;
+        }
+        if( g + dg < 0 || g + dg > 31 )
+        {
+            const uint32 c1 = ( ( ( w0 >> 27 ) & 0xF ) << 8 ) | ( ( ( w0 >> 24 ) & 0x7 ) << 5 ) | ( ( ( w0 >> 20 ) & 0x1 ) << 4 ) |
+                ( ( ( w0 >> 19 ) & 0x1 ) << 3 ) | ( ( w0 >> 15 ) & 0x7 );
+            const uint32 c2 = ( w0 >> 3 ) & 0xFFF;
+            const int32 d = g_distanceTH[( w0 & 0x4 ) | ( ( w0 & 0x1 ) << 1 ) | ( c1 >= c2 ? 1 : 0 )];
+
+            pal[0] = ExpandTH( c1, d );
+            pal[1] = ExpandTH( c1, -d );
+            pal[2] = ExpandTH( c2, d );
+            pal[3] = ExpandTH( c2, -d );
+            sub = 0;
+            return true;
+        }
+        return false;
+    }
+
+    for( int s=0; s<2; s++ )
+    {
+        const int32* tab = g_table[( w0 >> ( 5 - s*3 ) ) & 0x7];
+        for( int i=0; i<4; i++ )
+        {
+            pal[s*4+i] = PackRGBA( base[s][0] + tab[i], base[s][1] + tab[i], base[s][2] + tab[i] );
+        }
+    }
+    // Flipped blocks are split horizontally
+    sub = ( w0 & 0x1 ) ? 0xCCCC : 0xFF00;
+    return true;
+}
+
+// Origin, horizontal and vertical colors of a planar block, expanded to 8 bits
+static inline void DecodePlanarColors( uint32 w0, uint32 w1, int32 o[3], int32 h[3], int32 v[3] )
+{
+    const int32 ro = ( w0 >> 25 ) & 0x3F;
+    const int32 go = ( ( ( w0 >> 24 ) & 0x1 ) << 6 ) | ( ( w0 >> 17 ) & 0x3F );
+    const int32 bo = ( ( ( w0 >> 16 ) & 0x1 ) << 5 ) | ( ( ( w0 >> 11 ) & 0x3 ) << 3 ) | ( ( w0 >> 7 ) & 0x7 );
+    const int32 rh = ( ( ( w0 >> 2 ) & 0x1F ) << 1 ) | ( w0 & 0x1 );
+    const int32 gh = w1 >> 25;
+    const int32 bh = ( w1 >> 19 ) & 0x3F;
+    const int32 rv = ( w1 >> 13 ) & 0x3F;
+    const int32 gv = ( w1 >> 6 ) & 0x7F;
+    const int32 bv = w1 & 0x3F;
+
+    o[0] = ( ro << 2 ) | ( ro >> 4 );
+    o[1] = ( go << 1 ) | ( go >> 6 );
+    o[2] = ( bo << 2 ) | ( bo >> 4 );
+    h[0] = ( rh << 2 ) | ( rh >> 4 );
+    h[1] = ( gh << 1 ) | ( gh >> 6 );
+    h[2] = ( bh << 2 ) | ( bh >> 4 );
+    v[0] = ( rv << 2 ) | ( rv >> 4 );
+    v[1] = ( gv << 1 ) | ( gv >> 6 );
+    v[2] = ( bv << 2 ) | ( bv >> 4 );
+}
+
+// a is the EAC block in big endian order
+static inline void DecodeAlphaPalette( uint64 a, uint8 pal[8] )
+{
+    const int32 base = a >> 56;
+    const int32 mul = ( a >> 52 ) & 0xF;
+    const int16* tbl = g_tableAlpha[( a >> 48 ) & 0xF];
+
+    for( int i=0; i<8; i++ )
+    {
+        pal[i] = clampu8( base + tbl[i] * mul );
+    }
+}
+
+#endif
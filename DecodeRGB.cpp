@@ -0,0 +1,197 @@
+#include "DecodeCommon.hpp"
+#include "DecodeRGB.hpp"
+#ifdef __SSE4_1__
+#  ifdef _MSC_VER
+#    include <intrin.h>
+#  else
+#    include <x86intrin.h>
+#  endif
+#endif
+
+namespace
+{
+
+#ifdef __SSE4_1__
+// Decoded pixels are kept in registers, one register per pixel line
+void DecodePlanar( uint32 w0, uint32 w1, __m128i c[4] )
+{
+    int32 o[3], h[3], v[3];
+    DecodePlanarColors( w0, w1, o, h, v );
+
+    // Two pixels per register, alpha is 255 after the final shift
+    const __m128i dh = _mm_setr_epi16( h[0] - o[0], h[1] - o[1], h[2] - o[2], 0, h[0] - o[0], h[1] - o[1], h[2] - o[2], 0 );
+    const __m128i dv = _mm_setr_epi16( v[0] - o[0], v[1] - o[1], v[2] - o[2], 0, v[0] - o[0], v[1] - o[1], v[2] - o[2], 0 );
+    const __m128i dh2 = _mm_slli_epi16( dh, 1 );
+    __m128i row = _mm_add_epi16( _mm_setr_epi16( 4*o[0]+2, 4*o[1]+2, 4*o[2]+2, 255*4, 4*o[0]+2, 4*o[1]+2, 4*o[2]+2, 255*4 ),
+        _mm_unpackhi_epi64( _mm_setzero_si128(), dh ) );
+
+    for( int y=0; y<4; y++ )
+    {
+        __m128i p01 = _mm_srai_epi16( row, 2 );
+        __m128i p23 = _mm_srai_epi16( _mm_add_epi16( row, dh2 ), 2 );
+        c[y] = _mm_packus_epi16( p01, p23 );
+        row = _mm_add_epi16( row, dv );
+    }
+}
+
+void DecodeBlock( uint64 d, __m128i c[4] )
+{
+    const uint32 w0 = ByteSwap32( uint32( d ) );
+    const uint32 w1 = ByteSwap32( uint32( d >> 32 ) );
+
+    alignas(16) uint32 pal[8];
+    uint32 sub;
+    if( !DecodePalette( w0, w1, pal, sub ) )
+    {
+        DecodePlanar( w0, w1, c );
+        return;
+    }
+
+    const __m128i p0 = _mm_load_si128( (const __m128i*)pal );
+    const __m128i p1 = _mm_load_si128( (const __m128i*)pal + 1 );
+    const __m128i sel = _mm_set1_epi32( w1 );
+    const __m128i selHi = _mm_set1_epi32( w1 >> 16 );
+    const __m128i subv = _mm_set1_epi32( sub );
+    const __m128i spread = _mm_setr_epi8( 0, 0, 0, 0, 4, 4, 4, 4, 8, 8, 8, 8, 12, 12, 12, 12 );
+
+    // Selectors are stored column by column
+    __m128i bit = _mm_setr_epi32( 0x1, 0x10, 0x100, 0x1000 );
+    for( int y=0; y<4; y++ )
+    {
+        __m128i lsb = _mm_cmpeq_epi32( _mm_and_si128( sel, bit ), bit );
+        __m128i msb = _mm_cmpeq_epi32( _mm_and_si128( selHi, bit ), bit );
+        __m128i s1 = _mm_cmpeq_epi32( _mm_and_si128( subv, bit ), bit );
+        __m128i idx = _mm_or_si128( _mm_and_si128( lsb, _mm_set1_epi32( 4 ) ), _mm_and_si128( msb, _mm_set1_epi32( 8 ) ) );
+        __m128i ctrl = _mm_add_epi8( _mm_shuffle_epi8( idx, spread ), _mm_set1_epi32( 0x03020100 ) );
+        c[y] = _mm_blendv_epi8( _mm_shuffle_epi8( p0, ctrl ), _mm_shuffle_epi8( p1, ctrl ), s1 );
+        bit = _mm_slli_epi32( bit, 1 );
+    }
+}
+
+void DecodeAlpha( uint64 a, __m128i c[4] )
+{
+    a = ByteSwap64( a );
+    alignas(8) uint8 pal[8];
+    DecodeAlphaPalette( a, pal );
+
+    alignas(16) uint8 idx[16];
+    for( int i=0; i<16; i++ )
+    {
+        idx[( i % 4 ) * 4 + i / 4] = ( a >> ( 45 - i*3 ) ) & 0x7;
+    }
+    const __m128i alpha = _mm_shuffle_epi8( _mm_loadl_epi64( (const __m128i*)pal ), _mm_load_si128( (const __m128i*)idx ) );
+
+    // Move the alpha values of each line to the top byte of the pixels
+    __m128i ctrl = _mm_setr_epi8( -1, -1, -1, 0, -1, -1, -1, 1, -1, -1, -1, 2, -1, -1, -1, 3 );
+    const __m128i mask = _mm_set1_epi32( 0x00FFFFFF );
+    for( int y=0; y<4; y++ )
+    {
+        c[y] = _mm_or_si128( _mm_and_si128( c[y], mask ), _mm_shuffle_epi8( alpha, ctrl ) );
+        ctrl = _mm_add_epi8( ctrl, _mm_setr_epi8( 0, 0, 0, 4, 0, 0, 0, 4, 0, 0, 0, 4, 0, 0, 0, 4 ) );
+    }
+}
+
+void Store( const __m128i c[4], uint32* dst, size_t width )
+{
+    for( int y=0; y<4; y++ )
+    {
+        _mm_storeu_si128( (__m128i*)( dst + y * width ), c[y] );
+    }
+}
+#else
+void DecodePlanar( uint32 w0, uint32 w1, uint32* dst, size_t width )
+{
+    int32 o[3], h[3], v[3];
+    DecodePlanarColors( w0, w1, o, h, v );
+
+    for( int y=0; y<4; y++ )
+    {
+        for( int x=0; x<4; x++ )
+        {
+            dst[y * width + x] = PackRGBA(
+                ( x * ( h[0] - o[0] ) + y * ( v[0] - o[0] ) + 4 * o[0] + 2 ) >> 2,
+                ( x * ( h[1] - o[1] ) + y * ( v[1] - o[1] ) + 4 * o[1] + 2 ) >> 2,
+                ( x * ( h[2] - o[2] ) + y * ( v[2] - o[2] ) + 4 * o[2] + 2 ) >> 2 );
+        }
+    }
+}
+
+void DecodeBlock( uint64 d, uint32* dst, size_t width )
+{
+    const uint32 w0 = ByteSwap32( uint32( d ) );
+    const uint32 w1 = ByteSwap32( uint32( d >> 32 ) );
+
+    uint32 pal[8];
+    uint32 sub;
+    if( !DecodePalette( w0, w1, pal, sub ) )
+    {
+        DecodePlanar( w0, w1, dst, width );
+        return;
+    }
+
+    // Selectors are stored column by column
+    for( int x=0; x<4; x++ )
+    {
+        for( int y=0; y<4; y++ )
+        {
+            const int i = x * 4 + y;
+            const uint32 idx = ( ( w1 >> i ) & 0x1 ) | ( ( w1 >> ( i + 15 ) ) & 0x2 ) | ( ( ( sub >> i ) & 0x1 ) << 2 );
+            dst[y * width + x] = pal[idx];
+        }
+    }
+}
+
+void DecodeAlpha( uint64 a, uint32* dst, size_t width )
+{
+    a = ByteSwap64( a );
+    uint8 pal[8];
+    DecodeAlphaPalette( a, pal );
+
+    for( int x=0; x<4; x++ )
+    {
+        for( int y=0; y<4; y++ )
+        {
+            const uint32 idx = ( a >> ( 45 - ( x * 4 + y ) * 3 ) ) & 0x7;
+            uint32* ptr = dst + y * width + x;
+            *ptr = ( *ptr & 0x00FFFFFF ) | ( uint32( pal[idx] ) << 24 );
+        }
+    }
+}
+#endif
+
+}
+
+void DecodeRGB( const uint64* src, uint32* dst, uint32 blocks, size_t width )
+{
+    do
+    {
+#ifdef __SSE4_1__
+        __m128i c[4];
+        DecodeBlock( *src++, c );
+        Store( c, dst, width );
+#else
+        DecodeBlock( *src++, dst, width );
+#endif
+        dst += 4;
+    }
+    while( --blocks );
+}
+
+void DecodeRGBA( const uint64* src, uint32* dst, uint32 blocks, size_t width )
+{
+    do
+    {
+        const uint64 a = *src++;
+#ifdef __SSE4_1__
+        __m128i c[4];
+        DecodeBlock( *src++, c );
+        DecodeAlpha( a, c );
+        Store( c, dst, width );
+#else
+        DecodeBlock( *src++, dst, width );
+        DecodeAlpha( a, dst, width );
+#endif
+        dst += 4;
+    }
+    while( --blocks );
+}
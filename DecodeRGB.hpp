@@ -0,0 +1,12 @@
+#ifndef __DECODERGB_HPP__
+#define __DECODERGB_HPP__
+
+#include <stddef.h>
+
+#include "Types.hpp"
+
+// Decode a run of blocks from one block row, dst points to the first of four pixel lines of the given width
+void DecodeRGB( const uint64* src, uint32* dst, uint32 blocks, size_t width );
+void DecodeRGBA( const uint64* src, uint32* dst, uint32 blocks, size_t width );
+
+#endif
@@ -0,0 +1,187 @@
+#ifdef __SSE4_1__
+
+#include "DecodeCommon.hpp"
+#include "DecodeRGB_AVX2.hpp"
+#ifdef _MSC_VER
+#  include <intrin.h>
+#  define VS_VECTORCALL _vectorcall
+#else
+#  include <x86intrin.h>
+#  pragma GCC push_options
+#  pragma GCC target ("avx2,fma,bmi2")
+#  define VS_VECTORCALL
+#endif
+
+namespace
+{
+
+// Decoded pixels are kept in registers, two pixel lines per register
+void VS_VECTORCALL DecodePlanar_AVX2( uint32 w0, uint32 w1, __m256i& c01, __m256i& c23 ) noexcept
+{
+    int32 o[3], h[3], v[3];
+    DecodePlanarColors( w0, w1, o, h, v );
+
+    const __m256i dh = _mm256_broadcastsi128_si256( _mm_setr_epi16( h[0] - o[0], h[1] - o[1], h[2] - o[2], 0, h[0] - o[0], h[1] - o[1], h[2] - o[2], 0 ) );
+    const __m256i dv = _mm256_broadcastsi128_si256( _mm_setr_epi16( v[0] - o[0], v[1] - o[1], v[2] - o[2], 0, v[0] - o[0], v[1] - o[1], v[2] - o[2], 0 ) );
+
+    // Pixels 0 and 1 of a line in the low lane, the same pixels of the next line in the high lane
+    const __m256i base = _mm256_broadcastsi128_si256( _mm_setr_epi16( 4*o[0]+2, 4*o[1]+2, 4*o[2]+2, 255*4, 4*o[0]+2, 4*o[1]+2, 4*o[2]+2, 255*4 ) );
+    const __m256i xy = _mm256_setr_epi16( 0, 0, 0, 0, 1, 1, 1, 1, 0, 0, 0, 0, 1, 1, 1, 1 );
+    const __m256i yy = _mm256_setr_epi16( 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 1, 1, 1 );
+    const __m256i dh2 = _mm256_slli_epi16( dh, 1 );
+    const __m256i dv2 = _mm256_slli_epi16( dv, 1 );
+
+    __m256i row01 = _mm256_add_epi16( base, _mm256_add_epi16( _mm256_mullo_epi16( dh, xy ), _mm256_mullo_epi16( dv, yy ) ) );
+    __m256i row23 = _mm256_add_epi16( row01, dv2 );
+
+    c01 = _mm256_packus_epi16( _mm256_srai_epi16( row01, 2 ), _mm256_srai_epi16( _mm256_add_epi16( row01, dh2 ), 2 ) );
+    c23 = _mm256_packus_epi16( _mm256_srai_epi16( row23, 2 ), _mm256_srai_epi16( _mm256_add_epi16( row23, dh2 ), 2 ) );
+}
+
+// Individual and differential blocks, which are nearly all of them, expand their palettes in vector lanes. The
+// table entries are added to or subtracted from the base colors with byte saturation, which is the clamp.
+bool VS_VECTORCALL DecodePalette_AVX2( uint32 w0, __m256i& pal ) noexcept
+{
+    int32 base[2][3];
+    if( !DecodeBases( w0, base ) ) return false;
+
+    const __m256i b = _mm256_inserti128_si256( _mm256_castsi128_si256( _mm_set1_epi32( PackRGBA( base[0][0], base[0][1], base[0][2] ) ) ),
+        _mm_set1_epi32( PackRGBA( base[1][0], base[1][1], base[1][2] ) ), 1 );
+    const __m256i tab = _mm256_inserti128_si256( _mm256_castsi128_si256( _mm_loadu_si128( (const __m128i*)g_table[( w0 >> 5 ) & 0x7] ) ),
+        _mm_loadu_si128( (const __m128i*)g_table[( w0 >> 2 ) & 0x7] ), 1 );
+
+    // Magnitudes of the entries in the R, G and B bytes, the first two entries of each sub-block are added
+    const __m256i mag = _mm256_shuffle_epi8( _mm256_abs_epi32( tab ), _mm256_setr_epi8(
+        0, 0, 0, -1, 4, 4, 4, -1, 8, 8, 8, -1, 12, 12, 12, -1, 0, 0, 0, -1, 4, 4, 4, -1, 8, 8, 8, -1, 12, 12, 12, -1 ) );
+    const __m256i add = _mm256_setr_epi32( -1, -1, 0, 0, -1, -1, 0, 0 );
+
+    pal = _mm256_subs_epu8( _mm256_adds_epu8( b, _mm256_and_si256( mag, add ) ), _mm256_andnot_si256( add, mag ) );
+    return true;
+}
+
+void VS_VECTORCALL DecodeBlock_AVX2( uint64 d, __m256i& c01, __m256i& c23 ) noexcept
+{
+    const uint32 w0 = ByteSwap32( uint32( d ) );
+    const uint32 w1 = ByteSwap32( uint32( d >> 32 ) );
+
+    __m256i p;
+    uint32 sub;
+    if( DecodePalette_AVX2( w0, p ) )
+    {
+        // Flipped blocks are split horizontally
+        sub = ( w0 & 0x1 ) ? 0xCCCC : 0xFF00;
+    }
+    else
+    {
+        alignas(32) uint32 pal[8];
+        if( !DecodePalette( w0, w1, pal, sub ) )
+        {
+            DecodePlanar_AVX2( w0, w1, c01, c23 );
+            return;
+        }
+        p = _mm256_load_si256( (const __m256i*)pal );
+    }
+
+    const __m256i sel = _mm256_set1_epi32( w1 );
+    const __m256i subv = _mm256_set1_epi32( sub );
+    const __m256i one = _mm256_set1_epi32( 1 );
+
+    // Selector bit of each pixel, two pixel lines per register
+    const __m256i shift01 = _mm256_setr_epi32( 0, 4, 8, 12, 1, 5, 9, 13 );
+    const __m256i shift23 = _mm256_add_epi32( shift01, _mm256_set1_epi32( 2 ) );
+    const __m256i shiftHi = _mm256_set1_epi32( 16 );
+
+    __m256i idx01 = _mm256_and_si256( _mm256_srlv_epi32( sel, shift01 ), one );
+    idx01 = _mm256_or_si256( idx01, _mm256_slli_epi32( _mm256_and_si256( _mm256_srlv_epi32( sel, _mm256_add_epi32( shift01, shiftHi ) ), one ), 1 ) );
+    idx01 = _mm256_or_si256( idx01, _mm256_slli_epi32( _mm256_and_si256( _mm256_srlv_epi32( subv, shift01 ), one ), 2 ) );
+
+    __m256i idx23 = _mm256_and_si256( _mm256_srlv_epi32( sel, shift23 ), one );
+    idx23 = _mm256_or_si256( idx23, _mm256_slli_epi32( _mm256_and_si256( _mm256_srlv_epi32( sel, _mm256_add_epi32( shift23, shiftHi ) ), one ), 1 ) );
+    idx23 = _mm256_or_si256( idx23, _mm256_slli_epi32( _mm256_and_si256( _mm256_srlv_epi32( subv, shift23 ), one ), 2 ) );
+
+    c01 = _mm256_permutevar8x32_epi32( p, idx01 );
+    c23 = _mm256_permutevar8x32_epi32( p, idx23 );
+}
+
+void VS_VECTORCALL DecodeAlpha_AVX2( uint64 a, __m256i& c01, __m256i& c23 ) noexcept
+{
+    a = ByteSwap64( a );
+    alignas(8) uint8 pal[8];
+    DecodeAlphaPalette( a, pal );
+
+    // Spread the 3-bit indices to bytes, byte 15-i holds index of pixel i
+    const uint64 lo = _pdep_u64( a >> 24, 0x0707070707070707 );
+    const uint64 hi = _pdep_u64( a, 0x0707070707070707 );
+    const __m128i idx = _mm_set_epi64x( lo, hi );
+
+    // Reorder from column to line order and look up the alpha values
+    const __m128i order = _mm_setr_epi8( 15, 11, 7, 3, 14, 10, 6, 2, 13, 9, 5, 1, 12, 8, 4, 0 );
+    const __m128i alpha = _mm_shuffle_epi8( _mm_loadl_epi64( (const __m128i*)pal ), _mm_shuffle_epi8( idx, order ) );
+
+    const __m256i a01 = _mm256_slli_epi32( _mm256_cvtepu8_epi32( alpha ), 24 );
+    const __m256i a23 = _mm256_slli_epi32( _mm256_cvtepu8_epi32( _mm_srli_si128( alpha, 8 ) ), 24 );
+    const __m256i mask = _mm256_set1_epi32( 0x00FFFFFF );
+
+    c01 = _mm256_or_si256( _mm256_and_si256( c01, mask ), a01 );
+    c23 = _mm256_or_si256( _mm256_and_si256( c23, mask ), a23 );
+}
+
+void VS_VECTORCALL Store_AVX2( __m256i c01, __m256i c23, uint32* dst, size_t width ) noexcept
+{
+    _mm_storeu_si128( (__m128i*)dst, _mm256_castsi256_si128( c01 ) );
+    _mm_storeu_si128( (__m128i*)( dst + width ), _mm256_extracti128_si256( c01, 1 ) );
+    _mm_storeu_si128( (__m128i*)( dst + width * 2 ), _mm256_castsi256_si128( c23 ) );
+    _mm_storeu_si128( (__m128i*)( dst + width * 3 ), _mm256_extracti128_si256( c23, 1 ) );
+}
+
+}
+
+// Two blocks per iteration, so that the independent palette and selector work of both overlaps
+void DecodeRGB_AVX2( const uint64* src, uint32* dst, uint32 blocks, size_t width )
+{
+    for( ; blocks >= 2; blocks -= 2 )
+    {
+        __m256i c01[2], c23[2];
+        DecodeBlock_AVX2( src[0], c01[0], c23[0] );
+        DecodeBlock_AVX2( src[1], c01[1], c23[1] );
+        Store_AVX2( c01[0], c23[0], dst, width );
+        Store_AVX2( c01[1], c23[1], dst + 4, width );
+        src += 2;
+        dst += 8;
+    }
+    if( blocks )
+    {
+        __m256i c01, c23;
+        DecodeBlock_AVX2( *src, c01, c23 );
+        Store_AVX2( c01, c23, dst, width );
+    }
+}
+
+void DecodeRGBA_AVX2( const uint64* src, uint32* dst, uint32 blocks, size_t width )
+{
+    for( ; blocks >= 2; blocks -= 2 )
+    {
+        __m256i c01[2], c23[2];
+        DecodeBlock_AVX2( src[1], c01[0], c23[0] );
+        DecodeBlock_AVX2( src[3], c01[1], c23[1] );
+        DecodeAlpha_AVX2( src[0], c01[0], c23[0] );
+        DecodeAlpha_AVX2( src[2], c01[1], c23[1] );
+        Store_AVX2( c01[0], c23[0], dst, width );
+        Store_AVX2( c01[1], c23[1], dst + 4, width );
+        src += 4;
+        dst += 8;
+    }
+    if( blocks )
+    {
+        __m256i c01, c23;
+        DecodeBlock_AVX2( src[1], c01, c23 );
+        DecodeAlpha_AVX2( src[0], c01, c23 );
+        Store_AVX2( c01, c23, dst, width );
+    }
+}
+
+#ifndef _MSC_VER
+#  pragma GCC pop_options
+#endif
+
+#endif
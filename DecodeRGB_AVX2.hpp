@@ -0,0 +1,15 @@
+#ifndef __DECODERGB_AVX2_HPP__
+#define __DECODERGB_AVX2_HPP__
+
+#ifdef __SSE4_1__
+
+#include <stddef.h>
+
+#include "Types.hpp"
+
+void DecodeRGB_AVX2( const uint64* src, uint32* dst, uint32 blocks, size_t width );
+void DecodeRGBA_AVX2( const uint64* src, uint32* dst, uint32 blocks, size_t width );
+
+#endif
+
+#endif
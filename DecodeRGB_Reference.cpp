@@ -0,0 +1,6 @@
+// DecodeRGB.cpp without SIMD code, as the baseline of the differential check
+#undef __SSE4_1__
+#define DecodeRGB DecodeRGB_Reference
+#define DecodeRGBA DecodeRGBA_Reference
+
+#include "DecodeRGB.cpp"
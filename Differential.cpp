@@ -0,0 +1,411 @@
+#include <functional>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+#include "CpuArch.hpp"
+#include "DecodeRGB.hpp"
+#include "DecodeRGB_AVX2.hpp"
+#include "Differential.hpp"
+#include "ErrorMetric.hpp"
+#include "ProcessAlpha.hpp"
+#include "ProcessAlpha_AVX2.hpp"
+#include "ProcessRGB.hpp"
+#include "ProcessRGB_AVX2.hpp"
+#include "Reference.hpp"
+
+// A variant with a PSNR lower than the reference's by more than this fails
+static const double MaxPsnrLoss = 0.25;
+
+// Blocks are checked in groups, so that the batched kernels can be used
+enum { Group = 4 };
+
+static uint32 Random( uint32& seed )
+{
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    return seed;
+}
+
+static uint8 Clamp( int v )
+{
+    return v < 0 ? 0 : ( v > 255 ? 255 : v );
+}
+
+enum Pattern
+{
+    Noise,          // any value
+    Solid,
+    NearSolid,      // one color, off by one in places
+    TwoColors,
+    Halves,         // different colors on either side of a 4x2 or 2x4 split
+    Gradient,
+    LowContrast,
+    Extremes,       // channels at 0, 1, 254 or 255
+    NumPatterns
+};
+
+static const char* PatternNames[NumPatterns] = { "noise", "solid", "near solid", "two colors", "halves", "gradient", "low contrast", "extremes" };
+
+// Pixels column by column, as the kernels expect. All four channels follow the pattern.
+static void Generate( uint32* block, Pattern pattern, uint32& seed )
+{
+    const uint32 c0 = Random( seed );
+    const uint32 c1 = Random( seed );
+
+    switch( pattern )
+    {
+    case Noise:
+        for( int i=0; i<16; i++ ) block[i] = Random( seed );
+        break;
+    case Solid:
+        for( int i=0; i<16; i++ ) block[i] = c0;
+        break;
+    case NearSolid:
+        for( int i=0; i<16; i++ )
+        {
+            const uint32 r = Random( seed );
+            uint32 v = 0;
+            for( int c=0; c<4; c++ )
+            {
+                const int ch = ( c0 >> ( c*8 ) ) & 0xFF;
+                v |= uint32( Clamp( ch + int( ( r >> ( c*2 ) ) % 3 ) - 1 ) ) << ( c*8 );
+            }
+            block[i] = v;
+        }
+        break;
+    case TwoColors:
+    {
+        const uint32 mask = Random( seed );
+        for( int i=0; i<16; i++ ) block[i] = ( mask & ( 1 << i ) ) ? c1 : c0;
+        break;
+    }
+    case Halves:
+    {
+        const bool flip = c1 & 1;
+        for( int i=0; i<16; i++ ) block[i] = ( flip ? ( i & 2 ) : ( i & 8 ) ) ? c1 : c0;
+        break;
+    }
+    case Gradient:
+        for( int x=0; x<4; x++ )
+        {
+            for( int y=0; y<4; y++ )
+            {
+                uint32 v = 0;
+                for( int c=0; c<4; c++ )
+                {
+                    const int dx = int( ( c1 >> ( c*8 ) ) & 0xF ) - 8;
+                    const int dy = int( ( c1 >> ( c*8 + 4 ) ) & 0xF ) - 8;
+                    v |= uint32( Clamp( int( ( c0 >> ( c*8 ) ) & 0xFF ) + dx * x * 4 + dy * y * 4 ) ) << ( c*8 );
+                }
+                block[x*4+y] = v;
+            }
+        }
+        break;
+    case LowContrast:
+        for( int i=0; i<16; i++ ) block[i] = ( c0 & 0xF8F8F8F8 ) | ( Random( seed ) & 0x07070707 );
+        break;
+    case Extremes:
+    {
+        static const uint8 values[4] = { 0, 1, 254, 255 };
+        for( int i=0; i<16; i++ )
+        {
+            const uint32 r = Random( seed );
+            block[i] = values[r & 3] | ( values[( r >> 2 ) & 3] << 8 ) | ( values[( r >> 4 ) & 3] << 16 ) | ( values[( r >> 6 ) & 3] << 24 );
+        }
+        break;
+    }
+    default:
+        break;
+    }
+}
+
+struct Variant
+{
+    const char* name;
+    CpuIsa isa;
+    int exact;      // Variant which the output has to match bit for bit, or -1
+    // Encodes or decodes a group of blocks, the metric is for the color kernels
+    std::function<void( const uint32* src, uint64* dst, ErrorMetric metric )> run;
+};
+
+struct Family
+{
+    const char* name;
+    // What the blocks are compared by, after decoding the output
+    enum { Color, Alpha, Decoder } kind;
+    std::vector<Variant> variants;
+    ErrorMetric metric;     // Passed to the variants
+};
+
+template<class F>
+static std::function<void( const uint32*, uint64*, ErrorMetric )> Single( F f )
+{
+    return [f]( const uint32* src, uint64* dst, ErrorMetric metric )
+    {
+        for( int i=0; i<Group; i++ ) dst[i] = f( (const uint8*)( src + i*16 ), metric );
+    };
+}
+
+template<int N, class F>
+static std::function<void( const uint32*, uint64*, ErrorMetric )> Batch( F f )
+{
+    return [f]( const uint32* src, uint64* dst, ErrorMetric metric )
+    {
+        for( int i=0; i<Group; i+=N ) f( (const uint8*)( src + i*16 ), dst + i, metric );
+    };
+}
+
+// Alpha kernels take the 16 alpha values of a block
+template<class F>
+static std::function<void( const uint32*, uint64*, ErrorMetric )> Alpha( F f )
+{
+    return [f]( const uint32* src, uint64* dst, ErrorMetric )
+    {
+        for( int i=0; i<Group; i++ )
+        {
+            uint8 a[16];
+            for( int j=0; j<16; j++ ) a[j] = src[i*16+j] >> 24;
+            dst[i] = f( a );
+        }
+    };
+}
+
+// Decoders get the source pixels reinterpreted as blocks, so every bit pattern shows up. The decoded pixels
+// are folded into the output.
+static std::function<void( const uint32*, uint64*, ErrorMetric )> Decoder( void (*f)( const uint64*, uint32*, uint32, size_t ) )
+{
+    return [f]( const uint32* src, uint64* dst, ErrorMetric )
+    {
+        // An RGBA block takes two words, there are plenty in the source
+        uint32 out[4*Group*4];
+        f( (const uint64*)src, out, Group, Group*4 );
+        for( int i=0; i<Group; i++ )
+        {
+            uint64 h = 0;
+            for( int y=0; y<4; y++ )
+            {
+                for( int x=0; x<4; x++ ) h = h * 0x100000001B3ull ^ out[y*Group*4 + i*4 + x];
+            }
+            dst[i] = h;
+        }
+    };
+}
+
+static std::vector<Family> Families()
+{
+    std::vector<Family> ret;
+
+    ret.push_back( { "ETC1", Family::Color, {
+        { "reference", CpuIsa::Scalar, -1, Single( ProcessRGB_Reference ) },
+        { "sse41", CpuIsa::SSE41, -1, Single( ProcessRGB ) },
+#ifdef __SSE4_1__
+        { "avx2", CpuIsa::AVX2, 1, Single( ProcessRGB_AVX2 ) },
+        { "avx2 x2", CpuIsa::AVX2, 2, Batch<2>( ProcessRGB_AVX2_x2 ) },
+        { "avx512 x4", CpuIsa::AVX512, 2, Batch<4>( ProcessRGB_AVX512_x4 ) },
+#endif
+    } } );
+
+    ret.push_back( { "ETC1 4x2", Family::Color, {
+        { "reference", CpuIsa::Scalar, -1, Single( ProcessRGB_4x2_Reference ) },
+        { "sse41", CpuIsa::SSE41, -1, Single( ProcessRGB_4x2 ) },
+#ifdef __SSE4_1__
+        { "avx2", CpuIsa::AVX2, 1, Single( ProcessRGB_4x2_AVX2 ) },
+#endif
+    } } );
+
+    for( bool th : { false, true } )
+    {
+        ret.push_back( { th ? "ETC2 effort 2" : "ETC2", Family::Color, {
+            { "reference", CpuIsa::Scalar, -1, Single( [th]( const uint8* src, ErrorMetric metric ) { return ProcessRGB_ETC2_Reference( src, th, metric ); } ) },
+            { "sse41", CpuIsa::SSE41, -1, Single( [th]( const uint8* src, ErrorMetric metric ) { return ProcessRGB_ETC2( src, th, metric ); } ) },
+#ifdef __SSE4_1__
+            { "avx2", CpuIsa::AVX2, 1, Single( [th]( const uint8* src, ErrorMetric metric ) { return ProcessRGB_ETC2_AVX2( src, th, metric ); } ) },
+            { "avx2 x2", CpuIsa::AVX2, 2, Batch<2>( [th]( const uint8* src, uint64* dst, ErrorMetric metric ) { ProcessRGB_ETC2_AVX2_x2( src, dst, th, metric ); } ) },
+            { "avx512 x4", CpuIsa::AVX512, 2, Batch<4>( [th]( const uint8* src, uint64* dst, ErrorMetric metric ) { ProcessRGB_ETC2_AVX512_x4( src, dst, th, metric ); } ) },
+#endif
+        } } );
+    }
+
+    // The color kernels once more with the other error metrics, T and H modes included
+    static const struct { ErrorMetric metric; const char* etc1; const char* etc2; } metrics[] = {
+        { ErrorMetric::Uniform, "ETC1 uniform", "ETC2 uniform" },
+        { ErrorMetric::Linear, "ETC1 linear", "ETC2 linear" }
+    };
+    const Family etc1 = ret[0];
+    const Family etc2 = ret[3];
+    for( auto& m : metrics )
+    {
+        ret.push_back( etc1 );
+        ret.back().name = m.etc1;
+        ret.back().metric = m.metric;
+        ret.push_back( etc2 );
+        ret.back().name = m.etc2;
+        ret.back().metric = m.metric;
+    }
+
+    ret.push_back( { "EAC alpha", Family::Alpha, {
+        { "sse41", CpuIsa::SSE41, -1, Alpha( ProcessAlpha_ETC2 ) },
+#ifdef __SSE4_1__
+        { "avx2", CpuIsa::AVX2, 0, Alpha( ProcessAlpha_ETC2_AVX2 ) },
+#endif
+    } } );
+
+    ret.push_back( { "Decode RGB", Family::Decoder, {
+        { "reference", CpuIsa::Scalar, -1, Decoder( DecodeRGB_Reference ) },
+        { "sse41", CpuIsa::SSE41, 0, Decoder( DecodeRGB ) },
+#ifdef __SSE4_1__
+        { "avx2", CpuIsa::AVX2, 0, Decoder( DecodeRGB_AVX2 ) },
+#endif
+    } } );
+
+    ret.push_back( { "Decode RGBA", Family::Decoder, {
+        { "reference", CpuIsa::Scalar, -1, Decoder( DecodeRGBA_Reference ) },
+        { "sse41", CpuIsa::SSE41, 0, Decoder( DecodeRGBA ) },
+#ifdef __SSE4_1__
+        { "avx2", CpuIsa::AVX2, 0, Decoder( DecodeRGBA_AVX2 ) },
+#endif
+    } } );
+
+    return ret;
+}
+
+// Squared error of the decoded block against the source, over the compared channels
+static uint64 BlockError( const uint32* src, uint64 word, int kind )
+{
+    uint32 out[16];
+    if( kind == Family::Color )
+    {
+        DecodeRGB_Reference( &word, out, 1, 4 );
+    }
+    else
+    {
+        const uint64 rgba[2] = { word, 0 };
+        DecodeRGBA_Reference( rgba, out, 1, 4 );
+    }
+
+    uint64 err = 0;
+    for( int x=0; x<4; x++ )
+    {
+        for( int y=0; y<4; y++ )
+        {
+            const uint32 s = src[x*4+y];
+            const uint32 d = out[y*4+x];
+            for( int c=0; c<4; c++ )
+            {
+                if( ( kind == Family::Alpha ) != ( c == 3 ) ) continue;
+                const int e = int( ( s >> ( c*8 ) ) & 0xFF ) - int( ( d >> ( c*8 ) ) & 0xFF );
+                err += e * e;
+            }
+        }
+    }
+    return err;
+}
+
+static double Psnr( uint64 err, uint64 values )
+{
+    if( err == 0 ) return 99;
+    return 10 * log10( 255.0 * 255.0 * values / err );
+}
+
+int DifferentialCheck( uint32 blocks )
+{
+    const auto isa = cpu_isa();
+    const auto families = Families();
+    const uint32 groups = ( blocks + Group - 1 ) / Group;
+    int failures = 0;
+
+    // PSNR is compared for each pattern on its own, as the noise blocks would hide everything else
+    printf( "%-16s %-12s %12s %12s %10s %10s\n", "Family", "Variant", "Blocks", "Differ", "PSNR", "Worst delta" );
+    for( auto& family : families )
+    {
+        const size_t num = family.variants.size();
+        std::vector<uint64> differ( num, 0 ), mismatch( num, 0 );
+        std::vector<std::vector<uint64>> err( num, std::vector<uint64>( NumPatterns, 0 ) );
+        uint64 count[NumPatterns] = {};
+        std::vector<bool> reported( num, false );
+
+        uint32 seed = 0x2545F491;
+        alignas(32) uint32 src[Group*16];
+        uint64 out[8][Group];
+
+        for( uint32 g=0; g<groups; g++ )
+        {
+            Pattern pattern[Group];
+            for( int i=0; i<Group; i++ )
+            {
+                pattern[i] = Pattern( ( g * Group + i ) % NumPatterns );
+                Generate( src + i*16, pattern[i], seed );
+                count[pattern[i]]++;
+            }
+
+            for( size_t v=0; v<num; v++ )
+            {
+                const auto& var = family.variants[v];
+                if( var.isa > isa ) continue;
+                var.run( src, out[v], family.metric );
+
+                for( int i=0; i<Group; i++ )
+                {
+                    if( out[v][i] != out[0][i] ) differ[v]++;
+                    if( var.exact >= 0 && out[v][i] != out[var.exact][i] )
+                    {
+                        mismatch[v]++;
+                        if( !reported[v] )
+                        {
+                            reported[v] = true;
+                            printf( "  %s %s differs from %s on block", family.name, var.name, family.variants[var.exact].name );
+                            for( int j=0; j<16; j++ ) printf( " %08x", src[i*16+j] );
+                            printf( "\n" );
+                        }
+                    }
+                    if( family.kind != Family::Decoder ) err[v][pattern[i]] += BlockError( src + i*16, out[v][i], family.kind );
+                }
+            }
+        }
+
+        const int channels = family.kind == Family::Alpha ? 1 : 3;
+        for( size_t v=0; v<num; v++ )
+        {
+            const auto& var = family.variants[v];
+            if( var.isa > isa )
+            {
+                printf( "%-16s %-12s %12s\n", family.name, var.name, "skipped" );
+                continue;
+            }
+
+            printf( "%-16s %-12s %12u %12llu", family.name, var.name, groups * Group, (unsigned long long)differ[v] );
+            bool fail = mismatch[v] != 0;
+            if( family.kind != Family::Decoder )
+            {
+                uint64 total = 0;
+                double worst = 0;
+                int worstPattern = 0;
+                for( int p=0; p<NumPatterns; p++ )
+                {
+                    total += err[v][p];
+                    const double delta = Psnr( err[v][p], count[p] * 16 * channels ) - Psnr( err[0][p], count[p] * 16 * channels );
+                    if( delta < worst )
+                    {
+                        worst = delta;
+                        worstPattern = p;
+                    }
+                }
+                printf( " %10.4f %+10.4f", Psnr( total, uint64( groups ) * Group * 16 * channels ), worst );
+                if( worst < 0 ) printf( " (%s)", PatternNames[worstPattern] );
+                if( worst < -MaxPsnrLoss ) fail = true;
+            }
+            if( fail )
+            {
+                printf( "  FAIL" );
+                failures++;
+            }
+            printf( "\n" );
+        }
+    }
+
+    printf( "%i failing variants\n", failures );
+    return failures;
+}
@@ -0,0 +1,12 @@
+#ifndef __DIFFERENTIAL_HPP__
+#define __DIFFERENTIAL_HPP__
+
+#include "Types.hpp"
+
+// Runs random and adversarial blocks through every kernel variant compiled in and usable on this CPU, and
+// compares the results with the scalar reference. Variants that have to be bit exact with another one
+// fail on any difference, the others if their PSNR is noticeably lower than the reference's. Returns the
+// number of failing variants.
+int DifferentialCheck( uint32 blocks );
+
+#endif
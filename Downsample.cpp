@@ -0,0 +1,291 @@
+#include <algorithm>
+#include <math.h>
+#include <string.h>
+#include <vector>
+
+#include "CpuArch.hpp"
+#include "Downsample.hpp"
+#include "Downsample_AVX2.hpp"
+#ifdef __SSE4_1__
+#  ifdef _MSC_VER
+#    include <intrin.h>
+#  else
+#    include <x86intrin.h>
+#  endif
+#endif
+
+// Linear values are quantized to this many steps on the way back to sRGB, which is enough for every sRGB
+// value to survive the round trip
+enum { LutSize = 4096 };
+
+enum { MaxTaps = 6 };
+
+struct Taps
+{
+    int num;
+    int offset;         // First source pixel, relative to twice the destination coordinate
+    float w[MaxTaps];
+};
+
+struct Tables
+{
+    Tables()
+    {
+        for( int i=0; i<256; i++ )
+        {
+            const double c = i / 255.0;
+            toLinear[i] = float( c <= 0.04045 ? c / 12.92 : pow( ( c + 0.055 ) / 1.055, 2.4 ) );
+        }
+        for( int i=0; i<LutSize; i++ )
+        {
+            const double l = i / double( LutSize - 1 );
+            const double c = l <= 0.0031308 ? l * 12.92 : 1.055 * pow( l, 1 / 2.4 ) - 0.055;
+            fromLinear[i] = uint32( c * 255 + 0.5 );
+        }
+
+        box.num = 2;
+        box.offset = 0;
+        box.w[0] = box.w[1] = 0.5f;
+
+        // Windowed sinc with the cutoff at half the source sampling rate, taps are 0.5, 1.5 and 2.5 pixels
+        // away from the destination pixel center
+        const double beta = 4;
+        const double radius = 3;
+        double sum = 0;
+        double w[MaxTaps];
+        for( int i=0; i<MaxTaps; i++ )
+        {
+            const double d = i - 2.5;
+            const double x = d * 0.5 * 3.14159265358979323846;
+            const double t = d / radius;
+            w[i] = ( sin( x ) / x ) * BesselI0( beta * sqrt( 1 - t*t ) ) / BesselI0( beta );
+            sum += w[i];
+        }
+        kaiser.num = MaxTaps;
+        kaiser.offset = -2;
+        for( int i=0; i<MaxTaps; i++ )
+        {
+            kaiser.w[i] = float( w[i] / sum );
+        }
+    }
+
+    static double BesselI0( double x )
+    {
+        double sum = 1, term = 1;
+        for( int k=1; k<32; k++ )
+        {
+            term *= ( x / ( 2 * k ) ) * ( x / ( 2 * k ) );
+            sum += term;
+        }
+        return sum;
+    }
+
+    float toLinear[256];
+    uint32 fromLinear[LutSize];
+    Taps box;
+    Taps kaiser;
+};
+
+static const Tables& GetTables()
+{
+    static const Tables tables;
+    return tables;
+}
+
+static void ToLinear( const uint32* src, float* dst, int width, const float* lut )
+{
+    for( int x=0; x<width; x++ )
+    {
+        const uint32 v = *src++;
+        *dst++ = lut[v & 0xFF];
+        *dst++ = lut[( v >> 8 ) & 0xFF];
+        *dst++ = lut[( v >> 16 ) & 0xFF];
+        *dst++ = ( v >> 24 ) * ( 1.f / 255 );
+    }
+}
+
+static void FromLinear( const float* src, uint32* dst, int width, const uint32* lut )
+{
+#ifdef __SSE4_1__
+    const __m128 scale = _mm_setr_ps( LutSize - 1, LutSize - 1, LutSize - 1, 255 );
+    for( int x=0; x<width; x++ )
+    {
+        __m128 v = _mm_min_ps( _mm_max_ps( _mm_loadu_ps( src ), _mm_setzero_ps() ), _mm_set1_ps( 1 ) );
+        __m128i i = _mm_cvttps_epi32( _mm_add_ps( _mm_mul_ps( v, scale ), _mm_set1_ps( 0.5f ) ) );
+        *dst++ = lut[_mm_extract_epi32( i, 0 )] | ( lut[_mm_extract_epi32( i, 1 )] << 8 ) | ( lut[_mm_extract_epi32( i, 2 )] << 16 ) | ( _mm_extract_epi32( i, 3 ) << 24 );
+        src += 4;
+    }
+#else
+    for( int x=0; x<width; x++ )
+    {
+        uint32 v = 0;
+        for( int c=0; c<4; c++ )
+        {
+            const float f = std::min( 1.f, std::max( 0.f, src[c] ) );
+            v |= ( c < 3 ? lut[int( f * ( LutSize - 1 ) + 0.5f )] : uint32( f * 255 + 0.5f ) ) << ( c * 8 );
+        }
+        *dst++ = v;
+        src += 4;
+    }
+#endif
+}
+
+// dst is the weighted sum of the rows, n floats long
+static void VFilter( const float* const* rows, const float* w, int taps, float* dst, size_t n )
+{
+#ifdef __SSE4_1__
+    for( size_t i=0; i<n; i+=4 )
+    {
+        __m128 sum = _mm_mul_ps( _mm_loadu_ps( rows[0] + i ), _mm_set1_ps( w[0] ) );
+        for( int k=1; k<taps; k++ )
+        {
+            sum = _mm_add_ps( sum, _mm_mul_ps( _mm_loadu_ps( rows[k] + i ), _mm_set1_ps( w[k] ) ) );
+        }
+        _mm_storeu_ps( dst + i, sum );
+    }
+#else
+    for( size_t i=0; i<n; i++ )
+    {
+        float sum = 0;
+        for( int k=0; k<taps; k++ ) sum += rows[k][i] * w[k];
+        dst[i] = sum;
+    }
+#endif
+}
+
+// Pixel x of dst is the weighted sum of the source pixels starting at 2x
+static void HFilter( const float* src, const float* w, int taps, float* dst, int width )
+{
+#ifdef __SSE4_1__
+    for( int x=0; x<width; x++ )
+    {
+        const float* s = src + x*8;
+        __m128 sum = _mm_mul_ps( _mm_loadu_ps( s ), _mm_set1_ps( w[0] ) );
+        for( int k=1; k<taps; k++ )
+        {
+            sum = _mm_add_ps( sum, _mm_mul_ps( _mm_loadu_ps( s + k*4 ), _mm_set1_ps( w[k] ) ) );
+        }
+        _mm_storeu_ps( dst + x*4, sum );
+    }
+#else
+    for( int x=0; x<width; x++ )
+    {
+        for( int c=0; c<4; c++ )
+        {
+            float sum = 0;
+            for( int k=0; k<taps; k++ ) sum += src[( x*2 + k ) * 4 + c] * w[k];
+            dst[x*4+c] = sum;
+        }
+    }
+#endif
+}
+
+struct RowKernels
+{
+    void (*toLinear)( const uint32*, float*, int, const float* );
+    void (*fromLinear)( const float*, uint32*, int, const uint32* );
+    void (*vfilter)( const float* const*, const float*, int, float*, size_t );
+    void (*hfilter)( const float*, const float*, int, float*, int );
+};
+
+static RowKernels ResolveRowKernels()
+{
+#ifdef __SSE4_1__
+    if( can_use_intel_core_4th_gen_features() )
+    {
+        return { ToLinear_AVX2, FromLinear_AVX2, VFilter_AVX2, HFilter_AVX2 };
+    }
+#endif
+    return { ToLinear, FromLinear, VFilter, HFilter };
+}
+
+static const RowKernels& GetRowKernels()
+{
+    static const RowKernels kernels = ResolveRowKernels();
+    return kernels;
+}
+
+bool ParseMipFilter( const char* name, MipFilter& filter )
+{
+    if( strcmp( name, "box" ) == 0 )
+    {
+        filter = MipFilter::Box;
+        return true;
+    }
+    if( strcmp( name, "kaiser" ) == 0 )
+    {
+        filter = MipFilter::Kaiser;
+        return true;
+    }
+    return false;
+}
+
+// Length of the vertically filtered row, with room for the edge pixels the taps reach outside the image
+static int PaddedWidth( int offset, int num, int srcWidth, int dstWidth )
+{
+    return -offset + std::max( srcWidth, ( dstWidth - 1 ) * 2 + offset + num );
+}
+
+// Filters a destination row from the linear source rows under the taps
+static void FilterRow( const float* w, int num, int offset, const float* const* rows, int srcWidth, float* row, float* out, uint32* dst, int dstWidth )
+{
+    const auto& k = GetRowKernels();
+
+    // The vertically filtered row is padded with copies of the edge pixels
+    const int left = -offset;
+    const int right = PaddedWidth( offset, num, srcWidth, dstWidth ) - left - srcWidth;
+    float* mid = row + left * 4;
+    k.vfilter( rows, w, num, mid, size_t( srcWidth ) * 4 );
+    for( int i=0; i<left; i++ )
+    {
+        memcpy( row + i*4, mid, 4 * sizeof( float ) );
+    }
+    for( int i=0; i<right; i++ )
+    {
+        memcpy( mid + ( srcWidth + i ) * 4, mid + ( srcWidth - 1 ) * 4, 4 * sizeof( float ) );
+    }
+
+    k.hfilter( row, w, num, out, dstWidth );
+    k.fromLinear( out, dst, dstWidth, GetTables().fromLinear );
+}
+
+void Downsample( const uint32* src, const v2i& srcSize, size_t srcStride, uint32* dst, const v2i& dstSize, size_t dstStride, int y0, int y1, MipFilter filter )
+{
+    const auto& tables = GetTables();
+    const auto& k = GetRowKernels();
+    const Taps& taps = filter == MipFilter::Box ? tables.box : tables.kaiser;
+
+    // Source rows are converted to linear once, into a ring indexed by the row number. The taps of an
+    // output row cover consecutive rows, so they never share a slot.
+    std::vector<float> ring( size_t( taps.num ) * srcSize.x * 4 );
+    int tag[MaxTaps];
+    for( int i=0; i<taps.num; i++ ) tag[i] = -1;
+
+    std::vector<float> row( size_t( PaddedWidth( taps.offset, taps.num, srcSize.x, dstSize.x ) ) * 4 );
+    std::vector<float> out( size_t( dstSize.x ) * 4 );
+
+    for( int y=y0; y<y1; y++ )
+    {
+        const float* rows[MaxTaps];
+        for( int i=0; i<taps.num; i++ )
+        {
+            const int sy = std::min( std::max( y*2 + taps.offset + i, 0 ), srcSize.y - 1 );
+            const int slot = sy % taps.num;
+            float* ptr = ring.data() + size_t( slot ) * srcSize.x * 4;
+            if( tag[slot] != sy )
+            {
+                k.toLinear( src + sy * srcStride, ptr, srcSize.x, tables.toLinear );
+                tag[slot] = sy;
+            }
+            rows[i] = ptr;
+        }
+
+        FilterRow( taps.w, taps.num, taps.offset, rows, srcSize.x, row.data(), out.data(), dst + y * dstStride, dstSize.x );
+    }
+}
+
+int DownsampleRows( int y1, int srcHeight, MipFilter filter )
+{
+    const Taps& taps = filter == MipFilter::Box ? GetTables().box : GetTables().kaiser;
+    return std::min( std::max( ( y1 - 1 ) * 2 + taps.offset + taps.num, 1 ), srcHeight );
+}
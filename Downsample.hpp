@@ -0,0 +1,24 @@
+#ifndef __DOWNSAMPLE_HPP__
+#define __DOWNSAMPLE_HPP__
+
+#include <stddef.h>
+
+#include "Types.hpp"
+#include "Vector.hpp"
+
+enum class MipFilter
+{
+    Box,        // 2x2 average
+    Kaiser      // Kaiser windowed sinc, 6x6 taps
+};
+
+bool ParseMipFilter( const char* name, MipFilter& filter );
+
+// Halves a BGRA image, filtering the color channels in linear light and alpha as is. Only rows [y0, y1)
+// of dst are written, so that the work can be split into bands. Strides are in pixels.
+void Downsample( const uint32* src, const v2i& srcSize, size_t srcStride, uint32* dst, const v2i& dstSize, size_t dstStride, int y0, int y1, MipFilter filter );
+
+// Number of source rows, from the top, that rows [0, y1) of the destination read
+int DownsampleRows( int y1, int srcHeight, MipFilter filter );
+
+#endif
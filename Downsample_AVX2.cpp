@@ -0,0 +1,131 @@
+#ifdef __SSE4_1__
+
+#include "Downsample_AVX2.hpp"
+#ifdef _MSC_VER
+#  include <intrin.h>
+#  define VS_VECTORCALL _vectorcall
+#else
+#  include <x86intrin.h>
+#  pragma GCC push_options
+#  pragma GCC target ("avx2,fma,bmi2")
+#  define VS_VECTORCALL
+#endif
+
+void ToLinear_AVX2( const uint32* src, float* dst, int width, const float* lut )
+{
+    const __m256 scale = _mm256_set1_ps( 1.f / 255 );
+    int x = 0;
+    for( ; x + 2 <= width; x += 2 )
+    {
+        // Color channels through the table, alpha stays linear
+        const __m256i c = _mm256_cvtepu8_epi32( _mm_loadl_epi64( (const __m128i*)( src + x ) ) );
+        const __m256 l = _mm256_i32gather_ps( lut, c, 4 );
+        const __m256 a = _mm256_mul_ps( _mm256_cvtepi32_ps( c ), scale );
+        _mm256_storeu_ps( dst + x*4, _mm256_blend_ps( l, a, 0x88 ) );
+    }
+    if( x < width )
+    {
+        const uint32 v = src[x];
+        dst[x*4] = lut[v & 0xFF];
+        dst[x*4+1] = lut[( v >> 8 ) & 0xFF];
+        dst[x*4+2] = lut[( v >> 16 ) & 0xFF];
+        dst[x*4+3] = ( v >> 24 ) * ( 1.f / 255 );
+    }
+}
+
+// The table has 4096 entries, as in Downsample.cpp
+static inline __m256i VS_VECTORCALL Encode_AVX2( const float* src, const uint32* lut )
+{
+    const __m256 scale = _mm256_setr_ps( 4095, 4095, 4095, 255, 4095, 4095, 4095, 255 );
+    const __m256 v = _mm256_min_ps( _mm256_max_ps( _mm256_loadu_ps( src ), _mm256_setzero_ps() ), _mm256_set1_ps( 1 ) );
+    const __m256i i = _mm256_cvttps_epi32( _mm256_add_ps( _mm256_mul_ps( v, scale ), _mm256_set1_ps( 0.5f ) ) );
+    const __m256i c = _mm256_i32gather_epi32( (const int*)lut, i, 4 );
+    const __m256i p = _mm256_blend_epi32( c, i, 0x88 );
+
+    // Low byte of each channel into the first dword of its lane
+    const __m256i shuf = _mm256_setr_epi8( 0, 4, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+                                           0, 4, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 );
+    return _mm256_shuffle_epi8( p, shuf );
+}
+
+void FromLinear_AVX2( const float* src, uint32* dst, int width, const uint32* lut )
+{
+    int x = 0;
+    for( ; x + 4 <= width; x += 4 )
+    {
+        // Pixels 0 and 2 in the low lane, 1 and 3 in the high lane
+        const __m256i p01 = Encode_AVX2( src + x*4, lut );
+        const __m256i p23 = Encode_AVX2( src + x*4 + 8, lut );
+        const __m256i p = _mm256_or_si256( p01, _mm256_slli_si256( p23, 4 ) );
+        const __m256i r = _mm256_permutevar8x32_epi32( p, _mm256_setr_epi32( 0, 4, 1, 5, 2, 3, 6, 7 ) );
+        _mm_storeu_si128( (__m128i*)( dst + x ), _mm256_castsi256_si128( r ) );
+    }
+    for( ; x + 2 <= width; x += 2 )
+    {
+        const __m256i p = Encode_AVX2( src + x*4, lut );
+        dst[x] = _mm256_extract_epi32( p, 0 );
+        dst[x+1] = _mm256_extract_epi32( p, 4 );
+    }
+    if( x < width )
+    {
+        const __m128 v = _mm_min_ps( _mm_max_ps( _mm_loadu_ps( src + x*4 ), _mm_setzero_ps() ), _mm_set1_ps( 1 ) );
+        const __m128i i = _mm_cvttps_epi32( _mm_add_ps( _mm_mul_ps( v, _mm_setr_ps( 4095, 4095, 4095, 255 ) ), _mm_set1_ps( 0.5f ) ) );
+        dst[x] = lut[_mm_extract_epi32( i, 0 )] | ( lut[_mm_extract_epi32( i, 1 )] << 8 ) | ( lut[_mm_extract_epi32( i, 2 )] << 16 ) | ( _mm_extract_epi32( i, 3 ) << 24 );
+    }
+}
+
+void VFilter_AVX2( const float* const* rows, const float* w, int taps, float* dst, size_t n )
+{
+    size_t i = 0;
+    for( ; i + 8 <= n; i += 8 )
+    {
+        __m256 sum = _mm256_mul_ps( _mm256_loadu_ps( rows[0] + i ), _mm256_set1_ps( w[0] ) );
+        for( int k=1; k<taps; k++ )
+        {
+            sum = _mm256_add_ps( sum, _mm256_mul_ps( _mm256_loadu_ps( rows[k] + i ), _mm256_set1_ps( w[k] ) ) );
+        }
+        _mm256_storeu_ps( dst + i, sum );
+    }
+    if( i < n )
+    {
+        __m128 sum = _mm_mul_ps( _mm_loadu_ps( rows[0] + i ), _mm_set1_ps( w[0] ) );
+        for( int k=1; k<taps; k++ )
+        {
+            sum = _mm_add_ps( sum, _mm_mul_ps( _mm_loadu_ps( rows[k] + i ), _mm_set1_ps( w[k] ) ) );
+        }
+        _mm_storeu_ps( dst + i, sum );
+    }
+}
+
+void HFilter_AVX2( const float* src, const float* w, int taps, float* dst, int width )
+{
+    int x = 0;
+    for( ; x + 2 <= width; x += 2 )
+    {
+        // Output pixel x in the low lane, x+1 in the high lane, two source pixels further
+        const float* s = src + x*8;
+        __m256 sum = _mm256_mul_ps( _mm256_insertf128_ps( _mm256_castps128_ps256( _mm_loadu_ps( s ) ), _mm_loadu_ps( s + 8 ), 1 ), _mm256_set1_ps( w[0] ) );
+        for( int k=1; k<taps; k++ )
+        {
+            const __m256 p = _mm256_insertf128_ps( _mm256_castps128_ps256( _mm_loadu_ps( s + k*4 ) ), _mm_loadu_ps( s + 8 + k*4 ), 1 );
+            sum = _mm256_add_ps( sum, _mm256_mul_ps( p, _mm256_set1_ps( w[k] ) ) );
+        }
+        _mm256_storeu_ps( dst + x*4, sum );
+    }
+    if( x < width )
+    {
+        const float* s = src + x*8;
+        __m128 sum = _mm_mul_ps( _mm_loadu_ps( s ), _mm_set1_ps( w[0] ) );
+        for( int k=1; k<taps; k++ )
+        {
+            sum = _mm_add_ps( sum, _mm_mul_ps( _mm_loadu_ps( s + k*4 ), _mm_set1_ps( w[k] ) ) );
+        }
+        _mm_storeu_ps( dst + x*4, sum );
+    }
+}
+
+#ifndef _MSC_VER
+#  pragma GCC pop_options
+#endif
+
+#endif
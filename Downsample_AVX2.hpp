@@ -0,0 +1,18 @@
+#ifndef __DOWNSAMPLE_AVX2_HPP__
+#define __DOWNSAMPLE_AVX2_HPP__
+
+#ifdef __SSE4_1__
+
+#include <stddef.h>
+
+#include "Types.hpp"
+
+// Row kernels of Downsample.cpp. Pixels are four floats, in BGRA order.
+void ToLinear_AVX2( const uint32* src, float* dst, int width, const float* lut );
+void FromLinear_AVX2( const float* src, uint32* dst, int width, const uint32* lut );
+void VFilter_AVX2( const float* const* rows, const float* w, int taps, float* dst, size_t n );
+void HFilter_AVX2( const float* src, const float* w, int taps, float* dst, int width );
+
+#endif
+
+#endif
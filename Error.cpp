@@ -3,44 +3,78 @@
 
 float CalcMSE3( const Bitmap& bmp, const Bitmap& out )
 {
-    float err = 0;
+    double err = 0;
 
-    const uint32* p1 = bmp.Data();
-    const uint32* p2 = out.Data();
     size_t cnt = bmp.Size().x * bmp.Size().y;
 
-    for( size_t i=0; i<cnt; i++ )
+    // Rows are padded to whole blocks
+    for( int y=0; y<bmp.Size().y; y++ )
     {
-        uint32 c1 = *p1++;
-        uint32 c2 = *p2++;
+        const uint32* p1 = bmp.Data() + y * bmp.Stride();
+        const uint32* p2 = out.Data() + y * out.Stride();
+        for( int x=0; x<bmp.Size().x; x++ )
+        {
+            uint32 c1 = *p1++;
+            uint32 c2 = *p2++;
 
-        err += sq( ( c1 & 0x000000FF ) - ( c2 & 0x000000FF ) );
-        err += sq( ( ( c1 & 0x0000FF00 ) >> 8 ) - ( ( c2 & 0x0000FF00 ) >> 8 ) );
-        err += sq( ( ( c1 & 0x00FF0000 ) >> 16 ) - ( ( c2 & 0x00FF0000 ) >> 16 ) );
+            // Source is BGRA, decoded data is RGBA
+            err += sq( int32( c1 & 0x000000FF ) - int32( ( c2 & 0x00FF0000 ) >> 16 ) );
+            err += sq( int32( ( c1 & 0x0000FF00 ) >> 8 ) - int32( ( c2 & 0x0000FF00 ) >> 8 ) );
+            err += sq( int32( ( c1 & 0x00FF0000 ) >> 16 ) - int32( c2 & 0x000000FF ) );
+        }
     }
 
     err /= cnt * 3;
 
-    return err;
+    return float( err );
 }
 
 float CalcMSE1( const Bitmap& bmp, const Bitmap& out )
 {
-    float err = 0;
+    double err = 0;
 
-    const uint32* p1 = bmp.Data();
-    const uint32* p2 = out.Data();
     size_t cnt = bmp.Size().x * bmp.Size().y;
 
-    for( size_t i=0; i<cnt; i++ )
+    // Rows are padded to whole blocks
+    for( int y=0; y<bmp.Size().y; y++ )
     {
-        uint32 c1 = *p1++;
-        uint32 c2 = *p2++;
+        const uint32* p1 = bmp.Data() + y * bmp.Stride();
+        const uint32* p2 = out.Data() + y * out.Stride();
+        for( int x=0; x<bmp.Size().x; x++ )
+        {
+            uint32 c1 = *p1++;
+            uint32 c2 = *p2++;
 
-        err += sq( ( c1 >> 24 ) - ( c2 & 0xFF ) );
+            err += sq( ( c1 >> 24 ) - ( c2 & 0xFF ) );
+        }
     }
 
     err /= cnt;
 
-    return err;
+    return float( err );
+}
+
+float CalcMSEA( const Bitmap& bmp, const Bitmap& out )
+{
+    double err = 0;
+
+    size_t cnt = bmp.Size().x * bmp.Size().y;
+
+    // Rows are padded to whole blocks
+    for( int y=0; y<bmp.Size().y; y++ )
+    {
+        const uint32* p1 = bmp.Data() + y * bmp.Stride();
+        const uint32* p2 = out.Data() + y * out.Stride();
+        for( int x=0; x<bmp.Size().x; x++ )
+        {
+            uint32 c1 = *p1++;
+            uint32 c2 = *p2++;
+
+            err += sq( ( c1 >> 24 ) - ( c2 >> 24 ) );
+        }
+    }
+
+    err /= cnt;
+
+    return float( err );
 }
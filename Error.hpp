@@ -5,5 +5,6 @@
 
 float CalcMSE3( const Bitmap& bmp, const Bitmap& out );
 float CalcMSE1( const Bitmap& bmp, const Bitmap& out );
+float CalcMSEA( const Bitmap& bmp, const Bitmap& out );
 
 #endif
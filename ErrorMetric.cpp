@@ -0,0 +1,84 @@
+#include <algorithm>
+#include <math.h>
+#include <string.h>
+
+#include "ErrorMetric.hpp"
+
+static const ErrorWeights s_uniform = { 85, 86, 85, 43, 42, 43 };
+static const ErrorWeights s_luma = { 77, 151, 28, 38, 76, 14 };
+
+// Square of the slope of the sRGB to linear curve at each value, for the error of small changes
+struct Slopes
+{
+    Slopes()
+    {
+        for( int i=0; i<256; i++ )
+        {
+            const double c = i / 255.0;
+            const double d = c <= 0.04045 ? 1 / 12.92 : 2.4 / 1.055 * pow( ( c + 0.055 ) / 1.055, 1.4 );
+            sq[i] = float( d * d );
+        }
+    }
+
+    float sq[256];
+};
+
+static const Slopes& GetSlopes()
+{
+    static const Slopes slopes;
+    return slopes;
+}
+
+bool ParseErrorMetric( const char* name, ErrorMetric& metric )
+{
+    if( strcmp( name, "uniform" ) == 0 )
+    {
+        metric = ErrorMetric::Uniform;
+        return true;
+    }
+    if( strcmp( name, "luma" ) == 0 )
+    {
+        metric = ErrorMetric::Luma;
+        return true;
+    }
+    if( strcmp( name, "linear" ) == 0 )
+    {
+        metric = ErrorMetric::Linear;
+        return true;
+    }
+    return false;
+}
+
+static inline int32 Clamp( int32 v )
+{
+    return v < 1 ? 1 : ( v > 252 ? 252 : v );
+}
+
+ErrorWeights GetErrorWeights( const uint8* src, ErrorMetric metric )
+{
+    if( metric == ErrorMetric::Luma ) return s_luma;
+    if( metric == ErrorMetric::Uniform ) return s_uniform;
+
+    // Weighted at the block average, source pixels are BGRA
+    uint32 sum[3] = {};
+    for( int i=0; i<16; i++ )
+    {
+        sum[0] += src[i*4+2];
+        sum[1] += src[i*4+1];
+        sum[2] += src[i*4];
+    }
+    const float* sq = GetSlopes().sq;
+    const float r = 0.2126f * sq[( sum[0] + 8 ) / 16];
+    const float g = 0.7152f * sq[( sum[1] + 8 ) / 16];
+    const float b = 0.0722f * sq[( sum[2] + 8 ) / 16];
+    const float scale = 256 / ( r + g + b );
+
+    ErrorWeights w;
+    w.r = Clamp( int32( r * scale + 0.5f ) );
+    w.b = std::min( Clamp( int32( b * scale + 0.5f ) ), 255 - w.r );
+    w.g = 256 - w.r - w.b;
+    w.rh = ( w.r + 1 ) / 2;
+    w.bh = ( w.b + 1 ) / 2;
+    w.gh = 128 - w.rh - w.bh;
+    return w;
+}
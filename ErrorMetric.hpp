@@ -0,0 +1,26 @@
+#ifndef __ERRORMETRIC_HPP__
+#define __ERRORMETRIC_HPP__
+
+#include "Types.hpp"
+
+enum class ErrorMetric
+{
+    Luma,       // Channels weighted by their share of luma, the default
+    Uniform,    // Plain squared RGB error
+    Linear      // Rec. 709 weights, scaled per block by the slope of the sRGB curve to approximate linear light
+};
+
+bool ParseErrorMetric( const char* name, ErrorMetric& metric );
+
+// Channel weights of the squared error. The full weights sum to 256. The halved ones sum to 128, so that
+// weighted differences fit in 16 bits, and none is above 127.
+struct ErrorWeights
+{
+    int32 r, g, b;
+    int32 rh, gh, bh;
+};
+
+// Weights of metric for a kernel block, 16 BGRA pixels
+ErrorWeights GetErrorWeights( const uint8* src, ErrorMetric metric );
+
+#endif
@@ -0,0 +1,566 @@
+#include <algorithm>
+#include <assert.h>
+#include <mutex>
+#include <string.h>
+#include <vector>
+
+#include "BlockCache.hpp"
+#include "CpuArch.hpp"
+#include "DecodeRGB.hpp"
+#include "DecodeRGB_AVX2.hpp"
+#include "Dither.hpp"
+#include "Etcpak.hpp"
+#include "ProcessAlpha.hpp"
+#include "ProcessAlpha_AVX2.hpp"
+#include "ProcessRGB.hpp"
+#include "ProcessRGB_AVX2.hpp"
+#include "Rdo.hpp"
+#include "Refine.hpp"
+#ifdef __SSE4_1__
+#  ifdef _MSC_VER
+#    include <intrin.h>
+#  else
+#    include <x86intrin.h>
+#  endif
+#endif
+
+static uint64 _f_rgb( uint8* ptr, bool th, ErrorMetric metric )
+{
+    return ProcessRGB( ptr, metric );
+}
+
+#ifdef __SSE4_1__
+static uint64 _f_rgb_avx2( uint8* ptr, bool th, ErrorMetric metric )
+{
+    return ProcessRGB_AVX2( ptr, metric );
+}
+#endif
+
+static uint64 _f_rgb_4x2( uint8* ptr, bool th, ErrorMetric metric )
+{
+    return ProcessRGB_4x2( ptr, metric );
+}
+
+#ifdef __SSE4_1__
+static uint64 _f_rgb_4x2_avx2( uint8* ptr, bool th, ErrorMetric metric )
+{
+    return ProcessRGB_4x2_AVX2( ptr, metric );
+}
+#endif
+
+static uint64 _f_rgb_4x2_dither( uint8* ptr, bool th, ErrorMetric metric )
+{
+    Dither( ptr );
+    return ProcessRGB_4x2( ptr, metric );
+}
+
+static uint64 _f_rgb_dither( uint8* ptr, bool th, ErrorMetric metric )
+{
+    Dither( ptr );
+    return ProcessRGB( ptr, metric );
+}
+
+static uint64 _f_rgb_etc2( uint8* ptr, bool th, ErrorMetric metric )
+{
+    return ProcessRGB_ETC2( ptr, th, metric );
+}
+
+#ifdef __SSE4_1__
+static uint64 _f_rgb_etc2_avx2( uint8* ptr, bool th, ErrorMetric metric )
+{
+    return ProcessRGB_ETC2_AVX2( ptr, th, metric );
+}
+#endif
+
+static uint64 _f_rgb_etc2_dither( uint8* ptr, bool th, ErrorMetric metric )
+{
+    Dither( ptr );
+    return ProcessRGB_ETC2( ptr, th, metric );
+}
+
+#ifdef __SSE4_1__
+static void _f_rgb_avx2_x2( const uint8* ptr, uint64* dst, bool th, ErrorMetric metric )
+{
+    ProcessRGB_AVX2_x2( ptr, dst, metric );
+}
+
+static void _f_rgb_etc2_avx2_x2( const uint8* ptr, uint64* dst, bool th, ErrorMetric metric )
+{
+    ProcessRGB_ETC2_AVX2_x2( ptr, dst, th, metric );
+}
+
+static void _f_rgb_avx512_x4( const uint8* ptr, uint64* dst, bool th, ErrorMetric metric )
+{
+    ProcessRGB_AVX512_x4( ptr, dst, metric );
+}
+
+static void _f_rgb_etc2_avx512_x4( const uint8* ptr, uint64* dst, bool th, ErrorMetric metric )
+{
+    ProcessRGB_ETC2_AVX512_x4( ptr, dst, th, metric );
+}
+#endif
+
+// Largest number of blocks encoded by a single kernel call
+enum { MaxBatch = 4 };
+
+// Widest implementation of each kernel family for the instruction set tier in use
+struct KernelTable
+{
+    uint64 (*rgb)(uint8*, bool, ErrorMetric);
+    uint64 (*etc2)(uint8*, bool, ErrorMetric);
+    uint64 (*rgbDither)(uint8*, bool, ErrorMetric);
+    uint64 (*etc2Dither)(uint8*, bool, ErrorMetric);
+    uint64 (*fast)(uint8*, bool, ErrorMetric);
+    uint64 (*fastDither)(uint8*, bool, ErrorMetric);
+    void (*rgbBatch)(const uint8*, uint64*, bool, ErrorMetric);
+    void (*etc2Batch)(const uint8*, uint64*, bool, ErrorMetric);
+    uint32 batch;
+    uint64 (*alpha)(const uint8*);
+    bool ditherPairs;       // Dither_Swizzle_SSE41 on pairs of blocks, instead of the dithering kernels
+    void (*decodeRGB)(const uint64*, uint32*, uint32, size_t);
+    void (*decodeRGBA)(const uint64*, uint32*, uint32, size_t);
+};
+
+static KernelTable ResolveKernels()
+{
+    KernelTable t = { _f_rgb, _f_rgb_etc2, _f_rgb_dither, _f_rgb_etc2_dither, _f_rgb_4x2, _f_rgb_4x2_dither, nullptr, nullptr, 1, ProcessAlpha_ETC2, false, DecodeRGB, DecodeRGBA };
+
+#ifdef __SSE4_1__
+    // The SSE 4.1 tier shares the functions above, which have their SIMD code compiled in
+    t.ditherPairs = true;
+    t.rgbDither = t.etc2Dither = t.fastDither = nullptr;
+
+    const auto isa = cpu_isa();
+    if( isa >= CpuIsa::AVX2 )
+    {
+        t.rgb = _f_rgb_avx2;
+        t.etc2 = _f_rgb_etc2_avx2;
+        t.fast = _f_rgb_4x2_avx2;
+        t.rgbBatch = _f_rgb_avx2_x2;
+        t.etc2Batch = _f_rgb_etc2_avx2_x2;
+        t.batch = 2;
+        t.alpha = ProcessAlpha_ETC2_AVX2;
+        t.decodeRGB = DecodeRGB_AVX2;
+        t.decodeRGBA = DecodeRGBA_AVX2;
+    }
+    if( isa >= CpuIsa::AVX512 )
+    {
+        t.rgbBatch = _f_rgb_avx512_x4;
+        t.etc2Batch = _f_rgb_etc2_avx512_x4;
+        t.batch = 4;
+    }
+#endif
+
+    return t;
+}
+
+// Resolved on first use, after any cpu_force_isa() call
+static const KernelTable& GetKernelTable()
+{
+    static const KernelTable table = ResolveKernels();
+    return table;
+}
+
+struct Kernels
+{
+    uint64 (*func)(uint8*, bool, ErrorMetric);
+    uint64 (*funcAlpha)(const uint8*);
+    void (*funcBatch)(const uint8*, uint64*, bool, ErrorMetric);
+    uint32 batch;
+    bool refine;
+};
+
+// Encodes num gathered blocks, in groups of k.batch where possible, and interleaves the alpha blocks. Blocks
+// found in the cache are copied from it, the others are moved to the front of buf and buf8 and encoded.
+static uint64* Encode( uint32* buf, uint8* buf8, uint32 num, uint64* dst, const Kernels& k, bool th, ErrorMetric metric, BlockCache& cache )
+{
+    uint64 words[MaxBatch][2];
+    uint64 hash[MaxBatch];
+    uint32 miss[MaxBatch];
+    uint32 misses = 0;
+    for( uint32 i=0; i<num; i++ )
+    {
+        const uint8* alpha = k.funcAlpha ? buf8 + i*16 : nullptr;
+        hash[i] = BlockCache::Hash( buf + i*16, alpha );
+        if( cache.Find( hash[i], buf + i*16, alpha, words[i] ) ) continue;
+        if( misses != i )
+        {
+            memcpy( buf + misses*16, buf + i*16, 64 );
+            if( alpha ) memcpy( buf8 + misses*16, alpha, 16 );
+        }
+        miss[misses++] = i;
+    }
+
+    uint64 rgb[MaxBatch];
+    uint32 i = 0;
+    if( k.funcBatch )
+    {
+        for( ; i + k.batch <= misses; i += k.batch )
+        {
+            k.funcBatch( (const uint8*)( buf + i*16 ), rgb + i, th, metric );
+        }
+    }
+    for( ; i<misses; i++ )
+    {
+        rgb[i] = k.func( (uint8*)( buf + i*16 ), th, metric );
+    }
+    for( i=0; i<misses; i++ )
+    {
+        auto& w = words[miss[i]];
+        w[0] = k.funcAlpha ? k.funcAlpha( buf8 + i*16 ) : 0;
+        w[1] = k.refine ? RefineRGB( (const uint8*)( buf + i*16 ), rgb[i], metric ) : rgb[i];
+        cache.Insert( hash[miss[i]], buf + i*16, k.funcAlpha ? buf8 + i*16 : nullptr, w );
+    }
+
+    for( i=0; i<num; i++ )
+    {
+        if( k.funcAlpha ) *dst++ = words[i][0];
+        *dst++ = words[i][1];
+    }
+    return dst;
+}
+
+// Source pixel in the BGRA order expected by the kernels
+static inline uint32 Load( const uint32* src, bool rgba )
+{
+    const uint32 v = *src;
+    return rgba ? ( v & 0xFF00FF00 ) | ( ( v & 0xFF ) << 16 ) | ( ( v >> 16 ) & 0xFF ) : v;
+}
+
+// Blocks are stored column by column, alpha is spread to the color channels when it is compressed alone
+static inline void Gather( const uint32* src, size_t stride, uint32* dst, bool rgba, bool alpha )
+{
+    for( int x=0; x<4; x++ )
+    {
+        for( int y=0; y<4; y++ )
+        {
+            *dst++ = Load( src + y * stride + x, rgba );
+        }
+    }
+    if( alpha )
+    {
+        dst -= 16;
+        for( int i=0; i<16; i++ )
+        {
+            const uint32 a = dst[i] >> 24;
+            dst[i] = a | ( a << 8 ) | ( a << 16 );
+        }
+    }
+}
+
+// The undithered source is the reference for the rate-distortion pass
+static void Rdo( const uint32* src, uint64* dst, uint32 blocks, size_t width, size_t stride, bool alpha, bool rgba, float lambda, ErrorMetric metric )
+{
+    std::vector<uint32> px( size_t( blocks ) * 16 );
+    size_t w = 0;
+    for( uint32 i=0; i<blocks; i++ )
+    {
+        Gather( src, stride, px.data() + size_t( i ) * 16, rgba, alpha );
+        src += 4;
+        if( ++w == width/4 )
+        {
+            src += stride * 4 - width;
+            w = 0;
+        }
+    }
+    RdoEtc1( px.data(), dst, blocks, uint32( width / 4 ), lambda, metric );
+}
+
+#ifdef __SSE4_1__
+// Dithered rows of a block back to the column order of the kernels, in BGRA
+static inline void Transpose( const uint32* rows, uint32* dst, bool rgba )
+{
+    const __m128i r0 = _mm_load_si128( (const __m128i*)rows );
+    const __m128i r1 = _mm_load_si128( (const __m128i*)rows + 1 );
+    const __m128i r2 = _mm_load_si128( (const __m128i*)rows + 2 );
+    const __m128i r3 = _mm_load_si128( (const __m128i*)rows + 3 );
+
+    const __m128i t0 = _mm_unpacklo_epi32( r0, r1 );
+    const __m128i t1 = _mm_unpacklo_epi32( r2, r3 );
+    const __m128i t2 = _mm_unpackhi_epi32( r0, r1 );
+    const __m128i t3 = _mm_unpackhi_epi32( r2, r3 );
+
+    __m128i c0 = _mm_unpacklo_epi64( t0, t1 );
+    __m128i c1 = _mm_unpackhi_epi64( t0, t1 );
+    __m128i c2 = _mm_unpacklo_epi64( t2, t3 );
+    __m128i c3 = _mm_unpackhi_epi64( t2, t3 );
+
+    if( rgba )
+    {
+        const __m128i swap = _mm_setr_epi8( 2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15 );
+        c0 = _mm_shuffle_epi8( c0, swap );
+        c1 = _mm_shuffle_epi8( c1, swap );
+        c2 = _mm_shuffle_epi8( c2, swap );
+        c3 = _mm_shuffle_epi8( c3, swap );
+    }
+
+    _mm_store_si128( (__m128i*)dst, c0 );
+    _mm_store_si128( (__m128i*)dst + 1, c1 );
+    _mm_store_si128( (__m128i*)dst + 2, c2 );
+    _mm_store_si128( (__m128i*)dst + 3, c3 );
+}
+
+// Dithers two neighbouring blocks at a time straight from the source rows, then runs the non-dithering
+// kernels. The dither quantizes all channels equally, so it doesn't matter if red and blue are swapped.
+static void CompressBlocksDither( const uint32* src, uint64* dst, uint32 blocks, size_t width, size_t stride, const Kernels& k, bool th, ErrorMetric metric, bool rgba, BlockCache& cache )
+{
+    alignas(16) uint32 pad[4*8];
+    alignas(16) uint32 rows[2][4*4];
+    alignas(32) uint32 buf[MaxBatch*16];
+    uint8 buf8[MaxBatch*16];
+    uint32 gathered = 0;
+    size_t w = 0;
+
+    do
+    {
+        // A lone block at the end of a block row is paired with a copy of itself
+        const uint32 num = ( blocks > 1 && w + 2 <= width/4 ) ? 2 : 1;
+        if( num == 2 )
+        {
+            Dither_Swizzle_SSE41( (const uint8*)src, stride * 4, (uint8*)rows[0], (uint8*)rows[1] );
+        }
+        else
+        {
+            for( int y=0; y<4; y++ )
+            {
+                memcpy( pad + y*8, src + y * stride, 16 );
+                memcpy( pad + y*8 + 4, src + y * stride, 16 );
+            }
+            Dither_Swizzle_SSE41( (const uint8*)pad, 32, (uint8*)rows[0], (uint8*)rows[1] );
+        }
+
+        for( uint32 i=0; i<num; i++ )
+        {
+            Transpose( rows[i], buf + gathered*16, rgba );
+            if( k.funcAlpha )
+            {
+                auto ptr = buf8 + gathered*16;
+                for( int x=0; x<4; x++ )
+                {
+                    for( int y=0; y<4; y++ )
+                    {
+                        *ptr++ = src[y * stride + i*4 + x] >> 24;
+                    }
+                }
+            }
+            gathered++;
+        }
+
+        src += 4 * num;
+        w += num;
+        if( w == width/4 )
+        {
+            src += stride * 4 - width;
+            w = 0;
+        }
+        blocks -= num;
+
+        if( gathered + 2 > MaxBatch || blocks == 0 )
+        {
+            dst = Encode( buf, buf8, gathered, dst, k, th, metric, cache );
+            gathered = 0;
+        }
+    }
+    while( blocks );
+}
+#endif
+
+uint32 CompressBlocks( const uint32* src, uint64* dst, uint32 blocks, size_t width, size_t stride, BlockData::Type type, Channels channels, bool dither, int effort, float rdo, ErrorMetric metric, bool rgba )
+{
+    assert( type != BlockData::Etc2_RGBA || channels == Channels::RGB );
+
+    if( rdo > 0 && type == BlockData::Etc1 )
+    {
+        const uint32 reused = CompressBlocks( src, dst, blocks, width, stride, type, channels, dither, effort, 0, metric, rgba );
+        Rdo( src, dst, blocks, width, stride, channels == Channels::Alpha, rgba, rdo, metric );
+        return reused;
+    }
+
+    alignas(32) uint32 buf[MaxBatch*16];
+    uint8 buf8[MaxBatch*16];
+    size_t w = 0;
+    const bool etc2 = type != BlockData::Etc1;
+    const bool alpha = channels == Channels::Alpha;
+    if( alpha ) dither = false;
+
+    const auto& t = GetKernelTable();
+
+    // Dithering is done separately, two blocks at a time
+    const bool ditherPairs = dither && t.ditherPairs;
+    if( ditherPairs ) dither = false;
+
+    // Neighbouring blocks are encoded together, one per vector lane. The fast kernel is an ETC1 one, which
+    // also makes valid ETC2 blocks.
+    Kernels k;
+    if( effort == EffortFast )
+    {
+        k.func = dither ? t.fastDither : t.fast;
+        k.funcBatch = nullptr;
+    }
+    else if( etc2 )
+    {
+        k.func = dither ? t.etc2Dither : t.etc2;
+        k.funcBatch = t.etc2Batch;
+    }
+    else
+    {
+        k.func = dither ? t.rgbDither : t.rgb;
+        k.funcBatch = t.rgbBatch;
+    }
+    k.funcAlpha = type == BlockData::Etc2_RGBA ? t.alpha : nullptr;
+    k.batch = t.batch;
+    k.refine = effort >= EffortRefine;
+
+    // The kernels only tell whether to try T and H modes
+    const bool th = effort >= EffortTH;
+
+    BlockCache cache( blocks );
+
+#ifdef __SSE4_1__
+    if( ditherPairs )
+    {
+        CompressBlocksDither( src, dst, blocks, width, stride, k, th, metric, rgba, cache );
+        return cache.Hits();
+    }
+#endif
+
+    do
+    {
+        const uint32 num = std::min<uint32>( k.batch, blocks );
+        for( uint32 n=0; n<num; n++ )
+        {
+            auto ptr = buf + n*16;
+            Gather( src, stride, ptr, rgba, alpha );
+            src += 4;
+            if( ++w == width/4 )
+            {
+                src += stride * 4 - width;
+                w = 0;
+            }
+
+            if( k.funcAlpha )
+            {
+                for( int i=0; i<16; i++ )
+                {
+                    buf8[n*16+i] = ptr[i] >> 24;
+                }
+            }
+        }
+
+        dst = Encode( buf, buf8, num, dst, k, th, metric, cache );
+        blocks -= num;
+    }
+    while( blocks );
+
+    return cache.Hits();
+}
+
+size_t EtcCompressedSize( uint32 width, uint32 height, BlockData::Type type )
+{
+    const size_t blockSize = type == BlockData::Etc2_RGBA ? 16 : 8;
+    return size_t( ( width + 3 ) / 4 ) * ( ( height + 3 ) / 4 ) * blockSize;
+}
+
+// Work is split into groups of block rows
+enum { RowsPerJob = 8 };
+
+static void Run( uint32 rows, const EtcExecutor& executor, const std::function<void( uint32 )>& job )
+{
+    const uint32 jobs = ( rows + RowsPerJob - 1 ) / RowsPerJob;
+    if( executor )
+    {
+        executor( jobs, job );
+    }
+    else
+    {
+        for( uint32 i=0; i<jobs; i++ )
+        {
+            job( i );
+        }
+    }
+}
+
+void EtcCompress( const uint32* src, uint32 width, uint32 height, size_t stride, void* dst, const EtcParams& params, const EtcExecutor& executor )
+{
+    assert( stride >= width );
+    if( width == 0 || height == 0 ) return;
+
+    if( params.dither )
+    {
+        static std::once_flag ditherInit;
+        std::call_once( ditherInit, InitDither );
+    }
+
+    const uint32 bw = ( width + 3 ) / 4;
+    const uint32 bh = ( height + 3 ) / 4;
+    const size_t words = params.type == BlockData::Etc2_RGBA ? 2 : 1;
+
+    Run( bh, executor, [=]( uint32 job )
+    {
+        const uint32 y = job * RowsPerJob;
+        const uint32 rows = std::min<uint32>( RowsPerJob, bh - y );
+        const uint32* ptr = src + size_t( y ) * 4 * stride;
+        size_t pitch = stride;
+        size_t w = width;
+
+        // Partial blocks are filled by repeating the edge pixels, in a copy of the rows of the job
+        std::vector<uint32> pad;
+        if( width % 4 != 0 || ( y + rows ) * 4 > height )
+        {
+            pitch = w = size_t( bw ) * 4;
+            pad.resize( pitch * rows * 4 );
+            for( uint32 i=0; i<rows*4; i++ )
+            {
+                const uint32* line = ptr + std::min<size_t>( i, height - 1 - size_t( y ) * 4 ) * stride;
+                uint32* out = pad.data() + i * pitch;
+                memcpy( out, line, width * sizeof( uint32 ) );
+                for( uint32 x=width; x<pitch; x++ ) out[x] = line[width-1];
+            }
+            ptr = pad.data();
+        }
+
+        CompressBlocks( ptr, (uint64*)dst + size_t( y ) * bw * words, bw * rows, w, pitch, params.type, params.channels, params.dither, params.effort, params.rdo, params.metric, true );
+    } );
+}
+
+void EtcDecompress( const void* src, uint32 width, uint32 height, BlockData::Type type, uint32* dst, size_t stride, const EtcExecutor& executor )
+{
+    assert( stride >= width );
+    if( width == 0 || height == 0 ) return;
+
+    const bool alpha = type == BlockData::Etc2_RGBA;
+    const uint32 bw = ( width + 3 ) / 4;
+    const uint32 bh = ( height + 3 ) / 4;
+    const size_t words = alpha ? bw * 2 : bw;
+
+    const auto& t = GetKernelTable();
+    const auto func = alpha ? t.decodeRGBA : t.decodeRGB;
+
+    Run( bh, executor, [=]( uint32 job )
+    {
+        const uint32 y0 = job * RowsPerJob;
+        const uint32 y1 = std::min<uint32>( y0 + RowsPerJob, bh );
+
+        // Block rows that don't fit in dst are decoded to a scratch row, of which only the pixels inside the
+        // image are stored
+        std::vector<uint32> pad;
+        for( uint32 y=y0; y<y1; y++ )
+        {
+            uint32* out = dst + size_t( y ) * 4 * stride;
+            if( width % 4 == 0 && ( y + 1 ) * 4 <= height )
+            {
+                func( (const uint64*)src + y * words, out, bw, stride );
+                continue;
+            }
+
+            const size_t pitch = size_t( bw ) * 4;
+            pad.resize( pitch * 4 );
+            func( (const uint64*)src + y * words, pad.data(), bw, pitch );
+            const uint32 lines = std::min<uint32>( 4, height - y * 4 );
+            for( uint32 i=0; i<lines; i++ )
+            {
+                memcpy( out + i * stride, pad.data() + i * pitch, width * sizeof( uint32 ) );
+            }
+        }
+    } );
+}
@@ -0,0 +1,56 @@
+#ifndef __ETCPAK_HPP__
+#define __ETCPAK_HPP__
+
+#include <functional>
+#include <stddef.h>
+
+#include "Bitmap.hpp"
+#include "BlockData.hpp"
+#include "ErrorMetric.hpp"
+#include "Types.hpp"
+
+// In-memory compression interface. Nothing here touches the disk or the TaskDispatch singleton.
+
+// Encoding effort levels, each one slower than the one before
+enum
+{
+    EffortFast = 0,         // Only the 4x2 sub-block layouts, ETC2 without planar, T and H modes
+    EffortDefault = 1,
+    EffortTH = 2,           // Also ETC2 T and H modes
+    EffortRefine = 3,       // Also an exhaustive search around the result, see RefineRGB
+    EffortMax = EffortRefine
+};
+
+struct EtcParams
+{
+    BlockData::Type type;
+    Channels channels;      // Alpha compresses the alpha channel as a grayscale Etc1 or Etc2_RGB texture
+    bool dither;
+    int effort;             // One of the Effort levels
+    float rdo;              // Rate-distortion lambda for Etc1, 0 disables. See CompressBlocks.
+    ErrorMetric metric;     // What the color block search minimizes
+};
+
+// Calls job( i ) for each i in [0, count), possibly in parallel, and returns once all of them are done.
+// Lets the caller plug in its own thread pool.
+typedef std::function<void( uint32 count, const std::function<void( uint32 )>& job )> EtcExecutor;
+
+size_t EtcCompressedSize( uint32 width, uint32 height, BlockData::Type type );
+
+// src holds RGBA pixels (red in the lowest byte), stride is in pixels. Blocks that cross the right or bottom
+// edge are filled by repeating the edge pixels. Blocks are written in row order to dst, which must hold
+// EtcCompressedSize() bytes. Without an executor the work is done on the calling thread.
+void EtcCompress( const uint32* src, uint32 width, uint32 height, size_t stride, void* dst, const EtcParams& params, const EtcExecutor& executor = nullptr );
+
+// Decodes blocks produced by EtcCompress into RGBA pixels, stride is in pixels. Only the pixels inside
+// width and height are written.
+void EtcDecompress( const void* src, uint32 width, uint32 height, BlockData::Type type, uint32* dst, size_t stride, const EtcExecutor& executor = nullptr );
+
+// Compresses a run of blocks going across block rows of a width pixels wide image. Source pixels are
+// BGRA, unless rgba is set. A positive rdo trades Etc1 quality for smaller LZ compressed output: a block
+// may repeat parts of its neighbours when that adds less than rdo squared error per bit saved. The color
+// kernels weight their errors by metric. Blocks repeated within the run are encoded once, the number of
+// copies is returned.
+uint32 CompressBlocks( const uint32* src, uint64* dst, uint32 blocks, size_t width, size_t stride, BlockData::Type type, Channels channels, bool dither, int effort, float rdo, ErrorMetric metric, bool rgba );
+
+#endif
@@ -81,6 +81,16 @@ inline T sq( T val )
     return val * val;
 }
 
+inline uint32 ByteSwap32( uint32 v )
+{
+    return ( v >> 24 ) | ( ( v >> 8 ) & 0xFF00 ) | ( ( v << 8 ) & 0xFF0000 ) | ( v << 24 );
+}
+
+inline uint64 ByteSwap64( uint64 v )
+{
+    return ( uint64( ByteSwap32( uint32( v ) ) ) << 32 ) | ByteSwap32( uint32( v >> 32 ) );
+}
+
 static inline int mul8bit( int a, int b )
 {
     int t = a*b + 128;
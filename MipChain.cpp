@@ -0,0 +1,215 @@
+#include <algorithm>
+#include <assert.h>
+#include <string.h>
+
+#include "MipChain.hpp"
+#include "TaskDispatch.hpp"
+
+// Output rows per job
+enum { BandRows = 64 };
+
+MipChain::MipChain( uint lines, MipFilter filter )
+    : m_lines( lines )
+    , m_filter( filter )
+    , m_src( nullptr )
+    , m_srcStride( 0 )
+    , m_rows( 0 )
+{
+}
+
+void MipChain::Init( const v2i& size )
+{
+    m_size = size;
+    v2i current = size;
+    uint lines = m_lines;
+    uint offset = uint( ( size.x + 3 ) / 4 ) * ( ( size.y + 3 ) / 4 );
+    while( current.x != 1 || current.y != 1 )
+    {
+        Level level;
+        level.size = v2i( std::max( 1, current.x / 2 ), std::max( 1, current.y / 2 ) );
+        level.stride = ( level.size.x + 3 ) & ~3;
+        level.data.resize( size_t( level.stride ) * ( ( level.size.y + 3 ) & ~3 ) );
+        lines *= 2;
+        level.lines = lines;
+        level.offset = offset;
+        level.parted = 0;
+        level.queued = 0;
+        level.ready = 0;
+        level.done.resize( ( level.size.y + BandRows - 1 ) / BandRows, false );
+        offset += uint( level.stride / 4 ) * ( ( level.size.y + 3 ) / 4 );
+        current = level.size;
+        m_levels.emplace_back( std::move( level ) );
+    }
+}
+
+void MipChain::Push( const uint32* src, const v2i& size, size_t stride )
+{
+    std::lock_guard<std::mutex> lock( m_lock );
+    if( m_rows == 0 )
+    {
+        Init( size );
+        m_src = src;
+        m_srcStride = stride;
+    }
+    assert( src == m_src + m_rows * stride );
+    m_rows += std::min( 4, size.y - m_rows );
+}
+
+void MipChain::Queue()
+{
+    if( !TaskDispatch::Available() )
+    {
+        for(;;)
+        {
+            {
+                std::lock_guard<std::mutex> lock( m_lock );
+                Collect();
+            }
+            if( !RunNext() ) return;
+        }
+    }
+
+    size_t num;
+    {
+        std::lock_guard<std::mutex> lock( m_lock );
+        num = Collect();
+    }
+    if( num == 0 ) return;
+    m_cvBands.notify_all();
+
+    // Each job runs whichever band is next, NextPart may have taken some already. A finished band may
+    // complete the rows that bands of the next level wait for.
+    for( size_t i=0; i<num; i++ )
+    {
+        TaskDispatch::Queue( [this]() { if( RunNext() ) Queue(); } );
+    }
+}
+
+// Adds the bands whose source rows are all finished, called with the lock held. Returns how many.
+size_t MipChain::Collect()
+{
+    const size_t num = m_bands.size();
+    for( size_t i=0; i<m_levels.size(); i++ )
+    {
+        auto& level = m_levels[i];
+        const int srcRows = i == 0 ? m_rows : m_levels[i-1].ready;
+        const int srcHeight = i == 0 ? m_size.y : m_levels[i-1].size.y;
+        while( level.queued < level.size.y )
+        {
+            const int y1 = std::min( level.queued + BandRows, level.size.y );
+            if( DownsampleRows( y1, srcHeight, m_filter ) > srcRows ) break;
+            m_bands.push_back( { i, level.queued, y1 } );
+            level.queued = y1;
+        }
+    }
+    return m_bands.size() - num;
+}
+
+bool MipChain::RunNext()
+{
+    Band band;
+    {
+        std::lock_guard<std::mutex> lock( m_lock );
+        if( m_bands.empty() ) return false;
+        band = m_bands.front();
+        m_bands.pop_front();
+    }
+    Run( band );
+    return true;
+}
+
+void MipChain::Run( const Band& band )
+{
+    // Finished rows above are not written anymore, so they are read without the lock
+    auto& level = m_levels[band.level];
+    if( band.level == 0 )
+    {
+        Downsample( m_src, m_size, m_srcStride, level.data.data(), level.size, level.stride, band.y0, band.y1, m_filter );
+    }
+    else
+    {
+        const auto& src = m_levels[band.level-1];
+        Downsample( src.data.data(), src.size, src.stride, level.data.data(), level.size, level.stride, band.y0, band.y1, m_filter );
+    }
+
+    // Partial blocks repeat the edge pixels, so that the padding doesn't pull the encoded colors towards black
+    for( int y=band.y0; y<band.y1; y++ )
+    {
+        auto row = level.data.data() + size_t( y ) * level.stride;
+        for( int x=level.size.x; x<level.stride; x++ )
+        {
+            row[x] = row[level.size.x-1];
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> lock( m_lock );
+        level.done[band.y0 / BandRows] = true;
+        while( level.ready < level.size.y && level.done[level.ready / BandRows] )
+        {
+            level.ready = std::min( level.ready + BandRows, level.size.y );
+        }
+        Emit( level );
+    }
+    m_cvBands.notify_all();
+}
+
+// Called with the lock held
+void MipChain::Emit( Level& level )
+{
+    const bool complete = level.ready == level.size.y;
+    uint rows = level.ready / 4;
+    if( complete )
+    {
+        const int h = ( level.size.y + 3 ) & ~3;
+        for( int y=level.size.y; y<h; y++ )
+        {
+            memcpy( level.data.data() + size_t( y ) * level.stride, level.data.data() + size_t( level.size.y - 1 ) * level.stride, level.stride * sizeof( uint32 ) );
+        }
+        rows = h / 4;
+    }
+
+    while( rows - level.parted >= level.lines || ( complete && level.parted < rows ) )
+    {
+        const uint lines = std::min( level.lines, rows - level.parted );
+        const DataPart part = {
+            level.data.data() + size_t( level.parted ) * 4 * level.stride,
+            uint( level.stride ),
+            lines,
+            level.offset + level.parted * ( level.stride / 4 )
+        };
+        level.parted += lines;
+        m_parts.push_back( part );
+    }
+}
+
+DataPart MipChain::NextPart()
+{
+    DataPart part;
+    if( TryNextPart( part ) ) return part;
+
+    // Only mip parts are left. Bands that no job has started yet are run here, so that the compression
+    // jobs queued before them don't have to finish first. Bands running elsewhere are waited for.
+    Queue();
+    for(;;)
+    {
+        if( TryNextPart( part ) ) return part;
+        if( RunNext() )
+        {
+            Queue();
+            continue;
+        }
+        std::unique_lock<std::mutex> lock( m_lock );
+        assert( m_parts.empty() );
+        m_cvBands.wait( lock, [this]{ return !m_parts.empty() || !m_bands.empty(); } );
+    }
+}
+
+bool MipChain::TryNextPart( DataPart& part )
+{
+    std::lock_guard<std::mutex> lock( m_lock );
+    if( m_parts.empty() ) return false;
+    part = m_parts.front();
+    m_parts.pop_front();
+    return true;
+}
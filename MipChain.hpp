@@ -0,0 +1,76 @@
+#ifndef __MIPCHAIN_HPP__
+#define __MIPCHAIN_HPP__
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <vector>
+
+#include "DataProvider.hpp"
+#include "Downsample.hpp"
+#include "Types.hpp"
+#include "Vector.hpp"
+
+// Builds all mip levels below the source while it loads. Each level is filtered in bands of rows, as jobs on
+// the task dispatcher, as soon as the rows of the level above that a band reads are finished. The finished
+// block rows of every level are handed out as parts.
+class MipChain
+{
+public:
+    // Parts of level n have lines << n block rows, as the source parts have lines
+    MipChain( uint lines, MipFilter filter );
+
+    // A block row of the source, the rows below the image are skipped. Called by the loader, in order. The
+    // source must stay in memory until the chain is done.
+    void Push( const uint32* src, const v2i& size, size_t stride );
+
+    // Starts the bands that the loaded rows allow. Called by the thread that takes the parts: bands run as
+    // jobs if it is one of the task dispatcher's threads, and right away otherwise.
+    void Queue();
+
+    // Next finished part of any level. Once the whole source is pushed, runs or waits for the bands the next
+    // part needs, but not for other jobs on the task dispatcher.
+    DataPart NextPart();
+    bool TryNextPart( DataPart& part );
+
+private:
+    struct Level
+    {
+        v2i size;
+        int stride;
+        std::vector<uint32> data;
+        uint lines;
+        uint offset;        // Of the first block of the level, in the output
+        uint parted;        // Block rows handed out as parts
+        int queued;         // Rows of the bands started so far
+        int ready;          // Rows finished, from the top
+        std::vector<bool> done;     // Bands finished, in any order
+    };
+
+    struct Band
+    {
+        size_t level;
+        int y0, y1;
+    };
+
+    void Init( const v2i& size );
+    size_t Collect();
+    bool RunNext();
+    void Run( const Band& band );
+    void Emit( Level& level );
+
+    uint m_lines;
+    MipFilter m_filter;
+    const uint32* m_src;
+    size_t m_srcStride;
+    v2i m_size;
+    int m_rows;
+    std::vector<Level> m_levels;
+
+    std::deque<Band> m_bands;       // Collected, not started yet
+    std::deque<DataPart> m_parts;
+    std::mutex m_lock;
+    std::condition_variable m_cvBands;      // Signalled when bands were collected or finished
+};
+
+#endif
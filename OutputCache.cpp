@@ -0,0 +1,162 @@
+#include <algorithm>
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+#include "OutputCache.hpp"
+#include "RowHashes.hpp"
+#include "System.hpp"
+#include "Timing.hpp"
+
+enum { Magic = 0x43505445 };    // "ETPC"
+// Must be bumped whenever the encoder output changes, as old entries would still be hit
+enum { Version = 2 };
+
+static const char* Extension = ".etcpak";
+
+struct EntryHeader
+{
+    uint32 magic;
+    uint32 files;
+    uint64 size[2];
+};
+
+static bool ReadFile( const char* fn, std::vector<uint8>& data )
+{
+    FILE* f = fopen( fn, "rb" );
+    if( !f ) return false;
+    fseek( f, 0, SEEK_END );
+    const long len = ftell( f );
+    fseek( f, 0, SEEK_SET );
+    bool ok = len >= 0;
+    if( ok )
+    {
+        data.resize( size_t( len ) );
+        ok = fread( data.data(), 1, data.size(), f ) == data.size();
+    }
+    fclose( f );
+    return ok;
+}
+
+// Copies the next size bytes of src to a new file
+static bool CopyTo( FILE* src, const char* fn, uint64 size )
+{
+    FILE* dst = fopen( fn, "wb" );
+    if( !dst ) return false;
+    char buf[64*1024];
+    bool ok = true;
+    while( ok && size > 0 )
+    {
+        const size_t len = size_t( std::min<uint64>( size, sizeof( buf ) ) );
+        ok = fread( buf, 1, len, src ) == len && fwrite( buf, 1, len, dst ) == len;
+        size -= len;
+    }
+    return fclose( dst ) == 0 && ok;
+}
+
+OutputCache::OutputCache( const char* dir, uint64 limit )
+    : m_dir( dir )
+    , m_limit( limit )
+    , m_hits( 0 )
+{
+    System::MakeDirectory( dir );
+}
+
+std::string OutputCache::Key( const char* input, uint64 settings ) const
+{
+    std::vector<uint8> data;
+    if( !ReadFile( input, data ) ) return std::string();
+
+    const uint64 key[] = { Version, settings, data.size(), RowHashes::Hash( data.data(), data.size() ) };
+    char str[17];
+    snprintf( str, sizeof( str ), "%016llx", (unsigned long long)RowHashes::Hash( key, sizeof( key ) ) );
+    return str;
+}
+
+bool OutputCache::Fetch( const std::string& key, const char* out, const char* outa )
+{
+    const auto path = Path( key );
+    FILE* f = fopen( path.c_str(), "rb" );
+    if( !f ) return false;
+
+    // A truncated entry is treated as missing and replaced by the next store
+    EntryHeader hdr;
+    uint64 size, mtime;
+    bool ok = fread( &hdr, 1, sizeof( hdr ), f ) == sizeof( hdr ) &&
+        hdr.magic == Magic &&
+        ( hdr.files == 1 || hdr.files == 2 ) &&
+        System::FileInfo( path.c_str(), size, mtime ) &&
+        size == sizeof( hdr ) + hdr.size[0] + ( hdr.files == 2 ? hdr.size[1] : 0 );
+    ok = ok && CopyTo( f, out, hdr.size[0] );
+    ok = ok && ( hdr.files == 1 || CopyTo( f, outa, hdr.size[1] ) );
+    fclose( f );
+    if( !ok ) return false;
+
+    System::Touch( path.c_str() );
+    m_hits++;
+    return true;
+}
+
+bool OutputCache::Store( const std::string& key, const char* out, const char* outa )
+{
+    std::vector<uint8> data[2];
+    if( !ReadFile( out, data[0] ) ) return false;
+    if( outa && !ReadFile( outa, data[1] ) ) return false;
+
+    // Written under a temporary name, so that other runs sharing the directory never see a partial entry
+    const auto path = Path( key );
+    const auto tmp = path + ".tmp" + std::to_string( GetTime() );
+    FILE* f = fopen( tmp.c_str(), "wb" );
+    if( !f ) return false;
+
+    const EntryHeader hdr = { Magic, outa ? 2u : 1u, { data[0].size(), data[1].size() } };
+    bool ok = fwrite( &hdr, 1, sizeof( hdr ), f ) == sizeof( hdr );
+    for( auto& v : data )
+    {
+        ok = ok && fwrite( v.data(), 1, v.size(), f ) == v.size();
+    }
+    ok = fclose( f ) == 0 && ok;
+    if( !ok || rename( tmp.c_str(), path.c_str() ) != 0 )
+    {
+        // Renaming fails on Windows if another run stored the same entry first
+        remove( tmp.c_str() );
+        return false;
+    }
+    return true;
+}
+
+void OutputCache::Evict()
+{
+    struct Entry
+    {
+        std::string path;
+        uint64 size;
+        uint64 mtime;
+    };
+
+    std::vector<Entry> entries;
+    uint64 total = 0;
+    const size_t ext = strlen( Extension );
+    for( auto& fn : System::ListFiles( m_dir.c_str() ) )
+    {
+        if( fn.size() <= ext || fn.compare( fn.size() - ext, ext, Extension ) != 0 ) continue;
+        Entry e;
+        if( !System::FileInfo( fn.c_str(), e.size, e.mtime ) ) continue;
+        e.path = fn;
+        total += e.size;
+        entries.emplace_back( std::move( e ) );
+    }
+    if( total <= m_limit ) return;
+
+    std::sort( entries.begin(), entries.end(), []( const Entry& a, const Entry& b ) { return a.mtime < b.mtime || ( a.mtime == b.mtime && a.path < b.path ); } );
+    for( auto& e : entries )
+    {
+        if( total <= m_limit ) break;
+        if( remove( e.path.c_str() ) == 0 ) total -= e.size;
+    }
+}
+
+std::string OutputCache::Path( const std::string& key ) const
+{
+    return m_dir + "/" + key + Extension;
+}
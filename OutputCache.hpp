@@ -0,0 +1,38 @@
+#ifndef __OUTPUTCACHE_HPP__
+#define __OUTPUTCACHE_HPP__
+
+#include <string>
+
+#include "Types.hpp"
+
+// Compressed files of earlier runs, kept in a directory and keyed by a hash of the input file and the
+// settings. A hit is copied to the outputs without decoding the image. Each entry holds the color file and,
+// if there was one, the separate alpha file, so that both are published and evicted together. Once the
+// directory grows over its limit, the least recently used entries are removed.
+class OutputCache
+{
+public:
+    OutputCache( const char* dir, uint64 limit );
+
+    // Key of the input file with the given hash of the settings, empty if the file can't be read
+    std::string Key( const char* input, uint64 settings ) const;
+
+    // Writes the entry to out and, if it has an alpha file, to outa
+    bool Fetch( const std::string& key, const char* out, const char* outa );
+    // Adds the finished output files, outa is null without a separate alpha file
+    bool Store( const std::string& key, const char* out, const char* outa );
+
+    // Removes the least recently used entries until the directory fits in the limit
+    void Evict();
+
+    uint32 Hits() const { return m_hits; }
+
+private:
+    std::string Path( const std::string& key ) const;
+
+    std::string m_dir;
+    uint64 m_limit;
+    uint32 m_hits;
+};
+
+#endif
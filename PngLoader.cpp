@@ -0,0 +1,417 @@
+#include <algorithm>
+#include <assert.h>
+#include <atomic>
+#include <string.h>
+#include <thread>
+#include <vector>
+
+#include "zlib/zlib.h"
+
+#include "PngLoader.hpp"
+#include "Semaphore.hpp"
+#ifdef __SSE4_1__
+#  ifdef _MSC_VER
+#    include <intrin.h>
+#  else
+#    include <x86intrin.h>
+#  endif
+#endif
+
+// Rows are passed from the inflate thread in groups, a few groups are kept in flight
+enum { SlotRows = 16 };
+enum { Slots = 4 };
+// Row buffers are padded, so that pixels can be read and written with 4 and 16 byte accesses
+enum { Padding = 16 };
+
+static uint32 ReadBE32( const uint8* p )
+{
+    return ( uint32( p[0] ) << 24 ) | ( uint32( p[1] ) << 16 ) | ( uint32( p[2] ) << 8 ) | p[3];
+}
+
+bool PngLoadHeader( FILE* f, v2i& size, bool& alpha )
+{
+    static const uint8 sig[8] = { 137, 80, 78, 71, 13, 10, 26, 10 };
+
+    uint8 hdr[8+8+13+4];
+    fseek( f, 0, SEEK_SET );
+    if( fread( hdr, 1, sizeof( hdr ), f ) != sizeof( hdr ) ||
+        memcmp( hdr, sig, 8 ) != 0 ||
+        ReadBE32( hdr+8 ) != 13 ||
+        memcmp( hdr+12, "IHDR", 4 ) != 0 )
+    {
+        fseek( f, 0, SEEK_SET );
+        return false;
+    }
+
+    const uint32 w = ReadBE32( hdr+16 );
+    const uint32 h = ReadBE32( hdr+20 );
+    const uint8 depth = hdr[24];
+    const uint8 type = hdr[25];
+    const uint8 interlace = hdr[28];
+
+    if( depth != 8 || ( type != 2 && type != 6 ) || interlace != 0 )
+    {
+        fseek( f, 0, SEEK_SET );
+        return false;
+    }
+
+    for(;;)
+    {
+        uint8 chunk[8];
+        if( fread( chunk, 1, 8, f ) != 8 )
+        {
+            fseek( f, 0, SEEK_SET );
+            return false;
+        }
+        if( memcmp( chunk+4, "IDAT", 4 ) == 0 )
+        {
+            fseek( f, -8, SEEK_CUR );
+            break;
+        }
+        // Color key transparency is left to libpng
+        if( memcmp( chunk+4, "tRNS", 4 ) == 0 )
+        {
+            fseek( f, 0, SEEK_SET );
+            return false;
+        }
+        fseek( f, ReadBE32( chunk ) + 4, SEEK_CUR );
+    }
+
+    size = v2i( w, h );
+    alpha = type == 6;
+    return true;
+}
+
+#ifdef __SSE4_1__
+static inline __m128i LoadPixel( const uint8* p )
+{
+    int32 v;
+    memcpy( &v, p, 4 );
+    return _mm_cvtsi32_si128( v );
+}
+
+static inline void StorePixel( uint8* p, __m128i v )
+{
+    const int32 t = _mm_cvtsi128_si32( v );
+    memcpy( p, &t, 4 );
+}
+
+// Pixels are unfiltered one at a time, only the low bpp bytes of each store are valid
+template<int bpp>
+static void Unfilter( uint8 filter, uint8* out, const uint8* in, const uint8* prev, size_t n )
+{
+    switch( filter )
+    {
+    case 0:
+        memcpy( out, in, n );
+        break;
+    case 1:
+    {
+        __m128i a = _mm_setzero_si128();
+        for( size_t i=0; i<n; i+=bpp )
+        {
+            a = _mm_add_epi8( a, LoadPixel( in+i ) );
+            StorePixel( out+i, a );
+        }
+        break;
+    }
+    case 2:
+    {
+        size_t i = 0;
+        for( ; i+16<=n; i+=16 )
+        {
+            const __m128i x = _mm_loadu_si128( (const __m128i*)( in+i ) );
+            const __m128i b = _mm_loadu_si128( (const __m128i*)( prev+i ) );
+            _mm_storeu_si128( (__m128i*)( out+i ), _mm_add_epi8( x, b ) );
+        }
+        for( ; i<n; i++ )
+        {
+            out[i] = in[i] + prev[i];
+        }
+        break;
+    }
+    case 3:
+    {
+        // Average rounds down, pavgb rounds up
+        const __m128i one = _mm_set1_epi8( 1 );
+        __m128i a = _mm_setzero_si128();
+        for( size_t i=0; i<n; i+=bpp )
+        {
+            const __m128i b = LoadPixel( prev+i );
+            const __m128i avg = _mm_sub_epi8( _mm_avg_epu8( a, b ), _mm_and_si128( _mm_xor_si128( a, b ), one ) );
+            a = _mm_add_epi8( LoadPixel( in+i ), avg );
+            StorePixel( out+i, a );
+        }
+        break;
+    }
+    case 4:
+    {
+        // Paeth predictor in 16 bits, ties prefer a over b over c
+        const __m128i zero = _mm_setzero_si128();
+        __m128i a = zero;
+        __m128i c = zero;
+        for( size_t i=0; i<n; i+=bpp )
+        {
+            const __m128i b = _mm_unpacklo_epi8( LoadPixel( prev+i ), zero );
+            const __m128i pa = _mm_sub_epi16( b, c );
+            const __m128i pb = _mm_sub_epi16( a, c );
+            const __m128i pc = _mm_abs_epi16( _mm_add_epi16( pa, pb ) );
+            const __m128i apa = _mm_abs_epi16( pa );
+            const __m128i apb = _mm_abs_epi16( pb );
+            const __m128i smallest = _mm_min_epi16( pc, _mm_min_epi16( apa, apb ) );
+            __m128i nearest = _mm_blendv_epi8( c, b, _mm_cmpeq_epi16( smallest, apb ) );
+            nearest = _mm_blendv_epi8( nearest, a, _mm_cmpeq_epi16( smallest, apa ) );
+            const __m128i d = _mm_add_epi8( LoadPixel( in+i ), _mm_packus_epi16( nearest, nearest ) );
+            StorePixel( out+i, d );
+            a = _mm_unpacklo_epi8( d, zero );
+            c = b;
+        }
+        break;
+    }
+    default:
+        assert( false );
+        break;
+    }
+}
+
+static void ConvertRGBA( uint32* dst, const uint8* src, size_t w )
+{
+    const __m128i shuf = _mm_setr_epi8( 2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15 );
+    for( size_t i=0; i<w; i+=4 )
+    {
+        const __m128i v = _mm_loadu_si128( (const __m128i*)( src + i*4 ) );
+        _mm_storeu_si128( (__m128i*)( dst + i ), _mm_shuffle_epi8( v, shuf ) );
+    }
+}
+
+static void ConvertRGB( uint32* dst, const uint8* src, size_t w )
+{
+    const __m128i shuf = _mm_setr_epi8( 2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9, -1 );
+    const __m128i alpha = _mm_set1_epi32( 0xFF000000 );
+    for( size_t i=0; i<w; i+=4 )
+    {
+        const __m128i v = _mm_loadu_si128( (const __m128i*)( src + i*3 ) );
+        _mm_storeu_si128( (__m128i*)( dst + i ), _mm_or_si128( _mm_shuffle_epi8( v, shuf ), alpha ) );
+    }
+}
+#else
+static inline int Paeth( int a, int b, int c )
+{
+    const int pa = abs( b - c );
+    const int pb = abs( a - c );
+    const int pc = abs( a + b - c - c );
+    if( pa <= pb && pa <= pc ) return a;
+    if( pb <= pc ) return b;
+    return c;
+}
+
+template<int bpp>
+static void Unfilter( uint8 filter, uint8* out, const uint8* in, const uint8* prev, size_t n )
+{
+    switch( filter )
+    {
+    case 0:
+        memcpy( out, in, n );
+        break;
+    case 1:
+        for( size_t i=0; i<bpp; i++ ) out[i] = in[i];
+        for( size_t i=bpp; i<n; i++ ) out[i] = in[i] + out[i-bpp];
+        break;
+    case 2:
+        for( size_t i=0; i<n; i++ ) out[i] = in[i] + prev[i];
+        break;
+    case 3:
+        for( size_t i=0; i<bpp; i++ ) out[i] = in[i] + ( prev[i] >> 1 );
+        for( size_t i=bpp; i<n; i++ ) out[i] = in[i] + ( ( out[i-bpp] + prev[i] ) >> 1 );
+        break;
+    case 4:
+        for( size_t i=0; i<bpp; i++ ) out[i] = in[i] + prev[i];
+        for( size_t i=bpp; i<n; i++ ) out[i] = in[i] + Paeth( out[i-bpp], prev[i], prev[i-bpp] );
+        break;
+    default:
+        assert( false );
+        break;
+    }
+}
+
+static void ConvertRGBA( uint32* dst, const uint8* src, size_t w )
+{
+    for( size_t i=0; i<w; i++ )
+    {
+        dst[i] = src[2] | ( src[1] << 8 ) | ( src[0] << 16 ) | ( uint32( src[3] ) << 24 );
+        src += 4;
+    }
+}
+
+static void ConvertRGB( uint32* dst, const uint8* src, size_t w )
+{
+    for( size_t i=0; i<w; i++ )
+    {
+        dst[i] = src[2] | ( src[1] << 8 ) | ( src[0] << 16 ) | 0xFF000000;
+        src += 3;
+    }
+}
+#endif
+
+bool PngLoad( FILE* f, const v2i& size, bool alpha, size_t dstStride, const std::function<uint32*( uint blockRow )>& blockRow, const std::function<void()>& blockRowDone )
+{
+    const int bpp = alpha ? 4 : 3;
+    const size_t rowBytes = size_t( size.x ) * bpp;
+    const size_t stride = rowBytes + 1;
+    const size_t slotSize = stride * SlotRows;
+
+    std::vector<uint8> slots( slotSize * Slots + Padding );
+    Semaphore freeSlots( Slots );
+    Semaphore fullSlots( 0 );
+    // Set on truncated or corrupt image data. The inflater then stops and unlocks one more full slot, so
+    // that the calling thread is not left waiting for rows that never come.
+    std::atomic<bool> failed( false );
+
+    // Inflate the IDAT stream into the slots, one row group at a time
+    std::thread inflater( [&]()
+    {
+        z_stream zs = {};
+        auto ret = inflateInit( &zs );
+        bool ok = ret == Z_OK;
+
+        std::vector<uint8> in( 64*1024 );
+        uint32 rows = 0;
+        uint32 slot = 0;
+        uint8* out = nullptr;
+        size_t outLeft = 0;
+
+        auto next = [&]()
+        {
+            const uint32 num = std::min<uint32>( SlotRows, size.y - rows );
+            freeSlots.lock();
+            out = slots.data() + ( slot % Slots ) * slotSize;
+            outLeft = num * stride;
+            rows += num;
+        };
+        if( size.y > 0 ) next();
+
+        bool done = size.y == 0;
+        while( ok && !done )
+        {
+            uint8 chunk[8];
+            if( fread( chunk, 1, 8, f ) != 8 ) break;
+            size_t len = ReadBE32( chunk );
+            if( memcmp( chunk+4, "IDAT", 4 ) != 0 )
+            {
+                if( memcmp( chunk+4, "IEND", 4 ) == 0 ) break;
+                fseek( f, len + 4, SEEK_CUR );
+                continue;
+            }
+
+            while( ok && len > 0 && !done )
+            {
+                const size_t rd = fread( in.data(), 1, std::min( len, in.size() ), f );
+                if( rd == 0 )
+                {
+                    ok = false;
+                    break;
+                }
+                len -= rd;
+                zs.next_in = in.data();
+                zs.avail_in = uInt( rd );
+
+                while( zs.avail_in > 0 && !done )
+                {
+                    zs.next_out = out;
+                    zs.avail_out = uInt( outLeft );
+                    ret = inflate( &zs, Z_NO_FLUSH );
+                    if( ret != Z_OK && ret != Z_STREAM_END )
+                    {
+                        ok = false;
+                        break;
+                    }
+                    const size_t produced = outLeft - zs.avail_out;
+                    out += produced;
+                    outLeft -= produced;
+                    if( outLeft == 0 )
+                    {
+                        fullSlots.unlock();
+                        slot++;
+                        if( rows == uint32( size.y ) )
+                        {
+                            done = true;
+                        }
+                        else
+                        {
+                            next();
+                        }
+                    }
+                    else if( ret == Z_STREAM_END )
+                    {
+                        break;
+                    }
+                }
+            }
+            if( len > 0 ) fseek( f, len, SEEK_CUR );
+            fseek( f, 4, SEEK_CUR );
+        }
+        if( !done )
+        {
+            failed.store( true, std::memory_order_release );
+            fullSlots.unlock();
+        }
+
+        inflateEnd( &zs );
+        fclose( f );
+    } );
+
+    std::vector<uint8> rowBuf( ( rowBytes + Padding ) * 2 );
+    uint8* cur = rowBuf.data();
+    uint8* prev = cur + rowBytes + Padding;
+    const uint8* slotPtr = nullptr;
+    uint32* dst = nullptr;
+
+    for( int y=0; y<size.y; y++ )
+    {
+        const int r = y % SlotRows;
+        if( r == 0 && !failed.load( std::memory_order_acquire ) )
+        {
+            fullSlots.lock();
+            slotPtr = slots.data() + ( ( y / SlotRows ) % Slots ) * slotSize;
+        }
+
+        if( y % 4 == 0 )
+        {
+            dst = blockRow( y / 4 );
+        }
+
+        // Lines after a failure are cleared, the caller still gets all of them
+        if( failed.load( std::memory_order_acquire ) )
+        {
+            memset( dst, 0, size.x * sizeof( uint32 ) );
+        }
+        else
+        {
+            const uint8* in = slotPtr + r * stride;
+            if( alpha )
+            {
+                Unfilter<4>( in[0], cur, in+1, prev, rowBytes );
+                ConvertRGBA( dst, cur, size.x );
+            }
+            else
+            {
+                Unfilter<3>( in[0], cur, in+1, prev, rowBytes );
+                ConvertRGB( dst, cur, size.x );
+            }
+        }
+        dst += dstStride;
+        std::swap( cur, prev );
+
+        if( r == SlotRows - 1 || y == size.y - 1 )
+        {
+            freeSlots.unlock();
+        }
+        if( y % 4 == 3 || y == size.y - 1 )
+        {
+            blockRowDone();
+        }
+    }
+
+    inflater.join();
+    return !failed.load();
+}
@@ -0,0 +1,21 @@
+#ifndef __PNGLOADER_HPP__
+#define __PNGLOADER_HPP__
+
+#include <functional>
+#include <stdio.h>
+
+#include "Types.hpp"
+#include "Vector.hpp"
+
+// Fast path for 8-bit RGB and RGBA non-interlaced png files. Reads the header chunks from the start of the
+// file and leaves it at the first IDAT chunk. Returns false, with the file rewound, if the file needs the
+// generic libpng path.
+bool PngLoadHeader( FILE* f, v2i& size, bool& alpha );
+
+// Inflates the image data on a separate thread, while the rows are unfiltered and converted to BGRA on
+// the calling thread. blockRow returns where each group of four lines is written, dstStride pixels apart,
+// and blockRowDone is called once they are (the last group may be shorter). Closes the file. Returns false
+// on truncated or corrupt image data, the lines from there on are cleared.
+bool PngLoad( FILE* f, const v2i& size, bool alpha, size_t dstStride, const std::function<uint32*( uint blockRow )>& blockRow, const std::function<void()>& blockRowDone );
+
+#endif
@@ -1,9 +1,26 @@
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
 #include "Math.hpp"
 #include "ProcessAlpha.hpp"
 #include "ProcessCommon.hpp"
 #include "Tables.hpp"
 #include "Types.hpp"
 #include "Vector.hpp"
+#ifdef __SSE4_1__
+#  ifdef _MSC_VER
+#    include <intrin.h>
+#    define _bswap64(x) _byteswap_uint64(x)
+#  else
+#    include <x86intrin.h>
+#  endif
+#else
+#  ifndef _MSC_VER
+#    include <byteswap.h>
+#    define _bswap64(x) bswap_64(x)
+#  endif
+#endif
 
 static uint Average1( const uint8* data )
 {
@@ -206,6 +223,13 @@ uint64 CheckSolidAlpha( const uint8* src )
     {
         return ~(uint64)0;
     }
+#elif defined __SSE4_1__
+    __m128i d = _mm_loadu_si128( (const __m128i*)src );
+    __m128i c = _mm_set1_epi8( src[0] );
+    if( _mm_movemask_epi8( _mm_cmpeq_epi8( d, c ) ) != 0xFFFF )
+    {
+        return ~(uint64)0;
+    }
 #else
     const uint8* ptr = src + 1;
     for( int i=1; i<16; i++ )
@@ -225,6 +249,16 @@ uint64 ProcessAlpha_ETC2( const uint8* src )
     uint64 d = CheckSolidAlpha( src );
     if( d != ~(uint64)0 ) return d;
 
+#ifdef __SSE4_1__
+    __m128i srcBytes = _mm_loadu_si128( (const __m128i*)src );
+    __m128i min8 = _mm_min_epu8( srcBytes, _mm_srli_si128( srcBytes, 8 ) );
+    __m128i max8 = _mm_max_epu8( srcBytes, _mm_srli_si128( srcBytes, 8 ) );
+    // minpos works on words, max is found as minimum of inverted values
+    uint8 min = _mm_cvtsi128_si32( _mm_minpos_epu16( _mm_cvtepu8_epi16( min8 ) ) );
+    uint8 max = ~_mm_cvtsi128_si32( _mm_minpos_epu16( _mm_cvtepu8_epi16( _mm_xor_si128( max8, _mm_set1_epi8( -1 ) ) ) ) );
+    __m128i sad = _mm_sad_epu8( srcBytes, _mm_setzero_si128() );
+    uint16 sum = _mm_cvtsi128_si32( sad ) + _mm_extract_epi16( sad, 4 );
+#else
     uint8 min = src[0], max = src[0];
     uint16 sum = src[0];
     for( int i = 1; i < 16; ++i )
@@ -236,6 +270,7 @@ uint64 ProcessAlpha_ETC2( const uint8* src )
             max = v;
         sum += v;
     }
+#endif
     uint8 avg = sum / 16;
     uint8 diff = std::max(max - avg, avg - min);
 #if __ARM_NEON__
@@ -249,6 +284,49 @@ uint64 ProcessAlpha_ETC2( const uint8* src )
         (diff + 8) / 9,   (diff + 8) / 9,   (diff + 8) / 9,   (diff + 8) / 9,
         (diff + 8) / 9,   (diff + 8) / 9,   (diff + 7) / 8,   (diff + 7) / 8
     };
+    // Multiplier is stored in 4 bits
+    for( int i = 0; i < 16; ++i )
+    {
+        mod[i] = std::min( mod[i], 15 );
+    }
+#ifdef __SSE4_1__
+    uint8 indices[16];
+    uint16 bestTable = 0;
+
+    uint16 minTotalError = USHRT_MAX;
+    __m128i simdAvg = _mm_set1_epi16( avg );
+    for( int i = 0; i < 16; ++i )
+    {
+        // All 8 reconstructed values of the table, saturated to 0-255
+        __m128i simdTable = _mm_loadu_si128( (const __m128i*)g_tableAlpha[i] );
+        __m128i simdValue = _mm_add_epi16( simdAvg, _mm_mullo_epi16( _mm_set1_epi16( mod[i] ), simdTable ) );
+        __m128i simdZip = _mm_packus_epi16( simdValue, simdValue );
+
+        // Distance of all 16 pixels to each table entry, keeping the first minimum
+        __m128i v0 = _mm_shuffle_epi8( simdZip, _mm_setzero_si128() );
+        __m128i error = _mm_or_si128( _mm_subs_epu8( v0, srcBytes ), _mm_subs_epu8( srcBytes, v0 ) );
+        __m128i index = _mm_setzero_si128();
+        for( int k = 1; k < 8; ++k )
+        {
+            __m128i vk = _mm_shuffle_epi8( simdZip, _mm_set1_epi8( k ) );
+            __m128i d = _mm_or_si128( _mm_subs_epu8( vk, srcBytes ), _mm_subs_epu8( srcBytes, vk ) );
+            __m128i notLess = _mm_cmpeq_epi8( _mm_subs_epu8( error, d ), _mm_setzero_si128() );
+            index = _mm_blendv_epi8( _mm_set1_epi8( k ), index, notLess );
+            error = _mm_min_epu8( error, d );
+        }
+
+        __m128i errSum = _mm_sad_epu8( error, _mm_setzero_si128() );
+        uint16 totalError = _mm_cvtsi128_si32( errSum ) + _mm_extract_epi16( errSum, 4 );
+        if (minTotalError > totalError)
+        {
+            minTotalError = totalError;
+            bestTable = i;
+            _mm_storeu_si128( (__m128i*)indices, index );
+        }
+    }
+
+    const uint8* bestIndices = indices;
+#else
     uint8 indices[16][16];
     uint16 bestTable = 0;
 
@@ -280,8 +358,8 @@ uint64 ProcessAlpha_ETC2( const uint8* src )
 #else
             for( int k = 0; k < 8; ++k )
             {
-                int16 v = NiClamp(mod[i] * g_tableAlpha[i][k] + avg, 0, 255);
-                uint16 d = NiAbs(v - src[j]);
+                int16 v = clampu8( mod[i] * g_tableAlpha[i][k] + avg );
+                uint16 d = abs( v - src[j] );
                 if (error > d)
                 {
                     error = d;
@@ -298,13 +376,14 @@ uint64 ProcessAlpha_ETC2( const uint8* src )
         }
     }
 
+    const uint8* bestIndices = indices[bestTable];
+#endif
+
+    // Source block is stored column by column, which is the pixel order of the index table
     d = 0;
-    for( int i = 0; i < 4; ++i )
+    for( int i = 0; i < 16; ++i )
     {
-        d |= uint64(indices[bestTable][i * 4 + 0]) << (45 - i * 3);
-        d |= uint64(indices[bestTable][i * 4 + 1]) << (33 - i * 3);
-        d |= uint64(indices[bestTable][i * 4 + 2]) << (21 - i * 3);
-        d |= uint64(indices[bestTable][i * 4 + 3]) << (9  - i * 3);
+        d |= uint64(bestIndices[i]) << (45 - i * 3);
     }
     d |= uint64(bestTable)        << 48;
     d |= uint64(mod[bestTable])   << 52;
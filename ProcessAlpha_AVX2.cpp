@@ -0,0 +1,108 @@
+#ifdef __SSE4_1__
+
+#include <limits.h>
+
+#include "ProcessAlpha_AVX2.hpp"
+#include "Tables.hpp"
+#include "Types.hpp"
+#ifdef _MSC_VER
+#  include <intrin.h>
+#  define _bswap64(x) _byteswap_uint64(x)
+#else
+#  include <x86intrin.h>
+#  pragma GCC push_options
+#  pragma GCC target ("avx2,fma,bmi2")
+#endif
+
+uint64 ProcessAlpha_ETC2_AVX2( const uint8* src )
+{
+    __m128i srcBytes = _mm_loadu_si128( (const __m128i*)src );
+
+    if( _mm_movemask_epi8( _mm_cmpeq_epi8( srcBytes, _mm_set1_epi8( src[0] ) ) ) == 0xFFFF )
+    {
+        return src[0];
+    }
+
+    __m128i min8 = _mm_min_epu8( srcBytes, _mm_srli_si128( srcBytes, 8 ) );
+    __m128i max8 = _mm_max_epu8( srcBytes, _mm_srli_si128( srcBytes, 8 ) );
+    uint8 min = _mm_cvtsi128_si32( _mm_minpos_epu16( _mm_cvtepu8_epi16( min8 ) ) );
+    uint8 max = ~_mm_cvtsi128_si32( _mm_minpos_epu16( _mm_cvtepu8_epi16( _mm_xor_si128( max8, _mm_set1_epi8( -1 ) ) ) ) );
+    __m128i sad = _mm_sad_epu8( srcBytes, _mm_setzero_si128() );
+    uint16 sum = _mm_cvtsi128_si32( sad ) + _mm_extract_epi16( sad, 4 );
+
+    uint8 avg = sum / 16;
+    uint8 diff = max - avg > avg - min ? max - avg : avg - min;
+
+    int16 mod[16] =
+    {
+        int16( (diff + 13) / 14 ), int16( (diff + 11) / 12 ), int16( (diff + 11) / 12 ), int16( (diff + 11) / 12 ),
+        int16( (diff + 10) / 11 ), int16( (diff + 9) / 10 ),  int16( (diff + 9) / 10 ),  int16( (diff + 9) / 10 ),
+        int16( (diff + 8) / 9 ),   int16( (diff + 8) / 9 ),   int16( (diff + 8) / 9 ),   int16( (diff + 8) / 9 ),
+        int16( (diff + 8) / 9 ),   int16( (diff + 8) / 9 ),   int16( (diff + 7) / 8 ),   int16( (diff + 7) / 8 )
+    };
+    // Multiplier is stored in 4 bits
+    __m256i simdMod = _mm256_min_epi16( _mm256_loadu_si256( (const __m256i*)mod ), _mm256_set1_epi16( 15 ) );
+    _mm256_storeu_si256( (__m256i*)mod, simdMod );
+
+    alignas(16) uint8 indices[16];
+    uint16 bestTable = 0;
+
+    uint16 minTotalError = USHRT_MAX;
+    __m256i simdSrc = _mm256_broadcastsi128_si256( srcBytes );
+    __m256i simdAvg = _mm256_set1_epi16( avg );
+    // Two tables per iteration, one in each 128-bit lane
+    for( int i = 0; i < 16; i += 2 )
+    {
+        __m256i simdTable = _mm256_loadu_si256( (const __m256i*)g_tableAlpha[i] );
+        __m256i simdMul = _mm256_inserti128_si256( _mm256_set1_epi16( mod[i] ), _mm_set1_epi16( mod[i+1] ), 1 );
+        __m256i simdValue = _mm256_add_epi16( simdAvg, _mm256_mullo_epi16( simdMul, simdTable ) );
+        __m256i simdZip = _mm256_packus_epi16( simdValue, simdValue );
+
+        __m256i v0 = _mm256_shuffle_epi8( simdZip, _mm256_setzero_si256() );
+        __m256i error = _mm256_or_si256( _mm256_subs_epu8( v0, simdSrc ), _mm256_subs_epu8( simdSrc, v0 ) );
+        __m256i index = _mm256_setzero_si256();
+        for( int k = 1; k < 8; ++k )
+        {
+            __m256i vk = _mm256_shuffle_epi8( simdZip, _mm256_set1_epi8( k ) );
+            __m256i d = _mm256_or_si256( _mm256_subs_epu8( vk, simdSrc ), _mm256_subs_epu8( simdSrc, vk ) );
+            __m256i notLess = _mm256_cmpeq_epi8( _mm256_subs_epu8( error, d ), _mm256_setzero_si256() );
+            index = _mm256_blendv_epi8( _mm256_set1_epi8( k ), index, notLess );
+            error = _mm256_min_epu8( error, d );
+        }
+
+        __m256i errSum = _mm256_sad_epu8( error, _mm256_setzero_si256() );
+        uint16 totalError0 = _mm256_extract_epi16( errSum, 0 ) + _mm256_extract_epi16( errSum, 4 );
+        uint16 totalError1 = _mm256_extract_epi16( errSum, 8 ) + _mm256_extract_epi16( errSum, 12 );
+        if( minTotalError > totalError0 )
+        {
+            minTotalError = totalError0;
+            bestTable = i;
+            _mm_store_si128( (__m128i*)indices, _mm256_castsi256_si128( index ) );
+        }
+        if( minTotalError > totalError1 )
+        {
+            minTotalError = totalError1;
+            bestTable = i + 1;
+            _mm_store_si128( (__m128i*)indices, _mm256_extracti128_si256( index, 1 ) );
+        }
+    }
+
+    // Source block is stored column by column, which is the pixel order of the index table
+    uint64 d = 0;
+    for( int i = 0; i < 16; ++i )
+    {
+        d |= uint64(indices[i]) << (45 - i * 3);
+    }
+    d |= uint64(bestTable)        << 48;
+    d |= uint64(mod[bestTable])   << 52;
+    d |= uint64(avg)              << 56;
+    d = _bswap64(d);
+
+    return d;
+}
+
+#ifndef _MSC_VER
+#  pragma GCC pop_options
+#endif
+
+#endif
@@ -0,0 +1,12 @@
+#ifndef __PROCESSALPHA_AVX2_HPP__
+#define __PROCESSALPHA_AVX2_HPP__
+
+#ifdef __SSE4_1__
+
+#include "Types.hpp"
+
+uint64 ProcessAlpha_ETC2_AVX2( const uint8* src );
+
+#endif
+
+#endif
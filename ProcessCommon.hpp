@@ -4,6 +4,9 @@
 #include <assert.h>
 #include <stddef.h>
 
+#include "ErrorMetric.hpp"
+#include "Math.hpp"
+#include "Tables.hpp"
 #include "Types.hpp"
 
 template<class T>
@@ -48,4 +51,315 @@ static uint64 EncodeSelectors( uint64 d, const T terr[2][8], const S tsel[16][8]
     return d;
 }
 
+// Weighted RGB error of a source pixel (BGRA) against a color in the same layout, with the halved weights
+static uint32 ErrorRGB( const uint8* src, uint32 c, const ErrorWeights& w )
+{
+    int32 db = int32( src[0] ) - int32( c & 0xFF );
+    int32 dg = int32( src[1] ) - int32( ( c >> 8 ) & 0xFF );
+    int32 dr = int32( src[2] ) - int32( ( c >> 16 ) & 0xFF );
+    return dr * dr * w.rh + dg * dg * w.gh + db * db * w.bh;
+}
+
+static uint32 PackColor( int32 r, int32 g, int32 b )
+{
+    return clampu8( b ) | ( clampu8( g ) << 8 ) | ( clampu8( r ) << 16 );
+}
+
+// RGB444 color (as stored in T and H blocks) expanded and shifted by d
+static uint32 PaintColor( uint32 c, int32 d )
+{
+    return PackColor( ( c >> 8 ) * 17 + d, ( ( c >> 4 ) & 0xF ) * 17 + d, ( c & 0xF ) * 17 + d );
+}
+
+// Decodes an encoded RGB block into BGRA pixels, in source pixel order
+static void DecodeRGB( uint64 block, uint32 rec[16] )
+{
+    const uint32 w0 = ByteSwap32( uint32( block ) );
+    const uint32 w1 = ByteSwap32( uint32( block >> 32 ) );
+
+    uint32 paint[4];
+    bool th = false;
+
+    if( w0 & 0x2 )
+    {
+        const int32 r = w0 >> 27;
+        const int32 g = ( w0 >> 19 ) & 0x1F;
+        const int32 b = ( w0 >> 11 ) & 0x1F;
+        const int32 dr = int32( w0 << 5 ) >> 29;
+        const int32 dg = int32( w0 << 13 ) >> 29;
+        const int32 db = int32( w0 << 21 ) >> 29;
+
+        if( r + dr < 0 || r + dr > 31 )
+        {
+            const uint32 c1 = ( ( ( w0 >> 27 ) & 0x3 ) << 10 ) | ( ( ( w0 >> 24 ) & 0x3 ) << 8 ) | ( ( w0 >> 16 ) & 0xFF );
+            const uint32 c2 = ( w0 >> 4 ) & 0xFFF;
+            const int32 d = g_distanceTH[( ( w0 >> 1 ) & 0x6 ) | ( w0 & 0x1 )];
+            paint[0] = PaintColor( c1, 0 );
+            paint[1] = PaintColor( c2, d );
+            paint[2] = PaintColor( c2, 0 );
+            paint[3] = PaintColor( c2, -d );
+            th = true;
+        }
+        else if( g + dg < 0 || g + dg > 31 )
+        {
+            const uint32 c1 = ( ( ( w0 >> 27 ) & 0xF ) << 8 ) | ( ( ( w0 >> 24 ) & 0x7 ) << 5 ) | ( ( ( w0 >> 20 ) & 0x1 ) << 4 ) |
+                ( ( ( w0 >> 19 ) & 0x1 ) << 3 ) | ( ( w0 >> 15 ) & 0x7 );
+            const uint32 c2 = ( w0 >> 3 ) & 0xFFF;
+            const int32 d = g_distanceTH[( w0 & 0x4 ) | ( ( w0 & 0x1 ) << 1 ) | ( c1 >= c2 ? 1 : 0 )];
+            paint[0] = PaintColor( c1, d );
+            paint[1] = PaintColor( c1, -d );
+            paint[2] = PaintColor( c2, d );
+            paint[3] = PaintColor( c2, -d );
+            th = true;
+        }
+        else if( b + db < 0 || b + db > 31 )
+        {
+            const int32 ro = ( ( w0 >> 25 ) & 0x3F ) << 2 | ( ( w0 >> 25 ) & 0x3F ) >> 4;
+            const int32 go0 = ( ( w0 >> 24 ) & 0x1 ) << 6 | ( ( w0 >> 17 ) & 0x3F );
+            const int32 go = go0 << 1 | go0 >> 6;
+            const int32 bo0 = ( ( w0 >> 16 ) & 0x1 ) << 5 | ( ( w0 >> 11 ) & 0x3 ) << 3 | ( ( w0 >> 7 ) & 0x7 );
+            const int32 bo = bo0 << 2 | bo0 >> 4;
+            const int32 rh0 = ( ( w0 >> 2 ) & 0x1F ) << 1 | ( w0 & 0x1 );
+            const int32 rh = rh0 << 2 | rh0 >> 4;
+            const int32 gh = ( w1 >> 25 ) << 1 | ( w1 >> 31 );
+            const int32 bh = ( ( w1 >> 19 ) & 0x3F ) << 2 | ( ( w1 >> 19 ) & 0x3F ) >> 4;
+            const int32 rv = ( ( w1 >> 13 ) & 0x3F ) << 2 | ( ( w1 >> 13 ) & 0x3F ) >> 4;
+            const int32 gv = ( ( w1 >> 6 ) & 0x7F ) << 1 | ( ( w1 >> 6 ) & 0x7F ) >> 6;
+            const int32 bv = ( w1 & 0x3F ) << 2 | ( w1 & 0x3F ) >> 4;
+
+            for( int i=0; i<16; i++ )
+            {
+                const int32 x = i / 4;
+                const int32 y = i % 4;
+                rec[i] = PackColor(
+                    ( x * ( rh - ro ) + y * ( rv - ro ) + 4 * ro + 2 ) >> 2,
+                    ( x * ( gh - go ) + y * ( gv - go ) + 4 * go + 2 ) >> 2,
+                    ( x * ( bh - bo ) + y * ( bv - bo ) + 4 * bo + 2 ) >> 2 );
+            }
+            return;
+        }
+    }
+
+    if( th )
+    {
+        for( int i=0; i<16; i++ )
+        {
+            rec[i] = paint[( ( w1 >> i ) & 0x1 ) | ( ( w1 >> ( i + 15 ) ) & 0x2 )];
+        }
+        return;
+    }
+
+    int32 base[2][3];
+    if( w0 & 0x2 )
+    {
+        for( int c=0; c<3; c++ )
+        {
+            const int32 v = ( w0 >> ( 27 - c*8 ) ) & 0x1F;
+            const int32 v2 = v + ( int32( w0 << ( 5 + c*8 ) ) >> 29 );
+            base[0][c] = ( v << 3 ) | ( v >> 2 );
+            base[1][c] = ( v2 << 3 ) | ( v2 >> 2 );
+        }
+    }
+    else
+    {
+        for( int c=0; c<3; c++ )
+        {
+            base[0][c] = ( ( w0 >> ( 28 - c*8 ) ) & 0xF ) * 17;
+            base[1][c] = ( ( w0 >> ( 24 - c*8 ) ) & 0xF ) * 17;
+        }
+    }
+    const int32* tab[2] = { g_table[( w0 >> 5 ) & 0x7], g_table[( w0 >> 2 ) & 0x7] };
+    const bool flip = w0 & 0x1;
+
+    for( int i=0; i<16; i++ )
+    {
+        const int sub = flip ? ( ( i % 4 ) >= 2 ) : ( i >= 8 );
+        const int32 m = tab[sub][( ( w1 >> i ) & 0x1 ) | ( ( w1 >> ( i + 15 ) ) & 0x2 )];
+        rec[i] = PackColor( base[sub][0] + m, base[sub][1] + m, base[sub][2] + m );
+    }
+}
+
+// Splits the block into two color clusters with a few rounds of 2-means, returns RGB444 centers
+template<class E>
+static void ClusterTH( const uint8* src, uint32 q[2], const ErrorWeights& w, E eval )
+{
+    int32 sum[3] = {};
+    for( int i=0; i<16; i++ )
+    {
+        sum[0] += src[i*4+0];
+        sum[1] += src[i*4+1];
+        sum[2] += src[i*4+2];
+    }
+    uint32 c[2];
+    uint32 ref = PackColor( ( sum[2] + 8 ) / 16, ( sum[1] + 8 ) / 16, ( sum[0] + 8 ) / 16 );
+
+    // Seed with the pixel farthest from the mean and the pixel farthest from that one
+    for( int k=0; k<2; k++ )
+    {
+        uint32 maxErr = 0;
+        int idx = 0;
+        for( int i=0; i<16; i++ )
+        {
+            const uint32 err = ErrorRGB( src + i*4, ref, w );
+            if( err > maxErr )
+            {
+                maxErr = err;
+                idx = i;
+            }
+        }
+        c[k] = ref = PackColor( src[idx*4+2], src[idx*4+1], src[idx*4+0] );
+    }
+
+    for( int iter=0; iter<3; iter++ )
+    {
+        // Selector MSB tells which center is nearer
+        const uint32 paint[4] = { c[0], c[0], c[1], c[1] };
+        uint32 sel;
+        eval( paint, sel );
+
+        int32 csum[2][3] = {};
+        int32 cnt[2] = {};
+        for( int i=0; i<16; i++ )
+        {
+            const int k = ( sel >> ( i + 16 ) ) & 0x1;
+            csum[k][0] += src[i*4+0];
+            csum[k][1] += src[i*4+1];
+            csum[k][2] += src[i*4+2];
+            cnt[k]++;
+        }
+        for( int k=0; k<2; k++ )
+        {
+            if( cnt[k] == 0 ) continue;
+            const int32 h = cnt[k] / 2;
+            c[k] = PackColor( ( csum[k][2] + h ) / cnt[k], ( csum[k][1] + h ) / cnt[k], ( csum[k][0] + h ) / cnt[k] );
+        }
+    }
+
+    for( int k=0; k<2; k++ )
+    {
+        const uint32 r = ( ( ( c[k] >> 16 ) & 0xFF ) + 8 ) / 17;
+        const uint32 g = ( ( ( c[k] >> 8 ) & 0xFF ) + 8 ) / 17;
+        const uint32 b = ( ( c[k] & 0xFF ) + 8 ) / 17;
+        q[k] = ( r << 8 ) | ( g << 4 ) | b;
+    }
+}
+
+// sel holds the selector MSBs in the upper and the LSBs in the lower half, as stored in the block
+static uint64 EncodeT( uint32 c1, uint32 c2, uint32 dist, uint32 sel )
+{
+    const uint32 r1a = c1 >> 10;
+    const uint32 r1b = ( c1 >> 8 ) & 0x3;
+    uint32 w = ( r1a << 27 ) | ( r1b << 24 ) | ( ( c1 & 0xFF ) << 16 ) | ( c2 << 4 ) | ( ( dist >> 1 ) << 2 ) | 0x2 | ( dist & 0x1 );
+
+    // Differential red has to overflow for the block to be read as T mode
+    if( r1a + r1b >= 4 )
+    {
+        w |= 0x7 << 29;
+    }
+    else
+    {
+        w |= 0x1 << 26;
+    }
+
+    return ByteSwap32( w ) | ( uint64( ByteSwap32( sel ) ) << 32 );
+}
+
+static uint64 EncodeH( uint32 c1, uint32 c2, uint32 dist, uint32 sel )
+{
+    // Lowest bit of the distance is given by the order of the colors
+    if( ( c1 >= c2 ) != ( ( dist & 0x1 ) != 0 ) )
+    {
+        std::swap( c1, c2 );
+        sel ^= 0xFFFF0000;
+    }
+
+    const uint32 r1 = c1 >> 8;
+    const uint32 g1 = ( c1 >> 4 ) & 0xF;
+    const uint32 b1 = c1 & 0xF;
+    uint32 w = ( r1 << 27 ) | ( ( g1 >> 1 ) << 24 ) | ( ( g1 & 0x1 ) << 20 ) | ( ( b1 >> 3 ) << 19 ) | ( ( b1 & 0x7 ) << 15 ) |
+        ( c2 << 3 ) | ( ( dist >> 2 ) << 2 ) | 0x2 | ( ( dist >> 1 ) & 0x1 );
+
+    // Differential red must stay in range, while green has to overflow
+    const int32 dr = int32( g1 >> 1 ) - ( ( g1 & 0x8 ) ? 8 : 0 );
+    if( int32( r1 ) + dr < 0 )
+    {
+        w |= 0x1 << 31;
+    }
+    if( ( ( ( g1 & 0x1 ) << 1 ) | ( b1 >> 3 ) ) + ( ( b1 & 0x7 ) >> 1 ) >= 4 )
+    {
+        w |= 0x7 << 21;
+    }
+    else
+    {
+        w |= 0x1 << 18;
+    }
+
+    return ByteSwap32( w ) | ( uint64( ByteSwap32( sel ) ) << 32 );
+}
+
+// Tries ETC2 T and H modes on a block already encoded in another mode, eval returns the error
+// of the best paint color per pixel and the matching selectors
+template<class E>
+static uint64 SearchTH( const uint8* src, uint64 block, const ErrorWeights& w, E eval )
+{
+    uint32 rec[16];
+    DecodeRGB( block, rec );
+    uint32 bestError = 0;
+    for( int i=0; i<16; i++ )
+    {
+        bestError += ErrorRGB( src + i*4, rec[i], w );
+    }
+    // Blocks that are already close are left alone
+    if( bestError <= 16 * 128 * 4 ) return block;
+
+    uint32 q[2];
+    ClusterTH( src, q, w, eval );
+
+    uint64 result = block;
+    uint32 paint[4];
+    uint32 sel;
+
+    // Each cluster in turn takes the single color of T mode
+    for( int t=0; t<2; t++ )
+    {
+        const uint32 c1 = q[t];
+        const uint32 c2 = q[1-t];
+        paint[0] = PaintColor( c1, 0 );
+        paint[2] = PaintColor( c2, 0 );
+        for( uint32 dist=0; dist<8; dist++ )
+        {
+            const int32 d = g_distanceTH[dist];
+            paint[1] = PaintColor( c2, d );
+            paint[3] = PaintColor( c2, -d );
+            const uint32 err = eval( paint, sel );
+            if( err < bestError )
+            {
+                bestError = err;
+                result = EncodeT( c1, c2, dist, sel );
+            }
+        }
+    }
+
+    // H mode can't represent equal colors with every distance
+    if( q[0] != q[1] )
+    {
+        for( uint32 dist=0; dist<8; dist++ )
+        {
+            const int32 d = g_distanceTH[dist];
+            paint[0] = PaintColor( q[0], d );
+            paint[1] = PaintColor( q[0], -d );
+            paint[2] = PaintColor( q[1], d );
+            paint[3] = PaintColor( q[1], -d );
+            const uint32 err = eval( paint, sel );
+            if( err < bestError )
+            {
+                bestError = err;
+                result = EncodeH( q[0], q[1], dist, sel );
+            }
+        }
+    }
+
+    return result;
+}
+
 #endif
@@ -2,6 +2,7 @@
 #include <string.h>
 
 #include "Math.hpp"
+#include "ErrorMetric.hpp"
 #include "ProcessCommon.hpp"
 #include "ProcessRGB.hpp"
 #include "Tables.hpp"
@@ -465,7 +466,7 @@ void PrepareAverages( v4i a[8], const uint8* src, uint err[4] )
     }
 }
 
-void FindBestFit( uint64 terr[2][8], uint16 tsel[16][8], v4i a[8], const uint32* id, const uint8* data )
+void FindBestFit( uint64 terr[2][8], uint16 tsel[16][8], v4i a[8], const uint32* id, const uint8* data, const ErrorWeights& w )
 {
     for( size_t i=0; i<16; i++ )
     {
@@ -485,7 +486,7 @@ void FindBestFit( uint64 terr[2][8], uint16 tsel[16][8], v4i a[8], const uint32*
 #ifdef __SSE4_1__
         // Reference implementation
 
-        __m128i pix = _mm_set1_epi32(dr * 77 + dg * 151 + db * 28);
+        __m128i pix = _mm_set1_epi32(dr * w.r + dg * w.g + db * w.b);
         // Taking the absolute value is way faster. The values are only used to sort, so the result will be the same.
         __m128i error0 = _mm_abs_epi32(_mm_add_epi32(pix, g_table256_SIMD[0]));
         __m128i error1 = _mm_abs_epi32(_mm_add_epi32(pix, g_table256_SIMD[1]));
@@ -538,7 +539,7 @@ void FindBestFit( uint64 terr[2][8], uint16 tsel[16][8], v4i a[8], const uint32*
         __m128i minIndex = _mm_packs_epi32(minIndex0, minIndex1);
         _mm_storeu_si128((__m128i*)sel, minIndex);
 #elif __ARM_NEON__
-        int32x4_t pix = vdupq_n_s32(dr * 77 + dg * 151 + db * 28);
+        int32x4_t pix = vdupq_n_s32(dr * w.r + dg * w.g + db * w.b);
 
         // Taking the absolute value is way faster. The values are only used to sort, so the result will be the same.
         uint32x4_t error0 = vabsq_s32(vaddq_s32(pix, g_table256_SIMD[0]));
@@ -595,7 +596,7 @@ void FindBestFit( uint64 terr[2][8], uint16 tsel[16][8], v4i a[8], const uint32*
         uint16x8_t minIndex = vcombine_u16(vqmovn_u32(minIndex0), vqmovn_u32(minIndex1));
         vst1q_u16(sel, minIndex);
 #else
-        int pix = dr * 77 + dg * 151 + db * 28;
+        int pix = dr * w.r + dg * w.g + db * w.b;
 
         for( int t=0; t<8; t++ )
         {
@@ -620,7 +621,7 @@ void FindBestFit( uint64 terr[2][8], uint16 tsel[16][8], v4i a[8], const uint32*
 
 #ifdef __SSE4_1__
 // Non-reference implementation, but faster. Produces same results as the AVX2 version
-void FindBestFit( uint32 terr[2][8], uint16 tsel[16][8], v4i a[8], const uint32* id, const uint8* data )
+void FindBestFit( uint32 terr[2][8], uint16 tsel[16][8], v4i a[8], const uint32* id, const uint8* data, const ErrorWeights& w )
 {
     for( size_t i=0; i<16; i++ )
     {
@@ -639,7 +640,7 @@ void FindBestFit( uint32 terr[2][8], uint16 tsel[16][8], v4i a[8], const uint32*
 
         // The scaling values are divided by two and rounded, to allow the differences to be in the range of signed int16
         // This produces slightly different results, but is significant faster
-        __m128i pixel = _mm_set1_epi16(dr * 38 + dg * 76 + db * 14);
+        __m128i pixel = _mm_set1_epi16(dr * w.rh + dg * w.gh + db * w.bh);
         __m128i pix = _mm_abs_epi16(pixel);
 
         // Taking the absolute value is way faster. The values are only used to sort, so the result will be the same.
@@ -684,7 +685,7 @@ uint8_t convert7(float f)
     return (i + 9 - ((i + 9) >> 8) - ((i + 6) >> 8)) >> 2;
 }
 
-std::pair<uint64, uint64> Planar(const uint8* src)
+std::pair<uint64, uint64> Planar(const uint8* src, const ErrorWeights& w)
 {
     int32 r = 0;
     int32 g = 0;
@@ -802,7 +803,7 @@ std::pair<uint64, uint64> Planar(const uint8* src)
         int32 difG = static_cast<int>(src[i * 4 + 1]) - cG;
         int32 difR = static_cast<int>(src[i * 4 + 2]) - cR;
 
-        int32 dif = difR * 38 + difG * 76 + difB * 14;
+        int32 dif = difR * w.rh + difG * w.gh + difB * w.bh;
 
         error += dif * dif;
     }
@@ -826,6 +827,89 @@ std::pair<uint64, uint64> Planar(const uint8* src)
     return std::make_pair(result, error);
 }
 
+#ifdef __SSE4_1__
+// Pixels are expanded to 16 bits per channel, two pixels per register
+uint32 EvalPaint( const __m128i px[8], const uint32 paint[4], uint32& sel, const ErrorWeights& weights )
+{
+    const __m128i w = _mm_setr_epi16( weights.bh, weights.gh, weights.rh, 0, weights.bh, weights.gh, weights.rh, 0 );
+
+    __m128i err[4];
+    __m128i idx[4];
+    for( int k=0; k<4; k++ )
+    {
+        const __m128i c = _mm_cvtepu8_epi16( _mm_set1_epi32( paint[k] ) );
+        for( int j=0; j<4; j++ )
+        {
+            __m128i d0 = _mm_sub_epi16( px[j*2], c );
+            __m128i d1 = _mm_sub_epi16( px[j*2+1], c );
+            __m128i e0 = _mm_madd_epi16( d0, _mm_mullo_epi16( d0, w ) );
+            __m128i e1 = _mm_madd_epi16( d1, _mm_mullo_epi16( d1, w ) );
+            __m128i e = _mm_hadd_epi32( e0, e1 );
+            if( k == 0 )
+            {
+                err[j] = e;
+                idx[j] = _mm_setzero_si128();
+            }
+            else
+            {
+                __m128i less = _mm_cmplt_epi32( e, err[j] );
+                err[j] = _mm_min_epi32( e, err[j] );
+                idx[j] = _mm_blendv_epi8( idx[j], _mm_set1_epi32( k ), less );
+            }
+        }
+    }
+
+    __m128i sum = _mm_add_epi32( _mm_add_epi32( err[0], err[1] ), _mm_add_epi32( err[2], err[3] ) );
+    sum = _mm_hadd_epi32( sum, sum );
+    sum = _mm_hadd_epi32( sum, sum );
+
+    // Move selector bits to the sign bit of each byte
+    __m128i idx8 = _mm_packs_epi16( _mm_packs_epi32( idx[0], idx[1] ), _mm_packs_epi32( idx[2], idx[3] ) );
+    uint32 lsb = _mm_movemask_epi8( _mm_slli_epi16( idx8, 7 ) );
+    uint32 msb = _mm_movemask_epi8( _mm_slli_epi16( idx8, 6 ) );
+    sel = lsb | ( msb << 16 );
+
+    return _mm_cvtsi128_si32( sum );
+}
+#else
+uint32 EvalPaint( const uint8* src, const uint32 paint[4], uint32& sel, const ErrorWeights& w )
+{
+    uint32 error = 0;
+    sel = 0;
+    for( int i=0; i<16; i++ )
+    {
+        uint32 idx = 0;
+        uint32 err = ErrorRGB( src + i*4, paint[0], w );
+        for( uint32 k=1; k<4; k++ )
+        {
+            uint32 local = ErrorRGB( src + i*4, paint[k], w );
+            if( local < err )
+            {
+                err = local;
+                idx = k;
+            }
+        }
+        error += err;
+        sel |= ( ( idx & 0x1 ) << i ) | ( ( idx & 0x2 ) << ( i + 15 ) );
+    }
+    return error;
+}
+#endif
+
+uint64 ProcessTH( const uint8* src, uint64 block, const ErrorWeights& w )
+{
+#ifdef __SSE4_1__
+    __m128i px[8];
+    for( int i=0; i<8; i++ )
+    {
+        px[i] = _mm_cvtepu8_epi16( _mm_loadl_epi64( (const __m128i*)( src + i*8 ) ) );
+    }
+    return SearchTH( src, block, w, [&px, &w]( const uint32 paint[4], uint32& sel ) { return EvalPaint( px, paint, sel, w ); } );
+#else
+    return SearchTH( src, block, w, [src, &w]( const uint32 paint[4], uint32& sel ) { return EvalPaint( src, paint, sel, w ); } );
+#endif
+}
+
 template<class T, class S>
 uint64 EncodeSelectors( uint64 d, const T terr[2][8], const S tsel[16][8], const uint32* id, const uint64 value, const uint64 error)
 {
@@ -851,10 +935,11 @@ uint64 EncodeSelectors( uint64 d, const T terr[2][8], const S tsel[16][8], const
 }
 }
 
-uint64 ProcessRGB( const uint8* src )
+uint64 ProcessRGB( const uint8* src, ErrorMetric metric )
 {
     uint64 d = CheckSolid( src );
     if( d != 0 ) return d;
+    const auto w = GetErrorWeights( src, metric );
 
     v4i a[8];
     uint err[4] = {};
@@ -869,14 +954,39 @@ uint64 ProcessRGB( const uint8* src )
 #endif
     uint16 tsel[16][8];
     auto id = g_id[idx];
-    FindBestFit( terr, tsel, a, id, src );
+    FindBestFit( terr, tsel, a, id, src, w );
+
+    return FixByteOrder( EncodeSelectors( d, terr, tsel, id ) );
+}
+
+uint64 ProcessRGB_4x2( const uint8* src, ErrorMetric metric )
+{
+    uint64 d = CheckSolid( src );
+    if( d != 0 ) return d;
+    const auto w = GetErrorWeights( src, metric );
+
+    v4i a[8];
+    uint err[4] = {};
+    PrepareAverages( a, src, err );
+    size_t idx = err[0] < err[2] ? 0 : 2;
+    EncodeAverages( d, a, idx );
+
+#if defined __SSE4_1__ && !defined REFERENCE_IMPLEMENTATION
+    uint32 terr[2][8] = {};
+#else
+    uint64 terr[2][8] = {};
+#endif
+    uint16 tsel[16][8];
+    auto id = g_id[idx];
+    FindBestFit( terr, tsel, a, id, src, w );
 
     return FixByteOrder( EncodeSelectors( d, terr, tsel, id ) );
 }
 
-uint64 ProcessRGB_ETC2( const uint8* src )
+uint64 ProcessRGB_ETC2( const uint8* src, bool th, ErrorMetric metric )
 {
-    auto result = Planar( src );
+    const auto w = GetErrorWeights( src, metric );
+    auto result = Planar( src, w );
 
     uint64 d = 0;
 
@@ -893,8 +1003,13 @@ uint64 ProcessRGB_ETC2( const uint8* src )
 #endif
     uint16 tsel[16][8];
     auto id = g_id[idx];
-    FindBestFit( terr, tsel, a, id, src );
+    FindBestFit( terr, tsel, a, id, src, w );
 
-    return EncodeSelectors( d, terr, tsel, id, result.first, result.second );
+    d = EncodeSelectors( d, terr, tsel, id, result.first, result.second );
+    if( th )
+    {
+        d = ProcessTH( src, d, w );
+    }
+    return d;
 }
 
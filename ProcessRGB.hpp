@@ -1,9 +1,12 @@
 #ifndef __PROCESSRGB_HPP__
 #define __PROCESSRGB_HPP__
 
+#include "ErrorMetric.hpp"
 #include "Types.hpp"
 
-uint64 ProcessRGB( const uint8* src );
-uint64 ProcessRGB_ETC2( const uint8* src );
+uint64 ProcessRGB( const uint8* src, ErrorMetric metric );
+uint64 ProcessRGB_4x2( const uint8* src, ErrorMetric metric );
+// th also tries the ETC2 T and H modes
+uint64 ProcessRGB_ETC2( const uint8* src, bool th, ErrorMetric metric );
 
 #endif
@@ -3,6 +3,7 @@
 #include <array>
 #include <string.h>
 
+#include "ErrorMetric.hpp"
 #include "Math.hpp"
 #include "ProcessCommon.hpp"
 #include "ProcessRGB_AVX2.hpp"
@@ -209,8 +210,10 @@ __m128i VS_VECTORCALL PrepareAverages_AVX2( v4i a[8], const __m256i sum4) noexce
     return CalcErrorBlock_AVX2( sum4, a);
 }
 
-void VS_VECTORCALL FindBestFit_4x2_AVX2( uint32 terr[2][8], uint32 tsel[8], v4i a[8], const uint32 offset, const uint8* data) noexcept
+void VS_VECTORCALL FindBestFit_4x2_AVX2( uint32 terr[2][8], uint32 tsel[8], v4i a[8], const uint32 offset, const uint8* data, const ErrorWeights& w) noexcept
 {
+    const __m256i weights = _mm256_set_epi16(0, w.rh, w.gh, w.bh, 0, w.rh, w.gh, w.bh, 0, w.rh, w.gh, w.bh, 0, w.rh, w.gh, w.bh);
+
     __m256i sel0 = _mm256_setzero_si256();
     __m256i sel1 = _mm256_setzero_si256();
 
@@ -233,7 +236,7 @@ void VS_VECTORCALL FindBestFit_4x2_AVX2( uint32 terr[2][8], uint32 tsel[8], v4i
 
             // The scaling values are divided by two and rounded, to allow the differences to be in the range of signed int16
             // This produces slightly different results, but is significant faster
-            __m256i pixel0 = _mm256_madd_epi16(d, _mm256_set_epi16(0, 38, 76, 14, 0, 38, 76, 14, 0, 38, 76, 14, 0, 38, 76, 14));
+            __m256i pixel0 = _mm256_madd_epi16(d, weights);
             __m256i pixel1 = _mm256_packs_epi32(pixel0, pixel0);
             __m256i pixel2 = _mm256_hadd_epi16(pixel1, pixel1);
             __m128i pixel3 = _mm256_castsi256_si128(pixel2);
@@ -336,8 +339,10 @@ void VS_VECTORCALL FindBestFit_4x2_AVX2( uint32 terr[2][8], uint32 tsel[8], v4i
     _mm256_store_si256((__m256i*)tsel, sel);
 }
 
-void VS_VECTORCALL FindBestFit_2x4_AVX2( uint32 terr[2][8], uint32 tsel[8], v4i a[8], const uint32 offset, const uint8* data) noexcept
+void VS_VECTORCALL FindBestFit_2x4_AVX2( uint32 terr[2][8], uint32 tsel[8], v4i a[8], const uint32 offset, const uint8* data, const ErrorWeights& w) noexcept
 {
+    const __m256i weights = _mm256_set_epi16(0, w.rh, w.gh, w.bh, 0, w.rh, w.gh, w.bh, 0, w.rh, w.gh, w.bh, 0, w.rh, w.gh, w.bh);
+
     __m256i sel0 = _mm256_setzero_si256();
     __m256i sel1 = _mm256_setzero_si256();
 
@@ -361,7 +366,7 @@ void VS_VECTORCALL FindBestFit_2x4_AVX2( uint32 terr[2][8], uint32 tsel[8], v4i
 
         // The scaling values are divided by two and rounded, to allow the differences to be in the range of signed int16
         // This produces slightly different results, but is significant faster
-        __m256i pixel0 = _mm256_madd_epi16(d, _mm256_set_epi16(0, 38, 76, 14, 0, 38, 76, 14, 0, 38, 76, 14, 0, 38, 76, 14));
+        __m256i pixel0 = _mm256_madd_epi16(d, weights);
         __m256i pixel1 = _mm256_packs_epi32(pixel0, pixel0);
         __m256i pixel2 = _mm256_hadd_epi16(pixel1, pixel1);
         __m128i pixel3 = _mm256_castsi256_si128(pixel2);
@@ -561,7 +566,7 @@ struct Plane
 	__m256i sum4;
 };
 
-Plane Planar_AVX2(const uint8* src)
+Plane Planar_AVX2(const uint8* src, const ErrorWeights& w)
 {
     __m128i d0 = _mm_loadu_si128(((__m128i*)src) + 0);
     __m128i d1 = _mm_loadu_si128(((__m128i*)src) + 1);
@@ -749,9 +754,9 @@ Plane Planar_AVX2(const uint8* src)
     __m256i gdif = _mm256_sub_epi16(g08, gp2);
     __m256i bdif = _mm256_sub_epi16(b08, bp2);
 
-    __m256i rerr = _mm256_mullo_epi16(rdif, _mm256_set1_epi16(38));
-    __m256i gerr = _mm256_mullo_epi16(gdif, _mm256_set1_epi16(76));
-    __m256i berr = _mm256_mullo_epi16(bdif, _mm256_set1_epi16(14));
+    __m256i rerr = _mm256_mullo_epi16(rdif, _mm256_set1_epi16(w.rh));
+    __m256i gerr = _mm256_mullo_epi16(gdif, _mm256_set1_epi16(w.gh));
+    __m256i berr = _mm256_mullo_epi16(bdif, _mm256_set1_epi16(w.bh));
 
     __m256i sum0 = _mm256_add_epi16(rerr, gerr);
     __m256i sum1 = _mm256_add_epi16(sum0, berr);
@@ -788,6 +793,67 @@ Plane Planar_AVX2(const uint8* src)
     return plane;
 }
 
+// Pixels are expanded to 16 bits per channel, four pixels per register
+uint32 VS_VECTORCALL EvalPaint_AVX2( const __m256i px[4], const uint32 paint[4], uint32& sel, const ErrorWeights& weights ) noexcept
+{
+    const __m256i w = _mm256_setr_epi16( weights.bh, weights.gh, weights.rh, 0, weights.bh, weights.gh, weights.rh, 0, weights.bh, weights.gh, weights.rh, 0, weights.bh, weights.gh, weights.rh, 0 );
+
+    __m256i err[2];
+    __m256i idx[2];
+    for( int k=0; k<4; k++ )
+    {
+        const __m256i c = _mm256_cvtepu8_epi16( _mm_set1_epi32( paint[k] ) );
+        for( int j=0; j<2; j++ )
+        {
+            __m256i d0 = _mm256_sub_epi16( px[j*2], c );
+            __m256i d1 = _mm256_sub_epi16( px[j*2+1], c );
+            __m256i e0 = _mm256_madd_epi16( d0, _mm256_mullo_epi16( d0, w ) );
+            __m256i e1 = _mm256_madd_epi16( d1, _mm256_mullo_epi16( d1, w ) );
+            // Pixel order within the register is 0 1 4 5 2 3 6 7
+            __m256i e = _mm256_hadd_epi32( e0, e1 );
+            if( k == 0 )
+            {
+                err[j] = e;
+                idx[j] = _mm256_setzero_si256();
+            }
+            else
+            {
+                __m256i less = _mm256_cmpgt_epi32( err[j], e );
+                err[j] = _mm256_min_epi32( e, err[j] );
+                idx[j] = _mm256_blendv_epi8( idx[j], _mm256_set1_epi32( k ), less );
+            }
+        }
+    }
+
+    __m256i sum256 = _mm256_add_epi32( err[0], err[1] );
+    __m128i sum = _mm_add_epi32( _mm256_castsi256_si128( sum256 ), _mm256_extracti128_si256( sum256, 1 ) );
+    sum = _mm_hadd_epi32( sum, sum );
+    sum = _mm_hadd_epi32( sum, sum );
+
+    __m256i idx0 = _mm256_permute4x64_epi64( idx[0], _MM_SHUFFLE( 3, 1, 2, 0 ) );
+    __m256i idx1 = _mm256_permute4x64_epi64( idx[1], _MM_SHUFFLE( 3, 1, 2, 0 ) );
+    __m128i idx16a = _mm_packs_epi32( _mm256_castsi256_si128( idx0 ), _mm256_extracti128_si256( idx0, 1 ) );
+    __m128i idx16b = _mm_packs_epi32( _mm256_castsi256_si128( idx1 ), _mm256_extracti128_si256( idx1, 1 ) );
+    __m128i idx8 = _mm_packs_epi16( idx16a, idx16b );
+
+    // Move selector bits to the sign bit of each byte
+    uint32 lsb = _mm_movemask_epi8( _mm_slli_epi16( idx8, 7 ) );
+    uint32 msb = _mm_movemask_epi8( _mm_slli_epi16( idx8, 6 ) );
+    sel = lsb | ( msb << 16 );
+
+    return _mm_cvtsi128_si32( sum );
+}
+
+uint64 ProcessTH_AVX2( const uint8* src, uint64 block, const ErrorWeights& w )
+{
+    __m256i px[4];
+    for( int i=0; i<4; i++ )
+    {
+        px[i] = _mm256_cvtepu8_epi16( _mm_loadu_si128( (const __m128i*)( src + i*16 ) ) );
+    }
+    return SearchTH( src, block, w, [&px, &w]( const uint32 paint[4], uint32& sel ) { return EvalPaint_AVX2( px, paint, sel, w ); } );
+}
+
 uint64 VS_VECTORCALL EncodeSelectors_AVX2( uint64 d, const uint32 terr[2][8], const uint32 tsel[8], const bool rotate, const uint64 value, const uint32 error) noexcept
 {
     size_t tidx[2];
@@ -847,12 +913,135 @@ uint64 VS_VECTORCALL EncodeSelectors_AVX2( uint64 d, const uint32 terr[2][8], co
     return d | static_cast<uint64>(_bswap(t2)) << 32;
 }
 
+// The batched encoders below run the selector search of several blocks at once, one block in each 128-bit
+// lane. Results are the same as those of the single block functions.
+
+// Pixels which use the second average of a split, indexed by the flip bit
+const uint16 g_halfMask[2] = { 0x00FF, 0x3333 };
+
+void VS_VECTORCALL SelectSplit_x2_AVX2( const __m128i err0, const __m128i err1, size_t idx[2] ) noexcept
+{
+    __m256i err = _mm256_inserti128_si256(_mm256_castsi128_si256(err0), err1, 1);
+
+    // Get index of minimum error of each block
+    __m256i errMin0 = _mm256_min_epu32(err, _mm256_shuffle_epi32(err, _MM_SHUFFLE(2, 3, 0, 1)));
+    __m256i errMin1 = _mm256_min_epu32(errMin0, _mm256_shuffle_epi32(errMin0, _MM_SHUFFLE(1, 0, 3, 2)));
+
+    uint32 mask = _mm256_movemask_epi8(_mm256_cmpeq_epi32(errMin1, err));
+
+    idx[0] = _bit_scan_forward(mask & 0xFFFF) >> 2;
+    idx[1] = _bit_scan_forward(mask >> 16) >> 2;
+}
+
+// Luma of the average minus luma of each pixel, with the halved weights of FindBestFit. Pixel order.
+__m256i VS_VECTORCALL LumaDiff_AVX2( const uint8* src, const v4i a[8], size_t idx, const ErrorWeights& ew ) noexcept
+{
+    __m256i d0 = _mm256_loadu_si256(((const __m256i*)src) + 0);
+    __m256i d1 = _mm256_loadu_si256(((const __m256i*)src) + 1);
+
+    // Weights b, g, r, 0
+    __m256i w = _mm256_set1_epi32((ew.rh << 16) | (ew.gh << 8) | ew.bh);
+    __m256i l0 = _mm256_hadd_epi16(_mm256_maddubs_epi16(d0, w), _mm256_maddubs_epi16(d1, w));
+    __m256i l1 = _mm256_permute4x64_epi64(l0, _MM_SHUFFLE(3, 1, 2, 0));
+
+    const v4i& a0 = a[idx * 2];
+    const v4i& a1 = a[idx * 2 + 1];
+    const int16 avg0 = ew.bh * a0[0] + ew.gh * a0[1] + ew.rh * a0[2];
+    const int16 avg1 = ew.bh * a1[0] + ew.gh * a1[1] + ew.rh * a1[2];
+
+    __m256i bits = _mm256_setr_epi16(0x1, 0x2, 0x4, 0x8, 0x10, 0x20, 0x40, 0x80, 0x100, 0x200, 0x400, 0x800, 0x1000, 0x2000, 0x4000, int16(0x8000));
+    __m256i half = _mm256_cmpeq_epi16(_mm256_and_si256(_mm256_set1_epi16(g_halfMask[idx & 1]), bits), bits);
+    __m256i avg = _mm256_blendv_epi8(_mm256_set1_epi16(avg0), _mm256_set1_epi16(avg1), half);
+
+    return _mm256_sub_epi16(avg, l1);
+}
+
+// Pixel pairs are summed in four groups, {0,4}, {2,6}, {8,12} and {10,14}. Each half of both splits is
+// the sum of two of them.
+inline int PairGroup( int q )
+{
+    return ( q / 8 ) * 2 + ( ( q / 2 ) & 1 );
+}
+
+void VS_VECTORCALL FindBestFit_x2_AVX2( uint32 terr[2][2][8], uint32 tsel[2][8], const __m256i v0, const __m256i v1, const size_t flip[2] ) noexcept
+{
+    __m256i p0 = _mm256_permute2x128_si256(v0, v1, (0) | (2 << 4));
+    __m256i p1 = _mm256_permute2x128_si256(v0, v1, (1) | (3 << 4));
+
+    __m256i table0 = _mm256_broadcastsi128_si256(g_table128_SIMD[0]);
+    __m256i table1 = _mm256_broadcastsi128_si256(g_table128_SIMD[1]);
+
+    __m256i sel0 = _mm256_setzero_si256();
+    __m256i sel1 = _mm256_setzero_si256();
+    __m256i errLo[4], errHi[4];
+    for (int g = 0; g < 4; ++g)
+    {
+        errLo[g] = _mm256_setzero_si256();
+        errHi[g] = _mm256_setzero_si256();
+    }
+
+    for (int q = 0; q < 16; q += 2)
+    {
+        __m256i p = q < 8 ? p0 : p1;
+        int j = q % 8;
+
+        // Luma difference of pixels q and q+1 of each block, broadcast to all tables
+        __m256i x = _mm256_shuffle_epi8(p, _mm256_set1_epi16(short((2 * j) | ((2 * j + 1) << 8))));
+        __m256i y = _mm256_shuffle_epi8(p, _mm256_set1_epi16(short((2 * j + 2) | ((2 * j + 3) << 8))));
+
+        __m256i ax = _mm256_abs_epi16(x);
+        __m256i ay = _mm256_abs_epi16(y);
+
+        __m256i ex0 = _mm256_abs_epi16(_mm256_sub_epi16(ax, table0));
+        __m256i ex1 = _mm256_abs_epi16(_mm256_sub_epi16(ax, table1));
+        __m256i ey0 = _mm256_abs_epi16(_mm256_sub_epi16(ay, table0));
+        __m256i ey1 = _mm256_abs_epi16(_mm256_sub_epi16(ay, table1));
+
+        __m256i mx = _mm256_min_epi16(ex0, ex1);
+        __m256i my = _mm256_min_epi16(ey0, ey1);
+
+        __m256i lo = _mm256_unpacklo_epi16(mx, my);
+        __m256i hi = _mm256_unpackhi_epi16(mx, my);
+
+        int g = PairGroup(q);
+        errLo[g] = _mm256_add_epi32(errLo[g], _mm256_madd_epi16(lo, lo));
+        errHi[g] = _mm256_add_epi32(errHi[g], _mm256_madd_epi16(hi, hi));
+
+        // Selector bits q and q+1, the table entry and the sign
+        __m256i bx = _mm256_set1_epi16(short(1 << q));
+        __m256i by = _mm256_set1_epi16(short(1 << (q + 1)));
+
+        sel0 = _mm256_or_si256(sel0, _mm256_and_si256(_mm256_cmpgt_epi16(ex0, ex1), bx));
+        sel0 = _mm256_or_si256(sel0, _mm256_and_si256(_mm256_cmpgt_epi16(ey0, ey1), by));
+        sel1 = _mm256_or_si256(sel1, _mm256_and_si256(_mm256_srai_epi16(x, 15), bx));
+        sel1 = _mm256_or_si256(sel1, _mm256_and_si256(_mm256_srai_epi16(y, 15), by));
+    }
+
+    __m256i rotate = _mm256_setr_epi32(-int(flip[0]), -int(flip[0]), -int(flip[0]), -int(flip[0]), -int(flip[1]), -int(flip[1]), -int(flip[1]), -int(flip[1]));
+
+    __m256i err1Lo = _mm256_blendv_epi8(_mm256_add_epi32(errLo[0], errLo[1]), _mm256_add_epi32(errLo[0], errLo[2]), rotate);
+    __m256i err1Hi = _mm256_blendv_epi8(_mm256_add_epi32(errHi[0], errHi[1]), _mm256_add_epi32(errHi[0], errHi[2]), rotate);
+    __m256i err0Lo = _mm256_blendv_epi8(_mm256_add_epi32(errLo[2], errLo[3]), _mm256_add_epi32(errLo[1], errLo[3]), rotate);
+    __m256i err0Hi = _mm256_blendv_epi8(_mm256_add_epi32(errHi[2], errHi[3]), _mm256_add_epi32(errHi[1], errHi[3]), rotate);
+
+    __m256i selLo = _mm256_unpacklo_epi16(sel0, sel1);
+    __m256i selHi = _mm256_unpackhi_epi16(sel0, sel1);
+
+    _mm256_store_si256((__m256i*)terr[0][0], _mm256_permute2x128_si256(err0Lo, err0Hi, (0) | (2 << 4)));
+    _mm256_store_si256((__m256i*)terr[0][1], _mm256_permute2x128_si256(err1Lo, err1Hi, (0) | (2 << 4)));
+    _mm256_store_si256((__m256i*)terr[1][0], _mm256_permute2x128_si256(err0Lo, err0Hi, (1) | (3 << 4)));
+    _mm256_store_si256((__m256i*)terr[1][1], _mm256_permute2x128_si256(err1Lo, err1Hi, (1) | (3 << 4)));
+    _mm256_store_si256((__m256i*)tsel[0], _mm256_permute2x128_si256(selLo, selHi, (0) | (2 << 4)));
+    _mm256_store_si256((__m256i*)tsel[1], _mm256_permute2x128_si256(selLo, selHi, (1) | (3 << 4)));
+}
+
 }
 
-uint64 ProcessRGB_AVX2( const uint8* src )
+uint64 ProcessRGB_AVX2( const uint8* src, ErrorMetric metric )
 {
     uint64 d = CheckSolid_AVX2( src );
     if( d != 0 ) return d;
+    const auto w = GetErrorWeights( src, metric );
 
     alignas(32) v4i a[8];
 
@@ -878,20 +1067,21 @@ uint64 ProcessRGB_AVX2( const uint8* src )
 
     if ((idx == 0) || (idx == 2))
     {
-        FindBestFit_4x2_AVX2( terr, tsel, a, idx * 2, src );
+        FindBestFit_4x2_AVX2( terr, tsel, a, idx * 2, src, w );
     }
     else
     {
-        FindBestFit_2x4_AVX2( terr, tsel, a, idx * 2, src );
+        FindBestFit_2x4_AVX2( terr, tsel, a, idx * 2, src, w );
     }
 
     return EncodeSelectors_AVX2( d, terr, tsel, (idx % 2) == 1 );
 }
 
-uint64 ProcessRGB_4x2_AVX2( const uint8* src )
+uint64 ProcessRGB_4x2_AVX2( const uint8* src, ErrorMetric metric )
 {
     uint64 d = CheckSolid_AVX2( src );
     if( d != 0 ) return d;
+    const auto w = GetErrorWeights( src, metric );
 
     alignas(32) v4i a[8];
 
@@ -904,15 +1094,16 @@ uint64 ProcessRGB_4x2_AVX2( const uint8* src )
     alignas(32) uint32 terr[2][8] = {};
     alignas(32) uint32 tsel[8];
 
-    FindBestFit_4x2_AVX2( terr, tsel, a, idx * 2, src );
+    FindBestFit_4x2_AVX2( terr, tsel, a, idx * 2, src, w );
 
     return EncodeSelectors_AVX2( d, terr, tsel, false);
 }
 
-uint64 ProcessRGB_2x4_AVX2( const uint8* src )
+uint64 ProcessRGB_2x4_AVX2( const uint8* src, ErrorMetric metric )
 {
     uint64 d = CheckSolid_AVX2( src );
     if( d != 0 ) return d;
+    const auto w = GetErrorWeights( src, metric );
 
     alignas(32) v4i a[8];
 
@@ -925,14 +1116,15 @@ uint64 ProcessRGB_2x4_AVX2( const uint8* src )
     alignas(32) uint32 terr[2][8] = {};
     alignas(32) uint32 tsel[8];
 
-    FindBestFit_2x4_AVX2( terr, tsel, a, idx * 2, src );
+    FindBestFit_2x4_AVX2( terr, tsel, a, idx * 2, src, w );
 
     return EncodeSelectors_AVX2( d, terr, tsel, true);
 }
 
-uint64 ProcessRGB_ETC2_AVX2( const uint8* src )
+uint64 ProcessRGB_ETC2_AVX2( const uint8* src, bool th, ErrorMetric metric )
 {
-    auto plane = Planar_AVX2( src );
+    const auto w = GetErrorWeights( src, metric );
+    auto plane = Planar_AVX2( src, w );
 
     alignas(32) v4i a[8];
 
@@ -958,16 +1150,271 @@ uint64 ProcessRGB_ETC2_AVX2( const uint8* src )
 
     if ((idx == 0) || (idx == 2))
     {
-        FindBestFit_4x2_AVX2( terr, tsel, a, idx * 2, src );
+        FindBestFit_4x2_AVX2( terr, tsel, a, idx * 2, src, w );
     }
     else
     {
-        FindBestFit_2x4_AVX2( terr, tsel, a, idx * 2, src );
+        FindBestFit_2x4_AVX2( terr, tsel, a, idx * 2, src, w );
     }
 
-    return EncodeSelectors_AVX2( d, terr, tsel, (idx % 2) == 1, plane.plane, plane.error );
+    d = EncodeSelectors_AVX2( d, terr, tsel, (idx % 2) == 1, plane.plane, plane.error );
+    if( th )
+    {
+        d = ProcessTH_AVX2( src, d, w );
+    }
+    return d;
 }
 
+void ProcessRGB_AVX2_x2( const uint8* src, uint64* dst, ErrorMetric metric )
+{
+    const uint8* src1 = src + 64;
+    const ErrorWeights w[2] = { GetErrorWeights( src, metric ), GetErrorWeights( src1, metric ) };
+
+    alignas(32) v4i a[2][8];
+    size_t idx[2];
+    SelectSplit_x2_AVX2( PrepareAverages_AVX2( a[0], src ), PrepareAverages_AVX2( a[1], src1 ), idx );
+
+    const size_t flip[2] = { idx[0] & 1, idx[1] & 1 };
+
+    alignas(32) uint32 terr[2][2][8];
+    alignas(32) uint32 tsel[2][8];
+    FindBestFit_x2_AVX2( terr, tsel, LumaDiff_AVX2( src, a[0], idx[0], w[0] ), LumaDiff_AVX2( src1, a[1], idx[1], w[1] ), flip );
+
+    for( int i=0; i<2; i++ )
+    {
+        uint64 d = CheckSolid_AVX2( src + i*64 );
+        if( d == 0 )
+        {
+            d = EncodeSelectors_AVX2( EncodeAverages_AVX2( a[i], idx[i] ), terr[i], tsel[i], flip[i] == 1 );
+        }
+        dst[i] = d;
+    }
+}
+
+void ProcessRGB_ETC2_AVX2_x2( const uint8* src, uint64* dst, bool th, ErrorMetric metric )
+{
+    const uint8* src1 = src + 64;
+    const ErrorWeights w[2] = { GetErrorWeights( src, metric ), GetErrorWeights( src1, metric ) };
+
+    const Plane plane[2] = { Planar_AVX2( src, w[0] ), Planar_AVX2( src1, w[1] ) };
+
+    alignas(32) v4i a[2][8];
+    size_t idx[2];
+    SelectSplit_x2_AVX2( PrepareAverages_AVX2( a[0], plane[0].sum4 ), PrepareAverages_AVX2( a[1], plane[1].sum4 ), idx );
+
+    const size_t flip[2] = { idx[0] & 1, idx[1] & 1 };
+
+    alignas(32) uint32 terr[2][2][8];
+    alignas(32) uint32 tsel[2][8];
+    FindBestFit_x2_AVX2( terr, tsel, LumaDiff_AVX2( src, a[0], idx[0], w[0] ), LumaDiff_AVX2( src1, a[1], idx[1], w[1] ), flip );
+
+    for( int i=0; i<2; i++ )
+    {
+        uint64 d = EncodeSelectors_AVX2( EncodeAverages_AVX2( a[i], idx[i] ), terr[i], tsel[i], flip[i] == 1, plane[i].plane, plane[i].error );
+        if( th )
+        {
+            d = ProcessTH_AVX2( src + i*64, d, w[i] );
+        }
+        dst[i] = d;
+    }
+}
+
+#ifndef _MSC_VER
+#  pragma GCC push_options
+#  pragma GCC target ("avx2,fma,bmi2,avx512f,avx512bw,avx512vl")
+#endif
+
+namespace
+{
+
+void VS_VECTORCALL SelectSplit_x4_AVX512( const __m128i err[4], size_t idx[4] ) noexcept
+{
+    __m512i e = _mm512_inserti64x4(_mm512_castsi256_si512(_mm256_inserti128_si256(_mm256_castsi128_si256(err[0]), err[1], 1)),
+        _mm256_inserti128_si256(_mm256_castsi128_si256(err[2]), err[3], 1), 1);
+
+    // Get index of minimum error of each block
+    __m512i errMin0 = _mm512_min_epu32(e, _mm512_shuffle_epi32(e, _MM_PERM_CDAB));
+    __m512i errMin1 = _mm512_min_epu32(errMin0, _mm512_shuffle_epi32(errMin0, _MM_PERM_BADC));
+
+    uint32 mask = _mm512_cmpeq_epi32_mask(errMin1, e);
+
+    for (int b = 0; b < 4; ++b)
+    {
+        idx[b] = _bit_scan_forward((mask >> (b * 4)) & 0xF);
+    }
+}
+
+void VS_VECTORCALL FindBestFit_x4_AVX512( uint32 terr[4][2][8], uint32 tsel[4][8], const __m256i v[4], const size_t flip[4] ) noexcept
+{
+    __m512i v01 = _mm512_inserti64x4(_mm512_castsi256_si512(v[0]), v[1], 1);
+    __m512i v23 = _mm512_inserti64x4(_mm512_castsi256_si512(v[2]), v[3], 1);
+
+    // Pixels 0-7 and 8-15 of each block, one block per lane
+    __m512i p0 = _mm512_shuffle_i64x2(v01, v23, _MM_SHUFFLE(2, 0, 2, 0));
+    __m512i p1 = _mm512_shuffle_i64x2(v01, v23, _MM_SHUFFLE(3, 1, 3, 1));
+
+    __m512i table0 = _mm512_broadcast_i32x4(g_table128_SIMD[0]);
+    __m512i table1 = _mm512_broadcast_i32x4(g_table128_SIMD[1]);
+
+    __m512i sel0 = _mm512_setzero_si512();
+    __m512i sel1 = _mm512_setzero_si512();
+    __m512i errLo[4], errHi[4];
+    for (int g = 0; g < 4; ++g)
+    {
+        errLo[g] = _mm512_setzero_si512();
+        errHi[g] = _mm512_setzero_si512();
+    }
+
+    for (int q = 0; q < 16; q += 2)
+    {
+        __m512i p = q < 8 ? p0 : p1;
+        int j = q % 8;
+
+        __m512i x = _mm512_shuffle_epi8(p, _mm512_set1_epi16(short((2 * j) | ((2 * j + 1) << 8))));
+        __m512i y = _mm512_shuffle_epi8(p, _mm512_set1_epi16(short((2 * j + 2) | ((2 * j + 3) << 8))));
+
+        __m512i ax = _mm512_abs_epi16(x);
+        __m512i ay = _mm512_abs_epi16(y);
+
+        __m512i ex0 = _mm512_abs_epi16(_mm512_sub_epi16(ax, table0));
+        __m512i ex1 = _mm512_abs_epi16(_mm512_sub_epi16(ax, table1));
+        __m512i ey0 = _mm512_abs_epi16(_mm512_sub_epi16(ay, table0));
+        __m512i ey1 = _mm512_abs_epi16(_mm512_sub_epi16(ay, table1));
+
+        __m512i mx = _mm512_min_epi16(ex0, ex1);
+        __m512i my = _mm512_min_epi16(ey0, ey1);
+
+        __m512i lo = _mm512_unpacklo_epi16(mx, my);
+        __m512i hi = _mm512_unpackhi_epi16(mx, my);
+
+        int g = PairGroup(q);
+        errLo[g] = _mm512_add_epi32(errLo[g], _mm512_madd_epi16(lo, lo));
+        errHi[g] = _mm512_add_epi32(errHi[g], _mm512_madd_epi16(hi, hi));
+
+        __m512i bx = _mm512_set1_epi16(short(1 << q));
+        __m512i by = _mm512_set1_epi16(short(1 << (q + 1)));
+
+        sel0 = _mm512_or_si512(sel0, _mm512_maskz_mov_epi16(_mm512_cmpgt_epi16_mask(ex0, ex1), bx));
+        sel0 = _mm512_or_si512(sel0, _mm512_maskz_mov_epi16(_mm512_cmpgt_epi16_mask(ey0, ey1), by));
+        sel1 = _mm512_or_si512(sel1, _mm512_maskz_mov_epi16(_mm512_movepi16_mask(x), bx));
+        sel1 = _mm512_or_si512(sel1, _mm512_maskz_mov_epi16(_mm512_movepi16_mask(y), by));
+    }
+
+    __mmask16 rotate = 0;
+    for (int b = 0; b < 4; ++b)
+    {
+        if (flip[b]) rotate |= 0xF << (b * 4);
+    }
+
+    __m512i err1Lo = _mm512_mask_blend_epi32(rotate, _mm512_add_epi32(errLo[0], errLo[1]), _mm512_add_epi32(errLo[0], errLo[2]));
+    __m512i err1Hi = _mm512_mask_blend_epi32(rotate, _mm512_add_epi32(errHi[0], errHi[1]), _mm512_add_epi32(errHi[0], errHi[2]));
+    __m512i err0Lo = _mm512_mask_blend_epi32(rotate, _mm512_add_epi32(errLo[2], errLo[3]), _mm512_add_epi32(errLo[1], errLo[3]));
+    __m512i err0Hi = _mm512_mask_blend_epi32(rotate, _mm512_add_epi32(errHi[2], errHi[3]), _mm512_add_epi32(errHi[1], errHi[3]));
+
+    __m512i selLo = _mm512_unpacklo_epi16(sel0, sel1);
+    __m512i selHi = _mm512_unpackhi_epi16(sel0, sel1);
+
+    // Lower and upper tables of a block next to each other
+    __m512i first = _mm512_setr_epi64(0, 1, 8, 9, 2, 3, 10, 11);
+    __m512i second = _mm512_setr_epi64(4, 5, 12, 13, 6, 7, 14, 15);
+
+    __m512i e0[2] = { _mm512_permutex2var_epi64(err0Lo, first, err0Hi), _mm512_permutex2var_epi64(err0Lo, second, err0Hi) };
+    __m512i e1[2] = { _mm512_permutex2var_epi64(err1Lo, first, err1Hi), _mm512_permutex2var_epi64(err1Lo, second, err1Hi) };
+    __m512i s[2] = { _mm512_permutex2var_epi64(selLo, first, selHi), _mm512_permutex2var_epi64(selLo, second, selHi) };
+
+    for (int i = 0; i < 2; ++i)
+    {
+        _mm256_store_si256((__m256i*)terr[i * 2][0], _mm512_castsi512_si256(e0[i]));
+        _mm256_store_si256((__m256i*)terr[i * 2][1], _mm512_castsi512_si256(e1[i]));
+        _mm256_store_si256((__m256i*)terr[i * 2 + 1][0], _mm512_extracti64x4_epi64(e0[i], 1));
+        _mm256_store_si256((__m256i*)terr[i * 2 + 1][1], _mm512_extracti64x4_epi64(e1[i], 1));
+        _mm256_store_si256((__m256i*)tsel[i * 2], _mm512_castsi512_si256(s[i]));
+        _mm256_store_si256((__m256i*)tsel[i * 2 + 1], _mm512_extracti64x4_epi64(s[i], 1));
+    }
+}
+
+}
+
+void ProcessRGB_AVX512_x4( const uint8* src, uint64* dst, ErrorMetric metric )
+{
+    ErrorWeights w[4];
+    alignas(32) v4i a[4][8];
+    __m128i err[4];
+    for( int i=0; i<4; i++ )
+    {
+        w[i] = GetErrorWeights( src + i*64, metric );
+        err[i] = PrepareAverages_AVX2( a[i], src + i*64 );
+    }
+
+    size_t idx[4];
+    SelectSplit_x4_AVX512( err, idx );
+
+    size_t flip[4];
+    __m256i v[4];
+    for( int i=0; i<4; i++ )
+    {
+        flip[i] = idx[i] & 1;
+        v[i] = LumaDiff_AVX2( src + i*64, a[i], idx[i], w[i] );
+    }
+
+    alignas(32) uint32 terr[4][2][8];
+    alignas(32) uint32 tsel[4][8];
+    FindBestFit_x4_AVX512( terr, tsel, v, flip );
+
+    for( int i=0; i<4; i++ )
+    {
+        uint64 d = CheckSolid_AVX2( src + i*64 );
+        if( d == 0 )
+        {
+            d = EncodeSelectors_AVX2( EncodeAverages_AVX2( a[i], idx[i] ), terr[i], tsel[i], flip[i] == 1 );
+        }
+        dst[i] = d;
+    }
+}
+
+void ProcessRGB_ETC2_AVX512_x4( const uint8* src, uint64* dst, bool th, ErrorMetric metric )
+{
+    ErrorWeights w[4];
+    Plane plane[4];
+    alignas(32) v4i a[4][8];
+    __m128i err[4];
+    for( int i=0; i<4; i++ )
+    {
+        w[i] = GetErrorWeights( src + i*64, metric );
+        plane[i] = Planar_AVX2( src + i*64, w[i] );
+        err[i] = PrepareAverages_AVX2( a[i], plane[i].sum4 );
+    }
+
+    size_t idx[4];
+    SelectSplit_x4_AVX512( err, idx );
+
+    size_t flip[4];
+    __m256i v[4];
+    for( int i=0; i<4; i++ )
+    {
+        flip[i] = idx[i] & 1;
+        v[i] = LumaDiff_AVX2( src + i*64, a[i], idx[i], w[i] );
+    }
+
+    alignas(32) uint32 terr[4][2][8];
+    alignas(32) uint32 tsel[4][8];
+    FindBestFit_x4_AVX512( terr, tsel, v, flip );
+
+    for( int i=0; i<4; i++ )
+    {
+        uint64 d = EncodeSelectors_AVX2( EncodeAverages_AVX2( a[i], idx[i] ), terr[i], tsel[i], flip[i] == 1, plane[i].plane, plane[i].error );
+        if( th )
+        {
+            d = ProcessTH_AVX2( src + i*64, d, w[i] );
+        }
+        dst[i] = d;
+    }
+}
+
+#ifndef _MSC_VER
+#  pragma GCC pop_options
+#endif
+
 #ifndef _MSC_VER
 #  pragma GCC pop_options
 #endif
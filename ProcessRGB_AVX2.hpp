@@ -3,12 +3,21 @@
 
 #ifdef __SSE4_1__
 
+#include "ErrorMetric.hpp"
 #include "Types.hpp"
 
-uint64 ProcessRGB_AVX2( const uint8* src );
-uint64 ProcessRGB_4x2_AVX2( const uint8* src );
-uint64 ProcessRGB_2x4_AVX2( const uint8* src );
-uint64 ProcessRGB_ETC2_AVX2( const uint8* src );
+uint64 ProcessRGB_AVX2( const uint8* src, ErrorMetric metric );
+uint64 ProcessRGB_4x2_AVX2( const uint8* src, ErrorMetric metric );
+uint64 ProcessRGB_2x4_AVX2( const uint8* src, ErrorMetric metric );
+uint64 ProcessRGB_ETC2_AVX2( const uint8* src, bool th, ErrorMetric metric );
+
+// Two blocks, stored one after the other in src, are encoded at once
+void ProcessRGB_AVX2_x2( const uint8* src, uint64* dst, ErrorMetric metric );
+void ProcessRGB_ETC2_AVX2_x2( const uint8* src, uint64* dst, bool th, ErrorMetric metric );
+
+// Four blocks at once, needs AVX-512 BW and VL
+void ProcessRGB_AVX512_x4( const uint8* src, uint64* dst, ErrorMetric metric );
+void ProcessRGB_ETC2_AVX512_x4( const uint8* src, uint64* dst, bool th, ErrorMetric metric );
 
 #endif
 
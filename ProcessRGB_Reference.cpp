@@ -0,0 +1,13 @@
+// ProcessRGB.cpp without SIMD code and with REFERENCE_IMPLEMENTATION, as the baseline of the differential
+// check. The entry points are renamed, so that it can be linked next to the regular build.
+#undef __SSE4_1__
+#define REFERENCE_IMPLEMENTATION
+#define ProcessRGB ProcessRGB_Reference
+#define ProcessRGB_4x2 ProcessRGB_4x2_Reference
+#define ProcessRGB_ETC2 ProcessRGB_ETC2_Reference
+#ifdef _MSC_VER
+#  include <stdlib.h>
+#  define _bswap(x) _byteswap_ulong(x)
+#endif
+
+#include "ProcessRGB.cpp"
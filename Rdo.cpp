@@ -0,0 +1,351 @@
+#include <algorithm>
+#include <vector>
+
+#include "CpuArch.hpp"
+#include "DecodeCommon.hpp"
+#include "Math.hpp"
+#include "Rdo.hpp"
+#include "Rdo_AVX2.hpp"
+#include "Tables.hpp"
+#ifdef __SSE4_1__
+#  ifdef _MSC_VER
+#    include <intrin.h>
+#  else
+#    include <x86intrin.h>
+#  endif
+#endif
+
+// Blocks before the current one on its row that are tried as sources, besides the three above it
+enum { Window = 4 };
+
+// Halved weights sum to 128, this brings weighted errors back to the scale of plain squared RGB error
+static const float ErrorScale = 3.f / 128;
+
+// Estimated size after LZ compression, in bits. A four byte half found in a nearby block costs about as
+// much as a short match, and a whole block is a single match.
+enum { HalfLiteral = 32, HalfMatch = 16, BlockMatch = 16 };
+
+// Selector of pixel i, with the second sub-block in 4..7
+static inline uint32 Index( uint32 sel, uint32 sub, int i )
+{
+    return ( ( sel >> i ) & 0x1 ) | ( ( sel >> ( i + 15 ) ) & 0x2 ) | ( ( ( sub >> i ) & 0x1 ) << 2 );
+}
+
+// w0 is the color word in big endian order
+static void BaseColors( uint32 w0, int32 base[2][3] )
+{
+    if( w0 & 0x2 )
+    {
+        for( int i=0; i<3; i++ )
+        {
+            const int32 c = ( w0 >> ( 27 - i*8 ) ) & 0x1F;
+            const int32 c2 = c + ( int32( w0 << ( 5 + i*8 ) ) >> 29 );
+            base[0][i] = ( c << 3 ) | ( c >> 2 );
+            base[1][i] = ( c2 << 3 ) | ( c2 >> 2 );
+        }
+    }
+    else
+    {
+        for( int i=0; i<3; i++ )
+        {
+            base[0][i] = ( ( w0 >> ( 28 - i*8 ) ) & 0xF ) * 17;
+            base[1][i] = ( ( w0 >> ( 24 - i*8 ) ) & 0xF ) * 17;
+        }
+    }
+}
+
+struct Colors
+{
+    uint32 pal[8];      // BGRA, as the source pixels
+    uint32 sub;
+};
+
+static void GetColors( uint64 d, Colors& c )
+{
+    DecodePalette( ByteSwap32( uint32( d ) ), ByteSwap32( uint32( d >> 32 ) ), c.pal, c.sub );
+    for( int i=0; i<8; i++ )
+    {
+        const uint32 v = c.pal[i];
+        c.pal[i] = ( v & 0xFF00FF00 ) | ( ( v & 0xFF ) << 16 ) | ( ( v >> 16 ) & 0xFF );
+    }
+}
+
+#ifdef __SSE4_1__
+// Weighted squared error of four pixels, w holds the halved weights in BGRA order for two pixels
+static inline __m128i Error4( __m128i a, __m128i b, __m128i w )
+{
+    const __m128i mask = _mm_set1_epi32( 0x00FFFFFF );
+    a = _mm_and_si128( a, mask );
+    b = _mm_and_si128( b, mask );
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i lo = _mm_sub_epi16( _mm_unpacklo_epi8( a, zero ), _mm_unpacklo_epi8( b, zero ) );
+    const __m128i hi = _mm_sub_epi16( _mm_unpackhi_epi8( a, zero ), _mm_unpackhi_epi8( b, zero ) );
+    return _mm_hadd_epi32( _mm_madd_epi16( lo, _mm_mullo_epi16( lo, w ) ), _mm_madd_epi16( hi, _mm_mullo_epi16( hi, w ) ) );
+}
+
+static inline uint32 Sum4( __m128i v )
+{
+    v = _mm_add_epi32( v, _mm_shuffle_epi32( v, _MM_SHUFFLE( 1, 0, 3, 2 ) ) );
+    v = _mm_add_epi32( v, _mm_shuffle_epi32( v, _MM_SHUFFLE( 2, 3, 0, 1 ) ) );
+    return _mm_cvtsi128_si32( v );
+}
+
+static inline __m128i Weights( const ErrorWeights& w )
+{
+    return _mm_setr_epi16( w.bh, w.gh, w.rh, 0, w.bh, w.gh, w.rh, 0 );
+}
+#else
+static inline uint32 Error1( uint32 a, uint32 b, const ErrorWeights& w )
+{
+    const int32 wc[3] = { w.bh, w.gh, w.rh };
+    uint32 err = 0;
+    for( int c=0; c<3; c++ )
+    {
+        err += wc[c] * sq( int32( ( a >> ( c*8 ) ) & 0xFF ) - int32( ( b >> ( c*8 ) ) & 0xFF ) );
+    }
+    return err;
+}
+#endif
+
+static uint32 BlockError( const uint32* src, const Colors& c, uint32 sel, const ErrorWeights& w )
+{
+    alignas(16) uint32 px[16];
+    for( int i=0; i<16; i++ )
+    {
+        px[i] = c.pal[Index( sel, c.sub, i )];
+    }
+
+#ifdef __SSE4_1__
+    const __m128i wv = Weights( w );
+    __m128i sum = _mm_setzero_si128();
+    for( int i=0; i<16; i+=4 )
+    {
+        sum = _mm_add_epi32( sum, Error4( _mm_loadu_si128( (const __m128i*)( src + i ) ), _mm_load_si128( (const __m128i*)( px + i ) ), wv ) );
+    }
+    return Sum4( sum );
+#else
+    uint32 err = 0;
+    for( int i=0; i<16; i++ )
+    {
+        err += Error1( src[i], px[i], w );
+    }
+    return err;
+#endif
+}
+
+// Selectors with the least error for the colors, in big endian order. Returns the error.
+static uint32 FitSelectors( const uint32* src, const Colors& c, const ErrorWeights& w, uint32& sel )
+{
+    sel = 0;
+#ifdef __SSE4_1__
+    const __m128i wv = Weights( w );
+    const __m128i bits = _mm_setr_epi32( 1, 2, 4, 8 );
+    __m128i sum = _mm_setzero_si128();
+    for( int i=0; i<16; i+=4 )
+    {
+        const __m128i px = _mm_loadu_si128( (const __m128i*)( src + i ) );
+        const __m128i second = _mm_cmpeq_epi32( _mm_and_si128( _mm_set1_epi32( c.sub >> i ), bits ), bits );
+
+        __m128i best = _mm_set1_epi32( -1 );
+        __m128i idx = _mm_setzero_si128();
+        for( int k=0; k<4; k++ )
+        {
+            const __m128i col = _mm_blendv_epi8( _mm_set1_epi32( c.pal[k] ), _mm_set1_epi32( c.pal[k+4] ), second );
+            const __m128i err = Error4( px, col, wv );
+            const __m128i lt = _mm_cmplt_epi32( err, best );
+            best = _mm_min_epu32( err, best );
+            idx = _mm_blendv_epi8( idx, _mm_set1_epi32( k ), lt );
+        }
+        sum = _mm_add_epi32( sum, best );
+
+        alignas(16) uint32 k[4];
+        _mm_store_si128( (__m128i*)k, idx );
+        for( int j=0; j<4; j++ )
+        {
+            sel |= ( ( k[j] & 0x1 ) << ( i + j ) ) | ( ( k[j] >> 1 ) << ( i + j + 16 ) );
+        }
+    }
+    return Sum4( sum );
+#else
+    uint32 sum = 0;
+    for( int i=0; i<16; i++ )
+    {
+        const uint32* pal = c.pal + ( ( c.sub >> i ) & 0x1 ) * 4;
+        uint32 best = Error1( src[i], pal[0], w );
+        uint32 k = 0;
+        for( uint32 j=1; j<4; j++ )
+        {
+            const uint32 err = Error1( src[i], pal[j], w );
+            if( err < best )
+            {
+                best = err;
+                k = j;
+            }
+        }
+        sum += best;
+        sel |= ( ( k & 0x1 ) << i ) | ( ( k >> 1 ) << ( i + 16 ) );
+    }
+    return sum;
+#endif
+}
+
+void FitTables( const uint32* src, const int32 base[2][3], const ErrorWeights& w, uint32 sel, uint32 sub, uint32 err[2][8] )
+{
+#ifdef __SSE4_1__
+    // Tables 0-3 in the first register, 4-7 in the second
+    __m128i mod[4][2];
+    for( int k=0; k<4; k++ )
+    {
+        mod[k][0] = _mm_setr_epi32( g_table[0][k], g_table[1][k], g_table[2][k], g_table[3][k] );
+        mod[k][1] = _mm_setr_epi32( g_table[4][k], g_table[5][k], g_table[6][k], g_table[7][k] );
+    }
+
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i max = _mm_set1_epi32( 255 );
+    const __m128i wc[3] = { _mm_set1_epi32( w.rh ), _mm_set1_epi32( w.gh ), _mm_set1_epi32( w.bh ) };
+    __m128i acc[2][2] = { { zero, zero }, { zero, zero } };
+    for( int i=0; i<16; i++ )
+    {
+        const uint32 k = ( ( sel >> i ) & 0x1 ) | ( ( sel >> ( i + 15 ) ) & 0x2 );
+        const uint32 s = ( sub >> i ) & 0x1;
+        const uint32 p = src[i];
+        for( int h=0; h<2; h++ )
+        {
+            // Source pixels are BGRA, base colors RGB. Differences are below 256 and weights below 128, so
+            // madd multiplies in 16 bits.
+            __m128i sum = zero;
+            for( int c=0; c<3; c++ )
+            {
+                const __m128i v = _mm_min_epi32( _mm_max_epi32( _mm_add_epi32( _mm_set1_epi32( base[s][c] ), mod[k][h] ), zero ), max );
+                const __m128i d = _mm_abs_epi32( _mm_sub_epi32( v, _mm_set1_epi32( ( p >> ( 16 - c*8 ) ) & 0xFF ) ) );
+                sum = _mm_add_epi32( sum, _mm_madd_epi16( d, _mm_mullo_epi16( d, wc[c] ) ) );
+            }
+            acc[s][h] = _mm_add_epi32( acc[s][h], sum );
+        }
+    }
+
+    for( int s=0; s<2; s++ )
+    {
+        _mm_storeu_si128( (__m128i*)err[s], acc[s][0] );
+        _mm_storeu_si128( (__m128i*)( err[s] + 4 ), acc[s][1] );
+    }
+#else
+    const int32 wc[3] = { w.rh, w.gh, w.bh };
+    for( int s=0; s<2; s++ )
+    {
+        for( int t=0; t<8; t++ ) err[s][t] = 0;
+    }
+    for( int i=0; i<16; i++ )
+    {
+        const uint32 k = ( ( sel >> i ) & 0x1 ) | ( ( sel >> ( i + 15 ) ) & 0x2 );
+        const uint32 s = ( sub >> i ) & 0x1;
+        const uint32 p = src[i];
+        for( int t=0; t<8; t++ )
+        {
+            for( int c=0; c<3; c++ )
+            {
+                err[s][t] += wc[c] * sq( clampu8( base[s][c] + g_table[t][k] ) - int32( ( p >> ( 16 - c*8 ) ) & 0xFF ) );
+            }
+        }
+    }
+#endif
+}
+
+typedef void (*FitTablesFn)( const uint32*, const int32[2][3], const ErrorWeights&, uint32, uint32, uint32[2][8] );
+
+// Resolved on first use, after any cpu_force_isa() call
+static FitTablesFn GetFitTables()
+{
+#ifdef __SSE4_1__
+    static const FitTablesFn fn = cpu_isa() >= CpuIsa::AVX2 ? FitTables_AVX2 : FitTables;
+#else
+    static const FitTablesFn fn = FitTables;
+#endif
+    return fn;
+}
+
+void RdoEtc1( const uint32* src, uint64* dst, uint32 blocks, uint32 rowBlocks, float lambda, ErrorMetric metric )
+{
+    const auto fitTables = GetFitTables();
+
+    // Colors of the final blocks, for the blocks after them
+    std::vector<Colors> colors( blocks );
+
+    for( uint32 i=0; i<blocks; i++ )
+    {
+        const uint32* px = src + size_t( i ) * 16;
+        const uint64 d = dst[i];
+        const auto w = GetErrorWeights( (const uint8*)px, metric );
+        Colors& own = colors[i];
+        GetColors( d, own );
+
+        uint32 cand[Window+3];
+        int num = 0;
+        for( uint32 j=1; j<=Window && j<=i; j++ )
+        {
+            cand[num++] = i - j;
+        }
+        for( uint32 j=rowBlocks+1; j>=rowBlocks-1 && j>Window; j-- )
+        {
+            if( j <= i ) cand[num++] = i - j;
+        }
+        if( num == 0 ) continue;
+
+        auto rate = [dst, &cand, num]( uint64 c )
+        {
+            bool lo = false, hi = false;
+            for( int n=0; n<num; n++ )
+            {
+                const uint64 v = dst[cand[n]];
+                if( v == c ) return int( BlockMatch );
+                lo |= uint32( v ) == uint32( c );
+                hi |= uint32( v >> 32 ) == uint32( c >> 32 );
+            }
+            return ( lo ? HalfMatch : HalfLiteral ) + ( hi ? HalfMatch : HalfLiteral );
+        };
+
+        uint64 best = d;
+        float bestCost = BlockError( px, own, ByteSwap32( uint32( d >> 32 ) ), w ) * ErrorScale + lambda * rate( d );
+        auto consider = [&best, &bestCost, &rate, lambda]( uint64 c, uint32 err )
+        {
+            const float cost = err * ErrorScale + lambda * rate( c );
+            if( cost < bestCost )
+            {
+                best = c;
+                bestCost = cost;
+            }
+        };
+
+        int32 base[2][3];
+        BaseColors( ByteSwap32( uint32( d ) ), base );
+
+        for( int n=0; n<num; n++ )
+        {
+            const uint64 dj = dst[cand[n]];
+            const Colors& cj = colors[cand[n]];
+            const uint32 selj = ByteSwap32( uint32( dj >> 32 ) );
+
+            // All of the earlier block
+            consider( dj, BlockError( px, cj, selj, w ) );
+
+            // Its colors, with selectors for this block
+            uint32 sel;
+            const uint32 err = FitSelectors( px, cj, w, sel );
+            consider( ( dj & 0xFFFFFFFF ) | ( uint64( ByteSwap32( sel ) ) << 32 ), err );
+
+            // Its selectors, with this block's base colors and the tables that suit them best
+            uint32 terr[2][8];
+            fitTables( px, base, w, selj, own.sub, terr );
+            const uint32 t0 = uint32( std::min_element( terr[0], terr[0] + 8 ) - terr[0] );
+            const uint32 t1 = uint32( std::min_element( terr[1], terr[1] + 8 ) - terr[1] );
+            const uint32 w0 = ( uint32( d ) & 0x03FFFFFF ) | ( t0 << 29 ) | ( t1 << 26 );
+            consider( w0 | ( dj & 0xFFFFFFFF00000000 ), terr[0][t0] + terr[1][t1] );
+        }
+
+        if( best != d )
+        {
+            dst[i] = best;
+            GetColors( best, own );
+        }
+    }
+}
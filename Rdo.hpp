@@ -0,0 +1,19 @@
+#ifndef __RDO_HPP__
+#define __RDO_HPP__
+
+#include "ErrorMetric.hpp"
+#include "Types.hpp"
+
+// Rate-distortion pass over a run of ETC1 blocks. Each block may take the colors, the selectors or all of an
+// earlier block on its row or of the blocks above it, when the error added is worth less than lambda per bit
+// saved after LZ compression. Errors are weighted by metric, lambda is in units of plain squared RGB error.
+// Source pixels are BGRA, 16 per block, column by column as the kernels expect. Blocks run across block rows
+// of rowBlocks blocks.
+void RdoEtc1( const uint32* src, uint64* dst, uint32 blocks, uint32 rowBlocks, float lambda, ErrorMetric metric );
+
+// Squared error, weighted by the halved weights of w, of each sub-block for each of the 8 tables, with fixed
+// base colors (in RGB order) and selectors. sel is the selector word in big endian order, sub flags the
+// pixels of the second sub-block.
+void FitTables( const uint32* src, const int32 base[2][3], const ErrorWeights& w, uint32 sel, uint32 sub, uint32 err[2][8] );
+
+#endif
@@ -0,0 +1,63 @@
+#ifdef __SSE4_1__
+
+#include "Rdo_AVX2.hpp"
+#include "Tables.hpp"
+#ifdef _MSC_VER
+#  include <intrin.h>
+#  define VS_VECTORCALL _vectorcall
+#else
+#  include <x86intrin.h>
+#  pragma GCC push_options
+#  pragma GCC target ("avx2,fma,bmi2")
+#  define VS_VECTORCALL
+#endif
+
+void FitTables_AVX2( const uint32* src, const int32 base[2][3], const ErrorWeights& w, uint32 sel, uint32 sub, uint32 err[2][8] )
+{
+    // Modifier of each table, for each selector
+    __m256i mod[4];
+    for( int k=0; k<4; k++ )
+    {
+        mod[k] = _mm256_setr_epi32( g_table[0][k], g_table[1][k], g_table[2][k], g_table[3][k], g_table[4][k], g_table[5][k], g_table[6][k], g_table[7][k] );
+    }
+
+    __m256i b[2][3];
+    for( int s=0; s<2; s++ )
+    {
+        for( int c=0; c<3; c++ )
+        {
+            b[s][c] = _mm256_set1_epi32( base[s][c] );
+        }
+    }
+
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i max = _mm256_set1_epi32( 255 );
+    const __m256i wc[3] = { _mm256_set1_epi32( w.rh ), _mm256_set1_epi32( w.gh ), _mm256_set1_epi32( w.bh ) };
+    __m256i acc[2] = { zero, zero };
+    for( int i=0; i<16; i++ )
+    {
+        const uint32 k = ( ( sel >> i ) & 0x1 ) | ( ( sel >> ( i + 15 ) ) & 0x2 );
+        const uint32 s = ( sub >> i ) & 0x1;
+        const uint32 p = src[i];
+
+        // Source pixels are BGRA, base colors RGB. Differences are below 256 and weights below 128, so madd
+        // multiplies in 16 bits.
+        __m256i sum = zero;
+        for( int c=0; c<3; c++ )
+        {
+            const __m256i v = _mm256_min_epi32( _mm256_max_epi32( _mm256_add_epi32( b[s][c], mod[k] ), zero ), max );
+            const __m256i d = _mm256_abs_epi32( _mm256_sub_epi32( v, _mm256_set1_epi32( ( p >> ( 16 - c*8 ) ) & 0xFF ) ) );
+            sum = _mm256_add_epi32( sum, _mm256_madd_epi16( d, _mm256_mullo_epi16( d, wc[c] ) ) );
+        }
+        acc[s] = _mm256_add_epi32( acc[s], sum );
+    }
+
+    _mm256_storeu_si256( (__m256i*)err[0], acc[0] );
+    _mm256_storeu_si256( (__m256i*)err[1], acc[1] );
+}
+
+#ifndef _MSC_VER
+#  pragma GCC pop_options
+#endif
+
+#endif
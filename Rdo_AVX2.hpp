@@ -0,0 +1,14 @@
+#ifndef __RDO_AVX2_HPP__
+#define __RDO_AVX2_HPP__
+
+#ifdef __SSE4_1__
+
+#include "ErrorMetric.hpp"
+#include "Types.hpp"
+
+// FitTables with the 8 tables in the lanes of one register, as in Rdo.hpp
+void FitTables_AVX2( const uint32* src, const int32 base[2][3], const ErrorWeights& w, uint32 sel, uint32 sub, uint32 err[2][8] );
+
+#endif
+
+#endif
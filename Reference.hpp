@@ -0,0 +1,17 @@
+#ifndef __REFERENCE_HPP__
+#define __REFERENCE_HPP__
+
+#include <stddef.h>
+
+#include "ErrorMetric.hpp"
+#include "Types.hpp"
+
+// Scalar builds of ProcessRGB.cpp and DecodeRGB.cpp, the baseline of the SIMD variants
+uint64 ProcessRGB_Reference( const uint8* src, ErrorMetric metric );
+uint64 ProcessRGB_4x2_Reference( const uint8* src, ErrorMetric metric );
+uint64 ProcessRGB_ETC2_Reference( const uint8* src, bool th, ErrorMetric metric );
+
+void DecodeRGB_Reference( const uint64* src, uint32* dst, uint32 blocks, size_t width );
+void DecodeRGBA_Reference( const uint64* src, uint32* dst, uint32 blocks, size_t width );
+
+#endif
@@ -0,0 +1,294 @@
+#include <algorithm>
+
+#include "CpuArch.hpp"
+#include "DecodeRGB.hpp"
+#include "Math.hpp"
+#include "Refine.hpp"
+#include "Refine_AVX2.hpp"
+#include "Tables.hpp"
+#ifdef __SSE4_1__
+#  ifdef _MSC_VER
+#    include <intrin.h>
+#  else
+#    include <x86intrin.h>
+#  endif
+#endif
+
+// Pixels of the second sub-block, without and with flip, as in DecodePalette
+static const uint32 g_sub[2] = { 0xFF00, 0xCCCC };
+
+// Quantized colors tried around each sub-block average
+enum { MaxFits = 27 };
+
+void TableErrors( const uint32* px, const int32 base[3], const ErrorWeights& w, uint32 err[8] )
+{
+#ifdef __SSE4_1__
+    // Tables 0-3 in the first register, 4-7 in the second. The colors don't depend on the pixel.
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i max = _mm_set1_epi32( 255 );
+    const __m128i wc[3] = { _mm_set1_epi32( w.rh ), _mm_set1_epi32( w.gh ), _mm_set1_epi32( w.bh ) };
+    __m128i col[2][4][3];
+    for( int h=0; h<2; h++ )
+    {
+        for( int k=0; k<4; k++ )
+        {
+            const __m128i mod = _mm_setr_epi32( g_table[h*4][k], g_table[h*4+1][k], g_table[h*4+2][k], g_table[h*4+3][k] );
+            for( int c=0; c<3; c++ )
+            {
+                col[h][k][c] = _mm_min_epi32( _mm_max_epi32( _mm_add_epi32( _mm_set1_epi32( base[c] ), mod ), zero ), max );
+            }
+        }
+    }
+
+    __m128i acc[2] = { zero, zero };
+    for( int i=0; i<8; i++ )
+    {
+        // Source pixels are BGRA, base colors RGB
+        __m128i p[3];
+        for( int c=0; c<3; c++ )
+        {
+            p[c] = _mm_set1_epi32( ( px[i] >> ( 16 - c*8 ) ) & 0xFF );
+        }
+        for( int h=0; h<2; h++ )
+        {
+            __m128i best = _mm_set1_epi32( -1 );
+            for( int k=0; k<4; k++ )
+            {
+                // Differences are below 256 and weights below 128, so madd multiplies in 16 bits
+                __m128i sum = zero;
+                for( int c=0; c<3; c++ )
+                {
+                    const __m128i d = _mm_abs_epi32( _mm_sub_epi32( col[h][k][c], p[c] ) );
+                    sum = _mm_add_epi32( sum, _mm_madd_epi16( d, _mm_mullo_epi16( d, wc[c] ) ) );
+                }
+                best = _mm_min_epu32( best, sum );
+            }
+            acc[h] = _mm_add_epi32( acc[h], best );
+        }
+    }
+
+    _mm_storeu_si128( (__m128i*)err, acc[0] );
+    _mm_storeu_si128( (__m128i*)( err + 4 ), acc[1] );
+#else
+    const int32 wc[3] = { w.rh, w.gh, w.bh };
+    for( int t=0; t<8; t++ )
+    {
+        err[t] = 0;
+        for( int i=0; i<8; i++ )
+        {
+            uint32 best = 0xFFFFFFFF;
+            for( int k=0; k<4; k++ )
+            {
+                uint32 e = 0;
+                for( int c=0; c<3; c++ )
+                {
+                    e += wc[c] * sq( clampu8( base[c] + g_table[t][k] ) - int32( ( px[i] >> ( 16 - c*8 ) ) & 0xFF ) );
+                }
+                best = std::min( best, e );
+            }
+            err[t] += best;
+        }
+    }
+#endif
+}
+
+typedef void (*TableErrorsFn)( const uint32*, const int32[3], const ErrorWeights&, uint32[8] );
+
+// Resolved on first use, after any cpu_force_isa() call
+static TableErrorsFn GetTableErrors()
+{
+#ifdef __SSE4_1__
+    static const TableErrorsFn fn = cpu_isa() >= CpuIsa::AVX2 ? TableErrors_AVX2 : TableErrors;
+#else
+    static const TableErrorsFn fn = TableErrors;
+#endif
+    return fn;
+}
+
+static inline int32 Expand( int32 c, int bits )
+{
+    return bits == 4 ? c * 17 : ( c << 3 ) | ( c >> 2 );
+}
+
+// A quantized base color of a sub-block, with its best table
+struct Fit
+{
+    uint32 err;
+    uint32 table;
+    int32 c[3];
+};
+
+// Fits the colors within one quantization step of the average of the 8 pixels. Returns their number.
+static int Search( const uint32* px, int bits, TableErrorsFn fn, const ErrorWeights& w, Fit* fits )
+{
+    const int32 max = ( 1 << bits ) - 1;
+    int32 lo[3], hi[3];
+    for( int c=0; c<3; c++ )
+    {
+        int32 sum = 0;
+        for( int i=0; i<8; i++ )
+        {
+            sum += ( px[i] >> ( 16 - c*8 ) ) & 0xFF;
+        }
+        const int32 q = ( sum * max + 8*255/2 ) / ( 8*255 );
+        lo[c] = std::max( q - 1, 0 );
+        hi[c] = std::min( q + 1, max );
+    }
+
+    int num = 0;
+    for( int32 r=lo[0]; r<=hi[0]; r++ )
+    {
+        for( int32 g=lo[1]; g<=hi[1]; g++ )
+        {
+            for( int32 b=lo[2]; b<=hi[2]; b++ )
+            {
+                const int32 base[3] = { Expand( r, bits ), Expand( g, bits ), Expand( b, bits ) };
+                uint32 err[8];
+                fn( px, base, w, err );
+                const uint32 t = uint32( std::min_element( err, err + 8 ) - err );
+                fits[num++] = { err[t], t, { r, g, b } };
+            }
+        }
+    }
+    return num;
+}
+
+static const Fit& Best( const Fit* fits, int num )
+{
+    return *std::min_element( fits, fits + num, []( const Fit& a, const Fit& b ) { return a.err < b.err; } );
+}
+
+// Picks the closest selector of each pixel and puts the block together
+static uint64 Encode( const uint32* src, uint32 flip, bool diff, const Fit& f0, const Fit& f1, const ErrorWeights& w )
+{
+    const int32 wc[3] = { w.rh, w.gh, w.bh };
+    const Fit* f[2] = { &f0, &f1 };
+    const int bits = diff ? 5 : 4;
+    uint32 w0 = flip | ( diff ? 0x2 : 0 ) | ( f0.table << 5 ) | ( f1.table << 2 );
+    int32 base[2][3];
+    for( int c=0; c<3; c++ )
+    {
+        if( diff )
+        {
+            w0 |= ( uint32( f0.c[c] ) << ( 27 - c*8 ) ) | ( uint32( ( f1.c[c] - f0.c[c] ) & 0x7 ) << ( 24 - c*8 ) );
+        }
+        else
+        {
+            w0 |= ( uint32( f0.c[c] ) << ( 28 - c*8 ) ) | ( uint32( f1.c[c] ) << ( 24 - c*8 ) );
+        }
+        base[0][c] = Expand( f0.c[c], bits );
+        base[1][c] = Expand( f1.c[c], bits );
+    }
+
+    uint32 w1 = 0;
+    for( int i=0; i<16; i++ )
+    {
+        const uint32 s = ( g_sub[flip] >> i ) & 0x1;
+        const int32* tbl = g_table[f[s]->table];
+        uint32 best = 0xFFFFFFFF;
+        uint32 k = 0;
+        for( uint32 j=0; j<4; j++ )
+        {
+            uint32 e = 0;
+            for( int c=0; c<3; c++ )
+            {
+                e += wc[c] * sq( clampu8( base[s][c] + tbl[j] ) - int32( ( src[i] >> ( 16 - c*8 ) ) & 0xFF ) );
+            }
+            if( e < best )
+            {
+                best = e;
+                k = j;
+            }
+        }
+        w1 |= ( ( k & 0x1 ) << i ) | ( ( k >> 1 ) << ( i + 16 ) );
+    }
+
+    return ByteSwap32( w0 ) | ( uint64( ByteSwap32( w1 ) ) << 32 );
+}
+
+// Weighted squared error of a block in any mode
+static uint32 BlockError( const uint32* src, uint64 block, const ErrorWeights& w )
+{
+    const int32 wc[3] = { w.rh, w.gh, w.bh };
+    uint32 px[16];
+    DecodeRGB( &block, px, 1, 4 );
+
+    // Decoded pixels are RGBA in rows, the source BGRA in columns
+    uint32 err = 0;
+    for( int x=0; x<4; x++ )
+    {
+        for( int y=0; y<4; y++ )
+        {
+            const uint32 a = px[y*4+x];
+            const uint32 b = src[x*4+y];
+            for( int c=0; c<3; c++ )
+            {
+                err += wc[c] * sq( int32( ( a >> ( c*8 ) ) & 0xFF ) - int32( ( b >> ( 16 - c*8 ) ) & 0xFF ) );
+            }
+        }
+    }
+    return err;
+}
+
+uint64 RefineRGB( const uint8* src, uint64 block, ErrorMetric metric )
+{
+    const uint32* px = (const uint32*)src;
+    const auto w = GetErrorWeights( src, metric );
+    uint64 best = block;
+    uint32 bestErr = BlockError( px, block, w );
+    if( bestErr == 0 ) return best;
+
+    const auto fn = GetTableErrors();
+    for( uint32 flip=0; flip<2; flip++ )
+    {
+        uint32 sp[2][8];
+        int n[2] = {};
+        for( int i=0; i<16; i++ )
+        {
+            const uint32 s = ( g_sub[flip] >> i ) & 0x1;
+            sp[s][n[s]++] = px[i];
+        }
+
+        Fit fits[2][MaxFits];
+        int num[2];
+
+        // Individual colors, the sub-blocks don't depend on each other
+        for( int s=0; s<2; s++ )
+        {
+            num[s] = Search( sp[s], 4, fn, w, fits[s] );
+        }
+        const Fit& i0 = Best( fits[0], num[0] );
+        const Fit& i1 = Best( fits[1], num[1] );
+        if( i0.err + i1.err < bestErr )
+        {
+            bestErr = i0.err + i1.err;
+            best = Encode( px, flip, false, i0, i1, w );
+        }
+
+        // Differential colors, the second one within [-4, 3] of the first in each channel
+        for( int s=0; s<2; s++ )
+        {
+            num[s] = Search( sp[s], 5, fn, w, fits[s] );
+        }
+        for( int a=0; a<num[0]; a++ )
+        {
+            const Fit& f0 = fits[0][a];
+            if( f0.err >= bestErr ) continue;
+            for( int b=0; b<num[1]; b++ )
+            {
+                const Fit& f1 = fits[1][b];
+                if( f0.err + f1.err >= bestErr ) continue;
+                bool valid = true;
+                for( int c=0; c<3; c++ )
+                {
+                    const int32 d = f1.c[c] - f0.c[c];
+                    valid &= d >= -4 && d <= 3;
+                }
+                if( !valid ) continue;
+                bestErr = f0.err + f1.err;
+                best = Encode( px, flip, true, f0, f1, w );
+            }
+        }
+    }
+    return best;
+}
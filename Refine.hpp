@@ -0,0 +1,17 @@
+#ifndef __REFINE_HPP__
+#define __REFINE_HPP__
+
+#include "ErrorMetric.hpp"
+#include "Types.hpp"
+
+// Exhaustive search over the individual and differential modes, both flips and base colors within one
+// quantization step of the sub-block averages. Returns block, which may be in any ETC2 mode, unless the
+// search finds an encoding with less error under metric, as the kernels measure it. src is a kernel block,
+// 16 BGRA pixels column by column.
+uint64 RefineRGB( const uint8* src, uint64 block, ErrorMetric metric );
+
+// Squared error, weighted by the halved weights of w, of the 8 pixels of a sub-block for each of the 8
+// tables, each pixel taking the selector closest to it. Pixels are BGRA, the base color RGB.
+void TableErrors( const uint32* px, const int32 base[3], const ErrorWeights& w, uint32 err[8] );
+
+#endif
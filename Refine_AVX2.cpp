@@ -0,0 +1,62 @@
+#ifdef __SSE4_1__
+
+#include "Refine_AVX2.hpp"
+#include "Tables.hpp"
+#ifdef _MSC_VER
+#  include <intrin.h>
+#  define VS_VECTORCALL _vectorcall
+#else
+#  include <x86intrin.h>
+#  pragma GCC push_options
+#  pragma GCC target ("avx2,fma,bmi2")
+#  define VS_VECTORCALL
+#endif
+
+void TableErrors_AVX2( const uint32* px, const int32 base[3], const ErrorWeights& w, uint32 err[8] )
+{
+    // Color of each table for each selector, clamped
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i max = _mm256_set1_epi32( 255 );
+    const __m256i wc[3] = { _mm256_set1_epi32( w.rh ), _mm256_set1_epi32( w.gh ), _mm256_set1_epi32( w.bh ) };
+    __m256i col[4][3];
+    for( int k=0; k<4; k++ )
+    {
+        const __m256i mod = _mm256_setr_epi32( g_table[0][k], g_table[1][k], g_table[2][k], g_table[3][k], g_table[4][k], g_table[5][k], g_table[6][k], g_table[7][k] );
+        for( int c=0; c<3; c++ )
+        {
+            col[k][c] = _mm256_min_epi32( _mm256_max_epi32( _mm256_add_epi32( _mm256_set1_epi32( base[c] ), mod ), zero ), max );
+        }
+    }
+
+    __m256i acc = zero;
+    for( int i=0; i<8; i++ )
+    {
+        // Source pixels are BGRA, base colors RGB
+        __m256i p[3];
+        for( int c=0; c<3; c++ )
+        {
+            p[c] = _mm256_set1_epi32( ( px[i] >> ( 16 - c*8 ) ) & 0xFF );
+        }
+        __m256i best = _mm256_set1_epi32( -1 );
+        for( int k=0; k<4; k++ )
+        {
+            // Differences are below 256 and weights below 128, so madd multiplies in 16 bits
+            __m256i sum = zero;
+            for( int c=0; c<3; c++ )
+            {
+                const __m256i d = _mm256_abs_epi32( _mm256_sub_epi32( col[k][c], p[c] ) );
+                sum = _mm256_add_epi32( sum, _mm256_madd_epi16( d, _mm256_mullo_epi16( d, wc[c] ) ) );
+            }
+            best = _mm256_min_epu32( best, sum );
+        }
+        acc = _mm256_add_epi32( acc, best );
+    }
+
+    _mm256_storeu_si256( (__m256i*)err, acc );
+}
+
+#ifndef _MSC_VER
+#  pragma GCC pop_options
+#endif
+
+#endif
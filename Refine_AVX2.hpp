@@ -0,0 +1,14 @@
+#ifndef __REFINE_AVX2_HPP__
+#define __REFINE_AVX2_HPP__
+
+#ifdef __SSE4_1__
+
+#include "ErrorMetric.hpp"
+#include "Types.hpp"
+
+// TableErrors with the 8 tables in the lanes of one register, as in Refine.hpp
+void TableErrors_AVX2( const uint32* px, const int32 base[3], const ErrorWeights& w, uint32 err[8] );
+
+#endif
+
+#endif
@@ -0,0 +1,151 @@
+#include <algorithm>
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "MipMap.hpp"
+#include "RowHashes.hpp"
+
+enum { Magic = 0x53485245 };    // "ERHS"
+
+struct SidecarHeader
+{
+    uint32 magic;
+    uint32 width;
+    uint32 height;
+    uint32 rows;
+    uint64 settings;
+    uint64 output;      // FileHash of the output files the rows were saved with
+};
+
+RowHashes::RowHashes( const v2i& size, bool mipmap, uint64 settings )
+    : m_settings( settings )
+    , m_size( size )
+{
+    // Same layout as BlockData::Layout
+    const int levels = mipmap ? NumberOfMipLevels( size ) : 1;
+    m_levels.resize( levels );
+    size_t block = 0;
+    size_t row = 0;
+    v2i current = size;
+    for( int i=0; i<levels; i++ )
+    {
+        const size_t rows = size_t( current.y + 3 ) / 4;
+        m_levels[i].block = block;
+        m_levels[i].width = size_t( current.x + 3 ) / 4;
+        m_levels[i].row = row;
+        block += m_levels[i].width * rows;
+        row += rows;
+        current.x = std::max( 1, current.x / 2 );
+        current.y = std::max( 1, current.y / 2 );
+    }
+    m_new.resize( row );
+}
+
+bool RowHashes::Load( const char* fn, uint64 output )
+{
+    FILE* f = fopen( fn, "rb" );
+    if( !f ) return false;
+
+    SidecarHeader hdr;
+    bool ok = fread( &hdr, 1, sizeof( hdr ), f ) == sizeof( hdr ) &&
+        hdr.magic == Magic &&
+        hdr.width == uint32( m_size.x ) &&
+        hdr.height == uint32( m_size.y ) &&
+        hdr.rows == m_new.size() &&
+        hdr.settings == m_settings &&
+        hdr.output == output;
+    if( ok )
+    {
+        m_old.resize( hdr.rows );
+        ok = fread( m_old.data(), sizeof( uint64 ), hdr.rows, f ) == hdr.rows;
+        if( !ok ) m_old.clear();
+    }
+    fclose( f );
+    return ok;
+}
+
+bool RowHashes::Save( const char* fn, uint64 output ) const
+{
+    FILE* f = fopen( fn, "wb" );
+    if( !f ) return false;
+
+    const SidecarHeader hdr = { Magic, uint32( m_size.x ), uint32( m_size.y ), uint32( m_new.size() ), m_settings, output };
+    bool ok = fwrite( &hdr, 1, sizeof( hdr ), f ) == sizeof( hdr );
+    ok = ok && fwrite( m_new.data(), sizeof( uint64 ), m_new.size(), f ) == m_new.size();
+    return fclose( f ) == 0 && ok;
+}
+
+size_t RowHashes::Row( size_t block, size_t width ) const
+{
+    auto it = std::upper_bound( m_levels.begin(), m_levels.end(), block, []( size_t b, const Level& level ) { return b < level.block; } );
+    assert( it != m_levels.begin() );
+    const auto& level = *( it - 1 );
+    assert( width == level.width );
+    assert( ( block - level.block ) % width == 0 );
+    return level.row + ( block - level.block ) / width;
+}
+
+bool RowHashes::Changed( const uint32* src, size_t stride, size_t block )
+{
+    const size_t width = stride / 4;
+    const size_t row = Row( block, width );
+
+    uint64 h = 0;
+    for( int y=0; y<4; y++ )
+    {
+        h = h * 0x9E3779B97F4A7C15ull ^ Hash( src + y * stride, stride * 4 );
+    }
+    m_new[row] = h;
+    return m_old.empty() || m_old[row] != h;
+}
+
+uint32 RowHashes::ChangedRows() const
+{
+    if( m_old.empty() ) return uint32( m_new.size() );
+    uint32 ret = 0;
+    for( size_t i=0; i<m_new.size(); i++ )
+    {
+        if( m_old[i] != m_new[i] ) ret++;
+    }
+    return ret;
+}
+
+uint64 RowHashes::FileHash( const char* fn )
+{
+    FILE* f = fopen( fn, "rb" );
+    if( !f ) return 0;
+    std::vector<uint8> data;
+    uint8 buf[64*1024];
+    size_t len;
+    while( ( len = fread( buf, 1, sizeof( buf ), f ) ) > 0 )
+    {
+        data.insert( data.end(), buf, buf + len );
+    }
+    fclose( f );
+    return Hash( data.data(), data.size() );
+}
+
+// Two independent lanes keep the multiplies from waiting on each other
+uint64 RowHashes::Hash( const void* data, size_t bytes )
+{
+    auto ptr = (const uint8*)data;
+    uint64 h0 = 0x243F6A8885A308D3ull ^ bytes;
+    uint64 h1 = 0x13198A2E03707344ull;
+    for( ; bytes >= 16; bytes -= 16, ptr += 16 )
+    {
+        uint64 v0, v1;
+        memcpy( &v0, ptr, 8 );
+        memcpy( &v1, ptr + 8, 8 );
+        h0 = ( h0 ^ v0 ) * 0x9E3779B97F4A7C15ull;
+        h1 = ( h1 ^ v1 ) * 0xC2B2AE3D27D4EB4Full;
+        h0 ^= h0 >> 31;
+        h1 ^= h1 >> 29;
+    }
+    for( ; bytes; bytes--, ptr++ )
+    {
+        h0 = ( h0 ^ *ptr ) * 0x9E3779B97F4A7C15ull;
+    }
+    h0 ^= h1 * 0xFF51AFD7ED558CCDull;
+    return h0 ^ ( h0 >> 32 );
+}
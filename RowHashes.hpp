@@ -0,0 +1,52 @@
+#ifndef __ROWHASHES_HPP__
+#define __ROWHASHES_HPP__
+
+#include <vector>
+
+#include "Types.hpp"
+#include "Vector.hpp"
+
+// Source hashes of each block row of a compressed file, kept in a sidecar file next to it. A later run with
+// the same image size and settings re-encodes only the block rows whose source changed. Rows are numbered
+// level by level, like the blocks of BlockData.
+class RowHashes
+{
+public:
+    RowHashes( const v2i& size, bool mipmap, uint64 settings );
+
+    // Takes the hashes of an earlier run, unless they were made for another size, other settings or output
+    // files other than the ones described by output, see FileHash. Without them every row counts as changed.
+    bool Load( const char* fn, uint64 output );
+    // output describes the finished output files
+    bool Save( const char* fn, uint64 output ) const;
+
+    // Hashes the 4 pixel rows of the block row starting at block, stride is in pixels. Returns whether the
+    // source differs from the earlier run. Different rows may be checked in parallel.
+    bool Changed( const uint32* src, size_t stride, size_t block );
+
+    uint32 Rows() const { return uint32( m_new.size() ); }
+    // Rows that had to be encoded, once all of them were checked
+    uint32 ChangedRows() const;
+
+    static uint64 Hash( const void* data, size_t bytes );
+    // Hash of the contents of a file, 0 if it can't be read
+    static uint64 FileHash( const char* fn );
+
+private:
+    struct Level
+    {
+        size_t block;       // first block of the level
+        size_t width;       // in blocks
+        size_t row;         // first row of the level
+    };
+
+    size_t Row( size_t block, size_t width ) const;
+
+    std::vector<Level> m_levels;
+    std::vector<uint64> m_old;
+    std::vector<uint64> m_new;
+    uint64 m_settings;
+    v2i m_size;
+};
+
+#endif
@@ -1,9 +1,13 @@
 #include <algorithm>
+#include <errno.h>
 #ifdef _WIN32
 #  include <windows.h>
 #else
+#  include <dirent.h>
 #  include <pthread.h>
+#  include <sys/stat.h>
 #  include <unistd.h>
+#  include <utime.h>
 #endif
 
 #include "System.hpp"
@@ -66,3 +70,96 @@ void System::SetThreadName( std::thread& thread, const char* name )
     pthread_setname_np( thread.native_handle(), name );
 #endif
 }
+
+bool System::IsDirectory( const char* path )
+{
+#ifdef _WIN32
+    const DWORD attr = GetFileAttributesA( path );
+    return attr != INVALID_FILE_ATTRIBUTES && ( attr & FILE_ATTRIBUTE_DIRECTORY ) != 0;
+#else
+    struct stat st;
+    return stat( path, &st ) == 0 && S_ISDIR( st.st_mode );
+#endif
+}
+
+std::vector<std::string> System::ListFiles( const char* path )
+{
+    std::vector<std::string> ret;
+    const std::string dir( path );
+#ifdef _WIN32
+    WIN32_FIND_DATAA data;
+    HANDLE h = FindFirstFileA( ( dir + "\\*" ).c_str(), &data );
+    if( h != INVALID_HANDLE_VALUE )
+    {
+        do
+        {
+            if( ( data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY ) == 0 )
+            {
+                ret.emplace_back( dir + "\\" + data.cFileName );
+            }
+        }
+        while( FindNextFileA( h, &data ) );
+        FindClose( h );
+    }
+#else
+    DIR* d = opendir( path );
+    if( d )
+    {
+        while( auto e = readdir( d ) )
+        {
+            auto fn = dir + "/" + e->d_name;
+            struct stat st;
+            if( stat( fn.c_str(), &st ) == 0 && S_ISREG( st.st_mode ) )
+            {
+                ret.emplace_back( std::move( fn ) );
+            }
+        }
+        closedir( d );
+    }
+#endif
+    std::sort( ret.begin(), ret.end() );
+    return ret;
+}
+
+bool System::MakeDirectory( const char* path )
+{
+#ifdef _WIN32
+    return CreateDirectoryA( path, nullptr ) != 0 || GetLastError() == ERROR_ALREADY_EXISTS;
+#else
+    return mkdir( path, 0777 ) == 0 || errno == EEXIST;
+#endif
+}
+
+bool System::FileInfo( const char* path, uint64& size, uint64& mtime )
+{
+#ifdef _WIN32
+    WIN32_FILE_ATTRIBUTE_DATA data;
+    if( !GetFileAttributesExA( path, GetFileExInfoStandard, &data ) || ( data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY ) != 0 ) return false;
+    size = ( uint64( data.nFileSizeHigh ) << 32 ) | data.nFileSizeLow;
+    // 100 ns ticks since 1601
+    mtime = ( ( uint64( data.ftLastWriteTime.dwHighDateTime ) << 32 ) | data.ftLastWriteTime.dwLowDateTime ) / 10000000 - 11644473600ull;
+    return true;
+#else
+    struct stat st;
+    if( stat( path, &st ) != 0 || !S_ISREG( st.st_mode ) ) return false;
+    size = uint64( st.st_size );
+    mtime = uint64( st.st_mtime );
+    return true;
+#endif
+}
+
+void System::Touch( const char* path )
+{
+#ifdef _WIN32
+    HANDLE h = CreateFileA( path, FILE_WRITE_ATTRIBUTES, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr );
+    if( h != INVALID_HANDLE_VALUE )
+    {
+        FILETIME ft;
+        GetSystemTimeAsFileTime( &ft );
+        SetFileTime( h, nullptr, nullptr, &ft );
+        CloseHandle( h );
+    }
+#else
+    utime( path, nullptr );
+#endif
+}
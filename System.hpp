@@ -1,7 +1,9 @@
 #ifndef __DARKRL__SYSTEM_HPP__
 #define __DARKRL__SYSTEM_HPP__
 
+#include <string>
 #include <thread>
+#include <vector>
 
 #include "Types.hpp"
 
@@ -12,6 +14,16 @@ public:
 
     static uint CPUCores();
     static void SetThreadName( std::thread& thread, const char* name );
+
+    static bool IsDirectory( const char* path );
+    // Regular files in the directory, sorted by name
+    static std::vector<std::string> ListFiles( const char* path );
+    static bool MakeDirectory( const char* path );
+
+    // Size in bytes and modification time in seconds of a regular file
+    static bool FileInfo( const char* path, uint64& size, uint64& mtime );
+    // Sets the modification time of the file to now
+    static void Touch( const char* path );
 };
 
 #endif
@@ -15,6 +15,10 @@ extern const uint32 g_avg2[16];
 
 extern const uint32 g_flags[64];
 
+extern const int16 g_tableAlpha[16][8];
+
+extern const int32 g_distanceTH[8];
+
 #ifdef __SSE4_1__
 extern const uint8 g_flags_AVX2[64];
 extern const __m128i g_table_SIMD[2];
@@ -1,20 +1,180 @@
 #include <assert.h>
+#include <new>
 #include <stdio.h>
+#include <stdlib.h>
+#ifdef _WIN32
+#  include <malloc.h>
+#endif
 
 #include "Debug.hpp"
 #include "System.hpp"
 #include "TaskDispatch.hpp"
+#include "Timing.hpp"
 
 static TaskDispatch* s_instance = nullptr;
 
+// Index of the calling thread's deque, the thread that created the dispatcher owns deque 0
+static thread_local size_t s_index = size_t( -1 );
+
+enum { SpinCount = 64 };
+
+// Chase-Lev work stealing deque. Only the owning thread pushes and takes from the bottom,
+// other threads steal from the top.
+class TaskDispatch::Deque
+{
+public:
+    Deque()
+        : m_top( 0 )
+        , m_bottom( 0 )
+        , m_array( new Array( 1024 ) )
+    {
+    }
+
+    ~Deque()
+    {
+        delete m_array.load( std::memory_order_relaxed );
+    }
+
+    void Push( Job* job )
+    {
+        const int64 b = m_bottom.load( std::memory_order_relaxed );
+        const int64 t = m_top.load( std::memory_order_acquire );
+        Array* a = m_array.load( std::memory_order_relaxed );
+        if( b - t > int64( a->mask ) )
+        {
+            a = Grow( a, t, b );
+        }
+        a->Put( b, job );
+        m_bottom.store( b + 1, std::memory_order_release );
+    }
+
+    Job* Take()
+    {
+        const int64 b = m_bottom.load( std::memory_order_relaxed ) - 1;
+        Array* a = m_array.load( std::memory_order_relaxed );
+        m_bottom.store( b, std::memory_order_relaxed );
+        std::atomic_thread_fence( std::memory_order_seq_cst );
+        int64 t = m_top.load( std::memory_order_relaxed );
+
+        Job* job = nullptr;
+        if( t <= b )
+        {
+            job = a->Get( b );
+            if( t == b )
+            {
+                // Last job, race against thieves
+                if( !m_top.compare_exchange_strong( t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed ) )
+                {
+                    job = nullptr;
+                }
+                m_bottom.store( b + 1, std::memory_order_relaxed );
+            }
+        }
+        else
+        {
+            m_bottom.store( b + 1, std::memory_order_relaxed );
+        }
+        return job;
+    }
+
+    Job* Steal()
+    {
+        int64 t = m_top.load( std::memory_order_acquire );
+        std::atomic_thread_fence( std::memory_order_seq_cst );
+        const int64 b = m_bottom.load( std::memory_order_acquire );
+        if( t >= b ) return nullptr;
+
+        Array* a = m_array.load( std::memory_order_acquire );
+        Job* job = a->Get( t );
+        if( !m_top.compare_exchange_strong( t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed ) )
+        {
+            return nullptr;
+        }
+        return job;
+    }
+
+private:
+    struct Array
+    {
+        Array( size_t size ) : mask( size - 1 ), data( new std::atomic<Job*>[size] ) {}
+
+        Job* Get( int64 i ) const { return data[i & mask].load( std::memory_order_relaxed ); }
+        void Put( int64 i, Job* job ) { data[i & mask].store( job, std::memory_order_relaxed ); }
+
+        size_t mask;
+        std::unique_ptr<std::atomic<Job*>[]> data;
+    };
+
+    Array* Grow( Array* a, int64 t, int64 b )
+    {
+        Array* grown = new Array( ( a->mask + 1 ) * 2 );
+        for( int64 i=t; i<b; i++ )
+        {
+            grown->Put( i, a->Get( i ) );
+        }
+        m_array.store( grown, std::memory_order_release );
+        // Thieves may still read from the old array, keep it until the deque is gone
+        m_old.emplace_back( a );
+        return grown;
+    }
+
+    std::atomic<int64> m_top;
+    std::atomic<int64> m_bottom;
+    std::atomic<Array*> m_array;
+    std::vector<std::unique_ptr<Array>> m_old;
+};
+
+struct alignas(64) TaskDispatch::Context
+{
+    Deque deque;
+    std::atomic<uint64> steals { 0 };
+    std::atomic<uint64> idle { 0 };
+    uint32 seed;
+
+    // Plain new only guarantees the alignment of fundamental types before C++17, contexts of different
+    // threads must not share a cache line
+    static void* operator new( size_t size )
+    {
+        void* ptr;
+#ifdef _WIN32
+        ptr = _aligned_malloc( size, alignof( Context ) );
+        if( !ptr ) throw std::bad_alloc();
+#else
+        if( posix_memalign( &ptr, alignof( Context ), size ) != 0 ) throw std::bad_alloc();
+#endif
+        return ptr;
+    }
+
+    static void operator delete( void* ptr )
+    {
+#ifdef _WIN32
+        _aligned_free( ptr );
+#else
+        free( ptr );
+#endif
+    }
+};
+
 TaskDispatch::TaskDispatch( size_t workers )
-    : m_exit( false )
-    , m_jobs( 0 )
+    : m_pending( 0 )
+    , m_sleeping( 0 )
+    , m_epoch( 0 )
+    , m_exit( false )
+    , m_injected( 0 )
 {
     assert( !s_instance );
     s_instance = this;
 
     assert( workers >= 1 );
+
+    m_ctx.reserve( workers );
+    for( size_t i=0; i<workers; i++ )
+    {
+        m_ctx.emplace_back( new Context );
+        m_ctx.back()->seed = uint32( i * 2654435761u + 1 );
+    }
+    s_index = 0;
+
     workers--;
 
     m_workers.reserve( workers );
@@ -22,7 +182,7 @@ TaskDispatch::TaskDispatch( size_t workers )
     {
         char tmp[16];
         sprintf( tmp, "Worker %zu", i );
-        auto worker = std::thread( [this]{ Worker(); } );
+        auto worker = std::thread( [this, i]{ Worker( i + 1 ); } );
         System::SetThreadName( worker, tmp );
         m_workers.emplace_back( std::move( worker ) );
     }
@@ -32,7 +192,10 @@ TaskDispatch::TaskDispatch( size_t workers )
 
 TaskDispatch::~TaskDispatch()
 {
-    m_exit = true;
+    {
+        std::lock_guard<std::mutex> lock( m_lock );
+        m_exit = true;
+    }
     m_cvWork.notify_all();
 
     for( auto& worker : m_workers )
@@ -40,67 +203,173 @@ TaskDispatch::~TaskDispatch()
         worker.join();
     }
 
+    DBGPRINT( "Task dispatcher: " << GetStats().steals << " steals, " << GetStats().idle / 1000 << " ms idle" );
+
+    assert( m_pending == 0 );
     assert( s_instance );
     s_instance = nullptr;
+    s_index = size_t( -1 );
 }
 
 void TaskDispatch::Queue( const std::function<void(void)>& f )
 {
-    std::unique_lock<std::mutex> lock( s_instance->m_queueLock );
-    s_instance->m_queue.emplace_back( f );
-    const auto size = s_instance->m_queue.size();
-    lock.unlock();
-    if( size > 1 )
+    s_instance->Push( new Job( f ) );
+}
+
+void TaskDispatch::Queue( std::function<void(void)>&& f )
+{
+    s_instance->Push( new Job( std::move( f ) ) );
+}
+
+void TaskDispatch::Push( Job* job )
+{
+    m_pending++;
+    if( s_index < m_ctx.size() )
     {
-        s_instance->m_cvWork.notify_one();
+        m_ctx[s_index]->deque.Push( job );
+    }
+    else
+    {
+        std::lock_guard<std::mutex> lock( m_injectLock );
+        m_inject.push_back( job );
+        m_injected++;
+    }
+    m_epoch++;
+    if( m_sleeping > 0 )
+    {
+        std::lock_guard<std::mutex> lock( m_lock );
+        m_cvWork.notify_one();
     }
 }
 
-void TaskDispatch::Queue( std::function<void(void)>&& f )
+TaskDispatch::Job* TaskDispatch::Find( size_t idx )
 {
-    std::unique_lock<std::mutex> lock( s_instance->m_queueLock );
-    s_instance->m_queue.emplace_back( std::move( f ) );
-    const auto size = s_instance->m_queue.size();
-    lock.unlock();
-    if( size > 1 )
+    auto& ctx = *m_ctx[idx];
+    auto job = ctx.deque.Take();
+    if( job ) return job;
+
+    // xorshift, picks the first victim to spread thieves over the deques
+    ctx.seed ^= ctx.seed << 13;
+    ctx.seed ^= ctx.seed >> 17;
+    ctx.seed ^= ctx.seed << 5;
+
+    const size_t num = m_ctx.size();
+    const size_t start = ctx.seed % num;
+    for( size_t i=0; i<num; i++ )
+    {
+        const size_t victim = ( start + i ) % num;
+        if( victim == idx ) continue;
+        job = m_ctx[victim]->deque.Steal();
+        if( job )
+        {
+            ctx.steals.fetch_add( 1, std::memory_order_relaxed );
+            return job;
+        }
+    }
+
+    if( m_injected > 0 )
     {
-        s_instance->m_cvWork.notify_one();
+        std::lock_guard<std::mutex> lock( m_injectLock );
+        if( !m_inject.empty() )
+        {
+            job = m_inject.front();
+            m_inject.pop_front();
+            m_injected--;
+            return job;
+        }
     }
+    return nullptr;
 }
 
 void TaskDispatch::Sync()
 {
-    std::unique_lock<std::mutex> lock( s_instance->m_queueLock );
-    while( !s_instance->m_queue.empty() )
+    auto& self = *s_instance;
+    if( s_index >= self.m_ctx.size() )
+    {
+        // Jobs may be waiting for this thread, e.g. for the rows it loads
+        fprintf( stderr, "TaskDispatch::Sync called outside of the dispatcher threads.\n" );
+        abort();
+    }
+
+    for(;;)
+    {
+        auto job = self.Find( s_index );
+        if( !job ) break;
+        self.Run( job );
+    }
+
+    // Remaining jobs are running or will be picked up by the workers
+    if( self.m_pending != 0 )
+    {
+        const auto start = GetTime();
+        std::unique_lock<std::mutex> lock( self.m_lock );
+        self.m_cvJobs.wait( lock, [&self]{ return self.m_pending == 0; } );
+        self.m_ctx[s_index]->idle.fetch_add( GetTime() - start, std::memory_order_relaxed );
+    }
+}
+
+bool TaskDispatch::Available()
+{
+    return s_instance && s_index < s_instance->m_ctx.size();
+}
+
+TaskDispatch::Stats TaskDispatch::GetStats()
+{
+    Stats ret = {};
+    for( auto& ctx : s_instance->m_ctx )
+    {
+        ret.steals += ctx->steals.load( std::memory_order_relaxed );
+        ret.idle += ctx->idle.load( std::memory_order_relaxed );
+    }
+    return ret;
+}
+
+void TaskDispatch::Run( Job* job )
+{
+    (*job)();
+    delete job;
+    if( m_pending.fetch_sub( 1 ) == 1 )
     {
-        auto f = s_instance->m_queue.back();
-        s_instance->m_queue.pop_back();
-        lock.unlock();
-        f();
-        lock.lock();
+        std::lock_guard<std::mutex> lock( m_lock );
+        m_cvJobs.notify_all();
     }
-    s_instance->m_cvJobs.wait( lock, []{ return s_instance->m_jobs == 0; } );
 }
 
-void TaskDispatch::Worker()
+void TaskDispatch::Worker( size_t idx )
 {
+    s_index = idx;
+    auto& ctx = *m_ctx[idx];
+
     for(;;)
     {
-        std::unique_lock<std::mutex> lock( m_queueLock );
-        m_cvWork.wait( lock, [this]{ return !m_queue.empty() || m_exit; } );
-        if( m_exit ) return;
-        auto f = m_queue.back();
-        m_queue.pop_back();
-        m_jobs++;
-        lock.unlock();
-        f();
-        lock.lock();
-        m_jobs--;
-        bool notify = m_jobs == 0 && m_queue.empty();
-        lock.unlock();
-        if( notify )
+        auto job = Find( idx );
+        if( !job )
         {
-            m_cvJobs.notify_all();
+            const auto start = GetTime();
+            for( int i=0; i<SpinCount && !job; i++ )
+            {
+                std::this_thread::yield();
+                job = Find( idx );
+            }
+            while( !job )
+            {
+                // Any job queued after the epoch is read wakes us up
+                const auto epoch = m_epoch.load();
+                job = Find( idx );
+                if( job ) break;
+
+                std::unique_lock<std::mutex> lock( m_lock );
+                if( m_exit )
+                {
+                    ctx.idle.fetch_add( GetTime() - start, std::memory_order_relaxed );
+                    return;
+                }
+                m_sleeping++;
+                m_cvWork.wait( lock, [this, epoch]{ return m_epoch.load() != epoch || m_exit; } );
+                m_sleeping--;
+            }
+            ctx.idle.fetch_add( GetTime() - start, std::memory_order_relaxed );
         }
+        Run( job );
     }
 }
@@ -3,30 +3,64 @@
 
 #include <atomic>
 #include <condition_variable>
+#include <deque>
 #include <functional>
+#include <memory>
 #include <mutex>
 #include <thread>
 #include <vector>
 
+#include "Types.hpp"
+
 class TaskDispatch
 {
 public:
+    struct Stats
+    {
+        uint64 steals;
+        uint64 idle;        // microseconds, summed over all threads
+    };
+
     TaskDispatch( size_t workers );
     ~TaskDispatch();
 
+    // Jobs may be queued from any thread. The dispatcher threads, the one that created the dispatcher and
+    // the workers, push to their own deque; other threads go through a locked queue the workers also poll.
     static void Queue( const std::function<void(void)>& f );
     static void Queue( std::function<void(void)>&& f );
 
+    // Runs and waits for all queued jobs. Only allowed on the dispatcher threads, anywhere else it aborts.
     static void Sync();
 
+    // True on the threads that can wait for jobs with Sync
+    static bool Available();
+
+    static Stats GetStats();
+
 private:
-    void Worker();
+    typedef std::function<void(void)> Job;
 
-    std::vector<std::function<void(void)>> m_queue;
-    std::mutex m_queueLock;
-    std::condition_variable m_cvWork, m_cvJobs;
+    class Deque;
+    struct Context;
+
+    void Worker( size_t idx );
+    void Push( Job* job );
+    Job* Find( size_t idx );
+    void Run( Job* job );
+
+    std::vector<std::unique_ptr<Context>> m_ctx;
+    std::atomic<size_t> m_pending;
+    std::atomic<size_t> m_sleeping;
+    std::atomic<uint64> m_epoch;
     std::atomic<bool> m_exit;
-    size_t m_jobs;
+
+    std::mutex m_lock;
+    std::condition_variable m_cvWork, m_cvJobs;
+
+    // Jobs queued from threads that have no deque
+    std::mutex m_injectLock;
+    std::deque<Job*> m_inject;
+    std::atomic<size_t> m_injected;
 
     std::vector<std::thread> m_workers;
 };
@@ -4,13 +4,15 @@ DEFINES +=
 INCLUDES :=
 LIBS := -lpthread
 IMAGE := etcpak
+LIBRARY := libetcpak.a
 
 SRC := $(shell egrep 'ClCompile.*cpp"' ../build/etcpak.vcxproj | sed -e 's/.*\"\(.*\)\".*/\1/' | sed -e 's@\\@/@g')
 SRC2 := $(shell egrep 'ClCompile.*c"' ../build/etcpak.vcxproj | sed -e 's/.*\"\(.*\)\".*/\1/' | sed -e 's@\\@/@g')
 OBJ := $(SRC:%.cpp=%.o)
 OBJ2 := $(SRC2:%.c=%.o)
+LIBOBJ := $(filter-out ../Application.o ../Benchmark.o ../Differential.o ../%_Reference.o,$(OBJ))
 
-all: $(IMAGE)
+all: $(IMAGE) $(LIBRARY)
 
 %.o: %.cpp
 	$(CXX) -c $(INCLUDES) $(CXXFLAGS) $(DEFINES) $< -o $@
@@ -35,11 +37,15 @@ all: $(IMAGE)
 $(IMAGE): $(OBJ) $(OBJ2)
 	$(CXX) $(CXXFLAGS) $(DEFINES) $(OBJ) $(OBJ2) $(LIBS) -o $@
 
+$(LIBRARY): $(LIBOBJ) $(OBJ2)
+	rm -f $@
+	$(AR) rcs $@ $(LIBOBJ) $(OBJ2)
+
 ifneq "$(MAKECMDGOALS)" "clean"
 -include $(SRC:.cpp=.d) $(SRC2:.c=.d)
 endif
 
 clean:
-	rm -f $(OBJ) $(OBJ2) $(SRC:.cpp=.d) $(SRC2:.c=.d) $(IMAGE)
+	rm -f $(OBJ) $(OBJ2) $(SRC:.cpp=.d) $(SRC2:.c=.d) $(IMAGE) $(LIBRARY)
 
 .PHONY: clean all